@@ -0,0 +1,139 @@
+//- Copyright 2015 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "compress.hh"
+
+using namespace plankton;
+
+// Reads 4 bytes from a possibly unaligned address.
+static uint32_t read_uint32(const byte_t *src) {
+  uint32_t result;
+  memcpy(&result, src, sizeof(result));
+  return result;
+}
+
+size_t BlockCodec::max_compressed_size(size_t size) {
+  // At worst everything is literals which costs a length byte per 255 bytes,
+  // plus the token and the first length byte.
+  return size + (size / 255) + 16;
+}
+
+size_t BlockCodec::max_decompressed_size(size_t size) {
+  // Each byte of a length adds at most 255 to it so no part of a block
+  // expands by more than that, plus the fixed part of a token's lengths.
+  static const size_t kMaxSize = static_cast<size_t>(-1);
+  return (size > (kMaxSize - 16) / 255) ? kMaxSize : (size * 255 + 16);
+}
+
+byte_t *BlockCodec::write_length(byte_t *dest, size_t length) {
+  while (length >= 255) {
+    *(dest++) = 255;
+    length -= 255;
+  }
+  *(dest++) = static_cast<byte_t>(length);
+  return dest;
+}
+
+byte_t *BlockCodec::write_token(byte_t *dest, const byte_t *literals,
+    size_t literal_length, size_t offset, size_t match_length) {
+  byte_t *token = dest++;
+  byte_t literal_nibble = static_cast<byte_t>((literal_length < 15) ? literal_length : 15);
+  if (literal_length >= 15)
+    dest = write_length(dest, literal_length - 15);
+  if (literal_length > 0) {
+    memcpy(dest, literals, literal_length);
+    dest += literal_length;
+  }
+  byte_t match_nibble = 0;
+  if (match_length > 0) {
+    *(dest++) = static_cast<byte_t>(offset & 0xFF);
+    *(dest++) = static_cast<byte_t>(offset >> 8);
+    size_t extra = match_length - kMinMatch;
+    match_nibble = static_cast<byte_t>((extra < 15) ? extra : 15);
+    if (extra >= 15)
+      dest = write_length(dest, extra - 15);
+  }
+  *token = static_cast<byte_t>((literal_nibble << 4) | match_nibble);
+  return dest;
+}
+
+size_t BlockCodec::compress(const byte_t *src, size_t size, byte_t *dest) {
+  // Maps the hash of 4 bytes to the last position they were seen at.
+  uint32_t table[1 << kHashBits];
+  memset(table, 0, sizeof(table));
+  byte_t *out = dest;
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + kMinMatch <= size) {
+    uint32_t sequence = read_uint32(src + pos);
+    uint32_t hash = (sequence * 2654435761U) >> (32 - kHashBits);
+    size_t candidate = table[hash];
+    table[hash] = static_cast<uint32_t>(pos);
+    if (candidate < pos
+        && pos - candidate <= kMaxOffset
+        && read_uint32(src + candidate) == sequence) {
+      size_t length = kMinMatch;
+      while (pos + length < size && src[candidate + length] == src[pos + length])
+        length++;
+      out = write_token(out, src + anchor, pos - anchor, pos - candidate, length);
+      pos += length;
+      anchor = pos;
+    } else {
+      // Skip ahead faster the longer we go without a match so incompressible
+      // data doesn't cost a probe per byte.
+      pos += 1 + ((pos - anchor) >> 6);
+    }
+  }
+  // The block always ends with a token holding just the remaining literals.
+  out = write_token(out, src + anchor, size - anchor, 0, 0);
+  return out - dest;
+}
+
+bool BlockCodec::read_length(const byte_t *src, size_t size, size_t *cursor,
+    size_t *length) {
+  byte_t next;
+  do {
+    if (*cursor >= size)
+      return false;
+    next = src[(*cursor)++];
+    *length += next;
+  } while (next == 255);
+  return true;
+}
+
+bool BlockCodec::decompress(const byte_t *src, size_t size, byte_t *dest,
+    size_t dest_size) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < size) {
+    byte_t token = src[in++];
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !read_length(src, size, &in, &literal_length))
+      return false;
+    if (literal_length > size - in || literal_length > dest_size - out)
+      return false;
+    memcpy(dest + out, src + in, literal_length);
+    in += literal_length;
+    out += literal_length;
+    if (in == size)
+      // The last token has no match.
+      break;
+    if (size - in < 2)
+      return false;
+    size_t offset = src[in] | (src[in + 1] << 8);
+    in += 2;
+    if (offset == 0 || offset > out)
+      return false;
+    size_t match_length = token & 0xF;
+    if (match_length == 15 && !read_length(src, size, &in, &match_length))
+      return false;
+    match_length += kMinMatch;
+    if (match_length > dest_size - out)
+      return false;
+    // The match may overlap the bytes it produces so it has to be copied one
+    // byte at a time.
+    for (size_t i = 0; i < match_length; i++, out++)
+      dest[out] = dest[out - offset];
+  }
+  return out == dest_size;
+}
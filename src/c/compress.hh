@@ -0,0 +1,64 @@
+//- Copyright 2015 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Block compression for socket frames.
+
+#ifndef _COMPRESS_HH
+#define _COMPRESS_HH
+
+#include "c/stdc.h"
+
+namespace plankton {
+
+// A fast LZ77-style block codec. Speed matters more than ratio here so it
+// finds matches through a single hash probe and encodes them as a sequence of
+// tokens, each a run of literal bytes followed by a back reference into the
+// last 64K of output, much like LZ4.
+class BlockCodec {
+public:
+  // Returns the largest number of bytes compressing a block of the given size
+  // can produce.
+  static size_t max_compressed_size(size_t size);
+
+  // Compresses the given block into the destination which must have room for
+  // at least max_compressed_size bytes. Returns the size of the result.
+  static size_t compress(const byte_t *src, size_t size, byte_t *dest);
+
+  // Returns the largest number of bytes a compressed block of the given size
+  // can decompress to. Sizes claimed by a peer that are larger than this can
+  // be rejected without allocating anything.
+  static size_t max_decompressed_size(size_t size);
+
+  // Decompresses the given compressed block into the destination which must
+  // be exactly as large as the original block. Returns true iff the block was
+  // valid and decompressed to exactly dest_size bytes.
+  static bool decompress(const byte_t *src, size_t size, byte_t *dest,
+      size_t dest_size);
+
+private:
+  // The shortest match worth encoding as a back reference.
+  static const size_t kMinMatch = 4;
+
+  // The farthest back a match can be.
+  static const size_t kMaxOffset = 0xFFFF;
+
+  // The number of bits of the match finder's hash.
+  static const size_t kHashBits = 12;
+
+  // Writes a token with the given literals and, if the match length is
+  // nonzero, back reference. Returns the position just past the token.
+  static byte_t *write_token(byte_t *dest, const byte_t *literals,
+      size_t literal_length, size_t offset, size_t match_length);
+
+  // Writes the part of a length that doesn't fit in a token's nibble.
+  static byte_t *write_length(byte_t *dest, size_t length);
+
+  // Reads the part of a length that doesn't fit in a token's nibble, adding
+  // it to the length. Returns false if the input ends prematurely.
+  static bool read_length(const byte_t *src, size_t size, size_t *cursor,
+      size_t *length);
+};
+
+} // namespace plankton
+
+#endif // _COMPRESS_HH
@@ -59,74 +59,88 @@ Variant SeedType<T>::encode_instance(Native wrapped, Factory *factory) {
   return (encode_)(value, factory);
 }
 
+template <typename T>
+Blob SeedType<T>::encoded_instance(Native wrapped) {
+  T *value = wrapped.as(this);
+  if (value == NULL || encoded_.is_empty())
+    return Blob();
+  return (encoded_)(value);
+}
+
 template <typename T>
 SeedType<T>::SeedType(Variant header, new_instance_t create,
-    complete_instance_t complete, encode_instance_t encode)
+    complete_instance_t complete, encode_instance_t encode,
+    encoded_instance_t encoded)
   : header_(header)
   , create_(create)
   , complete_(complete)
-  , encode_(encode) { }
+  , encode_(encode)
+  , encoded_(encoded) { }
 
 template <typename T>
-void VariantMap<T>::set(Variant key, const T &value) {
-  if (key.is_string()) {
-    strings_[key] = value;
-  } else {
-    set_generic(key, value);
-  }
+bool StreamingSeedType<T>::encode_to(Native wrapped, Assembler *assm) {
+  T *value = wrapped.as(this);
+  return (value != NULL) && value->encode_to(assm);
 }
 
 template <typename T>
-void VariantMap<T>::set_generic(Variant key, const T &value) {
-  T *existing = get_generic(key);
-  if (existing == NULL) {
-    GenericMapping mapping = {key, value};
-    generic_.push_back(mapping);
-  } else {
-    *existing = value;
-  }
+void StreamingSeedType<T>::on_field(Variant instance, Variant key,
+    Variant value, Factory *factory) {
+  T *object = instance.native_as(this);
+  if (object != NULL)
+    object->on_field(key, value, factory);
 }
 
 template <typename T>
-T *VariantMap<T>::operator[](Variant key) {
-  if (key.is_string()) {
-    typename StringMap::iterator i = strings_.find(key);
-    return (i == strings_.end()) ? NULL : &i->second;
-  } else {
-    return get_generic(key);
+void VariantMap<T>::set(Variant key, const T &value) {
+  // Keep the table at most three quarters full so probe sequences stay short
+  // and always end at an unused entry.
+  if (4 * (size_ + 1) > 3 * entries_.size())
+    grow();
+  size_t hash = VariantMapKeys::hash(key);
+  Entry *entry = find_entry(key, hash);
+  if (!entry->is_used) {
+    entry->is_used = true;
+    entry->hash = hash;
+    entry->key = key;
+    size_++;
   }
+  entry->value = value;
 }
 
 template <typename T>
-T *VariantMap<T>::get_generic(Variant key) {
-  for (typename GenericVector::iterator i = generic_.begin();
-       i != generic_.end();
-       i++) {
-    if (i->key == key)
-      return &i->value;
-  }
-  return NULL;
+T *VariantMap<T>::operator[](Variant key) {
+  if (size_ == 0)
+    return NULL;
+  Entry *entry = find_entry(key, VariantMapKeys::hash(key));
+  return entry->is_used ? &entry->value : NULL;
 }
 
 template <typename T>
-size_t VariantMap<T>::StringHasher::operator()(const String &key) const {
-  // The msvc hasher uses the address to hash char pointers. The linux one on
-  // the other hand doesn't appear to know how to hash a std::string.
-  platform_hash<IF_MSVC(std::string, const char*)> hasher;
-  // Do we need to worry about embedded nulls? In theory strings with embedded
-  // nulls should get the same hash which is within the contract of a hash
-  // function so it should be okay.
-  return hasher(key.chars());
+typename VariantMap<T>::Entry *VariantMap<T>::find_entry(Variant key,
+    size_t hash) {
+  size_t mask = entries_.size() - 1;
+  for (size_t i = hash & mask; true; i = (i + 1) & mask) {
+    Entry *entry = &entries_[i];
+    if (!entry->is_used)
+      return entry;
+    if (entry->hash == hash && VariantMapKeys::equals(entry->key, key))
+      return entry;
+  }
 }
 
 template <typename T>
-bool VariantMap<T>::StringHasher::operator()(const String &a, const String &b) {
-  size_t a_length = a.length();
-  size_t b_length = b.length();
-  if (a_length != b_length || (a_length == 0))
-    // Different lengths or empty strings can be decided based just on length.
-    return a_length < b_length;
-  return strncmp(a.chars(), b.chars(), a_length) < 0;
+void VariantMap<T>::grow() {
+  size_t capacity = entries_.empty() ? kInitialCapacity : 2 * entries_.size();
+  std::vector<Entry> old_entries(capacity);
+  entries_.swap(old_entries);
+  for (size_t i = 0; i < old_entries.size(); i++) {
+    Entry &old_entry = old_entries[i];
+    if (!old_entry.is_used)
+      continue;
+    Entry *entry = find_entry(old_entry.key, old_entry.hash);
+    *entry = old_entry;
+  }
 }
 
 } // namespace plankton
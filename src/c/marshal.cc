@@ -7,26 +7,354 @@
 #include "plankton-inl.hh"
 #include "utils/log.hh"
 
+#include <algorithm>
+
+#if IS_MSVC
+#  include <intrin.h>
+#  define THREAD_LOCAL __declspec(thread)
+#else
+#  define THREAD_LOCAL __thread
+#endif
+
 using namespace plankton;
 
+// Loads a value written by another thread such that anything written before
+// it was stored is visible.
+template <typename T>
+static T load_acquire(T volatile *ptr) {
+#if IS_MSVC
+  // Volatile reads have acquire semantics under msvc.
+  return *ptr;
+#else
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Stores a value such that anything written before it is visible to threads
+// that load it.
+template <typename T>
+static void store_release(T volatile *ptr, T value) {
+#if IS_MSVC
+  // Volatile writes have release semantics under msvc.
+  *ptr = value;
+#else
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Loads a value such that the load is ordered with respect to all other
+// sequentially consistent operations, including preceding stores.
+template <typename T>
+static T load_seq_cst(T volatile *ptr) {
+#if IS_MSVC
+  // Only used after interlocked operations, which are full barriers.
+  return *ptr;
+#else
+  return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores the desired value if the current one is the expected one. Returns
+// true iff it was stored.
+static bool compare_and_swap(long volatile *ptr, long expected, long desired) {
+#if IS_MSVC
+  return _InterlockedCompareExchange(ptr, desired, expected) == expected;
+#else
+  return __atomic_compare_exchange_n(ptr, &expected, desired, false,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores the desired pointer if the current one is the expected one. Returns
+// true iff it was stored.
+template <typename T>
+static bool compare_and_swap_pointer(T *volatile *ptr, T *expected, T *desired) {
+#if IS_MSVC
+  return _InterlockedCompareExchangePointer(
+      reinterpret_cast<void *volatile*>(ptr), desired, expected) == expected;
+#else
+  return __atomic_compare_exchange_n(ptr, &expected, desired, false,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores the given pointer and returns the previous one.
+template <typename T>
+static T *exchange_pointer(T *volatile *ptr, T *value) {
+#if IS_MSVC
+  return static_cast<T*>(_InterlockedExchangePointer(
+      reinterpret_cast<void *volatile*>(ptr), value));
+#else
+  return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the identity of an array, map, seed, or native.
+static const void *variant_identity(Variant value) {
+  return value.to_c().payload_.as_arena_value_;
+}
+
+size_t VariantMapKeys::hash(Variant key) {
+  ContentHasher hasher;
+  pton_type_t type = key.type();
+  uint8_t tag = static_cast<uint8_t>(type);
+  hasher.update(&tag, 1);
+  switch (type) {
+    case PTON_INTEGER: {
+      int64_t value = key.integer_value();
+      hasher.update(&value, sizeof(value));
+      break;
+    }
+    case PTON_STRING:
+      hasher.update(key.string_chars(), key.string_length());
+      break;
+    case PTON_BLOB:
+      hasher.update(key.blob_data(), key.blob_size());
+      break;
+    case PTON_BOOL: {
+      uint8_t value = key.bool_value() ? 1 : 0;
+      hasher.update(&value, 1);
+      break;
+    }
+    case PTON_ID: {
+      uint32_t size = key.id_size();
+      uint64_t value = key.id64_value();
+      hasher.update(&size, sizeof(size));
+      hasher.update(&value, sizeof(value));
+      break;
+    }
+    case PTON_ARRAY:
+    case PTON_MAP:
+    case PTON_SEED:
+    case PTON_NATIVE: {
+      const void *identity = variant_identity(key);
+      hasher.update(&identity, sizeof(identity));
+      break;
+    }
+    default:
+      break;
+  }
+  return static_cast<size_t>(hasher.digest());
+}
+
+bool VariantMapKeys::equals(Variant a, Variant b) {
+  pton_type_t type = a.type();
+  if (type != b.type())
+    return false;
+  switch (type) {
+    case PTON_STRING: {
+      uint32_t length = a.string_length();
+      return length == b.string_length()
+          && memcmp(a.string_chars(), b.string_chars(), length) == 0;
+    }
+    case PTON_BLOB: {
+      uint32_t size = a.blob_size();
+      return size == b.blob_size()
+          && memcmp(a.blob_data(), b.blob_data(), size) == 0;
+    }
+    case PTON_SEED:
+    case PTON_NATIVE:
+      return variant_identity(a) == variant_identity(b);
+    default:
+      return a == b;
+  }
+}
+
+struct TypeRegistry::HazardSlot {
+  // The snapshot the owner is reading, if any.
+  Snapshot *volatile snapshot;
+  // Nonzero while a thread owns this slot.
+  volatile long is_owned;
+  HazardSlot *next;
+  // Keeps slots on separate cache lines so each thread only writes its own.
+  uint8_t padding[64];
+};
+
+TypeRegistry::HazardSlot *volatile TypeRegistry::hazard_slots_ = NULL;
+
+// The hazard slot the current thread owned last. It's usually free to take
+// again so threads keep to their own slots.
+static THREAD_LOCAL void *last_hazard_slot = NULL;
+
+TypeRegistry::TypeRegistry()
+  : snapshot_(NULL)
+  , version_(0) {
+  if (!guard_.initialize())
+    WARN("Failed to initialize type registry guard");
+}
+
+TypeRegistry::~TypeRegistry() {
+  delete snapshot_;
+  for (size_t i = 0; i < retired_.size(); i++)
+    delete retired_[i];
+}
+
+void TypeRegistry::bump_version() {
+#if IS_MSVC
+  _InterlockedIncrement(&version_);
+#else
+  __atomic_add_fetch(&version_, 1, __ATOMIC_ACQ_REL);
+#endif
+}
+
 void TypeRegistry::register_type(AbstractSeedType *type) {
-  types_.set(type->header(), type);
+  guard_.lock();
+  types_.push_back(type);
+  bump_version();
+  free_retired();
+  guard_.unlock();
 }
 
 void TypeRegistry::add_fallback(TypeRegistry *fallback) {
-  if (fallback != NULL)
-    fallbacks_.push_back(fallback);
+  if (fallback == NULL)
+    return;
+  guard_.lock();
+  fallbacks_.push_back(fallback);
+  bump_version();
+  free_retired();
+  guard_.unlock();
 }
 
 AbstractSeedType *TypeRegistry::resolve_type(Variant header) {
-  AbstractSeedType **type_ref = types_[header];
-  if (type_ref != NULL)
-    return *type_ref;
-  for (size_t i = 0; i < fallbacks_.size(); i++) {
-    TypeRegistry *fallback = fallbacks_[i];
-    AbstractSeedType *type = fallback->resolve_type(header);
-    if (type != NULL)
-      return type;
-  }
-  return NULL;
+  HazardSlot *slot = acquire_hazard_slot();
+  AbstractSeedType **type_ref = current_snapshot(slot)->types[header];
+  AbstractSeedType *result = (type_ref == NULL) ? NULL : *type_ref;
+  release_hazard_slot(slot);
+  return result;
+}
+
+size_t TypeRegistry::retired_snapshot_count() {
+  guard_.lock();
+  size_t result = retired_.size();
+  guard_.unlock();
+  return result;
+}
+
+TypeRegistry::HazardSlot *TypeRegistry::acquire_hazard_slot() {
+  HazardSlot *last = static_cast<HazardSlot*>(last_hazard_slot);
+  if (last != NULL && compare_and_swap(&last->is_owned, 0, 1))
+    return last;
+  // Slots that look owned are skipped without trying to take them so this
+  // doesn't write to other threads' slots.
+  for (HazardSlot *slot = load_acquire(&hazard_slots_); slot != NULL;
+       slot = slot->next) {
+    if (load_acquire(&slot->is_owned) == 0
+        && compare_and_swap(&slot->is_owned, 0, 1)) {
+      last_hazard_slot = slot;
+      return slot;
+    }
+  }
+  HazardSlot *slot = new HazardSlot();
+  slot->snapshot = NULL;
+  slot->is_owned = 1;
+  HazardSlot *head;
+  do {
+    head = load_acquire(&hazard_slots_);
+    slot->next = head;
+  } while (!compare_and_swap_pointer(&hazard_slots_, head, slot));
+  last_hazard_slot = slot;
+  return slot;
+}
+
+void TypeRegistry::release_hazard_slot(HazardSlot *slot) {
+  store_release(&slot->snapshot, static_cast<Snapshot*>(NULL));
+  store_release(&slot->is_owned, 0L);
+}
+
+bool TypeRegistry::is_hazard(Snapshot *snapshot) {
+  for (HazardSlot *slot = load_acquire(&hazard_slots_); slot != NULL;
+       slot = slot->next) {
+    if (load_seq_cst(&slot->snapshot) == snapshot)
+      return true;
+  }
+  return false;
+}
+
+void TypeRegistry::free_retired() {
+  // A snapshot is only retired once it has been replaced so a reader can't
+  // publish it after that without seeing that it has been replaced, which
+  // means that if no slot holds it now none ever will.
+  size_t kept = 0;
+  for (size_t i = 0; i < retired_.size(); i++) {
+    if (is_hazard(retired_[i])) {
+      retired_[kept++] = retired_[i];
+    } else {
+      delete retired_[i];
+    }
+  }
+  retired_.resize(kept);
+}
+
+bool TypeRegistry::Snapshot::is_current() {
+  for (size_t i = 0; i < sources.size(); i++) {
+    Source &source = sources[i];
+    if (load_acquire(&source.registry->version_) != source.version)
+      return false;
+  }
+  return true;
+}
+
+TypeRegistry::Snapshot *TypeRegistry::current_snapshot(HazardSlot *slot) {
+  // The snapshot is published before it's used and then checked to still be
+  // the current one, so a thread that replaces it after that will see that
+  // it's in use.
+  Snapshot *snapshot = load_seq_cst(&snapshot_);
+  while (true) {
+    exchange_pointer(&slot->snapshot, snapshot);
+    Snapshot *current = load_seq_cst(&snapshot_);
+    if (current == snapshot)
+      break;
+    snapshot = current;
+  }
+  if (snapshot != NULL && snapshot->is_current())
+    return snapshot;
+  return rebuild_snapshot(slot);
+}
+
+TypeRegistry::Snapshot *TypeRegistry::rebuild_snapshot(HazardSlot *slot) {
+  // Collect the registries in resolution order: this one first, then each
+  // fallback's chain in the order they were added. Each registry is locked
+  // only while its own state is copied so there's no lock ordering to worry
+  // about.
+  Snapshot *snapshot = new Snapshot();
+  std::vector<TypeRegistry*> order;
+  std::vector<AbstractSeedType*> types;
+  std::vector<size_t> type_ends;
+  std::vector<TypeRegistry*> pending;
+  pending.push_back(this);
+  while (!pending.empty()) {
+    TypeRegistry *registry = pending.back();
+    pending.pop_back();
+    if (std::find(order.begin(), order.end(), registry) != order.end())
+      continue;
+    order.push_back(registry);
+    registry->guard_.lock();
+    Source source = {registry, registry->version_};
+    snapshot->sources.push_back(source);
+    types.insert(types.end(), registry->types_.begin(), registry->types_.end());
+    // Pushed in reverse so they're popped in the order they were added.
+    pending.insert(pending.end(), registry->fallbacks_.rbegin(),
+        registry->fallbacks_.rend());
+    registry->guard_.unlock();
+    type_ends.push_back(types.size());
+  }
+  // Add the types backwards, least significant registry first, so that the
+  // most significant binding for each header is the one that sticks. Within
+  // a registry the most recent registration wins.
+  for (size_t i = order.size(); i > 0; i--) {
+    size_t start = (i == 1) ? 0 : type_ends[i - 2];
+    for (size_t j = start; j < type_ends[i - 1]; j++)
+      snapshot->types.set(types[j]->header(), types[j]);
+  }
+  // The thread building the snapshot publishes it in its slot before anyone
+  // else can see it so it can keep using it even if another thread replaces
+  // it right away.
+  exchange_pointer(&slot->snapshot, snapshot);
+  guard_.lock();
+  Snapshot *replaced = exchange_pointer(&snapshot_, snapshot);
+  if (replaced != NULL)
+    retired_.push_back(replaced);
+  free_retired();
+  guard_.unlock();
+  return snapshot;
 }
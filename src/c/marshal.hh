@@ -9,11 +9,14 @@
 #include "c/stdc.h"
 
 #include "c/stdhashmap.hh"
+#include "sync/mutex.hh"
 #include "utils/callback.hh"
 #include "variant.hh"
 
 namespace plankton {
 
+class Assembler;
+
 // A seed type handles the process of growing a custom object in place of a
 // seed. Typically you won't implement this directly but one of the two
 // subtypes, SeedType and AtomicSeedType. The plain version does construction in
@@ -41,6 +44,30 @@ public:
   // Given a native value, returns the value to use as a replacement.
   virtual Variant encode_instance(Native value, Factory *factory) = 0;
 
+  // If the binary encoding of the given native value is already known, for
+  // instance because it has been cached, returns it as a blob holding a single
+  // encoded value. Binary writers will then write those bytes directly rather
+  // than encoding the replacement. By default returns a non-blob.
+  virtual Blob encoded_instance(Native value) { return Blob(); }
+
+  // Writes the given native value to the given assembler as a single value
+  // and returns true, or returns false without writing anything if this type
+  // doesn't write instances directly, which is the default. Binary writers
+  // use this in place of encode_instance, which saves building the
+  // replacement, except when they share values, order mappings canonically,
+  // or use a string dictionary.
+  virtual bool encode_to(Native value, Assembler *assm) { return false; }
+
+  // Returns true if the fields of seeds of this type should be passed to
+  // on_field one at a time as they're read rather than collected into a
+  // payload. The payload passed to get_complete_instance is then null.
+  virtual bool receives_fields() { return false; }
+
+  // Called with each field of a seed of this type, after the initial instance
+  // has been created, if receives_fields returns true.
+  virtual void on_field(Variant instance, Variant key, Variant value,
+      Factory *factory) { }
+
   // Returns the header value that identifies instance of this type.
   virtual Variant header() = 0;
 };
@@ -65,18 +92,22 @@ public:
   typedef tclib::callback_t<T*(Variant, Factory*)> new_instance_t;
   typedef tclib::callback_t<void(T*, Seed, Factory*)> complete_instance_t;
   typedef tclib::callback_t<Variant(T*, Factory*)> encode_instance_t;
+  typedef tclib::callback_t<Blob(T*)> encoded_instance_t;
 
   // Constructs an object type for plankton objects that have the given value
   // as header. Instances will be constructed using new_instance and completed
-  // using complete_instance.
+  // using complete_instance. If encoded is given it is used to fetch the
+  // cached encodings of instances.
   SeedType(Variant header,
       new_instance_t new_instance = tclib::empty_callback(),
       complete_instance_t complete_instance = tclib::empty_callback(),
-      encode_instance_t encode = tclib::empty_callback());
+      encode_instance_t encode = tclib::empty_callback(),
+      encoded_instance_t encoded = tclib::empty_callback());
 
   virtual Variant get_initial_instance(Variant header, Factory *arena);
   virtual Variant get_complete_instance(Variant initial, Variant payload, Factory *arena);
   virtual Variant encode_instance(Native value, Factory *factory);
+  virtual Blob encoded_instance(Native value);
   virtual Variant header() { return header_; }
 
 private:
@@ -84,6 +115,7 @@ private:
   new_instance_t create_;
   complete_instance_t complete_;
   encode_instance_t encode_;
+  encoded_instance_t encoded_;
 };
 
 template <typename T>
@@ -96,12 +128,49 @@ public:
     : SeedType<T>(header, new_instance, complete_instance, encode) { }
 };
 
+// A seed type that writes instances directly and fills them in one field at a
+// time, using the instance methods
+//
+//   bool encode_to(Assembler *assm);
+//   void on_field(Variant key, Variant value, Factory *factory);
+//
+// in addition to T::new_instance and, for encoders that can't write instances
+// directly, T::to_seed.
+template <typename T>
+class StreamingSeedType : public SeedType<T> {
+public:
+  StreamingSeedType(Variant header,
+      typename SeedType<T>::new_instance_t new_instance = tclib::new_callback(T::new_instance),
+      typename SeedType<T>::encode_instance_t encode = tclib::new_callback(&T::to_seed))
+    : SeedType<T>(header, new_instance, tclib::empty_callback(), encode) { }
+
+  virtual bool encode_to(Native value, Assembler *assm);
+  virtual bool receives_fields() { return true; }
+  virtual void on_field(Variant instance, Variant key, Variant value,
+      Factory *factory);
+};
+
+// Hashing and equality for the keys of a variant map. Strings and blobs are
+// compared by their full contents including any embedded nulls, arrays, maps,
+// seeds, and natives by identity, and everything else by value.
+class VariantMapKeys {
+public:
+  // Returns a hash of the given key that is the same for equal keys.
+  static size_t hash(Variant key);
+
+  // Returns true iff the two keys are equal.
+  static bool equals(Variant a, Variant b);
+};
+
 // A mapping from variants to values. This is different from a variant map in
 // that the values can be of any type. A variant map also does not keep track
-// of insertion order.
+// of insertion order. Keys of all types live in the same open addressing
+// table so lookup takes constant time regardless of the key type.
 template <typename T>
 class VariantMap {
 public:
+  VariantMap() : size_(0) { }
+
   // Maps the given key to the given value. If there is already a mapping it is
   // replaced by this one. The map does not take ownership of the key, it is
   // up to the caller to ensure that it's valid as long as the map exists.
@@ -113,38 +182,33 @@ public:
   T *operator[](Variant key);
 
   // Returns the number of mappings in this map.
-  size_t size() { return strings_.size() + generic_.size(); }
+  size_t size() { return size_; }
 
 private:
-  // Controls how strings are hashed in the string map.
-  struct StringHasher {
-  public:
-    size_t operator()(const String &key) const;
-    // MSVC hash map stuff.
-    static const size_t bucket_size = 4;
-    bool operator()(const String &a, const String &b);
-  };
-
-  // A non special case mapping.
-  struct GenericMapping {
+  // A slot in the table.
+  struct Entry {
+    Entry() : is_used(false), hash(0) { }
+    bool is_used;
+    size_t hash;
     Variant key;
     T value;
   };
 
-  typedef platform_hash_map<String, T, StringHasher> StringMap;
-  typedef std::vector<GenericMapping> GenericVector;
+  // The number of entries in a table when the first mapping is added.
+  static const size_t kInitialCapacity = 8;
 
-  // Looks up a binding in the generic mappings.
-  T *get_generic(Variant key);
+  // Returns the entry that holds the given key, or if there is none the
+  // unused entry where it should go. The table must not be empty.
+  Entry *find_entry(Variant key, size_t hash);
 
-  // Add a mapping to the generic mappings.
-  void set_generic(Variant key, const T &value);
+  // Doubles the capacity of the table and rehashes the entries.
+  void grow();
 
-  // All string mappings are stored here, for more efficient access.
-  StringMap strings_;
+  // The table, whose size is always zero or a power of two.
+  std::vector<Entry> entries_;
 
-  // Mappings that don't belong anywhere else.
-  GenericVector generic_;
+  // The number of used entries.
+  size_t size_;
 };
 
 // A registry that can resolve object types during parsing based on the seed's
@@ -158,9 +222,16 @@ public:
   virtual AbstractSeedType *resolve_type(Variant header) = 0;
 };
 
-// A simple registry based on a mapping from headers to types.
+// A simple registry based on a mapping from headers to types. Types and
+// fallbacks can be added while other threads are resolving. Resolution goes
+// through a flattened snapshot of this registry and all its fallbacks which is
+// read without locking and rebuilt on the first lookup after any of those
+// registries has changed.
 class TypeRegistry : public AbstractTypeRegistry {
 public:
+  TypeRegistry();
+  virtual ~TypeRegistry();
+
   // Register the given seed type. The difference between this and the
   // non-template version is in that this uses the default seed type machinery
   // to extract the type object so if that's in place you only need to specify
@@ -178,9 +249,82 @@ public:
   void add_fallback(TypeRegistry *fallback);
 
   virtual AbstractSeedType *resolve_type(Variant header);
+
+  // Returns the number of replaced snapshots that are kept because a thread
+  // may still be reading them.
+  size_t retired_snapshot_count();
+
 private:
-  VariantMap<AbstractSeedType*> types_;
+  // A registry that was flattened into a snapshot and its version at the
+  // time.
+  struct Source {
+    TypeRegistry *registry;
+    long version;
+  };
+
+  // The resolved types of a registry and its fallbacks as of the given
+  // versions of each.
+  struct Snapshot {
+    std::vector<Source> sources;
+    VariantMap<AbstractSeedType*> types;
+
+    // Is this snapshot still up to date with all its sources?
+    bool is_current();
+  };
+
+  // A slot where a thread that is resolving publishes the snapshot it's
+  // reading so it doesn't get freed under it.
+  struct HazardSlot;
+
+  // Returns a slot owned by the calling thread until it's released.
+  static HazardSlot *acquire_hazard_slot();
+
+  // Gives up ownership of a slot returned by acquire_hazard_slot.
+  static void release_hazard_slot(HazardSlot *slot);
+
+  // Returns true iff a thread may be reading the given snapshot.
+  static bool is_hazard(Snapshot *snapshot);
+
+  // Returns a snapshot that is up to date, building one if necessary, and
+  // publishes it in the given slot.
+  Snapshot *current_snapshot(HazardSlot *slot);
+
+  // Builds and publishes a new snapshot, also in the given slot.
+  Snapshot *rebuild_snapshot(HazardSlot *slot);
+
+  // Bumps the version, invalidating snapshots that include this registry.
+  void bump_version();
+
+  // Frees the retired snapshots that no thread may be reading. Must be called
+  // with the guard held.
+  void free_retired();
+
+  // All the hazard slots there are. Slots are reused rather than freed so
+  // there are as many as there have been threads resolving at the same time.
+  static HazardSlot *volatile hazard_slots_;
+
+  // Guards the types, fallbacks, and snapshots.
+  tclib::NativeMutex guard_;
+
+  // The registered types in registration order.
+  std::vector<AbstractSeedType*> types_;
   std::vector<TypeRegistry*> fallbacks_;
+
+  // The snapshot to use for resolution. Readers load this without holding the
+  // guard.
+  Snapshot *volatile snapshot_;
+
+  // Snapshots that have been replaced. A reader may still be using one after
+  // it was replaced so it's only freed once no hazard slot holds it, which is
+  // checked whenever a snapshot is replaced or a type or fallback is added.
+  std::vector<Snapshot*> retired_;
+
+  // Bumped whenever types or fallbacks are added.
+  volatile long version_;
+
+  // Not copyable.
+  TypeRegistry(const TypeRegistry&);
+  TypeRegistry &operator=(const TypeRegistry&);
 };
 
 } // namespace plankton
@@ -1,14 +1,19 @@
 //- Copyright 2014 the Neutrino authors (see AUTHORS).
 //- Licensed under the Apache License, Version 2.0 (see LICENSE).
 
+#include <algorithm>
+
 #include "c/stdc.h"
 #include "c/stdnew.hh"
+#include "io/iop.hh"
 #include "marshal-inl.hh"
 #include "plankton-binary.hh"
+#include "sync/thread.hh"
 #include "utils-inl.hh"
 #include "utils/log.hh"
 
 using namespace plankton;
+using namespace tclib;
 
 // Implementation of the type declared in the C header. This is the actual
 // assembler implementation, the C++ wrapper delegates to this one.
@@ -27,6 +32,33 @@ public:
 
   bool begin_seed(uint32_t headerc, uint32_t fieldc);
 
+  bool begin_sized_array(uint32_t length);
+
+  bool begin_sized_map(uint32_t size);
+
+  bool begin_sized_seed(uint32_t headerc, uint32_t fieldc);
+
+  bool end_sized();
+
+  bool begin_open_array();
+
+  bool begin_open_map();
+
+  bool end_open();
+
+  bool begin_columns(uint32_t rowc, uint32_t headerc, uint32_t keyc);
+
+  bool emit_delta_array(const int64_t *values, uint32_t count);
+
+  bool begin_measured_array(uint32_t length, uint64_t contents_size);
+
+  bool begin_measured_map(uint32_t size, uint64_t contents_size);
+
+  bool begin_measured_seed(uint32_t headerc, uint32_t fieldc,
+      uint64_t contents_size);
+
+  void reserve(size_t size) { bytes_.reserve(size); }
+
   bool emit_bool(bool value);
 
   bool emit_null();
@@ -44,10 +76,18 @@ public:
 
   bool emit_reference(uint64_t offset);
 
+  bool emit_indexed_values();
+
+  bool emit_dictionary_string(uint32_t index);
+
+  bool emit_encoded(const void *data, size_t size);
+
   blob_t peek_code();
 
   blob_t release_code();
 
+  void reset();
+
 private:
   // Write a single byte to the stream.
   bool write_byte(uint8_t value);
@@ -58,7 +98,35 @@ private:
   // Write an untagged unsigned int64 varint.
   bool write_uint64(uint64_t value);
 
+  // Leaves room for the size of a sized container at the current position.
+  bool open_sized();
+
+  // Removes the unused parts of the room left for the sizes of the sized
+  // containers that have been closed.
+  void compact_sized();
+
   Buffer<uint8_t> bytes_;
+
+  // The room left for the size of a sized container: where it starts and how
+  // many of its bytes are unused once the size has been written at its end.
+  struct SizedGap {
+    size_t offset;
+    size_t unused;
+  };
+
+  // The gaps left for sized containers since the outermost one was opened,
+  // in the order they occur.
+  std::vector<SizedGap> sized_gaps_;
+
+  // A sized container that hasn't been closed yet: the index of its gap and
+  // the number of unused bytes in the gaps of the containers within it.
+  struct OpenSized {
+    size_t gap;
+    size_t unused;
+  };
+
+  // The currently open sized containers, innermost last.
+  std::vector<OpenSized> open_sized_;
 };
 
 pton_assembler_t *pton_new_assembler() {
@@ -97,6 +165,178 @@ bool pton_assembler_emit_bool(pton_assembler_t *assm, bool value) {
   return assm->emit_bool(value);
 }
 
+bool pton_assembler_t::begin_sized_array(uint32_t length) {
+  return write_byte(boSizedArray) && write_uint64(length) && open_sized();
+}
+
+bool pton_assembler_begin_sized_array(pton_assembler_t *assm, uint32_t length) {
+  return assm->begin_sized_array(length);
+}
+
+bool pton_assembler_t::begin_sized_map(uint32_t size) {
+  return write_byte(boSizedMap) && write_uint64(size) && open_sized();
+}
+
+bool pton_assembler_begin_sized_map(pton_assembler_t *assm, uint32_t size) {
+  return assm->begin_sized_map(size);
+}
+
+bool pton_assembler_t::begin_sized_seed(uint32_t headerc, uint32_t fieldc) {
+  return write_byte(boSizedSeed) && write_uint64(headerc) && write_uint64(fieldc)
+      && open_sized();
+}
+
+bool pton_assembler_begin_sized_seed(pton_assembler_t *assm, uint32_t headerc,
+    uint32_t fieldc) {
+  return assm->begin_sized_seed(headerc, fieldc);
+}
+
+// The size of a sized container comes before its contents but isn't known
+// until the contents have been written. Room for the largest possible size is
+// left before the contents and the size is written at the end of it when the
+// container is closed. Varints can't be padded so the unused part of the
+// room is removed afterwards, for all the containers at once when the
+// outermost one is closed, such that nested containers don't move the
+// contents more than once.
+bool pton_assembler_t::open_sized() {
+  OpenSized open = {sized_gaps_.size(), 0};
+  open_sized_.push_back(open);
+  SizedGap gap = {bytes_.length(), 0};
+  sized_gaps_.push_back(gap);
+  bytes_.fill(0, kMaxVarintSize);
+  return true;
+}
+
+bool pton_assembler_t::end_sized() {
+  if (open_sized_.empty())
+    return false;
+  OpenSized open = open_sized_.back();
+  open_sized_.pop_back();
+  SizedGap *gap = &sized_gaps_[open.gap];
+  size_t contents_start = gap->offset + kMaxVarintSize;
+  uint8_t size[kMaxVarintSize];
+  size_t size_size = encode_uint64(
+      bytes_.length() - contents_start - open.unused, size);
+  memcpy(*bytes_ + contents_start - size_size, size, size_size);
+  gap->unused = kMaxVarintSize - size_size;
+  if (open_sized_.empty()) {
+    compact_sized();
+  } else {
+    open_sized_.back().unused += open.unused + gap->unused;
+  }
+  return true;
+}
+
+void pton_assembler_t::compact_sized() {
+  uint8_t *code = *bytes_;
+  size_t dest = sized_gaps_[0].offset;
+  for (size_t i = 0; i < sized_gaps_.size(); i++) {
+    size_t start = sized_gaps_[i].offset + sized_gaps_[i].unused;
+    size_t end = (i + 1 < sized_gaps_.size())
+        ? sized_gaps_[i + 1].offset
+        : bytes_.length();
+    memmove(code + dest, code + start, end - start);
+    dest += end - start;
+  }
+  bytes_.truncate(dest);
+  sized_gaps_.clear();
+}
+
+bool pton_assembler_end_sized(pton_assembler_t *assm) {
+  return assm->end_sized();
+}
+
+bool pton_assembler_t::begin_open_array() {
+  return write_byte(boOpenArray);
+}
+
+bool pton_assembler_begin_open_array(pton_assembler_t *assm) {
+  return assm->begin_open_array();
+}
+
+bool pton_assembler_t::begin_open_map() {
+  return write_byte(boOpenMap);
+}
+
+bool pton_assembler_begin_open_map(pton_assembler_t *assm) {
+  return assm->begin_open_map();
+}
+
+bool pton_assembler_t::end_open() {
+  return write_byte(boEnd);
+}
+
+bool pton_assembler_end_open(pton_assembler_t *assm) {
+  return assm->end_open();
+}
+
+bool pton_assembler_t::begin_columns(uint32_t rowc, uint32_t headerc,
+    uint32_t keyc) {
+  return write_byte(boColumns) && write_uint64(rowc) && write_uint64(headerc)
+      && write_uint64(keyc);
+}
+
+bool pton_assembler_begin_columns(pton_assembler_t *assm, uint32_t rowc,
+    uint32_t headerc, uint32_t keyc) {
+  return assm->begin_columns(rowc, headerc, keyc);
+}
+
+bool pton_assembler_t::emit_delta_array(const int64_t *values, uint32_t count) {
+  if (!write_byte(boDeltaArray) || !write_uint64(count))
+    return false;
+  uint64_t prev = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    // The deltas wrap around rather than overflow.
+    uint64_t current = static_cast<uint64_t>(values[i]);
+    if (!write_int64(static_cast<int64_t>(current - prev)))
+      return false;
+    prev = current;
+  }
+  return true;
+}
+
+bool pton_assembler_emit_delta_array(pton_assembler_t *assm,
+    const int64_t *values, uint32_t count) {
+  return assm->emit_delta_array(values, count);
+}
+
+bool pton_assembler_t::begin_measured_array(uint32_t length,
+    uint64_t contents_size) {
+  return write_byte(boSizedArray) && write_uint64(length)
+      && write_uint64(contents_size);
+}
+
+bool pton_assembler_begin_measured_array(pton_assembler_t *assm,
+    uint32_t length, uint64_t contents_size) {
+  return assm->begin_measured_array(length, contents_size);
+}
+
+bool pton_assembler_t::begin_measured_map(uint32_t size,
+    uint64_t contents_size) {
+  return write_byte(boSizedMap) && write_uint64(size)
+      && write_uint64(contents_size);
+}
+
+bool pton_assembler_begin_measured_map(pton_assembler_t *assm, uint32_t size,
+    uint64_t contents_size) {
+  return assm->begin_measured_map(size, contents_size);
+}
+
+bool pton_assembler_t::begin_measured_seed(uint32_t headerc, uint32_t fieldc,
+    uint64_t contents_size) {
+  return write_byte(boSizedSeed) && write_uint64(headerc)
+      && write_uint64(fieldc) && write_uint64(contents_size);
+}
+
+bool pton_assembler_begin_measured_seed(pton_assembler_t *assm,
+    uint32_t headerc, uint32_t fieldc, uint64_t contents_size) {
+  return assm->begin_measured_seed(headerc, fieldc, contents_size);
+}
+
+void pton_assembler_reserve(pton_assembler_t *assm, size_t size) {
+  assm->reserve(size);
+}
+
 bool pton_assembler_t::emit_null() {
   return write_byte(boNull);
 }
@@ -196,6 +436,33 @@ bool pton_assembler_emit_reference(pton_assembler_t *assm, uint64_t offset) {
   return assm->emit_reference(offset);
 }
 
+bool pton_assembler_t::emit_indexed_values() {
+  return write_byte(boIndexedValues);
+}
+
+bool pton_assembler_emit_indexed_values(pton_assembler_t *assm) {
+  return assm->emit_indexed_values();
+}
+
+bool pton_assembler_t::emit_dictionary_string(uint32_t index) {
+  return write_byte(boDictionaryString) && write_uint64(index);
+}
+
+bool pton_assembler_emit_dictionary_string(pton_assembler_t *assm,
+    uint32_t index) {
+  return assm->emit_dictionary_string(index);
+}
+
+bool pton_assembler_t::emit_encoded(const void *data, size_t size) {
+  bytes_.write(static_cast<const uint8_t*>(data), size);
+  return true;
+}
+
+bool pton_assembler_emit_encoded(pton_assembler_t *assm, const void *data,
+    size_t size) {
+  return assm->emit_encoded(data, size);
+}
+
 blob_t pton_assembler_t::peek_code() {
   return blob_new(*bytes_, bytes_.length());
 }
@@ -213,6 +480,16 @@ blob_t pton_assembler_release_code(pton_assembler_t *assm) {
   return assm->release_code();
 }
 
+void pton_assembler_t::reset() {
+  bytes_.clear();
+  open_sized_.clear();
+  sized_gaps_.clear();
+}
+
+void pton_assembler_reset(pton_assembler_t *assm) {
+  assm->reset();
+}
+
 void pton_assembler_dispose_code(blob_t block) {
   delete[] static_cast<uint8_t*>(block.start);
 }
@@ -227,201 +504,1269 @@ bool pton_assembler_t::write_byte(uint8_t value) {
 }
 
 bool pton_assembler_t::write_int64(int64_t value) {
-  uint64_t zigzag = (value << 1) ^ (value >> 63);
-  return write_uint64(zigzag);
+  return write_uint64(zigzag(value));
 }
 
 bool pton_assembler_t::write_uint64(uint64_t value) {
-  uint64_t current = value;
-  while (current >= 0x80) {
-    write_byte(static_cast<byte_t>((current & 0x7F) | 0x80));
-    current = (current >> 7) - 1;
-  }
-  write_byte(static_cast<byte_t>(current));
+  uint8_t bytes[kMaxVarintSize];
+  size_t size = encode_uint64(value, bytes);
+  bytes_.write(bytes, size);
   return true;
 }
 
 namespace plankton {
 
-BinaryWriter::BinaryWriter()
-  : bytes_(NULL)
-  , size_(0) { }
+// Identifies a value that has been written such that later occurrences can be
+// written as references to it. Strings and blobs are identified by their
+// contents, everything else by the object that holds it.
+class SharedValueKey {
+public:
+  // The kind used for keys that identify objects rather than contents.
+  static const int32_t kObject = -2;
+  // The kind used for blob contents; strings use their encoding.
+  static const int32_t kBlob = -1;
 
-BinaryWriter::~BinaryWriter() {
-  delete[] bytes_;
-  bytes_ = NULL;
+  SharedValueKey(int32_t kind, const void *data, uint32_t size)
+    : kind_(kind)
+    , data_(data)
+    , size_(size) { }
+
+  // Returns true iff this key identifies a value by its contents.
+  bool is_contents() const { return kind_ != kObject; }
+
+  bool operator==(const SharedValueKey &that) const;
+
+  bool operator<(const SharedValueKey &that) const;
+
+  size_t hash_code() const;
+
+  // Helper class that tells the hash map how to hash keys.
+  class Hasher {
+  public:
+    size_t operator()(const SharedValueKey &key) const { return key.hash_code(); }
+
+    // See http://msdn.microsoft.com/en-us/library/1s1byw77.aspx.
+    static const size_t bucket_size = 4;
+
+    bool operator()(const SharedValueKey &a, const SharedValueKey &b) { return a < b; }
+  };
+
+private:
+  int32_t kind_;
+  const void *data_;
+  uint32_t size_;
+};
+
+bool SharedValueKey::operator==(const SharedValueKey &that) const {
+  if (kind_ != that.kind_ || size_ != that.size_)
+    return false;
+  return is_contents()
+      ? (memcmp(data_, that.data_, size_) == 0)
+      : (data_ == that.data_);
+}
+
+bool SharedValueKey::operator<(const SharedValueKey &that) const {
+  if (kind_ != that.kind_)
+    return kind_ < that.kind_;
+  if (size_ != that.size_)
+    return size_ < that.size_;
+  return is_contents()
+      ? (memcmp(data_, that.data_, size_) < 0)
+      : (data_ < that.data_);
+}
+
+size_t SharedValueKey::hash_code() const {
+  if (!is_contents())
+    return reinterpret_cast<size_t>(data_) >> 3;
+  // FNV-1a over the contents.
+  const uint8_t *bytes = static_cast<const uint8_t*>(data_);
+  size_t result = 2166136261U ^ static_cast<size_t>(kind_);
+  for (uint32_t i = 0; i < size_; i++)
+    result = (result ^ bytes[i]) * 16777619U;
+  return result;
 }
 
 // Utility that holds the state used when encoding a variant as plankton. The
-// difference between this and a BinaryWriter is that the binary writer's
-// lifetime is controlled by the client, the variant writer is created to write
-// one variant and then torn down.
-class VariantWriter {
+// difference between this and a BinaryWriter is that the binary writer is the
+// client-facing api whereas the variant writer does the actual work. A binary
+// writer keeps its variant writer around between writes so the memory it uses
+// can be reused.
+class VariantWriter : public BinaryImplUtils {
 public:
-  VariantWriter(Assembler *assm) : assm_(assm) { }
+  VariantWriter(Assembler *assm)
+    : scratch_(NULL)
+    , assm_(assm)
+    , sized_containers_(false)
+    , references_(false)
+    , is_measured_(false)
+    , next_contents_size_(0)
+    , next_replacement_(0)
+    , next_array_columns_(0)
+    , columns_used_(0)
+    , direct_assm_(NULL)
+    , next_direct_encoding_(0)
+    , next_index_(0)
+    , next_reference_offset_(0)
+    , canonical_(false)
+    , columnar_(false)
+    , string_dictionary_(NULL)
+    , key_assm_(NULL)
+    , key_writer_(NULL)
+    , streaming_(NULL) { }
+
+  // Sets the streaming writer whose buffer should be drained as it fills up
+  // while encoding.
+  void set_streaming(StreamingBinaryWriter *value) { streaming_ = value; }
+
+  ~VariantWriter();
+
+  // Sets whether containers should be written with their sizes.
+  void set_sized_containers(bool value) { sized_containers_ = value; }
+
+  // Sets whether values that occur more than once should be written as
+  // references.
+  void set_references(bool value) { references_ = value; }
+
+  // Sets whether the entries of maps and seeds should be written in canonical
+  // order.
+  void set_canonical(bool value) { canonical_ = value; }
+
+  // Sets whether arrays of same-shaped maps and seeds should be written as
+  // columns.
+  void set_columnar(bool value) { columnar_ = value; }
+
+  // Sets the dictionary to look strings up in.
+  void set_string_dictionary(StringDictionary *value) { string_dictionary_ = value; }
+
+  // Copies the settings of the given writer that apply to values a native
+  // writes itself. The rest don't matter since natives don't write themselves
+  // when references, canonical order, or a dictionary are used.
+  void inherit_settings(VariantWriter *outer) {
+    sized_containers_ = outer->sized_containers_;
+    columnar_ = outer->columnar_;
+  }
 
-  // Write the given value to the stream.
-  void encode(Variant value);
+  // Adds the strings that have been written in full since the last call to
+  // the string dictionary.
+  void update_string_dictionary();
+
+  // Clears the state left over from writing a previous value, keeping the
+  // memory used to hold it where possible.
+  void reset();
+
+  // Returns the number of bytes it takes to encode the given value. Along the
+  // way the sizes of the contents of sized containers and the replacements
+  // for native objects are recorded such that a subsequent call to encode
+  // with the same value doesn't have to compute them again and can write the
+  // sizes of sized containers directly.
+  size_t measure(Variant value);
+
+  // Write the given value to the stream. Returns false if the assembler
+  // failed to write any part of it.
+  bool encode(Variant value);
+
+  // Writes the given value as a whole rather than as part of an enclosing
+  // value. If references are enabled it is prefixed such that readers index
+  // all values within it.
+  bool encode_root(Variant value);
+
+  // If the given value is an array or map large enough that it's worth it,
+  // writes it by splitting its contents between the given number of threads
+  // and returns true. Otherwise nothing is written and false is returned.
+  bool encode_parallel(Variant value, size_t thread_count);
 
   // Flush the contents of the stream, storing them in the fields of the given
   // writer.
   void flush(BinaryWriter *writer);
 
-  void encode_array(Array value);
+  bool encode_array(Array value);
 
-  void encode_string(String value);
+  bool encode_string(String value);
 
-  void encode_blob(Blob value);
+  bool encode_blob(Blob value);
 
-  void encode_map(Map value);
+  bool encode_map(Map value);
 
-  void encode_seed(Seed value);
+  bool encode_seed(Seed value);
 
-  void encode_native(Native value);
+  bool encode_native(Native value);
 
 private:
-  Arena scratch_;
+  // Offset used to indicate that a value should be written in full rather
+  // than as a reference.
+  static const uint64_t kNotShared = ~static_cast<uint64_t>(0);
+
+  typedef platform_hash_map<SharedValueKey, uint64_t, SharedValueKey::Hasher> IndexMap;
+
+  // Writes the given value in full.
+  bool encode_value(Variant value);
+
+  // Returns the offset of the reference the given value should be written as,
+  // or kNotShared if it should be written in full.
+  uint64_t next_reference(Variant value);
+
+  // Looks up whether the given value has been written before and, if it has
+  // and it's worth it, returns the offset to write the reference with.
+  // Otherwise the value is given the next index and kNotShared is returned.
+  uint64_t find_reference(Variant value);
+
+  // Records that references to the given native should refer to the given
+  // replacement, which has just been written.
+  void share_native(Native value, Variant replacement);
+
+  // A mapping in a map or seed.
+  struct Entry {
+    Variant key;
+    Variant value;
+    // Where the key's encoding starts in the key writer's output, and its
+    // size.
+    size_t key_start;
+    size_t key_size;
+  };
+
+  // Orders entries by their encoded keys.
+  class EntryOrder {
+  public:
+    EntryOrder(const uint8_t *keys) : keys_(keys) { }
+    bool operator()(const Entry &a, const Entry &b) const;
+  private:
+    const uint8_t *keys_;
+  };
+
+  // Stores the mappings between the given iterators in the given vector in
+  // canonical order.
+  template <typename I>
+  void get_canonical_entries(I begin, I end, std::vector<Entry> *entries_out);
+
+  // Writes the given entries, keys and values alternating.
+  bool encode_entries(const std::vector<Entry> &entries);
+
+  // The contents of an array of maps or seeds with the same keys.
+  struct Columns {
+    uint32_t rowc;
+    // The header shared by the seeds, if the rows are seeds.
+    bool has_header;
+    Variant header;
+    std::vector<Variant> keys;
+    // The values of the rows, one row after the other.
+    std::vector<Variant> values;
+    // Returns the value of the given key in the given row.
+    Variant get(uint32_t row, size_t key) { return values[row * keys.size() + key]; }
+  };
+
+  // If the given array should be written as columns, stores its contents in
+  // the given struct and returns true.
+  bool get_columns(Array value, Columns *columns_out);
+
+  // Returns the columns to write the given array as, or NULL if it isn't
+  // written as columns, recording the decision for encode.
+  Columns *record_columns(Array value);
+
+  // Returns the columns recorded for the next array.
+  Columns *next_columns() { return array_columns_[next_array_columns_++]; }
+
+  // Returns true iff all the values of the given column are integers.
+  static bool is_integer_column(Columns *columns, size_t key);
+
+  // Returns the size of the given columns, recording what encode will need.
+  size_t measure_columns(Columns *columns);
+
+  // Writes the given columns.
+  bool encode_columns(Columns *columns);
+
+  // Returns the size of the given value, recording what encode will need.
+  size_t measure_value(Variant value);
+
+  // Returns the size of a sized container with the given header whose
+  // contents take up the given number of bytes. The contents size must have
+  // been recorded at the given index.
+  size_t measure_sized(size_t header_size, size_t index, size_t contents_size);
+
+  // Returns the recorded size of the next sized container.
+  uint64_t next_contents_size() { return contents_sizes_[next_contents_size_++]; }
+
+  // Returns the value to encode in place of the given native.
+  Variant get_replacement(Native value);
+
+  // Returns the encoding of the given native if it has one that can be written
+  // directly, otherwise a non-blob.
+  Blob get_encoded(Native value);
+
+  // Returns true iff values encoded separately from this writer can be
+  // spliced into its output.
+  bool can_splice();
+
+  // If the given native's type can write it directly, writes it to the direct
+  // encodings, stores the size in the out parameter, and returns true.
+  bool measure_direct(Native value, size_t *size_out);
+
+  // If the given native's type can write it directly, writes it to the output
+  // and returns true.
+  bool encode_direct(Native value);
+
+  // Lets the given native's type write it to the given assembler, with the
+  // values it writes through BinaryWriter::write_to using this writer's
+  // settings. Returns what the type's encode_to returns.
+  bool write_native(Native value, Assembler *assm);
+
+  // Where a native written directly while measuring is in the direct
+  // encodings.
+  struct DirectEncoding {
+    void *object;
+    size_t start;
+    size_t size;
+  };
+
+  // Returns true iff values of the given type can be written as references.
+  static bool is_shareable(pton_type_t type);
+
+  // Returns the index of the given string in the string dictionary, or
+  // kNotFound if it isn't there.
+  uint32_t find_in_dictionary(String value);
+
+  // Returns the number of bytes it takes to encode the given string or blob.
+  static size_t string_size(String value);
+  static size_t blob_size(Blob value);
+
+  // Arena that holds the replacements for native objects. Created the first
+  // time it's needed since most values don't contain natives and reset, not
+  // freed, between writes.
+  Arena *scratch_;
   Assembler *assm_;
+  bool sized_containers_;
+  bool references_;
+  bool is_measured_;
+  // The contents sizes of the sized containers, in the order they're written.
+  std::vector<uint64_t> contents_sizes_;
+  size_t next_contents_size_;
+  // The replacement values for native objects, in the order they're written.
+  std::vector<Variant> replacements_;
+  size_t next_replacement_;
+  // The columns of each array, or NULL for arrays that aren't written as
+  // columns, in the order they're written. The columns come from a pool that
+  // is kept between writes so their memory can be reused.
+  std::vector<Columns*> array_columns_;
+  size_t next_array_columns_;
+  std::vector<Columns*> columns_pool_;
+  size_t columns_used_;
+  // The natives written directly by their types while measuring, one after
+  // the other in an assembler that is created the first time it's needed.
+  Assembler *direct_assm_;
+  std::vector<DirectEncoding> direct_encodings_;
+  size_t next_direct_encoding_;
+  // The index the next value that can be referenced will get and the indices
+  // of the values written so far.
+  uint64_t next_index_;
+  IndexMap indices_;
+  // The reference offsets decided while measuring, in the order the values
+  // are written.
+  std::vector<uint64_t> reference_offsets_;
+  size_t next_reference_offset_;
+  bool canonical_;
+  bool columnar_;
+  StringDictionary *string_dictionary_;
+  // The strings written in full that will be added to the string dictionary.
+  std::vector<String> new_strings_;
+  // Assembler and writer used to encode keys to determine their canonical
+  // order. Created the first time they're needed.
+  Assembler *key_assm_;
+  VariantWriter *key_writer_;
+  StreamingBinaryWriter *streaming_;
   Assembler *assm() { return assm_; }
+
+  Arena *scratch() {
+    if (scratch_ == NULL)
+      scratch_ = new Arena();
+    return scratch_;
+  }
 };
 
+VariantWriter::~VariantWriter() {
+  for (size_t i = 0; i < columns_pool_.size(); i++)
+    delete columns_pool_[i];
+  delete scratch_;
+  delete direct_assm_;
+  delete key_writer_;
+  delete key_assm_;
+}
+
 void VariantWriter::flush(BinaryWriter *writer) {
-  blob_t live = assm()->peek_code();
-  writer->size_ = live.size;
-  writer->bytes_ = new uint8_t[live.size];
-  memcpy(writer->bytes_, live.start, live.size);
+  // The writer's assembler stays the owner of the code so the memory can be
+  // reused by the next write.
+  blob_t code = assm()->peek_code();
+  writer->size_ = code.size;
+  writer->bytes_ = static_cast<uint8_t*>(code.start);
+}
+
+void VariantWriter::reset() {
+  contents_sizes_.clear();
+  replacements_.clear();
+  new_strings_.clear();
+  next_contents_size_ = next_replacement_ = next_direct_encoding_ = 0;
+  array_columns_.clear();
+  next_array_columns_ = columns_used_ = 0;
+  direct_encodings_.clear();
+  if (direct_assm_ != NULL)
+    direct_assm_->reset();
+  indices_.clear();
+  reference_offsets_.clear();
+  next_index_ = next_reference_offset_ = 0;
+  is_measured_ = false;
+  // The replacements for natives from the previous value are no longer
+  // needed but the memory they used is kept for the next ones.
+  if (scratch_ != NULL)
+    scratch_->reset();
+}
+
+size_t VariantWriter::measure(Variant value) {
+  reset();
+  // The boIndexedValues prefix, if references are enabled, takes one byte.
+  size_t result = (references_ ? 1 : 0) + measure_value(value);
+  is_measured_ = true;
+  return result;
+}
+
+size_t VariantWriter::measure_sized(size_t header_size, size_t index,
+    size_t contents_size) {
+  contents_sizes_[index] = contents_size;
+  return header_size + uint64_size(contents_size) + contents_size;
 }
 
-void VariantWriter::encode(Variant value) {
+size_t VariantWriter::measure_value(Variant value) {
+  if (references_ && is_shareable(value.type())) {
+    uint64_t offset = find_reference(value);
+    reference_offsets_.push_back(offset);
+    if (offset != kNotShared)
+      return 1 + uint64_size(offset);
+  }
   switch (value.type()) {
-    case PTON_ARRAY:
-      encode_array(value);
-      break;
-    case PTON_STRING:
-      encode_string(value);
-      break;
+    case PTON_ARRAY: {
+      Array array = value;
+      Columns *columns = record_columns(array);
+      if (columns != NULL)
+        return measure_columns(columns);
+      uint32_t length = array.length();
+      size_t header_size = 1 + uint64_size(length);
+      size_t index = contents_sizes_.size();
+      if (sized_containers_)
+        contents_sizes_.push_back(0);
+      size_t contents_size = 0;
+      for (uint32_t i = 0; i < length; i++)
+        contents_size += measure_value(array[i]);
+      return sized_containers_
+          ? measure_sized(header_size, index, contents_size)
+          : header_size + contents_size;
+    }
+    case PTON_MAP: {
+      Map map = value;
+      size_t header_size = 1 + uint64_size(map.size());
+      size_t index = contents_sizes_.size();
+      if (sized_containers_)
+        contents_sizes_.push_back(0);
+      size_t contents_size = 0;
+      if (canonical_) {
+        std::vector<Entry> entries;
+        get_canonical_entries(map.begin(), map.end(), &entries);
+        for (size_t i = 0; i < entries.size(); i++)
+          contents_size += measure_value(entries[i].key)
+              + measure_value(entries[i].value);
+      } else {
+        for (Map::Iterator i = map.begin(); i != map.end(); i++)
+          contents_size += measure_value(i->key()) + measure_value(i->value());
+      }
+      return sized_containers_
+          ? measure_sized(header_size, index, contents_size)
+          : header_size + contents_size;
+    }
+    case PTON_SEED: {
+      Seed seed = value;
+      size_t header_size = 1 + uint64_size(1) + uint64_size(seed.field_count());
+      size_t index = contents_sizes_.size();
+      if (sized_containers_)
+        contents_sizes_.push_back(0);
+      size_t contents_size = measure_value(seed.header());
+      if (canonical_) {
+        std::vector<Entry> entries;
+        get_canonical_entries(seed.fields_begin(), seed.fields_end(), &entries);
+        for (size_t i = 0; i < entries.size(); i++)
+          contents_size += measure_value(entries[i].key)
+              + measure_value(entries[i].value);
+      } else {
+        for (Seed::Iterator i = seed.fields_begin(); i != seed.fields_end(); i++)
+          contents_size += measure_value(i->key()) + measure_value(i->value());
+      }
+      return sized_containers_
+          ? measure_sized(header_size, index, contents_size)
+          : header_size + contents_size;
+    }
+    case PTON_STRING: {
+      uint32_t index = find_in_dictionary(value);
+      return (index == StringDictionary::kNotFound)
+          ? string_size(value)
+          : 1 + uint64_size(index);
+    }
     case PTON_BLOB:
-      encode_blob(value);
-      break;
-    case PTON_MAP:
-      encode_map(value);
-      break;
-    case PTON_SEED:
-      encode_seed(value);
-      break;
-    case PTON_NATIVE:
-      encode_native(value);
-      break;
-    case PTON_BOOL:
-      assm()->emit_bool(value.bool_value());
-      break;
+      return blob_size(value);
+    case PTON_NATIVE: {
+      Native native = value;
+      Blob encoded = get_encoded(native);
+      if (encoded.is_blob())
+        return encoded.size();
+      size_t direct_size = 0;
+      if (measure_direct(native, &direct_size))
+        return direct_size;
+      Variant replacement = native.type()->encode_instance(native, scratch());
+      replacements_.push_back(replacement);
+      size_t result = measure_value(replacement);
+      if (references_)
+        share_native(native, replacement);
+      return result;
+    }
     case PTON_INTEGER:
-      assm()->emit_int64(value.integer_value());
-      break;
+      return 1 + int64_size(value.integer_value());
     case PTON_ID:
-      assm()->emit_id64(value.id_size(), value.id64_value());
-      break;
+      return 2 + (value.id_size() >> 3);
+    case PTON_BOOL:
     case PTON_NULL:
     default:
-      assm()->emit_null();
-      break;
+      return 1;
   }
 }
 
-void VariantWriter::encode_string(String value) {
-  uint32_t length = value.length();
-  pton_charset_t encoding = value.encoding();
-  if (encoding == Variant::default_string_encoding()) {
-    assm()->emit_default_string(value.chars(), length);
-  } else {
-    assm()->emit_string_with_encoding(encoding, value.chars(), length);
-  }
+uint32_t VariantWriter::find_in_dictionary(String value) {
+  // Only strings with the default encoding are added so the others are never
+  // found.
+  if (string_dictionary_ == NULL
+      || value.encoding() != Variant::default_string_encoding()
+      || !StringDictionary::is_eligible(value.length()))
+    return StringDictionary::kNotFound;
+  return string_dictionary_->find(value.chars(), value.length());
 }
 
-void VariantWriter::encode_blob(Blob value) {
-  assm()->emit_blob(value.data(), value.size());
+void VariantWriter::update_string_dictionary() {
+  if (string_dictionary_ != NULL) {
+    for (size_t i = 0; i < new_strings_.size(); i++)
+      string_dictionary_->add(new_strings_[i].chars(), new_strings_[i].length());
+  }
+  new_strings_.clear();
 }
 
-void VariantWriter::encode_array(Array value) {
+size_t VariantWriter::string_size(String value) {
   uint32_t length = value.length();
-  assm()->begin_array(length);
-  for (uint32_t i = 0; i < length; i++)
-    encode(value[i]);
+  pton_charset_t encoding = value.encoding();
+  size_t encoding_size = (encoding == Variant::default_string_encoding())
+      ? 0
+      : uint64_size(encoding);
+  return 1 + encoding_size + uint64_size(length) + length;
 }
 
-void VariantWriter::encode_map(Map value) {
+size_t VariantWriter::blob_size(Blob value) {
   uint32_t size = value.size();
-  assm()->begin_map(size);
-  for (Map::Iterator i = value.begin(); i != value.end(); i++) {
-    encode(i->key());
-    encode(i->value());
-  }
+  return 1 + uint64_size(size) + size;
 }
 
-void VariantWriter::encode_seed(Seed value) {
-  assm()->begin_seed(1, value.field_count());
-  encode(value.header());
-  for (Seed::Iterator i = value.fields_begin(); i != value.fields_end(); i++) {
-    encode(i->key());
-    encode(i->value());
+bool VariantWriter::is_shareable(pton_type_t type) {
+  switch (type) {
+    case PTON_STRING:
+    case PTON_BLOB:
+    case PTON_ARRAY:
+    case PTON_MAP:
+    case PTON_SEED:
+    case PTON_NATIVE:
+      return true;
+    default:
+      return false;
   }
 }
 
-void VariantWriter::encode_native(Native value) {
-  AbstractSeedType *type = value.type();
-  Variant replacement = type->encode_instance(value, &scratch_);
-  encode(replacement);
+// Values are given indices in the order they're written, a container before
+// its contents, and a reference records how many indices back the value it
+// refers to is. The decoder hands out indices the same way.
+uint64_t VariantWriter::find_reference(Variant value) {
+  SharedValueKey key(SharedValueKey::kObject,
+      value.to_c().payload_.as_arena_value_, 0);
+  switch (value.type()) {
+    case PTON_STRING: {
+      String str = value;
+      key = SharedValueKey(str.encoding(), str.chars(), str.length());
+      break;
+    }
+    case PTON_BLOB: {
+      Blob blob = value;
+      key = SharedValueKey(SharedValueKey::kBlob, blob.data(), blob.size());
+      break;
+    }
+    default:
+      break;
+  }
+  if (canonical_ && !key.is_contents()) {
+    // Whether containers are shared doesn't affect equality so in canonical
+    // mode they're always written in full. They still get an index though.
+    if (!value.is_native())
+      next_index_++;
+    return kNotShared;
+  }
+  IndexMap::iterator existing = indices_.find(key);
+  if (existing != indices_.end()) {
+    uint64_t offset = next_index_ - existing->second - 1;
+    // Objects must always be referenced to preserve sharing but there's no
+    // point in referencing contents that are no larger than the reference.
+    size_t size = 0;
+    if (value.is_string()) {
+      size = string_size(value);
+    } else if (value.is_blob()) {
+      size = blob_size(value);
+    }
+    if (!key.is_contents() || (1 + uint64_size(offset)) <= size)
+      return offset;
+  }
+  // Natives don't get an index of their own, they share the one of their
+  // replacement.
+  if (!value.is_native())
+    indices_[key] = next_index_++;
+  return kNotShared;
 }
 
-void BinaryWriter::write(Variant value) {
-  Assembler assm;
-  VariantWriter writer(&assm);
-  writer.encode(value);
-  writer.flush(this);
+void VariantWriter::share_native(Native value, Variant replacement) {
+  if (!is_shareable(replacement.type()))
+    return;
+  IndexMap::iterator index = indices_.find(SharedValueKey(
+      SharedValueKey::kObject, replacement.to_c().payload_.as_arena_value_, 0));
+  if (index == indices_.end())
+    return;
+  Variant native = value;
+  indices_[SharedValueKey(SharedValueKey::kObject,
+      native.to_c().payload_.as_arena_value_, 0)] = index->second;
 }
 
-class BinaryReaderImpl : public BinaryImplUtils {
-public:
-  BinaryReaderImpl(const void *data, size_t size, BinaryReader *reader);
-
-  bool decode(Variant *result_out);
+bool VariantWriter::EntryOrder::operator()(const Entry &a, const Entry &b) const {
+  size_t common = (a.key_size < b.key_size) ? a.key_size : b.key_size;
+  int cmp = memcmp(keys_ + a.key_start, keys_ + b.key_start, common);
+  return (cmp == 0) ? (a.key_size < b.key_size) : (cmp < 0);
+}
 
-private:
-  // Returns true iff there are more bytes to return.
-  bool has_more() { return cursor_ < size_; }
+template <typename I>
+void VariantWriter::get_canonical_entries(I begin, I end,
+    std::vector<Entry> *entries_out) {
+  if (key_writer_ == NULL) {
+    key_assm_ = new Assembler();
+    key_writer_ = new VariantWriter(key_assm_);
+    key_writer_->set_canonical(true);
+  }
+  // The keys are encoded one after the other into the key assembler and the
+  // entries are then sorted by their encodings.
+  key_assm_->reset();
+  for (I i = begin; i != end; i++) {
+    Entry entry;
+    entry.key = i->key();
+    entry.value = i->value();
+    entry.key_start = key_assm_->peek_code().size;
+    key_writer_->reset();
+    key_writer_->encode(entry.key);
+    entry.key_size = key_assm_->peek_code().size - entry.key_start;
+    entries_out->push_back(entry);
+  }
+  if (entries_out->empty())
+    return;
+  EntryOrder order(static_cast<const uint8_t*>(key_assm_->peek_code().start));
+  std::sort(entries_out->begin(), entries_out->end(), order);
+}
 
-  // Read an array's payload.
-  bool decode_array(uint32_t length, Variant *result_out);
+uint64_t VariantWriter::next_reference(Variant value) {
+  if (!is_shareable(value.type()))
+    return kNotShared;
+  return is_measured_
+      ? reference_offsets_[next_reference_offset_++]
+      : find_reference(value);
+}
 
-  // Read a map's payload.
-  bool decode_map(uint32_t size, Variant *result_out);
+Variant VariantWriter::get_replacement(Native value) {
+  if (is_measured_)
+    return replacements_[next_replacement_++];
+  AbstractSeedType *type = value.type();
+  return type->encode_instance(value, scratch());
+}
 
-  // Read an seed's payload.
-  bool decode_seed(uint32_t headerc, uint32_t fieldc, Variant *result_out);
+Blob VariantWriter::get_encoded(Native value) {
+  // The values within an encoded fragment take up indices the reference
+  // bookkeeping doesn't know about, the fragment's entries aren't necessarily
+  // in canonical order, and its strings would be added to the reader's string
+  // dictionary but not the writer's, so in those modes the replacement is
+  // written instead.
+  if (!can_splice())
+    return Blob();
+  Blob encoded = value.type()->encoded_instance(value);
+  // The fragment is written verbatim so it must hold exactly one value, the
+  // same as new_preencoded requires; anything else is written through the
+  // replacement instead.
+  if (!encoded.is_blob() || encoded.size() == 0)
+    return Blob();
+  return (BinaryReader::value_size(encoded.data(), encoded.size()) == encoded.size())
+      ? encoded
+      : Blob();
+}
 
-  // Convert default-encoding string data into a string variant.
-  bool decode_default_string(pton_instr_t *instr, Variant *result_out);
+bool VariantWriter::can_splice() {
+  return !references_ && !canonical_ && string_dictionary_ == NULL;
+}
 
-  // Convert a binary blob into a blob variant.
-  bool decode_blob(pton_instr_t *instr, Variant *result_out);
+bool VariantWriter::measure_direct(Native value, size_t *size_out) {
+  if (!can_splice())
+    return false;
+  if (direct_assm_ == NULL)
+    direct_assm_ = new Assembler();
+  size_t start = direct_assm_->peek_code().size;
+  if (!write_native(value, direct_assm_))
+    return false;
+  DirectEncoding encoding = {value.value(), start,
+      direct_assm_->peek_code().size - start};
+  direct_encodings_.push_back(encoding);
+  *size_out = encoding.size;
+  return true;
+}
 
-  // Convert a custom-encoding string data into a string variant.
-  bool decode_string_with_encoding(pton_instr_t *instr, Variant *result_out);
+bool VariantWriter::write_native(Native value, Assembler *assm) {
+  VariantWriter *outer = assm->outer_writer_;
+  assm->outer_writer_ = this;
+  bool result = value.type()->encode_to(value, assm);
+  assm->outer_writer_ = outer;
+  return result;
+}
 
-  // Succeeds parsing of some expression, returning true.
-  bool succeed(Variant value, Variant *out);
+bool VariantWriter::encode_direct(Native value) {
+  if (!can_splice())
+    return false;
+  if (!is_measured_)
+    return write_native(value, assm());
+  // Natives are encoded in the same order they were measured so if this one
+  // was written directly it's the next direct encoding.
+  if (next_direct_encoding_ == direct_encodings_.size()
+      || direct_encodings_[next_direct_encoding_].object != value.value())
+    return false;
+  DirectEncoding &encoding = direct_encodings_[next_direct_encoding_++];
+  const uint8_t *code = static_cast<const uint8_t*>(direct_assm_->peek_code().start);
+  assm()->emit_encoded(code + encoding.start, encoding.size);
+  return true;
+}
 
-  size_t size_;
-  size_t cursor_;
-  const uint8_t *data_;
-  BinaryReader *reader_;
-};
+bool VariantWriter::encode(Variant value) {
+  uint64_t offset = references_ ? next_reference(value) : kNotShared;
+  bool result = (offset == kNotShared)
+      ? encode_value(value)
+      : assm()->emit_reference(offset);
+  if (streaming_ != NULL
+      && assm()->peek_code().size >= streaming_->buffer_size_)
+    streaming_->drain();
+  return result;
+}
 
-BinaryReaderImpl::BinaryReaderImpl(const void *data, size_t size, BinaryReader *reader)
-  : size_(size)
-  , cursor_(0)
-  , data_(static_cast<const uint8_t*>(data))
-  , reader_(reader) { }
+bool VariantWriter::encode_value(Variant value) {
+  switch (value.type()) {
+    case PTON_ARRAY:
+      return encode_array(value);
+    case PTON_STRING:
+      return encode_string(value);
+    case PTON_BLOB:
+      return encode_blob(value);
+    case PTON_MAP:
+      return encode_map(value);
+    case PTON_SEED:
+      return encode_seed(value);
+    case PTON_NATIVE:
+      return encode_native(value);
+    case PTON_BOOL:
+      return assm()->emit_bool(value.bool_value());
+    case PTON_INTEGER:
+      return assm()->emit_int64(value.integer_value());
+    case PTON_ID:
+      return assm()->emit_id64(value.id_size(), value.id64_value());
+    case PTON_NULL:
+    default:
+      return assm()->emit_null();
+  }
+}
+
+bool VariantWriter::encode_string(String value) {
+  uint32_t length = value.length();
+  pton_charset_t encoding = value.encoding();
+  uint32_t index = find_in_dictionary(value);
+  if (index != StringDictionary::kNotFound) {
+    string_dictionary_->touch(index);
+    return assm()->emit_dictionary_string(index);
+  }
+  if (string_dictionary_ != NULL && encoding == Variant::default_string_encoding()
+      && StringDictionary::is_eligible(length))
+    new_strings_.push_back(value);
+  return (encoding == Variant::default_string_encoding())
+      ? assm()->emit_default_string(value.chars(), length)
+      : assm()->emit_string_with_encoding(encoding, value.chars(), length);
+}
+
+bool VariantWriter::encode_blob(Blob value) {
+  return assm()->emit_blob(value.data(), value.size());
+}
+
+// If the value has been measured the sizes of sized containers are known up
+// front and are written directly, otherwise they're filled in by end_sized.
+bool VariantWriter::encode_array(Array value) {
+  Columns unmeasured;
+  Columns *columns = NULL;
+  if (is_measured_) {
+    columns = next_columns();
+  } else if (get_columns(value, &unmeasured)) {
+    columns = &unmeasured;
+  }
+  if (columns != NULL)
+    return encode_columns(columns);
+  uint32_t length = value.length();
+  bool end_sized = sized_containers_ && !is_measured_;
+  bool result;
+  if (!sized_containers_) {
+    result = assm()->begin_array(length);
+  } else if (is_measured_) {
+    result = assm()->begin_measured_array(length, next_contents_size());
+  } else {
+    result = assm()->begin_sized_array(length);
+  }
+  for (uint32_t i = 0; i < length && result; i++)
+    result = encode(value[i]);
+  return result && (!end_sized || assm()->end_sized());
+}
+
+bool VariantWriter::encode_map(Map value) {
+  uint32_t size = value.size();
+  bool end_sized = sized_containers_ && !is_measured_;
+  bool result;
+  if (!sized_containers_) {
+    result = assm()->begin_map(size);
+  } else if (is_measured_) {
+    result = assm()->begin_measured_map(size, next_contents_size());
+  } else {
+    result = assm()->begin_sized_map(size);
+  }
+  if (!result) {
+    return false;
+  } else if (canonical_) {
+    std::vector<Entry> entries;
+    get_canonical_entries(value.begin(), value.end(), &entries);
+    result = encode_entries(entries);
+  } else {
+    for (Map::Iterator i = value.begin(); i != value.end() && result; i++)
+      result = encode(i->key()) && encode(i->value());
+  }
+  return result && (!end_sized || assm()->end_sized());
+}
+
+bool VariantWriter::encode_seed(Seed value) {
+  uint32_t fieldc = value.field_count();
+  bool end_sized = sized_containers_ && !is_measured_;
+  bool result;
+  if (!sized_containers_) {
+    result = assm()->begin_seed(1, fieldc);
+  } else if (is_measured_) {
+    result = assm()->begin_measured_seed(1, fieldc, next_contents_size());
+  } else {
+    result = assm()->begin_sized_seed(1, fieldc);
+  }
+  if (!result || !encode(value.header())) {
+    return false;
+  } else if (canonical_) {
+    std::vector<Entry> entries;
+    get_canonical_entries(value.fields_begin(), value.fields_end(), &entries);
+    result = encode_entries(entries);
+  } else {
+    for (Seed::Iterator i = value.fields_begin(); i != value.fields_end() && result; i++)
+      result = encode(i->key()) && encode(i->value());
+  }
+  return result && (!end_sized || assm()->end_sized());
+}
+
+bool VariantWriter::encode_entries(const std::vector<Entry> &entries) {
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (!encode(entries[i].key) || !encode(entries[i].value))
+      return false;
+  }
+  return true;
+}
+
+bool VariantWriter::get_columns(Array value, Columns *columns_out) {
+  // The rows don't get indices of their own so columns can't be mixed with
+  // references, and they're not canonical.
+  uint32_t rowc = value.length();
+  if (!columnar_ || references_ || canonical_
+      || rowc < BinaryWriter::kMinColumnarLength)
+    return false;
+  columns_out->rowc = rowc;
+  std::vector<Variant> &keys = columns_out->keys;
+  std::vector<Variant> &values = columns_out->values;
+  Variant first = value[0];
+  if (first.is_map()) {
+    columns_out->has_header = false;
+    Map map = first;
+    for (Map::Iterator i = map.begin(); i != map.end(); i++)
+      keys.push_back(i->key());
+  } else if (first.is_seed()) {
+    columns_out->has_header = true;
+    Seed seed = first;
+    columns_out->header = seed.header();
+    for (Seed::Iterator i = seed.fields_begin(); i != seed.fields_end(); i++)
+      keys.push_back(i->key());
+  } else {
+    return false;
+  }
+  size_t keyc = keys.size();
+  if (keyc == 0)
+    return false;
+  // The rows must have the same keys in the same order.
+  values.reserve(static_cast<size_t>(rowc) * keyc);
+  for (uint32_t r = 0; r < rowc; r++) {
+    Variant row = value[r];
+    size_t k = 0;
+    if (columns_out->has_header) {
+      if (!row.is_seed())
+        return false;
+      Seed seed = row;
+      if (seed.field_count() != keyc || !(seed.header() == columns_out->header))
+        return false;
+      for (Seed::Iterator i = seed.fields_begin(); i != seed.fields_end(); i++, k++) {
+        if (!(i->key() == keys[k]))
+          return false;
+        values.push_back(i->value());
+      }
+    } else {
+      if (!row.is_map())
+        return false;
+      Map map = row;
+      if (map.size() != keyc)
+        return false;
+      for (Map::Iterator i = map.begin(); i != map.end(); i++, k++) {
+        if (!(i->key() == keys[k]))
+          return false;
+        values.push_back(i->value());
+      }
+    }
+  }
+  return true;
+}
+
+VariantWriter::Columns *VariantWriter::record_columns(Array value) {
+  Columns *result = NULL;
+  if (columnar_) {
+    if (columns_used_ == columns_pool_.size())
+      columns_pool_.push_back(new Columns());
+    Columns *columns = columns_pool_[columns_used_];
+    columns->keys.clear();
+    columns->values.clear();
+    if (get_columns(value, columns)) {
+      columns_used_++;
+      result = columns;
+    }
+  }
+  array_columns_.push_back(result);
+  return result;
+}
+
+bool VariantWriter::is_integer_column(Columns *columns, size_t key) {
+  for (uint32_t r = 0; r < columns->rowc; r++) {
+    if (!columns->get(r, key).is_integer())
+      return false;
+  }
+  return true;
+}
+
+size_t VariantWriter::measure_columns(Columns *columns) {
+  uint32_t rowc = columns->rowc;
+  size_t keyc = columns->keys.size();
+  size_t result = 1 + uint64_size(rowc) + uint64_size(columns->has_header ? 1 : 0)
+      + uint64_size(keyc);
+  if (columns->has_header)
+    result += measure_value(columns->header);
+  for (size_t k = 0; k < keyc; k++)
+    result += measure_value(columns->keys[k]);
+  size_t header_size = 1 + uint64_size(rowc);
+  for (size_t k = 0; k < keyc; k++) {
+    if (is_integer_column(columns, k)) {
+      int64_t prev = 0;
+      result += header_size;
+      for (uint32_t r = 0; r < rowc; r++) {
+        int64_t current = columns->get(r, k).integer_value();
+        result += int64_size(static_cast<int64_t>(
+            static_cast<uint64_t>(current) - static_cast<uint64_t>(prev)));
+        prev = current;
+      }
+      continue;
+    }
+    size_t index = contents_sizes_.size();
+    if (sized_containers_)
+      contents_sizes_.push_back(0);
+    size_t contents_size = 0;
+    for (uint32_t r = 0; r < rowc; r++)
+      contents_size += measure_value(columns->get(r, k));
+    result += sized_containers_
+        ? measure_sized(header_size, index, contents_size)
+        : header_size + contents_size;
+  }
+  return result;
+}
+
+bool VariantWriter::encode_columns(Columns *columns) {
+  uint32_t rowc = columns->rowc;
+  uint32_t keyc = static_cast<uint32_t>(columns->keys.size());
+  if (!assm()->begin_columns(rowc, columns->has_header ? 1 : 0, keyc))
+    return false;
+  if (columns->has_header && !encode(columns->header))
+    return false;
+  for (uint32_t k = 0; k < keyc; k++) {
+    if (!encode(columns->keys[k]))
+      return false;
+  }
+  std::vector<int64_t> ints;
+  bool end_sized = sized_containers_ && !is_measured_;
+  for (uint32_t k = 0; k < keyc; k++) {
+    if (is_integer_column(columns, k)) {
+      ints.clear();
+      for (uint32_t r = 0; r < rowc; r++)
+        ints.push_back(columns->get(r, k).integer_value());
+      if (!assm()->emit_delta_array(&ints[0], rowc))
+        return false;
+      continue;
+    }
+    bool result;
+    if (!sized_containers_) {
+      result = assm()->begin_array(rowc);
+    } else if (is_measured_) {
+      result = assm()->begin_measured_array(rowc, next_contents_size());
+    } else {
+      result = assm()->begin_sized_array(rowc);
+    }
+    for (uint32_t r = 0; r < rowc && result; r++)
+      result = encode(columns->get(r, k));
+    if (!result || (end_sized && !assm()->end_sized()))
+      return false;
+  }
+  return true;
+}
+
+bool VariantWriter::encode_root(Variant value) {
+  if (references_ && !assm()->emit_indexed_values())
+    return false;
+  return encode(value);
+}
+
+bool VariantWriter::encode_native(Native value) {
+  Blob encoded = get_encoded(value);
+  if (encoded.is_blob())
+    return assm()->emit_encoded(encoded.data(), encoded.size());
+  if (encode_direct(value))
+    return true;
+  Variant replacement = get_replacement(value);
+  if (!encode(replacement))
+    return false;
+  if (references_ && !is_measured_)
+    share_native(value, replacement);
+  return true;
+}
+
+BinaryWriter::BinaryWriter()
+  : bytes_(NULL)
+  , size_(0)
+  , sized_containers_(false)
+  , references_(false)
+  , canonical_(false)
+  , columnar_(false)
+  , thread_count_(1)
+  , string_dictionary_(NULL)
+  , writer_(NULL) { }
+
+BinaryWriter::~BinaryWriter() {
+  delete writer_;
+  writer_ = NULL;
+}
+
+// A range of the elements of a large array, or keys and values of a large map,
+// which is written by its own thread into its own assembler.
+class ParallelEncodeSlice {
+public:
+  ParallelEncodeSlice(const Variant *items, size_t count, bool sized_containers,
+      bool canonical, bool columnar)
+    : items_(items)
+    , count_(count)
+    , sized_containers_(sized_containers)
+    , writer_(&assm_) {
+    writer_.set_sized_containers(sized_containers);
+    writer_.set_canonical(canonical);
+    writer_.set_columnar(columnar);
+  }
+
+  // Writes the items of this slice. Returns a dummy value such that this can
+  // be used as a thread's body.
+  opaque_t run();
+
+  // Returns the code written by this slice.
+  blob_t code() { return assm_.peek_code(); }
+
+  NativeThread *thread() { return &thread_; }
+
+private:
+  const Variant *items_;
+  size_t count_;
+  bool sized_containers_;
+  Assembler assm_;
+  VariantWriter writer_;
+  NativeThread thread_;
+};
+
+opaque_t ParallelEncodeSlice::run() {
+  for (size_t i = 0; i < count_; i++) {
+    // The items are independent so measuring them one at a time gives the
+    // same sizes as measuring the whole container.
+    if (sized_containers_) {
+      writer_.measure(items_[i]);
+    } else {
+      writer_.reset();
+    }
+    writer_.encode(items_[i]);
+  }
+  return o0();
+}
+
+bool VariantWriter::encode_parallel(Variant value, size_t thread_count) {
+  if (thread_count < 2 || references_ || streaming_ != NULL
+      || string_dictionary_ != NULL)
+    return false;
+  // Flatten the contents into a list of items, keys and values alternating
+  // for maps, such that they can be split into ranges.
+  std::vector<Variant> items;
+  size_t item_size = 1;
+  if (value.is_array()) {
+    Array array = value;
+    uint32_t length = array.length();
+    if (length < BinaryWriter::kMinParallelLength)
+      return false;
+    // Columns are written as a whole.
+    Columns columns;
+    if (get_columns(array, &columns))
+      return false;
+    items.reserve(length);
+    for (uint32_t i = 0; i < length; i++)
+      items.push_back(array[i]);
+  } else if (value.is_map()) {
+    Map map = value;
+    if (map.size() < BinaryWriter::kMinParallelLength)
+      return false;
+    item_size = 2;
+    items.reserve(static_cast<size_t>(map.size()) * 2);
+    if (canonical_) {
+      std::vector<Entry> entries;
+      get_canonical_entries(map.begin(), map.end(), &entries);
+      for (size_t i = 0; i < entries.size(); i++) {
+        items.push_back(entries[i].key);
+        items.push_back(entries[i].value);
+      }
+    } else {
+      for (Map::Iterator i = map.begin(); i != map.end(); i++) {
+        items.push_back(i->key());
+        items.push_back(i->value());
+      }
+    }
+  } else {
+    return false;
+  }
+  // A map's entries can't be split between slices so the ranges are counted
+  // in whole entries.
+  size_t unit_count = items.size() / item_size;
+  std::vector<ParallelEncodeSlice*> slices;
+  for (size_t i = 0; i < thread_count; i++) {
+    size_t first = (i * unit_count / thread_count) * item_size;
+    size_t end = ((i + 1) * unit_count / thread_count) * item_size;
+    slices.push_back(new ParallelEncodeSlice(&items[0] + first, end - first,
+        sized_containers_, canonical_, columnar_));
+  }
+  for (size_t i = 1; i < thread_count; i++) {
+    ParallelEncodeSlice *slice = slices[i];
+    *slice->thread() = new_callback(&ParallelEncodeSlice::run, slice);
+    slice->thread()->start();
+  }
+  slices[0]->run();
+  for (size_t i = 1; i < thread_count; i++)
+    slices[i]->thread()->join(NULL);
+  // Join the slices' code behind the header.
+  size_t contents_size = 0;
+  for (size_t i = 0; i < thread_count; i++)
+    contents_size += slices[i]->code().size;
+  assm()->reserve(1 + 2 * kMaxVarintSize + contents_size);
+  uint32_t count = static_cast<uint32_t>(unit_count);
+  if (value.is_array()) {
+    if (sized_containers_) {
+      assm()->begin_measured_array(count, contents_size);
+    } else {
+      assm()->begin_array(count);
+    }
+  } else {
+    if (sized_containers_) {
+      assm()->begin_measured_map(count, contents_size);
+    } else {
+      assm()->begin_map(count);
+    }
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    blob_t code = slices[i]->code();
+    assm()->emit_encoded(code.start, code.size);
+    delete slices[i];
+  }
+  return true;
+}
+
+VariantWriter *BinaryWriter::writer() {
+  if (writer_ == NULL)
+    writer_ = new VariantWriter(&assm_);
+  writer_->set_sized_containers(sized_containers_);
+  writer_->set_references(references_);
+  writer_->set_canonical(canonical_);
+  writer_->set_columnar(columnar_);
+  writer_->set_string_dictionary(string_dictionary_);
+  return writer_;
+}
+
+void BinaryWriter::write(Variant value) {
+  VariantWriter *writer = this->writer();
+  assm_.reset();
+  if (thread_count_ > 1 && writer->encode_parallel(value, thread_count_)) {
+    // Writing in parallel doesn't need the value to be measured up front.
+    writer->flush(this);
+    return;
+  }
+  if (sized_containers_) {
+    // Measuring first means the sizes of sized containers are known when they
+    // begin so their contents don't have to be moved afterwards. Otherwise
+    // it's cheaper to let the buffer grow than to walk the value twice.
+    assm_.reserve(writer->measure(value));
+  } else {
+    writer->reset();
+  }
+  writer->encode_root(value);
+  writer->update_string_dictionary();
+  writer->flush(this);
+}
+
+size_t BinaryWriter::measure(Variant value) {
+  return writer()->measure(value);
+}
+
+bool BinaryWriter::write_to(Assembler *assm, Variant value) {
+  VariantWriter writer(assm);
+  if (assm->outer_writer_ != NULL)
+    writer.inherit_settings(assm->outer_writer_);
+  return writer.encode(value);
+}
+
+void BinaryWriter::reset() {
+  assm_.reset();
+  if (writer_ != NULL)
+    writer_->reset();
+  bytes_ = NULL;
+  size_ = 0;
+}
 
 // Utility for decoding an individual instruction.
 class InstrDecoder {
@@ -429,11 +1774,18 @@ public:
   InstrDecoder(const uint8_t *data, size_t size)
     : data_(data)
     , size_(size)
-    , cursor_(0) { }
+    , cursor_(0)
+    , error_cause_(DecodeError::NONE) { }
 
   // Returns true iff there are more bytes to return.
   bool has_more() { return cursor_ < size_; }
 
+  // Returns the number of bytes read so far.
+  size_t cursor() { return cursor_; }
+
+  // Returns true iff the next byte is the given opcode.
+  bool next_is(uint8_t opcode) { return has_more() && data_[cursor_] == opcode; }
+
   // Returns true iff this decode has data enough that a block of the given size
   // can be read.
   bool has_data(size_t required) { return (cursor_ + required) <= size_; }
@@ -443,7 +1795,7 @@ public:
 
   bool read_bytes(uint8_t *dest, size_t size) {
     if (!has_data(size))
-      return false;
+      return fail(DecodeError::TRUNCATED);
     memcpy(dest, data_ + cursor_, size);
     cursor_ += size;
     return true;
@@ -457,16 +1809,42 @@ public:
 
   bool decode_uint32(uint32_t *result_out);
 
+  // Decodes a run of consecutive integer instructions, at most max_count of
+  // them, into the given array. Returns the number of integers decoded.
+  size_t decode_int64_run(int64_t *values_out, size_t max_count);
+
+  // Reads the next delta of a delta array and adds it to the given value.
+  bool decode_delta(int64_t *value_inout);
+
+  // If decoding failed, returns why.
+  DecodeError::Cause error_cause() { return error_cause_; }
+
 private:
+  // Records that decoding failed for the given reason and returns false.
+  bool fail(DecodeError::Cause cause) {
+    error_cause_ = cause;
+    return false;
+  }
+
+  // Decodes a varint using the slow byte-at-a-time approach.
+  bool decode_uint64_slow(uint64_t *result_out);
+
+  // Reads the size of the contents of a sized container.
+  bool decode_contents_size(pton_instr_t *instr_out);
+
   const uint8_t *data_;
   size_t size_;
   size_t cursor_;
+  DecodeError::Cause error_cause_;
 };
 
 bool InstrDecoder::decode(pton_instr_t *instr_out) {
   if (!has_more())
-    return false;
+    return fail(DecodeError::TRUNCATED);
+  size_t start = cursor_;
   uint8_t opcode = read_byte();
+  instr_out->is_sized = false;
+  instr_out->is_open = false;
   switch (opcode) {
     case BinaryImplUtils::boInteger:
       if (!decode_int64(&instr_out->payload.int64_value))
@@ -478,7 +1856,7 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
       if (!decode_uint32(&length))
         return false;
       if (!has_data(length))
-        return false;
+        return fail(DecodeError::TRUNCATED);
       instr_out->opcode = PTON_OPCODE_DEFAULT_STRING;
       instr_out->payload.default_string_data.length = length;
       instr_out->payload.default_string_data.contents = data_ + cursor_;
@@ -494,7 +1872,7 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
       if (!decode_uint32(&length))
         return false;
       if (!has_data(length))
-        return false;
+        return fail(DecodeError::TRUNCATED);
       instr_out->opcode = PTON_OPCODE_STRING_WITH_ENCODING;
       instr_out->payload.string_with_encoding_data.encoding = encoding;
       instr_out->payload.string_with_encoding_data.length = length;
@@ -507,7 +1885,7 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
       if (!decode_uint32(&length))
         return false;
       if (!has_data(length))
-        return false;
+        return fail(DecodeError::TRUNCATED);
       instr_out->opcode = PTON_OPCODE_BLOB;
       instr_out->payload.blob_data.length = length;
       instr_out->payload.blob_data.contents = data_ + cursor_;
@@ -540,14 +1918,85 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
         return false;
       instr_out->opcode = PTON_OPCODE_BEGIN_SEED;
       break;
+    case BinaryImplUtils::boSizedArray:
+      if (!decode_uint32(&instr_out->payload.array_length))
+        return false;
+      if (!decode_contents_size(instr_out))
+        return false;
+      instr_out->opcode = PTON_OPCODE_BEGIN_ARRAY;
+      break;
+    case BinaryImplUtils::boSizedMap:
+      if (!decode_uint32(&instr_out->payload.map_size))
+        return false;
+      if (!decode_contents_size(instr_out))
+        return false;
+      instr_out->opcode = PTON_OPCODE_BEGIN_MAP;
+      break;
+    case BinaryImplUtils::boSizedSeed:
+      if (!decode_uint32(&instr_out->payload.seed_data.headerc))
+        return false;
+      if (!decode_uint32(&instr_out->payload.seed_data.fieldc))
+        return false;
+      if (!decode_contents_size(instr_out))
+        return false;
+      instr_out->opcode = PTON_OPCODE_BEGIN_SEED;
+      break;
+    case BinaryImplUtils::boOpenArray:
+      instr_out->payload.array_length = 0;
+      instr_out->is_open = true;
+      instr_out->opcode = PTON_OPCODE_BEGIN_ARRAY;
+      break;
+    case BinaryImplUtils::boOpenMap:
+      instr_out->payload.map_size = 0;
+      instr_out->is_open = true;
+      instr_out->opcode = PTON_OPCODE_BEGIN_MAP;
+      break;
+    case BinaryImplUtils::boEnd:
+      instr_out->opcode = PTON_OPCODE_END;
+      break;
+    case BinaryImplUtils::boColumns:
+      if (!decode_uint32(&instr_out->payload.columns_data.rowc))
+        return false;
+      if (!decode_uint32(&instr_out->payload.columns_data.headerc))
+        return false;
+      if (!decode_uint32(&instr_out->payload.columns_data.keyc))
+        return false;
+      instr_out->opcode = PTON_OPCODE_BEGIN_COLUMNS;
+      break;
+    case BinaryImplUtils::boDeltaArray: {
+      uint32_t count = 0;
+      if (!decode_uint32(&count))
+        return false;
+      // The deltas are read here to find where they end and again when the
+      // values are needed.
+      size_t contents_start = cursor_;
+      int64_t value = 0;
+      for (uint32_t i = 0; i < count; i++) {
+        if (!decode_delta(&value))
+          return false;
+      }
+      instr_out->opcode = PTON_OPCODE_DELTA_ARRAY;
+      instr_out->payload.delta_array_data.count = count;
+      instr_out->payload.delta_array_data.contents = data_ + contents_start;
+      instr_out->payload.delta_array_data.size = cursor_ - contents_start;
+      break;
+    }
     case BinaryImplUtils::boReference:
       if (!decode_uint64(&instr_out->payload.reference_offset))
         return false;
       instr_out->opcode = PTON_OPCODE_REFERENCE;
       break;
+    case BinaryImplUtils::boDictionaryString:
+      if (!decode_uint32(&instr_out->payload.dictionary_index))
+        return false;
+      instr_out->opcode = PTON_OPCODE_DICTIONARY_STRING;
+      break;
+    case BinaryImplUtils::boIndexedValues:
+      instr_out->opcode = PTON_OPCODE_INDEXED_VALUES;
+      break;
     case BinaryImplUtils::boId: {
       if (!has_more())
-        return false;
+        return fail(DecodeError::TRUNCATED);
       uint32_t size = read_byte() << 3;
       uint64_t value = 0;
       switch (size) {
@@ -571,11 +2020,13 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
           break;
         }
         case 8: {
+          if (!has_more())
+            return fail(DecodeError::TRUNCATED);
           value = read_byte();
           break;
         }
         default:
-          return false;
+          return fail(DecodeError::INVALID_PAYLOAD);
       }
       instr_out->payload.id64.value = value;
       instr_out->payload.id64.size = size;
@@ -584,9 +2035,22 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
     }
     default:
       WARN("Unknown instruction %i", opcode);
-      return false;
+      return fail(DecodeError::UNKNOWN_OPCODE);
   }
-  instr_out->size = cursor_;
+  instr_out->size = cursor_ - start;
+  return true;
+}
+
+bool InstrDecoder::decode_contents_size(pton_instr_t *instr_out) {
+  uint64_t size = 0;
+  if (!decode_uint64(&size))
+    return false;
+  // Checking the size up front means truncated input gets caught early and
+  // that skipping a sized container can't overshoot the end of the data.
+  if (size > size_ - cursor_)
+    return fail(DecodeError::TRUNCATED);
+  instr_out->is_sized = true;
+  instr_out->contents_size = size;
   return true;
 }
 
@@ -598,6 +2062,56 @@ bool InstrDecoder::decode_int64(int64_t *result_out) {
   return true;
 }
 
+// Returns the 8 bytes starting at the given address as a little-endian word.
+static uint64_t load_uint64_le(const uint8_t *bytes) {
+  // Assembling the word explicitly rather than casting makes it independent of
+  // the host's endianness; compilers turn it into a single load anyway.
+  return static_cast<uint64_t>(bytes[0])
+      | (static_cast<uint64_t>(bytes[1]) << 8)
+      | (static_cast<uint64_t>(bytes[2]) << 16)
+      | (static_cast<uint64_t>(bytes[3]) << 24)
+      | (static_cast<uint64_t>(bytes[4]) << 32)
+      | (static_cast<uint64_t>(bytes[5]) << 40)
+      | (static_cast<uint64_t>(bytes[6]) << 48)
+      | (static_cast<uint64_t>(bytes[7]) << 56);
+}
+
+// Returns the value of the first length bytes, at most 8, of a varint given
+// the word they were loaded into and a mask that covers exactly those bytes.
+static uint64_t gather_varint_word(uint64_t word, uint64_t mask, size_t length) {
+  // Squeeze out the continuation bits, halving the number of gaps each step.
+  uint64_t value = word & mask & 0x7F7F7F7F7F7F7F7FULL;
+  value = (value & 0x007F007F007F007FULL) | ((value & 0x7F007F007F007F00ULL) >> 1);
+  value = (value & 0x00003FFF00003FFFULL) | ((value & 0x3FFF00003FFF0000ULL) >> 2);
+  value = (value & 0x000000000FFFFFFFULL) | ((value & 0x0FFFFFFF00000000ULL) >> 4);
+  // Finally add the implicit 1s, the bias, of all but the first byte.
+  static const uint64_t kBiases[9] = {
+    0,
+    0,
+    0x80ULL,
+    0x4080ULL,
+    0x204080ULL,
+    0x10204080ULL,
+    0x0810204080ULL,
+    0x040810204080ULL,
+    0x02040810204080ULL
+  };
+  return value + kBiases[length];
+}
+
+#if PTON_HAS_SSE2
+// Returns the index of the lowest set bit of a nonzero value.
+static size_t lowest_set_bit(uint32_t bits) {
+#  if IS_MSVC
+  unsigned long index;
+  _BitScanForward(&index, bits);
+  return index;
+#  else
+  return __builtin_ctz(bits);
+#  endif
+}
+#endif
+
 // The wire encoding of unsigned integers is similar to protobuf varints with
 // a slight twist. You might call them biased varints. Basically it's a sequence
 // of bytes where the bottom 7 bits give 7 bits of the value and the top bit
@@ -628,15 +2142,76 @@ bool InstrDecoder::decode_int64(int64_t *result_out) {
 // This is also slightly more space efficient -- without the bias two bytes will
 // hold up to 16383, with the bias it's 16511, but that's in the order of less
 // than 1% so it hardly matters.
+//
+// Most varints are short so rather than looping over the bytes one at a time
+// the fast paths look at a block of bytes at once. Where SSE2 is available a
+// 16-byte load covers every valid varint, so the end is found with a single
+// movemask. Otherwise 8 bytes are loaded into a word and mask operations find
+// the end of the varint and gather the payload bits, without any
+// data-dependent branches. Varints that don't fit the block, and those too
+// close to the end of the input, use the slow loop.
 bool InstrDecoder::decode_uint64(uint64_t *result_out) {
+#if PTON_HAS_SSE2
+  if (has_data(16)) {
+    const uint8_t *bytes = data_ + cursor_;
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    // The movemask collects the top bit of each byte; the last byte of the
+    // varint is the first one whose top bit is clear.
+    uint32_t ends = ~static_cast<uint32_t>(_mm_movemask_epi8(block)) & 0xFFFF;
+    if (ends == 0)
+      return decode_uint64_slow(result_out);
+    size_t length = lowest_set_bit(ends) + 1;
+    if (length > BinaryImplUtils::kMaxVarintSize)
+      // Let the slow path report the error.
+      return decode_uint64_slow(result_out);
+    uint64_t value;
+    if (length < 8) {
+      uint64_t mask = (static_cast<uint64_t>(1) << (8 * length)) - 1;
+      value = gather_varint_word(load_uint64_le(bytes), mask, length);
+    } else {
+      value = gather_varint_word(load_uint64_le(bytes), ~static_cast<uint64_t>(0), 8);
+      // The ninth and tenth bytes, if present, carry the top bits and wrap
+      // exactly like the slow loop does.
+      for (size_t i = 8; i < length; i++)
+        value += static_cast<uint64_t>((bytes[i] & 0x7F) + 1) << (7 * i);
+    }
+    *result_out = value;
+    cursor_ += length;
+    return true;
+  }
+#endif
+  if (!has_data(8))
+    return decode_uint64_slow(result_out);
+  const uint8_t *bytes = data_ + cursor_;
+  uint64_t word = load_uint64_le(bytes);
+  // The last byte of the varint is the first one whose top bit is clear.
+  uint64_t ends = ~word & 0x8080808080808080ULL;
+  if (ends == 0)
+    return decode_uint64_slow(result_out);
+  // A mask that covers the bytes of the varint, up to and including the last.
+  uint64_t first_end = ends & (~ends + 1);
+  uint64_t mask = (first_end << 1) - 1;
+  // Counts the bytes covered by the mask by summing a 1 for each of them into
+  // the top byte.
+  size_t length = static_cast<size_t>(
+      ((mask & 0x0101010101010101ULL) * 0x0101010101010101ULL) >> 56);
+  *result_out = gather_varint_word(word, mask, length);
+  cursor_ += length;
+  return true;
+}
+
+bool InstrDecoder::decode_uint64_slow(uint64_t *result_out) {
   if (!has_more())
-    return false;
+    return fail(DecodeError::TRUNCATED);
   uint8_t next = read_byte();
   uint64_t result = (next & 0x7F);
   uint64_t offset = 7;
   while (next >= 0x80) {
     if (!has_more())
-      return false;
+      return fail(DecodeError::TRUNCATED);
+    if (offset >= 64)
+      // No 64-bit value needs this many bytes.
+      return fail(DecodeError::INVALID_PAYLOAD);
     next = read_byte();
     uint64_t payload = ((next & 0x7F) + 1);
     result = result + (payload << offset);
@@ -646,196 +2221,1271 @@ bool InstrDecoder::decode_uint64(uint64_t *result_out) {
   return true;
 }
 
+size_t InstrDecoder::decode_int64_run(int64_t *values_out, size_t max_count) {
+  size_t count = 0;
+  while (count < max_count && has_more() && data_[cursor_] == BinaryImplUtils::boInteger) {
+    size_t start = cursor_;
+    cursor_++;
+    if (!decode_int64(&values_out[count])) {
+      cursor_ = start;
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+bool InstrDecoder::decode_delta(int64_t *value_inout) {
+  int64_t delta = 0;
+  if (!decode_int64(&delta))
+    return false;
+  // Like when encoding the deltas wrap around rather than overflow.
+  *value_inout = static_cast<int64_t>(static_cast<uint64_t>(*value_inout)
+      + static_cast<uint64_t>(delta));
+  return true;
+}
+
 bool InstrDecoder::decode_uint32(uint32_t *result_out) {
   uint64_t next = 0;
   if (!decode_uint64(&next))
     return false;
   if (next > 0xFFFFFFFF)
-    return false;
+    return fail(DecodeError::INVALID_PAYLOAD);
   *result_out = static_cast<uint32_t>(next);
   return true;
 }
 
 
-bool BinaryReaderImpl::decode(Variant *result_out) {
-  if (!has_more())
-    return false;
-  pton_instr_t instr;
-  if (!pton_decode_next_instruction(data_ + cursor_, size_ - cursor_, &instr))
-    return false;
-  cursor_ += instr.size;
-  switch (instr.opcode) {
-    case PTON_OPCODE_INT64:
-      return succeed(Variant::integer(instr.payload.int64_value), result_out);
-    case PTON_OPCODE_DEFAULT_STRING:
-      return decode_default_string(&instr, result_out);
-    case PTON_OPCODE_STRING_WITH_ENCODING:
-      return decode_string_with_encoding(&instr, result_out);
-    case PTON_OPCODE_BLOB:
-      return decode_blob(&instr, result_out);
-    case PTON_OPCODE_BEGIN_ARRAY:
-      return decode_array(instr.payload.array_length, result_out);
-    case PTON_OPCODE_BEGIN_MAP:
-      return decode_map(instr.payload.map_size, result_out);
-    case PTON_OPCODE_BEGIN_SEED:
-      return decode_seed(instr.payload.seed_data.headerc,
-          instr.payload.seed_data.fieldc, result_out);
-    case PTON_OPCODE_NULL:
-      return succeed(Variant::null(), result_out);
-    case PTON_OPCODE_BOOL:
-      return succeed(Variant::boolean(instr.payload.bool_value), result_out);
-    case PTON_OPCODE_ID64:
-      return succeed(Variant::id(instr.payload.id64.size, instr.payload.id64.value),
-          result_out);
-    case PTON_OPCODE_REFERENCE:
-      return succeed(Variant::integer(instr.payload.reference_offset), result_out);
-    default:
-      return false;
-  }
+// Returns the capacity to allocate up front for a container that claims to
+// hold the given number of elements, limited to what is left of the given
+// budget, and deducts it from the budget. Claims in the input can't be
+// trusted until the elements have been read so they only get memory up to
+// what the input could actually hold.
+static uint32_t take_capacity(uint64_t count, size_t *budget) {
+  size_t result = static_cast<size_t>(std::min(count,
+      static_cast<uint64_t>(*budget)));
+  *budget -= result;
+  return static_cast<uint32_t>(std::min(result, static_cast<size_t>(0xFFFFFFFF)));
 }
 
-bool BinaryReaderImpl::decode_default_string(pton_instr_t *instr, Variant *result_out) {
-  const uint8_t *chars = instr->payload.default_string_data.contents;
-  uint32_t size = instr->payload.default_string_data.length;
-  String result = reader_->factory_->new_string(size);
-  memcpy(result.mutable_chars(), chars, size);
-  result.ensure_frozen();
-  return succeed(result, result_out);
-}
+// Decodes binary plankton into variants. Decoding is iterative: the containers
+// whose contents are being read are kept on an explicit stack rather than the
+// native one, so deeply nested input can't overflow it, and the instructions
+// are dispatched directly through a table indexed by opcode.
+class BinaryReaderImpl : public BinaryImplUtils {
+public:
+  BinaryReaderImpl(const void *data, size_t size, BinaryReader *reader);
 
-bool BinaryReaderImpl::decode_blob(pton_instr_t *instr, Variant *result_out) {
-  const uint8_t *data = instr->payload.blob_data.contents;
-  uint32_t size = instr->payload.blob_data.length;
-  Blob result = reader_->factory_->new_blob(data, size);
-  return succeed(result, result_out);
-}
+  // Decodes the next value from the input, storing it in the given out
+  // parameter. Returns true iff decoding succeeded; if it fails the reader's
+  // error describes why.
+  bool decode(Variant *result_out);
 
-bool BinaryReaderImpl::decode_string_with_encoding(pton_instr_t *instr, Variant *result_out) {
-  pton_charset_t encoding = instr->payload.string_with_encoding_data.encoding;
-  const uint8_t *chars = instr->payload.string_with_encoding_data.contents;
-  uint32_t size = instr->payload.string_with_encoding_data.length;
-  String result = reader_->factory_->new_string(size, encoding);
-  memcpy(result.mutable_chars(), chars, size);
-  result.ensure_frozen();
-  return succeed(result, result_out);
-}
+  // Returns true iff all the input has been read.
+  bool at_end() { return !decoder_.has_more(); }
 
-bool BinaryReaderImpl::decode_array(uint32_t length, Variant *result_out) {
-  Array result = reader_->factory_->new_array(length);
-  for (size_t i = 0; i < length; i++) {
-    Variant elm;
-    if (!decode(&elm))
-      return false;
-    result.add(elm);
-  }
-  result.ensure_frozen();
-  return succeed(result, result_out);
-}
+  // Returns the offset of the next byte to read.
+  size_t cursor() { return decoder_.cursor(); }
 
-bool BinaryReaderImpl::decode_map(uint32_t size, Variant *result_out) {
-  Map result = reader_->factory_->new_map();
-  for (size_t i = 0; i < size; i++) {
-    Variant key;
-    if (!decode(&key))
-      return false;
-    Variant value;
-    if (!decode(&value))
-      return false;
-    result.set(key, value);
-  }
-  result.ensure_frozen();
-  return succeed(result, result_out);
-}
+  // Records that decoding failed at the given offset for the given reason and
+  // returns false.
+  bool fail(DecodeError::Cause cause, size_t offset);
 
-bool BinaryReaderImpl::decode_seed(uint32_t headerc, uint32_t size, Variant *result_out) {
-  Seed seed = reader_->factory_->new_seed();
-  AbstractTypeRegistry *registry = reader_->type_registry_;
-  AbstractSeedType *type = NULL;
-  for (size_t i = 0; i < headerc; i++) {
-    // Scan through and read the headers, resolving them to types as we go.
+  // Forgets the values read so far such that the next value can't refer back
+  // to them.
+  void reset_shared() { shared_.clear(); }
+
+private:
+  // The state of a container whose contents are being read.
+  struct Frame {
+    Frame(pton_instr_opcode_t opcode, Variant value, size_t remaining)
+      : opcode(opcode)
+      , value(value)
+      , remaining(remaining)
+      , headers_read(0)
+      , headers_remaining(0)
+      , type(NULL)
+      , start(0)
+      , is_sized(false)
+      , contents_end(0)
+      , is_open(false)
+      , index(0)
+      , rowc(0)
+      , keyc(0) { }
+
+    // The opcode that began the container.
+    pton_instr_opcode_t opcode;
+    // The array, map, or seed being built.
+    Variant value;
+    // The number of values still to be read into the container. Keys and
+    // values count separately.
+    size_t remaining;
+    // The number of seed headers read so far and still to be read.
+    uint32_t headers_read;
+    uint32_t headers_remaining;
+    // The key most recently read, if the next value is the mapping for it.
+    Variant key;
+    // The type of a seed, if it was resolved, and the value that will be
+    // returned for it.
+    AbstractSeedType *type;
+    Variant instance;
+    // The offset of the instruction that began the container.
+    size_t start;
+    // If the container was encoded with its size, the offset where its
+    // contents must end.
+    bool is_sized;
+    size_t contents_end;
+    // True if the container's contents are terminated by an end instruction
+    // rather than counted.
+    bool is_open;
+    // The index of the container among the values that can be referenced.
+    size_t index;
+    // For columns, the number of rows and keys, and the header the rows
+    // share if they're seeds. The keys and columns are collected in the
+    // value until the rows can be built.
+    uint32_t rowc;
+    uint32_t keyc;
     Variant header;
-    if (!decode(&header))
+  };
+
+  typedef bool (BinaryReaderImpl::*InstrHandler)(pton_instr_t *instr);
+
+  // Handlers for each instruction, indexed by opcode.
+  static const InstrHandler kHandlers[];
+
+  bool on_int64(pton_instr_t *instr);
+  bool on_id64(pton_instr_t *instr);
+  bool on_default_string(pton_instr_t *instr);
+  bool on_string_with_encoding(pton_instr_t *instr);
+  bool on_begin_array(pton_instr_t *instr);
+  bool on_begin_map(pton_instr_t *instr);
+  bool on_null(pton_instr_t *instr);
+  bool on_bool(pton_instr_t *instr);
+  bool on_begin_seed(pton_instr_t *instr);
+  bool on_reference(pton_instr_t *instr);
+  bool on_blob(pton_instr_t *instr);
+  bool on_end(pton_instr_t *instr);
+  bool on_begin_columns(pton_instr_t *instr);
+  bool on_delta_array(pton_instr_t *instr);
+  bool on_dictionary_string(pton_instr_t *instr);
+  bool on_indexed_values(pton_instr_t *instr);
+
+  // The number of values remaining used for open containers. It's even so
+  // keys and values can be told apart the same way as for other maps, and
+  // large enough that it never runs out.
+  static const size_t kOpenRemaining = ~static_cast<size_t>(0) - 1;
+
+  // Starts reading the contents of the container described by the given
+  // frame which was begun by the given instruction.
+  bool begin_frame(Frame *frame, pton_instr_t *instr);
+
+  // Adds a completed value to the innermost container, completing any
+  // containers that become full as a result. If there are no containers the
+  // value becomes the result.
+  bool deliver(Variant value);
+
+  // Adds the given value to the given frame's container.
+  void add_to_frame(Frame *frame, Variant value);
+
+  // Called when all of a seed's headers have been read.
+  void begin_seed_fields(Frame *frame);
+
+  // Adds the given header to the given seed or columns frame.
+  void add_header(Frame *frame, Variant value);
+
+  // Returns true if the given instruction is allowed next in the given
+  // columns frame. Each column must be an array with a value for each row.
+  static bool is_valid_in_columns(Frame *frame, pton_instr_t *instr);
+
+  // Builds the rows of a columns frame whose keys and columns have all been
+  // read.
+  Variant build_rows(Frame *frame);
+
+  // Stores the value resulting from a frame that has been completely read in
+  // the given out parameter. Fails if the frame's size was wrong.
+  bool end_frame(Frame *frame, Variant *result_out);
+
+  // Reads a run of integers directly into the array of the given frame.
+  bool decode_int64_run(Frame *frame);
+
+  // Delivers a string with the given contents read by the given instruction.
+  bool decode_string(pton_instr_t *instr, const uint8_t *chars, uint32_t size,
+      pton_charset_t encoding);
+
+  // Index used for containers that can't be referenced.
+  static const size_t kNotShared = ~static_cast<size_t>(0);
+
+  // Records that the given value can be referenced and returns its index.
+  size_t share(Variant value);
+
+  // Records that the given string, blob, array, or map can be referenced if
+  // the value being read indexes all values, not just seeds. Returns its index
+  // or kNotShared.
+  size_t share_value(Variant value);
+
+  // Adds the strings read in full while decoding the last value to the
+  // string dictionary.
+  void update_string_dictionary();
+
+  // Returns true iff the input left after the current instruction is long
+  // enough to hold the given number of values of at least min_size bytes
+  // each.
+  bool has_room_for(uint64_t count, size_t min_size) {
+    return count <= (size_ - decoder_.cursor()) / min_size;
+  }
+
+  const uint8_t *data_;
+  size_t size_;
+  InstrDecoder decoder_;
+  BinaryReader *reader_;
+  std::vector<Frame> stack_;
+  // The values that can be referenced, in the order they were read.
+  std::vector<Variant> shared_;
+  // True once a boIndexedValues prefix has been read. Until then only seeds
+  // can be referenced, which is all plain references have ever referred to.
+  bool index_values_;
+  Variant result_;
+  bool has_result_;
+  // The contents of the strings read in full that will be added to the string
+  // dictionary, and whether the factory has adopted the dictionary's arena
+  // while decoding the current value.
+  std::vector<blob_t> new_strings_;
+  bool has_adopted_dictionary_;
+  // The number of elements that may still be allocated before they're read.
+  // Each element takes at least a byte of input so valid input never needs
+  // more than its size; nested claims beyond that grow as they're read.
+  size_t capacity_budget_;
+};
+
+const BinaryReaderImpl::InstrHandler BinaryReaderImpl::kHandlers[] = {
+  &BinaryReaderImpl::on_int64,                // PTON_OPCODE_INT64
+  &BinaryReaderImpl::on_id64,                 // PTON_OPCODE_ID64
+  &BinaryReaderImpl::on_default_string,       // PTON_OPCODE_DEFAULT_STRING
+  &BinaryReaderImpl::on_string_with_encoding, // PTON_OPCODE_STRING_WITH_ENCODING
+  &BinaryReaderImpl::on_begin_array,          // PTON_OPCODE_BEGIN_ARRAY
+  &BinaryReaderImpl::on_begin_map,            // PTON_OPCODE_BEGIN_MAP
+  &BinaryReaderImpl::on_null,                 // PTON_OPCODE_NULL
+  &BinaryReaderImpl::on_bool,                 // PTON_OPCODE_BOOL
+  &BinaryReaderImpl::on_begin_seed,           // PTON_OPCODE_BEGIN_SEED
+  &BinaryReaderImpl::on_reference,            // PTON_OPCODE_REFERENCE
+  &BinaryReaderImpl::on_blob,                 // PTON_OPCODE_BLOB
+  &BinaryReaderImpl::on_end,                  // PTON_OPCODE_END
+  &BinaryReaderImpl::on_begin_columns,        // PTON_OPCODE_BEGIN_COLUMNS
+  &BinaryReaderImpl::on_delta_array,          // PTON_OPCODE_DELTA_ARRAY
+  &BinaryReaderImpl::on_dictionary_string,    // PTON_OPCODE_DICTIONARY_STRING
+  &BinaryReaderImpl::on_indexed_values        // PTON_OPCODE_INDEXED_VALUES
+};
+
+BinaryReaderImpl::BinaryReaderImpl(const void *data, size_t size, BinaryReader *reader)
+  : data_(static_cast<const uint8_t*>(data))
+  , size_(size)
+  , decoder_(data_, size)
+  , reader_(reader)
+  , index_values_(false)
+  , has_result_(false)
+  , has_adopted_dictionary_(false)
+  , capacity_budget_(size) { }
+
+bool BinaryReaderImpl::decode(Variant *result_out) {
+  stack_.clear();
+  new_strings_.clear();
+  index_values_ = false;
+  has_result_ = false;
+  has_adopted_dictionary_ = false;
+  while (!has_result_) {
+    if (!stack_.empty()) {
+      Frame *top = &stack_.back();
+      if (top->opcode == PTON_OPCODE_BEGIN_ARRAY && decoder_.next_is(boInteger)) {
+        if (!decode_int64_run(top))
+          return false;
+        continue;
+      }
+    }
+    size_t start = decoder_.cursor();
+    pton_instr_t instr;
+    if (!decoder_.decode(&instr))
+      return fail(decoder_.error_cause(), start);
+    if (!stack_.empty() && stack_.back().opcode == PTON_OPCODE_BEGIN_COLUMNS
+        && !is_valid_in_columns(&stack_.back(), &instr))
+      return fail(DecodeError::INVALID_PAYLOAD, start);
+    if (!(this->*kHandlers[instr.opcode])(&instr))
       return false;
-    if (i == 0)
-      // We set the header to the first, most specific, one.
-      seed.set_header(header);
-    if (type == NULL && registry != NULL) {
-      // If there is a registry and we still haven't recognized a type we try to
-      // resolve the current header to a type.
-      type = registry->resolve_type(header);
-    }
-  }
-  // Note that when building the instance we're not giving the type's own header
-  // necessarily, the header we're giving may be more specific.
-  Variant result = (type == NULL)
-    ? seed
-    : type->get_initial_instance(seed.header(), reader_->factory_);
-  for (size_t i = 0; i < size; i++) {
-    Variant key;
-    if (!decode(&key))
+  }
+  update_string_dictionary();
+  *result_out = result_;
+  return true;
+}
+
+void BinaryReaderImpl::update_string_dictionary() {
+  StringDictionary *dictionary = reader_->string_dictionary_;
+  if (dictionary == NULL)
+    return;
+  for (size_t i = 0; i < new_strings_.size(); i++)
+    dictionary->add(static_cast<const char*>(new_strings_[i].start),
+        static_cast<uint32_t>(new_strings_[i].size));
+}
+
+bool BinaryReaderImpl::fail(DecodeError::Cause cause, size_t offset) {
+  int opcode = (offset < size_) ? data_[offset] : -1;
+  reader_->error_ = DecodeError(cause, offset, opcode);
+  return false;
+}
+
+bool BinaryReaderImpl::on_int64(pton_instr_t *instr) {
+  return deliver(Variant::integer(instr->payload.int64_value));
+}
+
+bool BinaryReaderImpl::on_id64(pton_instr_t *instr) {
+  return deliver(Variant::id(instr->payload.id64.size, instr->payload.id64.value));
+}
+
+bool BinaryReaderImpl::on_null(pton_instr_t *instr) {
+  return deliver(Variant::null());
+}
+
+bool BinaryReaderImpl::on_bool(pton_instr_t *instr) {
+  return deliver(Variant::boolean(instr->payload.bool_value));
+}
+
+bool BinaryReaderImpl::on_reference(pton_instr_t *instr) {
+  uint64_t offset = instr->payload.reference_offset;
+  if (offset >= shared_.size())
+    return fail(DecodeError::INVALID_PAYLOAD, decoder_.cursor() - instr->size);
+  return deliver(shared_[shared_.size() - static_cast<size_t>(offset) - 1]);
+}
+
+bool BinaryReaderImpl::on_end(pton_instr_t *instr) {
+  // An end must close an open container and can't come between a key and its
+  // value.
+  Frame *top = stack_.empty() ? NULL : &stack_.back();
+  if (top == NULL || !top->is_open
+      || (top->opcode == PTON_OPCODE_BEGIN_MAP && (top->remaining & 1) != 0))
+    return fail(DecodeError::INVALID_PAYLOAD, decoder_.cursor() - instr->size);
+  Variant result;
+  if (!end_frame(top, &result))
+    return false;
+  stack_.pop_back();
+  return deliver(result);
+}
+
+size_t BinaryReaderImpl::share(Variant value) {
+  shared_.push_back(value);
+  return shared_.size() - 1;
+}
+
+size_t BinaryReaderImpl::share_value(Variant value) {
+  return index_values_ ? share(value) : kNotShared;
+}
+
+bool BinaryReaderImpl::on_indexed_values(pton_instr_t *instr) {
+  // The prefix applies to the rest of the value being read; the value itself
+  // comes next.
+  index_values_ = true;
+  return true;
+}
+
+bool BinaryReaderImpl::on_default_string(pton_instr_t *instr) {
+  // The writer adds the same strings to its dictionary, the ones it writes in
+  // full with the default encoding.
+  uint32_t length = instr->payload.default_string_data.length;
+  if (reader_->string_dictionary_ != NULL && StringDictionary::is_eligible(length))
+    new_strings_.push_back(blob_new(const_cast<uint8_t*>(
+        instr->payload.default_string_data.contents), length));
+  return decode_string(instr, instr->payload.default_string_data.contents,
+      instr->payload.default_string_data.length,
+      Variant::default_string_encoding());
+}
+
+bool BinaryReaderImpl::on_blob(pton_instr_t *instr) {
+  const uint8_t *data = instr->payload.blob_data.contents;
+  uint32_t size = instr->payload.blob_data.length;
+  Variant result = reader_->borrow_input_
+      ? Variant::blob(data, size)
+      : reader_->factory_->new_blob(data, size);
+  share_value(result);
+  return deliver(result);
+}
+
+bool BinaryReaderImpl::on_string_with_encoding(pton_instr_t *instr) {
+  return decode_string(instr, instr->payload.string_with_encoding_data.contents,
+      instr->payload.string_with_encoding_data.length,
+      instr->payload.string_with_encoding_data.encoding);
+}
+
+bool BinaryReaderImpl::decode_string(pton_instr_t *instr, const uint8_t *chars,
+    uint32_t size, pton_charset_t encoding) {
+  bool validate = reader_->validate_strings_
+      && (encoding == PTON_CHARSET_UTF_8 || encoding == PTON_CHARSET_US_ASCII);
+  bool is_ascii = false;
+  if (reader_->borrow_input_ && encoding == Variant::default_string_encoding()) {
+    // Strings with the default encoding, including ones that are explicitly
+    // tagged with it, can be borrowed.
+    if (validate && !pton_validate_utf8(chars, size, NULL, NULL))
+      return fail(DecodeError::INVALID_ENCODING, decoder_.cursor() - instr->size);
+    Variant borrowed = Variant::string(reinterpret_cast<const char*>(chars), size);
+    share_value(borrowed);
+    return deliver(borrowed);
+  }
+  String result = reader_->factory_->new_string(size, encoding);
+  if (validate) {
+    if (!pton_validate_utf8(chars, size, result.mutable_chars(), &is_ascii)
+        || (encoding == PTON_CHARSET_US_ASCII && !is_ascii))
+      return fail(DecodeError::INVALID_ENCODING, decoder_.cursor() - instr->size);
+    if (is_ascii)
+      result.mark_ascii();
+  } else {
+    memcpy(result.mutable_chars(), chars, size);
+  }
+  result.ensure_frozen();
+  share_value(result);
+  return deliver(result);
+}
+
+bool BinaryReaderImpl::on_begin_array(pton_instr_t *instr) {
+  uint32_t length = instr->payload.array_length;
+  // Input that can't hold the elements ends in the middle of the array, which
+  // is reported where it ends.
+  if (!has_room_for(length, 1))
+    return fail(DecodeError::TRUNCATED, size_);
+  Frame frame(PTON_OPCODE_BEGIN_ARRAY,
+      reader_->factory_->new_array(take_capacity(length, &capacity_budget_)),
+      length);
+  return begin_frame(&frame, instr);
+}
+
+bool BinaryReaderImpl::on_begin_map(pton_instr_t *instr) {
+  uint32_t size = instr->payload.map_size;
+  // Each entry takes at least a byte for the key and one for the value.
+  // Input that can't hold the entries ends in the middle of the map, which is
+  // reported where it ends.
+  if (!has_room_for(size, 2))
+    return fail(DecodeError::TRUNCATED, size_);
+  Frame frame(PTON_OPCODE_BEGIN_MAP,
+      reader_->factory_->new_map(take_capacity(size, &capacity_budget_)),
+      static_cast<size_t>(size) * 2);
+  return begin_frame(&frame, instr);
+}
+
+bool BinaryReaderImpl::on_begin_seed(pton_instr_t *instr) {
+  Frame frame(PTON_OPCODE_BEGIN_SEED, reader_->factory_->new_seed(),
+      static_cast<size_t>(instr->payload.seed_data.fieldc) * 2);
+  frame.headers_remaining = instr->payload.seed_data.headerc;
+  return begin_frame(&frame, instr);
+}
+
+bool BinaryReaderImpl::on_begin_columns(pton_instr_t *instr) {
+  uint32_t rowc = instr->payload.columns_data.rowc;
+  uint32_t keyc = instr->payload.columns_data.keyc;
+  // Without keys there are no columns to say how many rows there are.
+  if (keyc == 0 && rowc > 0)
+    return fail(DecodeError::INVALID_PAYLOAD, decoder_.cursor() - instr->size);
+  // Each key and column takes at least a byte, and so does each column's
+  // value for each row.
+  if (!has_room_for(keyc, 2)
+      || !has_room_for(static_cast<uint64_t>(rowc) * keyc, 1))
+    return fail(DecodeError::TRUNCATED, size_);
+  size_t valuec = static_cast<size_t>(keyc) * 2;
+  Frame frame(PTON_OPCODE_BEGIN_COLUMNS,
+      reader_->factory_->new_array(take_capacity(valuec, &capacity_budget_)),
+      valuec);
+  frame.headers_remaining = instr->payload.columns_data.headerc;
+  frame.rowc = rowc;
+  frame.keyc = keyc;
+  return begin_frame(&frame, instr);
+}
+
+bool BinaryReaderImpl::on_delta_array(pton_instr_t *instr) {
+  uint32_t count = instr->payload.delta_array_data.count;
+  InstrDecoder deltas(instr->payload.delta_array_data.contents,
+      instr->payload.delta_array_data.size);
+  Array result = reader_->factory_->new_array(count);
+  int64_t value = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    // The deltas were checked when the instruction was decoded.
+    deltas.decode_delta(&value);
+    result.add(Variant::integer(value));
+  }
+  result.ensure_frozen();
+  share_value(result);
+  return deliver(result);
+}
+
+bool BinaryReaderImpl::on_dictionary_string(pton_instr_t *instr) {
+  StringDictionary *dictionary = reader_->string_dictionary_;
+  uint32_t index = instr->payload.dictionary_index;
+  String value = (dictionary == NULL) ? String(Variant::null()) : dictionary->get(index);
+  if (!value.is_string())
+    return fail(DecodeError::INVALID_PAYLOAD, decoder_.cursor() - instr->size);
+  dictionary->touch(index);
+  if (!has_adopted_dictionary_) {
+    // The dictionary may replace the string later on so the result must keep
+    // it alive.
+    reader_->factory_->adopt_ownership(dictionary->arena());
+    has_adopted_dictionary_ = true;
+  }
+  share_value(value);
+  return deliver(value);
+}
+
+bool BinaryReaderImpl::is_valid_in_columns(Frame *frame, pton_instr_t *instr) {
+  if (frame->headers_remaining > 0 || frame->remaining > frame->keyc)
+    // Still reading headers or keys.
+    return true;
+  switch (instr->opcode) {
+    case PTON_OPCODE_BEGIN_ARRAY:
+      return !instr->is_open && instr->payload.array_length == frame->rowc;
+    case PTON_OPCODE_DELTA_ARRAY:
+      return instr->payload.delta_array_data.count == frame->rowc;
+    default:
       return false;
-    Variant value;
-    if (!decode(&value))
+  }
+}
+
+Variant BinaryReaderImpl::build_rows(Frame *frame) {
+  Factory *factory = reader_->factory_;
+  Array contents = frame->value;
+  uint32_t keyc = frame->keyc;
+  Array rows = factory->new_array(frame->rowc);
+  for (uint32_t r = 0; r < frame->rowc; r++) {
+    if (frame->headers_read == 0) {
+      Map row = factory->new_map(keyc);
+      for (uint32_t k = 0; k < keyc; k++)
+        row.set(contents[k], Array(contents[keyc + k])[r]);
+      row.ensure_frozen();
+      rows.add(row);
+    } else if (frame->type != NULL && frame->type->receives_fields()) {
+      Variant instance = frame->type->get_initial_instance(frame->header,
+          factory);
+      for (uint32_t k = 0; k < keyc; k++)
+        frame->type->on_field(instance, contents[k],
+            Array(contents[keyc + k])[r], factory);
+      rows.add(frame->type->get_complete_instance(instance, Variant::null(),
+          factory));
+    } else {
+      Seed row = factory->new_seed();
+      row.set_header(frame->header);
+      for (uint32_t k = 0; k < keyc; k++)
+        row.set_field(contents[k], Array(contents[keyc + k])[r]);
+      row.ensure_frozen();
+      if (frame->type == NULL) {
+        rows.add(row);
+      } else {
+        Variant initial = frame->type->get_initial_instance(frame->header,
+            factory);
+        rows.add(frame->type->get_complete_instance(initial, row, factory));
+      }
+    }
+  }
+  rows.ensure_frozen();
+  return rows;
+}
+
+bool BinaryReaderImpl::begin_frame(Frame *frame, pton_instr_t *instr) {
+  frame->start = decoder_.cursor() - instr->size;
+  if (instr->is_open) {
+    frame->is_open = true;
+    frame->remaining = kOpenRemaining;
+  }
+  // The container can be referenced from within its own contents so it gets
+  // its index before they're read.
+  frame->index = (frame->opcode == PTON_OPCODE_BEGIN_SEED)
+      ? share(frame->value)
+      : share_value(frame->value);
+  if (frame->opcode == PTON_OPCODE_BEGIN_SEED && frame->headers_remaining == 0)
+    begin_seed_fields(frame);
+  if (instr->is_sized) {
+    frame->is_sized = true;
+    frame->contents_end = decoder_.cursor() + static_cast<size_t>(instr->contents_size);
+  }
+  if (frame->remaining == 0 && frame->headers_remaining == 0) {
+    // There are no contents to read so the container is already complete.
+    Variant result;
+    return end_frame(frame, &result) && deliver(result);
+  }
+  if (stack_.size() >= reader_->max_depth_)
+    return fail(DecodeError::TOO_DEEP, frame->start);
+  stack_.push_back(*frame);
+  return true;
+}
+
+bool BinaryReaderImpl::deliver(Variant value) {
+  Variant current = value;
+  while (!stack_.empty()) {
+    Frame *top = &stack_.back();
+    add_to_frame(top, current);
+    if (top->remaining > 0 || top->headers_remaining > 0)
+      return true;
+    if (!end_frame(top, &current))
       return false;
-    seed.set_field(key, value);
+    stack_.pop_back();
+  }
+  result_ = current;
+  has_result_ = true;
+  return true;
+}
+
+void BinaryReaderImpl::add_to_frame(Frame *frame, Variant value) {
+  switch (frame->opcode) {
+    case PTON_OPCODE_BEGIN_ARRAY:
+      Array(frame->value).add(value);
+      frame->remaining--;
+      break;
+    case PTON_OPCODE_BEGIN_MAP:
+      // The number of values remaining is even before each key.
+      if ((frame->remaining & 1) == 0) {
+        frame->key = value;
+      } else {
+        Map(frame->value).set(frame->key, value);
+      }
+      frame->remaining--;
+      break;
+    case PTON_OPCODE_BEGIN_SEED: {
+      Seed seed = frame->value;
+      if (frame->headers_remaining > 0) {
+        if (frame->headers_read == 0)
+          seed.set_header(value);
+        add_header(frame, value);
+        if (frame->headers_remaining == 0)
+          begin_seed_fields(frame);
+      } else {
+        if ((frame->remaining & 1) == 0) {
+          frame->key = value;
+        } else if (frame->type != NULL && frame->type->receives_fields()) {
+          frame->type->on_field(frame->instance, frame->key, value,
+              reader_->factory_);
+        } else {
+          seed.set_field(frame->key, value);
+        }
+        frame->remaining--;
+      }
+      break;
+    }
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      if (frame->headers_remaining > 0) {
+        add_header(frame, value);
+      } else {
+        Array(frame->value).add(value);
+        frame->remaining--;
+      }
+      break;
+    default:
+      break;
   }
-  seed.ensure_frozen();
-  if (type != NULL)
-    result = type->get_complete_instance(result, seed, reader_->factory_);
-  return succeed(result, result_out);
 }
 
-bool BinaryReaderImpl::succeed(Variant value, Variant *out) {
-  *out = value;
+void BinaryReaderImpl::add_header(Frame *frame, Variant value) {
+  if (frame->headers_read == 0)
+    // We use the first, most specific, header.
+    frame->header = value;
+  AbstractTypeRegistry *registry = reader_->type_registry_;
+  if (frame->type == NULL && registry != NULL) {
+    // If there is a registry and we still haven't recognized a type we
+    // try to resolve the current header to a type.
+    frame->type = registry->resolve_type(value);
+  }
+  frame->headers_read++;
+  frame->headers_remaining--;
+}
+
+void BinaryReaderImpl::begin_seed_fields(Frame *frame) {
+  // Note that when building the instance we're not giving the type's own
+  // header necessarily, the header we're giving may be more specific.
+  Seed seed = frame->value;
+  frame->instance = (frame->type == NULL)
+    ? seed
+    : frame->type->get_initial_instance(seed.header(), reader_->factory_);
+  if (frame->index != kNotShared)
+    shared_[frame->index] = frame->instance;
+}
+
+bool BinaryReaderImpl::end_frame(Frame *frame, Variant *result_out) {
+  if (frame->is_sized && frame->contents_end != decoder_.cursor())
+    return fail(DecodeError::SIZE_MISMATCH, frame->start);
+  frame->value.ensure_frozen();
+  if (frame->opcode == PTON_OPCODE_BEGIN_COLUMNS) {
+    *result_out = build_rows(frame);
+  } else if (frame->opcode != PTON_OPCODE_BEGIN_SEED) {
+    *result_out = frame->value;
+  } else if (frame->type == NULL) {
+    *result_out = frame->instance;
+  } else {
+    Variant payload = frame->type->receives_fields()
+        ? Variant::null()
+        : frame->value;
+    *result_out = frame->type->get_complete_instance(frame->instance,
+        payload, reader_->factory_);
+  }
+  if (frame->index != kNotShared)
+    shared_[frame->index] = *result_out;
   return true;
 }
 
+bool BinaryReaderImpl::decode_int64_run(Frame *frame) {
+  // Numeric arrays are common so runs of integers get decoded in bulk.
+  static const size_t kMaxRunSize = 64;
+  int64_t values[kMaxRunSize];
+  size_t max_count = frame->remaining;
+  if (max_count > kMaxRunSize)
+    max_count = kMaxRunSize;
+  size_t count = decoder_.decode_int64_run(values, max_count);
+  if (count == 0)
+    return fail(decoder_.error_cause(), decoder_.cursor());
+  Array array = frame->value;
+  for (size_t i = 0; i < count; i++)
+    array.add(Variant::integer(values[i]));
+  frame->remaining -= count;
+  if (frame->remaining > 0)
+    return true;
+  Variant result;
+  if (!end_frame(frame, &result))
+    return false;
+  stack_.pop_back();
+  return deliver(result);
+}
+
 BinaryReader::BinaryReader(Factory *factory)
   : factory_(factory)
-  , type_registry_(NULL) { }
+  , type_registry_(NULL)
+  , borrow_input_(false)
+  , max_depth_(kDefaultMaxDepth)
+  , thread_count_(1)
+  , compact_layout_(false)
+  , validate_strings_(false)
+  , string_dictionary_(NULL) { }
 
 Variant BinaryReader::parse(const void *data, size_t size) {
+  error_ = DecodeError();
+  if (thread_count_ > 1 && size >= kMinParallelInputSize
+      && string_dictionary_ == NULL) {
+    Variant result;
+    if (parse_parallel(static_cast<const uint8_t*>(data), size, &result))
+      return result;
+  }
+  reserve_layout(static_cast<const uint8_t*>(data), size);
   BinaryReaderImpl decoder(data, size, this);
   Variant result;
-  decoder.decode(&result);
+  if (!decoder.decode(&result))
+    return Variant::null();
+  if (!decoder.at_end()) {
+    decoder.fail(DecodeError::TRAILING_DATA, decoder.cursor());
+    return Variant::null();
+  }
   return result;
 }
 
+Variant BinaryReader::parse_next(const void *data, size_t size,
+    size_t *size_out) {
+  error_ = DecodeError();
+  *size_out = 0;
+  if (compact_layout_) {
+    // Only reserve memory for the first value, not whatever comes after it.
+    size_t value_size = BinaryReader::value_size(data, size);
+    if (value_size > 0)
+      reserve_checked_layout(static_cast<const uint8_t*>(data), value_size);
+  }
+  BinaryReaderImpl decoder(data, size, this);
+  Variant result;
+  if (!decoder.decode(&result))
+    return Variant::null();
+  *size_out = decoder.cursor();
+  return result;
+}
+
+Array BinaryReader::parse_all(const void *data, size_t size) {
+  error_ = DecodeError();
+  reserve_layout(static_cast<const uint8_t*>(data), size);
+  BinaryReaderImpl decoder(data, size, this);
+  std::vector<Variant> values;
+  while (!decoder.at_end()) {
+    Variant value;
+    // Each value is written on its own so references don't reach across
+    // values.
+    decoder.reset_shared();
+    if (!decoder.decode(&value))
+      return Variant::null();
+    values.push_back(value);
+  }
+  Array result = factory_->new_array(static_cast<uint32_t>(values.size()));
+  for (size_t i = 0; i < values.size(); i++)
+    result.add(values[i]);
+  result.ensure_frozen();
+  return result;
+}
+
+void BinaryReader::reserve_layout(const uint8_t *data, size_t size) {
+  if (!compact_layout_)
+    return;
+  size_t checked = 0;
+  while (checked < size) {
+    size_t value_size = BinaryReader::value_size(data + checked, size - checked);
+    if (value_size == 0)
+      // The decoder will report the problem; there's no point in reserving
+      // memory for a value that won't be produced.
+      return;
+    checked += value_size;
+  }
+  reserve_checked_layout(data, size);
+}
+
+void BinaryReader::reserve_checked_layout(const uint8_t *data, size_t size) {
+  // The contents of sized containers are skipped when checking so the counts
+  // within them are still unchecked claims. Each element takes at least a
+  // byte so that's all the input can ever need.
+  size_t budget = size;
+  size_t total = 0;
+  size_t offset = 0;
+  while (offset < size) {
+    pton_instr_t instr;
+    if (!pton_decode_next_instruction(data + offset, size - offset, &instr))
+      return;
+    switch (instr.opcode) {
+      case PTON_OPCODE_DEFAULT_STRING:
+        if (!borrow_input_)
+          total += factory_->value_footprint(PTON_STRING,
+              instr.payload.default_string_data.length);
+        break;
+      case PTON_OPCODE_STRING_WITH_ENCODING:
+        if (!borrow_input_ || instr.payload.string_with_encoding_data.encoding
+            != Variant::default_string_encoding())
+          total += factory_->value_footprint(PTON_STRING,
+              instr.payload.string_with_encoding_data.length);
+        break;
+      case PTON_OPCODE_BLOB:
+        if (!borrow_input_)
+          total += factory_->value_footprint(PTON_BLOB,
+              instr.payload.blob_data.length);
+        break;
+      case PTON_OPCODE_BEGIN_ARRAY:
+        total += factory_->value_footprint(PTON_ARRAY,
+            take_capacity(instr.payload.array_length, &budget));
+        break;
+      case PTON_OPCODE_BEGIN_MAP:
+        total += factory_->value_footprint(PTON_MAP,
+            take_capacity(instr.payload.map_size, &budget));
+        break;
+      case PTON_OPCODE_BEGIN_SEED:
+        total += factory_->value_footprint(PTON_SEED,
+            take_capacity(instr.payload.seed_data.fieldc, &budget));
+        break;
+      case PTON_OPCODE_BEGIN_COLUMNS: {
+        // The keys and columns are collected in an array and then the rows
+        // are built.
+        uint32_t keyc = instr.payload.columns_data.keyc;
+        if (keyc == 0)
+          break;
+        pton_type_t row_type = (instr.payload.columns_data.headerc == 0)
+            ? PTON_MAP
+            : PTON_SEED;
+        // Every cell is a value in one of the columns.
+        uint32_t cells = take_capacity(
+            static_cast<uint64_t>(instr.payload.columns_data.rowc) * keyc,
+            &budget);
+        uint32_t rowc = cells / keyc;
+        total += factory_->value_footprint(PTON_ARRAY,
+                take_capacity(static_cast<uint64_t>(keyc) * 2, &budget))
+            + factory_->value_footprint(PTON_ARRAY, rowc)
+            + rowc * factory_->value_footprint(row_type, keyc);
+        break;
+      }
+      case PTON_OPCODE_DELTA_ARRAY:
+        total += factory_->value_footprint(PTON_ARRAY,
+            take_capacity(instr.payload.delta_array_data.count, &budget));
+        break;
+      default:
+        break;
+    }
+    offset += instr.size;
+  }
+  factory_->reserve(total);
+}
+
+// A slice of the elements of a large top-level array which is decoded by its
+// own thread into its own arena.
+class ParallelDecodeSlice {
+public:
+  ParallelDecodeSlice(BinaryReader *reader, const uint8_t *data, size_t start,
+      size_t end, Variant *values, size_t count)
+    : reader_(reader)
+    , data_(data)
+    , start_(start)
+    , end_(end)
+    , values_(values)
+    , count_(count)
+    , succeeded_(false) { }
+
+  // Decodes the elements of this slice. Returns a dummy value such that this
+  // can be used as a thread's body.
+  opaque_t run();
+
+  BinaryReader *reader() { return reader_; }
+  size_t start() { return start_; }
+  bool succeeded() { return succeeded_; }
+  NativeThread *thread() { return &thread_; }
+
+private:
+  BinaryReader *reader_;
+  const uint8_t *data_;
+  size_t start_;
+  size_t end_;
+  Variant *values_;
+  size_t count_;
+  bool succeeded_;
+  NativeThread thread_;
+};
+
+opaque_t ParallelDecodeSlice::run() {
+  reader_->reserve_layout(data_ + start_, end_ - start_);
+  BinaryReaderImpl decoder(data_ + start_, end_ - start_, reader_);
+  succeeded_ = true;
+  for (size_t i = 0; i < count_ && succeeded_; i++)
+    succeeded_ = decoder.decode(&values_[i]);
+  return o0();
+}
+
+bool BinaryReader::parse_parallel(const uint8_t *data, size_t size,
+    Variant *result_out) {
+  pton_instr_t header;
+  if (!pton_decode_next_instruction(data, size, &header)
+      || header.opcode != PTON_OPCODE_BEGIN_ARRAY
+      || max_depth_ == 0)
+    return false;
+  size_t length = header.payload.array_length;
+  size_t slice_count = thread_count_;
+  if (length < slice_count)
+    return false;
+  // Scan through the elements to find where each slice begins. This is cheap
+  // compared to decoding, particularly if the elements are sized containers
+  // in which case their contents are skipped without scanning. If the scan
+  // runs into anything unexpected the input is left to the plain decoder so
+  // the error gets reported the usual way.
+  std::vector<size_t> slice_offsets;
+  size_t cursor = header.size;
+  for (size_t i = 0; i < length; i++) {
+    if (i == (slice_offsets.size() * length / slice_count))
+      slice_offsets.push_back(cursor);
+    size_t elm_size = value_size(data + cursor, size - cursor);
+    if (elm_size == 0)
+      return false;
+    cursor += elm_size;
+  }
+  slice_offsets.push_back(cursor);
+  if (cursor != size)
+    return false;
+  if (header.is_sized && (header.size + header.contents_size != cursor))
+    return false;
+  // Decode the slices, one on this thread and the rest on their own threads.
+  std::vector<Variant> values(length);
+  std::vector<ParallelDecodeSlice*> slices;
+  for (size_t i = 0; i < slice_count; i++) {
+    Arena *arena = new Arena();
+    BinaryReader *reader = new BinaryReader(arena);
+    reader->type_registry_ = type_registry_;
+    reader->borrow_input_ = borrow_input_;
+    reader->validate_strings_ = validate_strings_;
+    reader->compact_layout_ = compact_layout_;
+    // The top-level array counts towards the depth.
+    reader->max_depth_ = max_depth_ - 1;
+    size_t first = i * length / slice_count;
+    size_t count = ((i + 1) * length / slice_count) - first;
+    slices.push_back(new ParallelDecodeSlice(reader, data, slice_offsets[i],
+        slice_offsets[i + 1], &values[first], count));
+  }
+  for (size_t i = 1; i < slice_count; i++) {
+    ParallelDecodeSlice *slice = slices[i];
+    *slice->thread() = new_callback(&ParallelDecodeSlice::run, slice);
+    slice->thread()->start();
+  }
+  slices[0]->run();
+  for (size_t i = 1; i < slice_count; i++)
+    slices[i]->thread()->join(NULL);
+  // A slice can't resolve references to values that come before it so if
+  // that happened the input is left to the plain decoder.
+  bool has_outside_references = false;
+  for (size_t i = 0; i < slice_count; i++) {
+    ParallelDecodeSlice *slice = slices[i];
+    if (!slice->succeeded()
+        && slice->reader()->error().opcode() == BinaryImplUtils::boReference)
+      has_outside_references = true;
+  }
+  // Stitch the results together. The slices' arenas are adopted by this
+  // reader's factory so the elements live as long as the array does.
+  bool succeeded = true;
+  for (size_t i = 0; i < slice_count; i++) {
+    ParallelDecodeSlice *slice = slices[i];
+    BinaryReader *reader = slice->reader();
+    if (!has_outside_references && succeeded && !slice->succeeded()) {
+      const DecodeError &error = reader->error();
+      error_ = DecodeError(error.cause(), slice->start() + error.offset(),
+          error.opcode());
+      succeeded = false;
+    }
+    Factory *arena = reader->factory_;
+    if (!has_outside_references)
+      factory_->adopt_ownership(arena);
+    delete reader;
+    delete arena;
+    delete slice;
+  }
+  if (has_outside_references)
+    return false;
+  if (!succeeded) {
+    *result_out = Variant::null();
+    return true;
+  }
+  Array result = factory_->new_array(static_cast<uint32_t>(length));
+  for (size_t i = 0; i < length; i++)
+    result.add(values[i]);
+  result.ensure_frozen();
+  *result_out = result;
+  return true;
+}
+
+const char *DecodeError::reason() const {
+  switch (cause_) {
+    case NONE:
+      return "no error";
+    case TRUNCATED:
+      return "input ended unexpectedly";
+    case UNKNOWN_OPCODE:
+      return "unknown opcode";
+    case INVALID_PAYLOAD:
+      return "invalid instruction payload";
+    case INVALID_ENCODING:
+      return "invalid string encoding";
+    case TOO_DEEP:
+      return "maximum nesting depth exceeded";
+    case SIZE_MISMATCH:
+      return "container size doesn't match its contents";
+    case TRAILING_DATA:
+      return "unexpected data after value";
+    default:
+      return "unknown error";
+  }
+}
+
+// A sized container whose contents are still being validated.
+struct OpenSizedContainer {
+  // The offset where the container's contents must end.
+  size_t end;
+  // The number of remaining instructions there will be when the container's
+  // contents have all been read.
+  size_t remaining_instrs;
+};
+
+// Returns the number of values that follow the given instruction as part of
+// the value it begins.
+static size_t get_child_count(pton_instr_t *instr) {
+  switch (instr->opcode) {
+    case PTON_OPCODE_BEGIN_ARRAY:
+      return instr->payload.array_length;
+    case PTON_OPCODE_BEGIN_MAP:
+      return static_cast<size_t>(instr->payload.map_size) * 2;
+    case PTON_OPCODE_BEGIN_SEED:
+      return instr->payload.seed_data.headerc
+          + static_cast<size_t>(instr->payload.seed_data.fieldc) * 2;
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      return instr->payload.columns_data.headerc
+          + static_cast<size_t>(instr->payload.columns_data.keyc) * 2;
+    case PTON_OPCODE_INDEXED_VALUES:
+      // The prefixed value.
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// A columns container whose contents are still being validated.
+struct OpenColumns {
+  // The number of remaining instructions there were before the container's
+  // contents were added. Its own values are read when there are that many
+  // plus the number of its values left.
+  size_t remaining_instrs;
+  size_t values_left;
+  uint32_t rowc;
+  uint32_t keyc;
+};
+
+// Checks that an instruction read when there were the given number of
+// remaining instructions can occur where it does within the innermost
+// columns container, if there is one. Each column must be an array with a
+// value for each row.
+static bool scan_columns(pton_instr_t *instr, size_t remaining_instrs,
+    std::vector<OpenColumns> *open_columns) {
+  if (open_columns->empty())
+    return true;
+  OpenColumns *top = &open_columns->back();
+  if (remaining_instrs != top->remaining_instrs + top->values_left)
+    // The instruction is nested deeper within the container.
+    return true;
+  bool is_column = (top->values_left <= top->keyc);
+  uint32_t rowc = top->rowc;
+  if (--top->values_left == 0)
+    open_columns->pop_back();
+  if (!is_column)
+    return true;
+  switch (instr->opcode) {
+    case PTON_OPCODE_BEGIN_ARRAY:
+      return !instr->is_open && instr->payload.array_length == rowc;
+    case PTON_OPCODE_DELTA_ARRAY:
+      return instr->payload.delta_array_data.count == rowc;
+    default:
+      return false;
+  }
+}
+
+// An open-ended container whose contents are still being scanned.
+struct OpenEndedContainer {
+  // The number of remaining instructions there are when the next instruction
+  // is one of the container's own values or its end.
+  size_t remaining_instrs;
+  // The number of values read into the container so far.
+  size_t value_count;
+  bool is_map;
+};
+
+// Accounts for an instruction that has just been read in the number of
+// remaining instructions and the open-ended containers. Returns false if the
+// instruction can't occur where it does.
+static bool scan_instr(pton_instr_t *instr, size_t *remaining_instrs,
+    std::vector<OpenEndedContainer> *open_ended) {
+  OpenEndedContainer *top = open_ended->empty() ? NULL : &open_ended->back();
+  if (top != NULL && top->remaining_instrs == *remaining_instrs) {
+    // The instruction belongs directly to the innermost open-ended container
+    // so it doesn't use up any of the remaining instructions, except if it's
+    // the end.
+    if (instr->opcode == PTON_OPCODE_END) {
+      if (top->is_map && (top->value_count & 1) != 0)
+        return false;
+      open_ended->pop_back();
+      (*remaining_instrs)--;
+      return true;
+    }
+    top->value_count++;
+  } else if (instr->opcode == PTON_OPCODE_END) {
+    return false;
+  } else {
+    (*remaining_instrs)--;
+  }
+  if (instr->is_open) {
+    // The end of the container counts as a remaining instruction until it has
+    // been read.
+    (*remaining_instrs)++;
+    OpenEndedContainer open = {*remaining_instrs, 0,
+        instr->opcode == PTON_OPCODE_BEGIN_MAP};
+    open_ended->push_back(open);
+  }
+  return true;
+}
+
 bool BinaryReader::validate(const void *raw_data, size_t size) {
   const uint8_t *data = static_cast<const uint8_t*>(raw_data);
   size_t cursor = 0;
   size_t remaining_instrs = 1;
+  std::vector<OpenSizedContainer> open_sized;
+  std::vector<OpenEndedContainer> open_ended;
+  std::vector<OpenColumns> open_columns;
+  // The number of values read so far that can be referenced, and whether all
+  // values can be or just seeds.
+  uint64_t shared_count = 0;
+  bool index_values = false;
   pton_instr_t instr;
   while (cursor < size && remaining_instrs > 0) {
     if (!pton_decode_next_instruction(data + cursor, size - cursor, &instr))
       return false;
     cursor += instr.size;
-    remaining_instrs--;
+    if (!scan_columns(&instr, remaining_instrs, &open_columns))
+      return false;
+    if (!scan_instr(&instr, &remaining_instrs, &open_ended))
+      return false;
     switch (instr.opcode) {
-      case PTON_OPCODE_BOOL:
-      case PTON_OPCODE_DEFAULT_STRING:
-      case PTON_OPCODE_ID64:
-      case PTON_OPCODE_INT64:
-      case PTON_OPCODE_NULL:
       case PTON_OPCODE_REFERENCE:
+        if (instr.payload.reference_offset >= shared_count)
+          return false;
+        break;
+      case PTON_OPCODE_INDEXED_VALUES:
+        index_values = true;
+        break;
+      case PTON_OPCODE_BEGIN_SEED:
+        shared_count++;
+        break;
+      case PTON_OPCODE_DEFAULT_STRING:
       case PTON_OPCODE_STRING_WITH_ENCODING:
       case PTON_OPCODE_BLOB:
-        break;
       case PTON_OPCODE_BEGIN_ARRAY:
-        remaining_instrs += instr.payload.array_length;
-        break;
       case PTON_OPCODE_BEGIN_MAP:
-        remaining_instrs += instr.payload.map_size * 2;
+      case PTON_OPCODE_BEGIN_COLUMNS:
+      case PTON_OPCODE_DELTA_ARRAY:
+      case PTON_OPCODE_DICTIONARY_STRING:
+        if (index_values)
+          shared_count++;
         break;
-      case PTON_OPCODE_BEGIN_SEED:
-        remaining_instrs += instr.payload.seed_data.headerc
-          + instr.payload.seed_data.fieldc * 2;
+      default:
         break;
     }
+    if (instr.is_sized) {
+      OpenSizedContainer open = {cursor + instr.contents_size, remaining_instrs};
+      open_sized.push_back(open);
+    }
+    if (instr.opcode == PTON_OPCODE_BEGIN_COLUMNS
+        && instr.payload.columns_data.keyc == 0
+        && instr.payload.columns_data.rowc > 0)
+      return false;
+    size_t child_count = get_child_count(&instr);
+    if (instr.opcode == PTON_OPCODE_BEGIN_COLUMNS && child_count > 0) {
+      OpenColumns open = {remaining_instrs, child_count,
+          instr.payload.columns_data.rowc, instr.payload.columns_data.keyc};
+      open_columns.push_back(open);
+    }
+    remaining_instrs += child_count;
+    // Check that the sized containers that just ended had the size they said
+    // they would.
+    while (!open_sized.empty() && open_sized.back().remaining_instrs == remaining_instrs) {
+      if (open_sized.back().end != cursor)
+        return false;
+      open_sized.pop_back();
+    }
   }
   return (cursor == size) && (remaining_instrs == 0);
 }
 
+size_t BinaryReader::value_size(const void *raw_data, size_t size) {
+  const uint8_t *data = static_cast<const uint8_t*>(raw_data);
+  size_t cursor = 0;
+  size_t remaining_instrs = 1;
+  std::vector<OpenEndedContainer> open_ended;
+  pton_instr_t instr;
+  while (cursor < size && remaining_instrs > 0) {
+    if (!pton_decode_next_instruction(data + cursor, size - cursor, &instr))
+      return 0;
+    cursor += instr.size;
+    if (!scan_instr(&instr, &remaining_instrs, &open_ended))
+      return 0;
+    if (instr.is_sized) {
+      cursor += instr.contents_size;
+    } else {
+      remaining_instrs += get_child_count(&instr);
+    }
+  }
+  return (remaining_instrs == 0) ? cursor : 0;
+}
+
+Native Factory::new_preencoded(const void *data, uint32_t size) {
+  if (!BinaryReader::validate(data, size))
+    return Native();
+  Preencoded *value = new (this) Preencoded(new_blob(data, size));
+  return new_native(value);
+}
+
+SeedType<Preencoded> Preencoded::kSeedType("plankton.Preencoded",
+    tclib::empty_callback(), tclib::empty_callback(),
+    tclib::new_callback(Preencoded::decode),
+    tclib::new_callback(Preencoded::get_encoded));
+
+Variant Preencoded::decode(Preencoded *value, Factory *factory) {
+  BinaryReader reader(factory);
+  return reader.parse(value->encoded_.data(), value->encoded_.size());
+}
+
 } // namespace plankton
 
 bool pton_decode_next_instruction(const uint8_t *code, size_t size, pton_instr_t *instr_out) {
@@ -843,10 +3493,315 @@ bool pton_decode_next_instruction(const uint8_t *code, size_t size, pton_instr_t
   return in.decode(instr_out);
 }
 
+size_t pton_decode_int64_run(const uint8_t *code, size_t size,
+    int64_t *values_out, size_t max_count, size_t *size_out) {
+  InstrDecoder in(code, size);
+  size_t count = in.decode_int64_run(values_out, max_count);
+  *size_out = in.cursor();
+  return count;
+}
+
+bool pton_decode_delta_array(pton_instr_t *instr, int64_t *values_out) {
+  InstrDecoder in(instr->payload.delta_array_data.contents,
+      instr->payload.delta_array_data.size);
+  int64_t value = 0;
+  for (uint32_t i = 0; i < instr->payload.delta_array_data.count; i++) {
+    if (!in.decode_delta(&value))
+      return false;
+    values_out[i] = value;
+  }
+  return true;
+}
+
 bool pton_validate(const void *code, size_t size) {
   return BinaryReader::validate(code, size);
 }
 
+// Constants used by the content hash. They're the ones used by xxhash and
+// murmur3 and have no meaning beyond that they mix bits well.
+static const uint64_t kHashPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t kHashPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t kHashPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t kHashFinal1 = 0xFF51AFD7ED558CCDULL;
+static const uint64_t kHashFinal2 = 0xC4CEB9FE1A85EC53ULL;
+
+static uint64_t hash_rotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// Reads a little-endian word such that the hash doesn't depend on the byte
+// order of the machine.
+static uint64_t hash_read_word(const uint8_t *bytes) {
+  uint64_t result = 0;
+  for (int i = 7; i >= 0; i--)
+    result = (result << 8) | bytes[i];
+  return result;
+}
+
+ContentHasher::ContentHasher()
+  : state_(kHashPrime4)
+  , pending_(0)
+  , pending_size_(0)
+  , length_(0) { }
+
+void ContentHasher::mix(uint64_t word) {
+  state_ ^= hash_rotate(word * kHashPrime2, 31) * kHashPrime1;
+  state_ = hash_rotate(state_, 27) * kHashPrime1 + kHashPrime4;
+}
+
+void ContentHasher::update(const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t*>(data);
+  length_ += size;
+  size_t i = 0;
+  // Complete the word left over from the last update, if there is one.
+  while (pending_size_ > 0 && i < size) {
+    pending_ |= static_cast<uint64_t>(bytes[i++]) << (8 * pending_size_);
+    if (++pending_size_ == 8) {
+      mix(pending_);
+      pending_ = 0;
+      pending_size_ = 0;
+    }
+  }
+  for (; i + 8 <= size; i += 8)
+    mix(hash_read_word(bytes + i));
+  for (; i < size; i++)
+    pending_ |= static_cast<uint64_t>(bytes[i]) << (8 * pending_size_++);
+}
+
+uint64_t ContentHasher::digest() const {
+  uint64_t result = state_ ^ (length_ * kHashPrime1);
+  if (pending_size_ > 0)
+    result ^= hash_rotate(pending_ * kHashPrime2, 31) * kHashPrime1;
+  result ^= result >> 33;
+  result *= kHashFinal1;
+  result ^= result >> 33;
+  result *= kHashFinal2;
+  result ^= result >> 33;
+  return result;
+}
+
+uint64_t ContentHasher::hash(const void *data, size_t size) {
+  ContentHasher hasher;
+  hasher.update(data, size);
+  return hasher.digest();
+}
+
+StringDictionary::StringDictionary(uint32_t capacity)
+  : capacity_(capacity)
+  , newest_(kNone)
+  , oldest_(kNone)
+  , arena_(new Arena())
+  , live_size_(0)
+  , garbage_size_(0) {
+  // There are at least as many buckets as strings, and a power of two of them
+  // such that hashes can be masked.
+  size_t bucket_count = 1;
+  while (bucket_count < capacity)
+    bucket_count <<= 1;
+  buckets_.resize(bucket_count, static_cast<uint32_t>(kNone));
+}
+
+StringDictionary::~StringDictionary() {
+  delete arena_;
+}
+
+uint32_t StringDictionary::find(const char *chars, uint32_t length) {
+  return find(chars, length, ContentHasher::hash(chars, length));
+}
+
+uint32_t StringDictionary::find(const char *chars, uint32_t length,
+    uint64_t hash) {
+  for (uint32_t i = bucket(hash); i != kNone; i = slots_[i].next_in_bucket) {
+    Slot &slot = slots_[i];
+    if (slot.hash == hash && slot.value.length() == length
+        && memcmp(slot.value.chars(), chars, length) == 0)
+      return i;
+  }
+  return kNotFound;
+}
+
+String StringDictionary::get(uint32_t index) {
+  return (index < slots_.size()) ? slots_[index].value : String(Variant::null());
+}
+
+void StringDictionary::touch(uint32_t index) {
+  if (index == newest_)
+    return;
+  unlink(index);
+  link_newest(index);
+}
+
+void StringDictionary::add(const char *chars, uint32_t length) {
+  if (capacity_ == 0 || !is_eligible(length))
+    return;
+  uint64_t hash = ContentHasher::hash(chars, length);
+  uint32_t existing = find(chars, length, hash);
+  if (existing != kNotFound) {
+    touch(existing);
+    return;
+  }
+  uint32_t index = 0;
+  if (slots_.size() < capacity_) {
+    index = size();
+    slots_.push_back(Slot());
+  } else {
+    // Replace the least recently used string. Its characters stay in the
+    // arena until it's compacted.
+    index = oldest_;
+    unlink(index);
+    remove_from_bucket(index);
+    uint32_t old_length = slots_[index].value.length();
+    live_size_ -= old_length;
+    garbage_size_ += old_length;
+  }
+  Slot &slot = slots_[index];
+  slot.value = arena_->new_string(chars, length);
+  slot.value.ensure_frozen();
+  slot.hash = hash;
+  uint32_t &head = bucket(hash);
+  slot.next_in_bucket = head;
+  head = index;
+  link_newest(index);
+  live_size_ += length;
+  if (garbage_size_ >= kMaxGarbageSize && garbage_size_ > live_size_)
+    compact();
+}
+
+void StringDictionary::unlink(uint32_t index) {
+  Slot &slot = slots_[index];
+  if (slot.newer == kNone) {
+    newest_ = slot.older;
+  } else {
+    slots_[slot.newer].older = slot.older;
+  }
+  if (slot.older == kNone) {
+    oldest_ = slot.newer;
+  } else {
+    slots_[slot.older].newer = slot.newer;
+  }
+}
+
+void StringDictionary::link_newest(uint32_t index) {
+  Slot &slot = slots_[index];
+  slot.newer = kNone;
+  slot.older = newest_;
+  if (newest_ == kNone) {
+    oldest_ = index;
+  } else {
+    slots_[newest_].newer = index;
+  }
+  newest_ = index;
+}
+
+void StringDictionary::remove_from_bucket(uint32_t index) {
+  uint32_t *link = &bucket(slots_[index].hash);
+  while (*link != index)
+    link = &slots_[*link].next_in_bucket;
+  *link = slots_[index].next_in_bucket;
+}
+
+void StringDictionary::compact() {
+  // Values that were read from the old arena have adopted it so disposing it
+  // here only releases this dictionary's hold on it.
+  Arena *fresh = new Arena();
+  for (size_t i = 0; i < slots_.size(); i++) {
+    String old_value = slots_[i].value;
+    String new_value = fresh->new_string(old_value.chars(), old_value.length());
+    new_value.ensure_frozen();
+    slots_[i].value = new_value;
+  }
+  delete arena_;
+  arena_ = fresh;
+  garbage_size_ = 0;
+}
+
+StreamingBinaryWriter::StreamingBinaryWriter(tclib::OutStream *dest,
+    size_t buffer_size)
+  : dest_(dest)
+  , buffer_size_(buffer_size)
+  , sized_containers_(false)
+  , references_(false)
+  , canonical_(false)
+  , columnar_(false)
+  , has_failed_(false)
+  , open_depth_(0)
+  , drained_(0)
+  , writer_(NULL) {
+  assm_.reserve(buffer_size);
+}
+
+StreamingBinaryWriter::~StreamingBinaryWriter() {
+  delete writer_;
+  writer_ = NULL;
+}
+
+bool StreamingBinaryWriter::write(Variant value) {
+  if (writer_ == NULL) {
+    writer_ = new VariantWriter(&assm_);
+    writer_->set_streaming(this);
+  }
+  writer_->reset();
+  writer_->set_sized_containers(sized_containers_);
+  writer_->set_references(references_);
+  writer_->set_canonical(canonical_);
+  writer_->set_columnar(columnar_);
+  // Sized containers can't be back-patched once their beginning has been
+  // written to the stream so their sizes must be known in advance.
+  if (sized_containers_)
+    writer_->measure(value);
+  writer_->encode_root(value);
+  return !has_failed_;
+}
+
+bool StreamingBinaryWriter::drain() {
+  blob_t code = assm_.peek_code();
+  hasher_.update(code.start, code.size);
+  if (code.size > 0 && !has_failed_) {
+    tclib::WriteIop iop(dest_, code.start, code.size);
+    if (!iop.execute())
+      has_failed_ = true;
+  }
+  drained_ += code.size;
+  assm_.reset();
+  return !has_failed_;
+}
+
+bool StreamingBinaryWriter::begin_array() {
+  open_depth_++;
+  assm_.begin_open_array();
+  return !has_failed_;
+}
+
+bool StreamingBinaryWriter::begin_map() {
+  open_depth_++;
+  assm_.begin_open_map();
+  return !has_failed_;
+}
+
+bool StreamingBinaryWriter::end() {
+  if (open_depth_ == 0)
+    return false;
+  open_depth_--;
+  assm_.end_open();
+  return !has_failed_;
+}
+
+uint64_t StreamingBinaryWriter::content_hash() {
+  ContentHasher hasher = hasher_;
+  blob_t code = assm_.peek_code();
+  hasher.update(code.start, code.size);
+  return hasher.digest();
+}
+
+bool StreamingBinaryWriter::flush() {
+  return drain() && dest_->flush() && !has_failed_;
+}
+
+size_t pton_binary_writer_measure(pton_variant_t value) {
+  BinaryWriter writer;
+  return writer.measure(value);
+}
+
 void pton_binary_writer_write(pton_assembler_t *assm, pton_variant_t value) {
   Assembler inner(assm);
   VariantWriter writer(&inner);
@@ -9,6 +9,18 @@
 
 #include "plankton-inl.hh"
 
+// SSE2 is part of the x86-64 baseline so this is on for most 64-bit builds;
+// everything else uses the portable word-at-a-time code.
+#if defined(__SSE2__) || (IS_MSVC && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)))
+#  define PTON_HAS_SSE2 1
+#  include <emmintrin.h>
+#  if IS_MSVC
+#    include <intrin.h>
+#  endif
+#else
+#  define PTON_HAS_SSE2 0
+#endif
+
 namespace plankton {
 
 // Various utilities shared between the binary reader and writer.
@@ -27,8 +39,69 @@ public:
     boReference = 8,
     boStringWithEncoding = 10,
     boId = 11,
-    boBlob = 12
+    boBlob = 12,
+    // Containers whose headers also record the size in bytes of their
+    // contents such that readers can skip them without scanning. 13 is left
+    // alone because the python codec uses it for strings with an encoding.
+    boSizedArray = 14,
+    boSizedMap = 15,
+    boSizedSeed = 16,
+    // Arrays and maps whose length isn't known when they're begun. Their
+    // contents are terminated by boEnd.
+    boOpenArray = 17,
+    boOpenMap = 18,
+    boEnd = 19,
+    // An array of maps or seeds with the same keys, written column by column,
+    // and an array of integers written as the deltas between them.
+    boColumns = 20,
+    boDeltaArray = 21,
+    // A string held by the dictionary the writer shares with the reader.
+    boDictionaryString = 22,
+    // Prefix to a value within which strings, blobs, arrays, and maps get
+    // indices too, not just seeds, so references can refer to them.
+    boIndexedValues = 23
   };
+
+  // The max number of bytes a varint can take up.
+  static const size_t kMaxVarintSize = 10;
+
+  // Writes the biased varint encoding of the given value into the given
+  // buffer, which must have room for at least kMaxVarintSize bytes, and
+  // returns the number of bytes written.
+  static size_t encode_uint64(uint64_t value, uint8_t *dest) {
+    size_t size = 0;
+    uint64_t current = value;
+    while (current >= 0x80) {
+      dest[size++] = static_cast<uint8_t>((current & 0x7F) | 0x80);
+      current = (current >> 7) - 1;
+    }
+    dest[size++] = static_cast<uint8_t>(current);
+    return size;
+  }
+
+  // Returns the number of bytes encode_uint64 writes for the given value.
+  static size_t uint64_size(uint64_t value) {
+    size_t size = 1;
+    uint64_t current = value;
+    while (current >= 0x80) {
+      size++;
+      current = (current >> 7) - 1;
+    }
+    return size;
+  }
+
+  // Returns the zig-zag encoding of the given value which maps small negative
+  // values to small unsigned ones. The shift is done unsigned since shifting
+  // a negative value left is undefined.
+  static uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+  }
+
+  // Returns the number of bytes it takes to encode the given value as a
+  // zig-zag encoded varint.
+  static size_t int64_size(int64_t value) {
+    return uint64_size(zigzag(value));
+  }
 };
 
 } // plankton
@@ -667,6 +667,9 @@ protected:
   // Parses the next quoted string.
   bool decode_quoted_string(Variant *out);
 
+  // Creates a string from the characters of a string that has been read.
+  bool decode_string_chars(Buffer<char> *buf, Variant *out);
+
   // Parses the next binary blob.
   bool decode_blob(Variant *out);
 
@@ -936,8 +939,7 @@ bool TextReaderImpl::decode_unquoted_string(Variant *out) {
     buf.add(next);
   }
   skip_whitespace();
-  return succeed(factory()->new_string(*buf, static_cast<uint32_t>(buf.length())),
-      out);
+  return decode_string_chars(&buf, out);
 }
 
 bool TextReaderImpl::decode_character(char *out) {
@@ -980,8 +982,21 @@ bool TextReaderImpl::decode_quoted_string(Variant *out) {
   } else {
     advance_and_skip();
   }
-  return succeed(factory()->new_string(*buf, static_cast<uint32_t>(buf.length())),
-      out);
+  return decode_string_chars(&buf, out);
+}
+
+bool TextReaderImpl::decode_string_chars(Buffer<char> *buf, Variant *out) {
+  uint32_t length = static_cast<uint32_t>(buf->length());
+  if (!parser_->validate_strings_)
+    return succeed(factory()->new_string(**buf, length), out);
+  String result = factory()->new_string(length);
+  bool is_ascii = false;
+  if (!pton_validate_utf8(**buf, length, result.mutable_chars(), &is_ascii))
+    return fail(out);
+  if (is_ascii)
+    result.mark_ascii();
+  result.ensure_frozen();
+  return succeed(result, out);
 }
 
 bool SourceTextReaderImpl::decode_array(Variant *out) {
@@ -1266,7 +1281,8 @@ TextReader::TextReader(TextSyntax syntax, Factory *factory)
   : factory_(factory)
   , scratch_arena_(NULL)
   , syntax_(syntax)
-  , error_(NULL) {
+  , error_(NULL)
+  , validate_strings_(false) {
   if (factory_ == NULL) {
     scratch_arena_ = new Arena();
     factory_ = scratch_arena_;
@@ -3,6 +3,7 @@
 
 #include "c/stdc.h"
 #include "c/stdnew.hh"
+#include "compress.hh"
 #include "io/iop.hh"
 #include "marshal-inl.hh"
 #include "plankton-binary.hh"
@@ -53,6 +54,7 @@ private:
   friend class plankton::Arena;
   friend class ArraySink;
   static const uint32_t kDefaultInitCapacity = 8;
+  static size_t footprint(uint32_t length);
   Arena *origin_;
   uint32_t length_;
   uint32_t capacity_;
@@ -78,7 +80,7 @@ public:
     Variant value;
   };
 
-  explicit pton_arena_map_t(Arena *origin);
+  pton_arena_map_t(Arena *origin, uint32_t init_capacity);
 
   bool set(Variant key, Variant value);
 
@@ -92,6 +94,10 @@ public:
 
   entry_t *elms() { return elms_; }
 
+  // Returns the number of bytes allocated for a map with the given initial
+  // capacity once it holds the given number of entries.
+  static size_t footprint(uint32_t init_capacity, uint32_t size);
+
 private:
   friend class ::Map_Iterator;
   friend class MapKeySink;
@@ -130,10 +136,15 @@ public:
 
   pton_charset_t encoding() { return encoding_; }
 
+  bool is_ascii() { return is_ascii_; }
+
+  bool mark_ascii();
+
 private:
   char *chars_;
   uint32_t length_;
   pton_charset_t encoding_;
+  bool is_ascii_;
 };
 
 struct pton_arena_blob_t : public pton_arena_value_t {
@@ -173,6 +184,17 @@ void pton_dispose_arena(pton_arena_t *arena) {
   delete arena;
 }
 
+// Allocations within an arena's reserved block are aligned to this.
+static const size_t kArenaAlignment = sizeof(uint64_t);
+
+static size_t arena_align(size_t bytes) {
+  return (bytes + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+}
+
+ArenaData::ArenaData()
+  : reserved_next_(NULL)
+  , reserved_limit_(NULL) { }
+
 ArenaData::~ArenaData() {
   // Invoke the scheduled cleanups.
   for (size_t i = 0; i < cleanups_.size(); i++) {
@@ -191,6 +213,44 @@ ArenaData::~ArenaData() {
   }
 }
 
+void ArenaData::reset() {
+  for (size_t i = 0; i < cleanups_.size(); i++) {
+    tclib::callback_t<void(void)> &cleanup = cleanups_[i];
+    cleanup();
+  }
+  cleanups_.clear();
+  for (size_t i = 0; i < adopted_.size(); i++)
+    adopted_[i]->unmark_adopted();
+  adopted_.clear();
+  // The largest block is kept, and replaced by one that's large enough if it
+  // isn't, so allocating the same values again doesn't allocate memory. Unlike
+  // when the arena is destroyed the memory isn't zapped since that would cost
+  // as much as the values took to write.
+  size_t total = 0;
+  blob_t largest = blob_new(NULL, 0);
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    blob_t block = blocks_[i];
+    total += arena_align(block.size);
+    if (block.size > largest.size) {
+      if (largest.start != NULL)
+        allocator_default_free(largest);
+      largest = block;
+    } else {
+      allocator_default_free(block);
+    }
+  }
+  blocks_.clear();
+  reserved_next_ = reserved_limit_ = NULL;
+  if (largest.size < total) {
+    allocator_default_free(largest);
+    reserve(total);
+  } else if (largest.start != NULL) {
+    blocks_.push_back(largest);
+    reserved_next_ = static_cast<uint8_t*>(largest.start);
+    reserved_limit_ = reserved_next_ + largest.size;
+  }
+}
+
 void ArenaData::adopt_ownership(VariantOwner *owner) {
   owner->mark_adopted();
   adopted_.push_back(owner);
@@ -213,12 +273,31 @@ VariantOwner *ArenaData::resolve_adopted() {
 }
 
 void *ArenaData::alloc_raw(size_t bytes) {
+  size_t aligned = arena_align(bytes);
+  if (aligned <= static_cast<size_t>(reserved_limit_ - reserved_next_)) {
+    uint8_t *result = reserved_next_;
+    reserved_next_ += aligned;
+    return result;
+  }
   blob_t block = allocator_default_malloc(bytes);
   uint8_t *memory = static_cast<uint8_t*>(block.start);
   blocks_.push_back(block);
   return memory;
 }
 
+void ArenaData::reserve(size_t bytes) {
+  if (bytes == 0)
+    return;
+  blob_t block = allocator_default_malloc(bytes);
+  blocks_.push_back(block);
+  reserved_next_ = static_cast<uint8_t*>(block.start);
+  reserved_limit_ = reserved_next_ + bytes;
+}
+
+void Arena::reset() {
+  data()->reset();
+}
+
 void Arena::adopt_ownership(VariantOwner *owner) {
   data()->adopt_ownership(owner->resolve_adopted());
 }
@@ -227,6 +306,33 @@ void *Arena::alloc_raw(size_t bytes) {
   return data()->alloc_raw(bytes);
 }
 
+void Arena::reserve(size_t bytes) {
+  data()->reserve(bytes);
+}
+
+size_t Arena::value_footprint(pton_type_t type, uint32_t length) {
+  switch (type) {
+    case PTON_ARRAY:
+      return arena_align(sizeof(pton_arena_array_t))
+          + pton_arena_array_t::footprint(length);
+    case PTON_MAP:
+      return arena_align(sizeof(pton_arena_map_t))
+          + pton_arena_map_t::footprint(length, length);
+    case PTON_SEED:
+      // Seeds' field maps grow as fields are added.
+      return arena_align(sizeof(pton_arena_seed_t))
+          + arena_align(sizeof(pton_arena_map_t))
+          + pton_arena_map_t::footprint(0, length);
+    case PTON_STRING:
+      return arena_align(sizeof(pton_arena_string_t))
+          + arena_align(static_cast<size_t>(length) + 1);
+    case PTON_BLOB:
+      return arena_align(sizeof(pton_arena_blob_t)) + arena_align(length);
+    default:
+      return 0;
+  }
+}
+
 void Arena::register_cleanup(tclib::callback_t<void(void)> callback) {
   data()->register_cleanup(callback);
 }
@@ -289,8 +395,13 @@ pton_variant_t pton_new_array_with_capacity(pton_arena_t *arena, uint32_t init_c
 }
 
 Map Arena::new_map() {
+  return new_map(0);
+}
+
+Map Arena::new_map(uint32_t init_capacity) {
   pton_arena_map_t *data = alloc_value<pton_arena_map_t>();
-  Variant result(header_t::PTON_REPR_ARNA_MAP, new (data) pton_arena_map_t(this));
+  Variant result(header_t::PTON_REPR_ARNA_MAP,
+      new (data) pton_arena_map_t(this, init_capacity));
   return Map(result);
 }
 
@@ -572,21 +683,24 @@ Variant Variant::array_get(uint32_t index) const {
 pton_arena_array_t::pton_arena_array_t(Arena *origin, uint32_t init_capacity)
   : origin_(origin)
   , length_(0)
-  , capacity_(0)
+  , capacity_(init_capacity)
   , elms_(NULL) {
-  if (init_capacity < kDefaultInitCapacity)
-    init_capacity = kDefaultInitCapacity;
-  capacity_ = init_capacity;
-  elms_ = origin->alloc_values<Variant>(capacity_);
+  if (capacity_ > 0)
+    elms_ = origin->alloc_values<Variant>(capacity_);
+}
+
+size_t pton_arena_array_t::footprint(uint32_t length) {
+  return arena_align(sizeof(Variant) * length);
 }
 
 bool pton_arena_array_t::add(Variant value) {
   if (is_frozen())
     return false;
   if (length_ == capacity_) {
-    capacity_ *= 2;
+    capacity_ = (capacity_ == 0) ? kDefaultInitCapacity : (2 * capacity_);
     Variant *new_elms = origin_->alloc_values<Variant>(capacity_);
-    memcpy(new_elms, elms_, sizeof(Variant) * length_);
+    if (length_ > 0)
+      memcpy(new_elms, elms_, sizeof(Variant) * length_);
     elms_ = new_elms;
   }
   elms_[length_++] = value;
@@ -866,11 +980,24 @@ bool pton_map_iter_has_next(pton_map_iter_t *iter) {
       ((iter->cursor + 1) < iter->data->size());
 }
 
-pton_arena_map_t::pton_arena_map_t(Arena *origin)
+pton_arena_map_t::pton_arena_map_t(Arena *origin, uint32_t init_capacity)
   : origin_(origin)
   , size_(0)
-  , capacity_(0)
-  , elms_(NULL) { }
+  , capacity_(init_capacity)
+  , elms_(NULL) {
+  if (capacity_ > 0)
+    elms_ = origin->alloc_values<entry_t>(capacity_);
+}
+
+size_t pton_arena_map_t::footprint(uint32_t init_capacity, uint32_t size) {
+  size_t result = arena_align(sizeof(entry_t) * init_capacity);
+  uint32_t capacity = init_capacity;
+  while (capacity < size) {
+    capacity = (capacity < 4 ? 4 : (2 * capacity));
+    result += arena_align(sizeof(entry_t) * capacity);
+  }
+  return result;
+}
 
 bool pton_arena_map_t::set(Variant key, Variant value) {
   if (is_frozen())
@@ -878,7 +1005,8 @@ bool pton_arena_map_t::set(Variant key, Variant value) {
   if (size_ == capacity_) {
     capacity_ = (capacity_ < 4 ? 4 : (2 * capacity_));
     entry_t *new_elms = origin_->alloc_values<entry_t>(capacity_);
-    memcpy(new_elms, elms_, sizeof(entry_t) * size_);
+    if (size_ > 0)
+      memcpy(new_elms, elms_, sizeof(entry_t) * size_);
     elms_ = new_elms;
   }
   entry_t *entry = &elms_[size_++];
@@ -1027,10 +1155,107 @@ pton_arena_string_t::pton_arena_string_t(char *chars, uint32_t length,
     pton_charset_t encoding, bool is_frozen)
   : chars_(chars)
   , length_(length)
-  , encoding_(encoding) {
+  , encoding_(encoding)
+  , is_ascii_(false) {
   is_frozen_ = is_frozen;
 }
 
+bool pton_arena_string_t::mark_ascii() {
+  if (is_frozen())
+    return false;
+  is_ascii_ = true;
+  return true;
+}
+
+bool Variant::string_is_ascii() const {
+  return pton_string_is_ascii(value_);
+}
+
+bool pton_string_is_ascii(pton_variant_t variant) {
+  pton_check_binary_version(variant);
+  return (variant.header_.repr_tag_ == header_t::PTON_REPR_ARNA_STRING)
+      && variant.payload_.as_arena_string_->is_ascii();
+}
+
+bool Variant::string_mark_ascii() {
+  return pton_string_mark_ascii(value_);
+}
+
+bool pton_string_mark_ascii(pton_variant_t variant) {
+  pton_check_binary_version(variant);
+  return (variant.header_.repr_tag_ == header_t::PTON_REPR_ARNA_STRING)
+      && variant.payload_.as_arena_string_->mark_ascii();
+}
+
+// Returns the size of the UTF-8 sequence at the start of the given data if it
+// is valid, otherwise 0. Overlong encodings, surrogates, and code points above
+// U+10FFFF are invalid.
+static size_t utf8_sequence_size(const uint8_t *data, size_t size) {
+  uint8_t lead = data[0];
+  if (lead < 0x80)
+    return 1;
+  size_t length = (lead < 0xC2) ? 0 : (lead < 0xE0) ? 2 : (lead < 0xF0) ? 3
+      : (lead < 0xF5) ? 4 : 0;
+  if (length == 0 || length > size)
+    return 0;
+  for (size_t i = 1; i < length; i++) {
+    if ((data[i] & 0xC0) != 0x80)
+      return 0;
+  }
+  uint8_t second = data[1];
+  if ((lead == 0xE0 && second < 0xA0)
+      || (lead == 0xED && second >= 0xA0)
+      || (lead == 0xF0 && second < 0x90)
+      || (lead == 0xF4 && second >= 0x90))
+    return 0;
+  return length;
+}
+
+bool pton_validate_utf8(const void *data, size_t size, void *dest,
+    bool *is_ascii_out) {
+  const uint8_t *src = static_cast<const uint8_t*>(data);
+  uint8_t *out = static_cast<uint8_t*>(dest);
+  bool is_ascii = true;
+  size_t cursor = 0;
+  while (cursor < size) {
+    // Runs of ascii, which are the common case, are validated and copied a
+    // block at a time, 16 bytes where SSE2 is available and otherwise a word.
+#if PTON_HAS_SSE2
+    while (size - cursor >= sizeof(__m128i)) {
+      __m128i block = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(src + cursor));
+      if (_mm_movemask_epi8(block) != 0)
+        break;
+      if (out != NULL)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + cursor), block);
+      cursor += sizeof(block);
+    }
+#endif
+    while (size - cursor >= sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, src + cursor, sizeof(word));
+      if ((word & 0x8080808080808080ULL) != 0)
+        break;
+      if (out != NULL)
+        memcpy(out + cursor, &word, sizeof(word));
+      cursor += sizeof(word);
+    }
+    if (cursor == size)
+      break;
+    size_t length = utf8_sequence_size(src + cursor, size - cursor);
+    if (length == 0)
+      return false;
+    if (length > 1)
+      is_ascii = false;
+    if (out != NULL)
+      memcpy(out + cursor, src + cursor, length);
+    cursor += length;
+  }
+  if (is_ascii_out != NULL)
+    *is_ascii_out = is_ascii;
+  return true;
+}
+
 pton_arena_blob_t::pton_arena_blob_t(void *data, uint32_t size, bool is_frozen)
   : data_(data)
   , size_(size) {
@@ -1273,12 +1498,470 @@ pton_variant_t pton_id(uint32_t size, uint64_t value) {
   return result;
 }
 
+// Returns an iterator at the first mapping of a map or field of a seed.
+static Map_Iterator mappings_begin(Variant value) {
+  return value.is_map() ? value.map_begin() : value.seed_fields_begin();
+}
+
+// Returns an iterator just past the mappings of a map or fields of a seed.
+static Map_Iterator mappings_end(Variant value) {
+  return value.is_map() ? value.map_end() : value.seed_fields_end();
+}
+
+// Returns the number of mappings of a map or fields of a seed.
+static uint32_t mappings_size(Variant value) {
+  return value.is_map() ? value.map_size() : value.seed_field_count();
+}
+
+// Adds a mapping to a map or a field to a seed.
+static void set_mapping(Variant target, Variant key, Variant value) {
+  if (target.is_map()) {
+    target.map_set(key, value);
+  } else {
+    target.seed_set_field(key, value);
+  }
+}
+
+Variant ValuePatch::copy(Variant value, Factory *factory) {
+  switch (value.type()) {
+    case PTON_STRING: {
+      String str = value;
+      String result = factory->new_string(str.length(), str.encoding());
+      memcpy(result.mutable_chars(), str.chars(), str.length());
+      if (str.is_ascii())
+        result.mark_ascii();
+      result.ensure_frozen();
+      return result;
+    }
+    case PTON_BLOB: {
+      Blob result = factory->new_blob(value.blob_data(), value.blob_size());
+      result.ensure_frozen();
+      return result;
+    }
+    case PTON_ARRAY: {
+      Array array = value;
+      Array result = factory->new_array(array.length());
+      for (uint32_t i = 0; i < array.length(); i++)
+        result.add(copy(array[i], factory));
+      result.ensure_frozen();
+      return result;
+    }
+    case PTON_MAP:
+    case PTON_SEED: {
+      Variant result;
+      if (value.is_map()) {
+        result = factory->new_map(value.map_size());
+      } else {
+        Seed seed = factory->new_seed();
+        seed.set_header(copy(value.seed_header(), factory));
+        result = seed;
+      }
+      Map_Iterator end = mappings_end(value);
+      for (Map_Iterator i = mappings_begin(value); i != end; i++)
+        set_mapping(result, copy(i->key(), factory), copy(i->value(), factory));
+      result.ensure_frozen();
+      return result;
+    }
+    case PTON_NATIVE: {
+      Native native = value;
+      AbstractSeedType *type = native.type();
+      return copy(type->encode_instance(native, factory), factory);
+    }
+    default:
+      return value;
+  }
+}
+
+bool ValuePatch::equals(Variant a, Variant b) {
+  pton_type_t type = a.type();
+  if (type != b.type())
+    return false;
+  switch (type) {
+    case PTON_STRING:
+      return a.string_length() == b.string_length()
+          && a.string_encoding() == b.string_encoding()
+          && memcmp(a.string_chars(), b.string_chars(), a.string_length()) == 0;
+    case PTON_BLOB:
+      return a.blob_size() == b.blob_size()
+          && memcmp(a.blob_data(), b.blob_data(), a.blob_size()) == 0;
+    case PTON_ARRAY: {
+      uint32_t length = a.array_length();
+      if (length != b.array_length())
+        return false;
+      for (uint32_t i = 0; i < length; i++) {
+        if (!equals(a.array_get(i), b.array_get(i)))
+          return false;
+      }
+      return true;
+    }
+    case PTON_MAP:
+    case PTON_SEED: {
+      if (mappings_size(a) != mappings_size(b))
+        return false;
+      if (type == PTON_SEED && !equals(a.seed_header(), b.seed_header()))
+        return false;
+      Map_Iterator cursor = mappings_begin(b);
+      Map_Iterator end = mappings_end(a);
+      for (Map_Iterator i = mappings_begin(a); i != end; i++) {
+        Variant value;
+        if (!find_mapping(b, &cursor, i->key(), &value) || !equals(i->value(), value))
+          return false;
+      }
+      return true;
+    }
+    default:
+      return a == b;
+  }
+}
+
+bool ValuePatch::find_mapping(Variant container, Map_Iterator *cursor,
+    Variant key, Variant *value_out) {
+  // The mappings of two versions of the same value are usually in the same
+  // order so the one under the cursor is tried before searching.
+  Map_Iterator end = mappings_end(container);
+  if (*cursor != end && equals((*cursor)->key(), key)) {
+    *value_out = (*cursor)->value();
+    (*cursor)++;
+    return true;
+  }
+  for (Map_Iterator i = mappings_begin(container); i != end; i++) {
+    if (equals(i->key(), key)) {
+      *value_out = i->value();
+      *cursor = i;
+      (*cursor)++;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns a new patch node of the given kind with room for the given number of
+// arguments.
+static Array new_patch_node(ValuePatch::Kind kind, uint32_t argc, Factory *factory) {
+  Array result = factory->new_array(argc + 1);
+  result.add(Variant::integer(kind));
+  return result;
+}
+
+Variant ValuePatch::diff(Variant old_value, Variant new_value, Factory *factory) {
+  Variant result = diff_node(old_value, new_value, factory);
+  return result.is_null() ? new_patch_node(kUnchanged, 0, factory) : result;
+}
+
+Variant ValuePatch::diff_node(Variant old_value, Variant new_value,
+    Factory *factory) {
+  if (new_value.is_native()) {
+    // Natives are diffed as the seeds they're sent as.
+    Native native = new_value;
+    new_value = native.type()->encode_instance(native, factory);
+  }
+  pton_type_t type = old_value.type();
+  if (type == new_value.type()) {
+    if (type == PTON_ARRAY) {
+      return diff_arrays(old_value, new_value, factory);
+    } else if (type == PTON_MAP
+        || (type == PTON_SEED && equals(old_value.seed_header(), new_value.seed_header()))) {
+      Array removed = factory->new_array();
+      Map changes = factory->new_map();
+      if (!diff_mappings(old_value, new_value, removed, changes, factory))
+        return Variant::null();
+      Array result = new_patch_node((type == PTON_MAP) ? kEditMap : kEditSeed,
+          2, factory);
+      result.add(removed);
+      result.add(changes);
+      return result;
+    } else if (type != PTON_SEED && equals(old_value, new_value)) {
+      return Variant::null();
+    }
+  }
+  Array result = new_patch_node(kReplace, 1, factory);
+  result.add(new_value);
+  return result;
+}
+
+bool ValuePatch::diff_mappings(Variant old_value, Variant new_value,
+    Array removed, Map changes, Factory *factory) {
+  Map_Iterator new_cursor = mappings_begin(new_value);
+  Map_Iterator old_end = mappings_end(old_value);
+  uint32_t kept = 0;
+  for (Map_Iterator i = mappings_begin(old_value); i != old_end; i++) {
+    Variant value;
+    if (!find_mapping(new_value, &new_cursor, i->key(), &value)) {
+      removed.add(i->key());
+      continue;
+    }
+    kept++;
+    Variant node = diff_node(i->value(), value, factory);
+    if (!node.is_null())
+      changes.set(i->key(), node);
+  }
+  if (mappings_size(new_value) > kept) {
+    // Some mappings are new; they're added as replacements of nothing.
+    Map_Iterator old_cursor = mappings_begin(old_value);
+    Map_Iterator new_end = mappings_end(new_value);
+    for (Map_Iterator i = mappings_begin(new_value); i != new_end; i++) {
+      Variant value;
+      if (find_mapping(old_value, &old_cursor, i->key(), &value))
+        continue;
+      Array node = new_patch_node(kReplace, 1, factory);
+      node.add(i->value());
+      changes.set(i->key(), node);
+    }
+  }
+  return removed.length() > 0 || changes.size() > 0;
+}
+
+Variant ValuePatch::diff_arrays(Array old_value, Array new_value,
+    Factory *factory) {
+  uint32_t old_length = old_value.length();
+  uint32_t new_length = new_value.length();
+  if (old_length == new_length) {
+    Map changes = factory->new_map();
+    for (uint32_t i = 0; i < old_length; i++) {
+      Variant node = diff_node(old_value[i], new_value[i], factory);
+      if (!node.is_null())
+        changes.set(Variant::integer(i), node);
+    }
+    if (changes.size() == 0)
+      return Variant::null();
+    Array result = new_patch_node(kEditArray, 1, factory);
+    result.add(changes);
+    return result;
+  }
+  // Elements are typically added or removed in one place so everything but the
+  // part between the common prefix and suffix is left alone.
+  uint32_t shortest = (old_length < new_length) ? old_length : new_length;
+  uint32_t prefix = 0;
+  while (prefix < shortest && equals(old_value[prefix], new_value[prefix]))
+    prefix++;
+  uint32_t suffix = 0;
+  while (suffix < shortest - prefix
+      && equals(old_value[old_length - suffix - 1], new_value[new_length - suffix - 1]))
+    suffix++;
+  Array inserted = factory->new_array(new_length - prefix - suffix);
+  for (uint32_t i = prefix; i < new_length - suffix; i++)
+    inserted.add(new_value[i]);
+  Array result = new_patch_node(kSpliceArray, 3, factory);
+  result.add(Variant::integer(prefix));
+  result.add(Variant::integer(old_length - prefix - suffix));
+  result.add(inserted);
+  return result;
+}
+
+bool ValuePatch::apply(Variant value, Variant patch, Factory *factory,
+    Variant *result_out) {
+  Array node = patch;
+  if (node.array_length() == 0)
+    return false;
+  switch (node[0].integer_value(-1)) {
+    case kUnchanged:
+      *result_out = value;
+      return true;
+    case kReplace:
+      if (node.length() != 2)
+        return false;
+      *result_out = node[1];
+      return true;
+    case kEditMap:
+    case kEditSeed: {
+      bool is_map = (node[0].integer_value() == kEditMap);
+      Array removed = node[1];
+      Map changes = node[2];
+      if ((is_map ? !value.is_map() : !value.is_seed())
+          || !removed.is_array()
+          || !changes.is_map())
+        return false;
+      Variant result;
+      if (is_map) {
+        result = factory->new_map(value.map_size() + changes.size());
+      } else {
+        Seed seed = factory->new_seed();
+        seed.set_header(value.seed_header());
+        result = seed;
+      }
+      if (!apply_mappings(value, removed, changes, factory, result))
+        return false;
+      result.ensure_frozen();
+      *result_out = result;
+      return true;
+    }
+    case kEditArray: {
+      Array array = value;
+      Map changes = node[1];
+      if (!array.is_array() || !changes.is_map())
+        return false;
+      // The changes are in increasing index order.
+      Map::Iterator change = changes.begin();
+      Map::Iterator changes_end = changes.end();
+      Array result = factory->new_array(array.length());
+      for (uint32_t i = 0; i < array.length(); i++) {
+        Variant element = array[i];
+        if (change != changes_end && change->key().integer_value(-1) == i) {
+          if (!apply(element, change->value(), factory, &element))
+            return false;
+          change++;
+        }
+        result.add(element);
+      }
+      if (change != changes_end)
+        return false;
+      result.ensure_frozen();
+      *result_out = result;
+      return true;
+    }
+    case kSpliceArray: {
+      Array array = value;
+      int64_t start = node[1].integer_value(-1);
+      int64_t delete_count = node[2].integer_value(-1);
+      Array inserted = node[3];
+      if (!array.is_array()
+          || !inserted.is_array()
+          || start < 0
+          || delete_count < 0
+          || start + delete_count > array.length())
+        return false;
+      uint32_t end = static_cast<uint32_t>(start + delete_count);
+      Array result = factory->new_array(array.length() - (end - start) + inserted.length());
+      for (uint32_t i = 0; i < start; i++)
+        result.add(array[i]);
+      for (uint32_t i = 0; i < inserted.length(); i++)
+        result.add(inserted[i]);
+      for (uint32_t i = end; i < array.length(); i++)
+        result.add(array[i]);
+      result.ensure_frozen();
+      *result_out = result;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// The edits a patch makes to the mappings of a map or seed, indexed by key so
+// applying them takes time proportional to the size of the value plus the size
+// of the patch. Container keys are compared structurally, not by identity, so
+// they can't be hashed; they're rare so they're searched linearly instead.
+class MappingEdits {
+public:
+  struct Edit {
+    Edit() : is_removed(false), is_applied(false) { }
+    // The patch node to apply to the mapping's value.
+    Variant node;
+    // Is the mapping removed?
+    bool is_removed;
+    // Has the node been applied?
+    bool is_applied;
+  };
+
+  MappingEdits(Array removed, Map changes);
+
+  // Returns the edit for the given key, or NULL if it is left unchanged.
+  Edit *find(Variant key);
+
+private:
+  // Returns the edit for the given key, creating it if necessary.
+  Edit *ensure(Variant key);
+
+  // Returns true iff the given key has to be searched for linearly.
+  static bool is_unhashable(Variant key);
+
+  VariantMap<Edit> edits_;
+  std::vector< std::pair<Variant, Edit> > unhashable_;
+};
+
+MappingEdits::MappingEdits(Array removed, Map changes) {
+  for (uint32_t i = 0; i < removed.length(); i++)
+    ensure(removed[i])->is_removed = true;
+  for (Map::Iterator i = changes.begin(); i != changes.end(); i++)
+    ensure(i->key())->node = i->value();
+}
+
+bool MappingEdits::is_unhashable(Variant key) {
+  switch (key.type()) {
+    case PTON_ARRAY:
+    case PTON_MAP:
+    case PTON_SEED:
+    case PTON_NATIVE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+MappingEdits::Edit *MappingEdits::find(Variant key) {
+  if (!is_unhashable(key))
+    return edits_[key];
+  for (size_t i = 0; i < unhashable_.size(); i++) {
+    if (ValuePatch::equals(unhashable_[i].first, key))
+      return &unhashable_[i].second;
+  }
+  return NULL;
+}
+
+MappingEdits::Edit *MappingEdits::ensure(Variant key) {
+  Edit *result = find(key);
+  if (result != NULL)
+    return result;
+  if (is_unhashable(key)) {
+    unhashable_.push_back(std::make_pair(key, Edit()));
+    return &unhashable_.back().second;
+  }
+  edits_.set(key, Edit());
+  return edits_[key];
+}
+
+bool ValuePatch::apply_mappings(Variant value, Array removed, Map changes,
+    Factory *factory, Variant target) {
+  MappingEdits edits(removed, changes);
+  Map_Iterator end = mappings_end(value);
+  for (Map_Iterator i = mappings_begin(value); i != end; i++) {
+    Variant key = i->key();
+    Variant current = i->value();
+    MappingEdits::Edit *edit = edits.find(key);
+    if (edit != NULL) {
+      if (edit->is_removed)
+        continue;
+      if (!apply(current, edit->node, factory, &current))
+        return false;
+      edit->is_applied = true;
+    }
+    set_mapping(target, key, current);
+  }
+  // The changes that didn't match an existing mapping add new ones.
+  for (Map::Iterator i = changes.begin(); i != changes.end(); i++) {
+    MappingEdits::Edit *edit = edits.find(i->key());
+    if (edit->is_applied || edit->is_removed)
+      continue;
+    Variant added;
+    if (!apply(Variant::null(), edit->node, factory, &added))
+      return false;
+    edit->is_applied = true;
+    set_mapping(target, i->key(), added);
+  }
+  return true;
+}
+
 OutputSocket::OutputSocket(tclib::OutStream *dest)
   : dest_(dest)
   , cursor_(0)
   , default_encoding_(PTON_CHARSET_UTF_8)
+  , string_dictionary_size_(0)
+  , delta_resync_interval_(0)
+  , compression_threshold_(0)
   , has_been_inited_(false) { }
 
+OutputSocket::~OutputSocket() {
+  for (StreamStateMap::iterator i = streams_.begin(); i != streams_.end(); ++i) {
+    StreamId id = i->first;
+    StreamState *stream = i->second;
+    id.dispose();
+    delete stream->dictionary;
+    delete stream->delta_arena;
+    delete stream;
+  }
+  streams_.clear();
+}
+
 static const byte_t kHeader[8] = {'p', 't', 0xF6, 'n', 0, 0, 0, 0};
 
 fat_bool_t OutputSocket::init() {
@@ -1286,6 +1969,16 @@ fat_bool_t OutputSocket::init() {
   write_byte(kSetDefaultStringEncoding);
   write_uint64(default_encoding_);
   write_padding();
+  if (string_dictionary_size_ > 0) {
+    write_byte(kSetStringDictionarySize);
+    write_uint64(string_dictionary_size_);
+    write_padding();
+  }
+  if (compression_threshold_ > 0) {
+    write_byte(kSetCompression);
+    write_uint64(kLzCompression);
+    write_padding();
+  }
   dest_->flush();
   has_been_inited_ = true;
   return F_TRUE;
@@ -1298,26 +1991,103 @@ bool OutputSocket::set_default_string_encoding(pton_charset_t value) {
   return true;
 }
 
+bool OutputSocket::set_string_dictionary_size(uint32_t value) {
+  if (has_been_inited_ || value > StringDictionary::kMaxCapacity)
+    return false;
+  string_dictionary_size_ = value;
+  return true;
+}
+
+bool OutputSocket::set_compression_threshold(uint32_t value) {
+  if (has_been_inited_)
+    return false;
+  compression_threshold_ = value;
+  return true;
+}
+
 void OutputSocket::send_value(Variant value, Variant stream_id) {
-  write_byte(kSendValue);
-  write_value(stream_id);
-  write_value(value);
+  id_writer_.write(stream_id);
+  StreamState *stream = NULL;
+  if (string_dictionary_size_ > 0 || delta_resync_interval_ > 0)
+    stream = get_stream_state();
+  writer_.set_string_dictionary((stream == NULL) ? NULL : stream->dictionary);
+  byte_t opcode = kSendValue;
+  if (delta_resync_interval_ > 0) {
+    opcode = encode_delta_value(value, stream);
+  } else {
+    writer_.write(value);
+  }
+  write_byte(opcode);
+  write_encoded(&id_writer_);
+  write_value_frame(&writer_);
   write_padding();
   flush();
 }
 
+byte_t OutputSocket::encode_delta_value(Variant value, StreamState *stream) {
+  if (stream->delta_arena != NULL && stream->delta_count + 1 < delta_resync_interval_) {
+    // The patch is copied into the stream's arena and applied to the previous
+    // value there, which copies only the containers the patch changes, to get
+    // what the receiver will end up with and the next value is diffed against.
+    Variant patch;
+    {
+      Arena scratch;
+      patch = ValuePatch::copy(ValuePatch::diff(stream->last_value, value,
+          &scratch), stream->delta_arena);
+    }
+    // The patch is sent if it's smaller than the last full value which saves
+    // measuring the current one.
+    Variant current;
+    if (writer_.measure(patch) < stream->base_size
+        && ValuePatch::apply(stream->last_value, patch, stream->delta_arena, &current)) {
+      writer_.write(patch);
+      stream->delta_count++;
+      stream->last_value = current;
+      return kSendDelta;
+    }
+  }
+  delete stream->delta_arena;
+  stream->delta_arena = new Arena();
+  stream->last_value = ValuePatch::copy(value, stream->delta_arena);
+  writer_.write(stream->last_value);
+  stream->base_size = writer_.size();
+  stream->delta_count = 0;
+  return kSendDeltaBase;
+}
+
 void OutputSocket::write_blob(byte_t *data, size_t size) {
   cursor_ += size;
   tclib::WriteIop iop(dest_, data, size);
   iop.execute();
 }
 
-void OutputSocket::write_value(Variant value) {
-  BinaryWriter writer;
-  writer.write(value);
-  size_t size = writer.size();
+void OutputSocket::write_encoded(BinaryWriter *writer) {
+  size_t size = writer->size();
   write_uint64(size);
-  write_blob(*writer, size);
+  write_blob(**writer, size);
+}
+
+void OutputSocket::write_value_frame(BinaryWriter *writer) {
+  size_t size = writer->size();
+  if (compression_threshold_ == 0) {
+    write_uint64(size);
+    write_blob(**writer, size);
+    return;
+  }
+  // When compression is enabled the low bit of the size tells whether the
+  // frame is compressed, in which case the size of the original value follows.
+  if (size >= compression_threshold_) {
+    compressed_.resize(BlockCodec::max_compressed_size(size));
+    size_t compressed_size = BlockCodec::compress(**writer, size, &compressed_[0]);
+    if (compressed_size < size) {
+      write_uint64((compressed_size << 1) | 1);
+      write_uint64(size);
+      write_blob(&compressed_[0], compressed_size);
+      return;
+    }
+  }
+  write_uint64(size << 1);
+  write_blob(**writer, size);
 }
 
 void OutputSocket::write_byte(byte_t value) {
@@ -1344,6 +2114,22 @@ void OutputSocket::flush() {
   dest_->flush();
 }
 
+OutputSocket::StreamState *OutputSocket::get_stream_state() {
+  StreamId id(*id_writer_, id_writer_.size(), false);
+  StreamStateMap::iterator existing = streams_.find(id);
+  if (existing != streams_.end())
+    return existing->second;
+  // The id borrows the writer's buffer so the map gets its own copy.
+  size_t key_size = id_writer_.size();
+  byte_t *key = new byte_t[key_size];
+  memcpy(key, *id_writer_, key_size);
+  StreamState *result = new StreamState();
+  if (string_dictionary_size_ > 0)
+    result->dictionary = new StringDictionary(string_dictionary_size_);
+  streams_[StreamId(key, key_size, true)] = result;
+  return result;
+}
+
 StreamId::StreamId(byte_t *raw_key, size_t key_size, bool owns_key)
   : raw_key_(raw_key)
   , key_size_(key_size)
@@ -1383,7 +2169,9 @@ InputSocket::InputSocket(tclib::InStream *src)
   : src_(src)
   , has_been_inited_(false)
   , cursor_(0)
-  , default_type_registry_(NULL) {
+  , default_type_registry_(NULL)
+  , compression_(kNoCompression)
+  , string_dictionary_size_(0) {
   CHECK_FALSE("NULL socket source", src == NULL);
   stream_factory_ = tclib::new_callback(new_default_stream);
 }
@@ -1423,9 +2211,7 @@ Variant BufferInputStream::pull_message(Factory *factory) {
     return Variant::null();
   MessageData *message = pending_messages_.front();
   pending_messages_.erase(pending_messages_.begin());
-  BinaryReader reader(factory);
-  reader.set_type_registry(type_registry_);
-  Variant result = reader.parse(message->data(), message->size());
+  Variant result = decode_message(message, factory, type_registry_);
   delete message;
   return result;
 }
@@ -1437,15 +2223,141 @@ PushInputStream::PushInputStream(InputStreamConfig *config, MessageAction action
     actions_.push_back(action);
 }
 
+InputStream::~InputStream() {
+  delete string_dictionary_;
+  delete delta_arena_;
+}
+
+// Stores the given plain value in the out parameter with the seeds whose types
+// are known to the registry replaced by instances, and the containers that hold
+// them copied. Returns true iff anything was replaced, otherwise the value is
+// stored as it is.
+static bool resolve_seeds(Variant value, AbstractTypeRegistry *registry,
+    Factory *factory, Variant *result_out) {
+  switch (value.type()) {
+    case PTON_ARRAY: {
+      Array array = value;
+      Array result;
+      for (uint32_t i = 0; i < array.length(); i++) {
+        Variant element;
+        if (resolve_seeds(array[i], registry, factory, &element) && result.is_null()) {
+          result = factory->new_array(array.length());
+          for (uint32_t j = 0; j < i; j++)
+            result.add(array[j]);
+        }
+        if (!result.is_null())
+          result.add(element);
+      }
+      if (result.is_null())
+        break;
+      result.ensure_frozen();
+      *result_out = result;
+      return true;
+    }
+    case PTON_MAP:
+    case PTON_SEED: {
+      Variant resolved = value;
+      bool changed = false;
+      Map_Iterator end = mappings_end(value);
+      for (Map_Iterator i = mappings_begin(value); i != end; i++) {
+        Variant key;
+        Variant field;
+        bool key_changed = resolve_seeds(i->key(), registry, factory, &key);
+        bool field_changed = resolve_seeds(i->value(), registry, factory, &field);
+        if ((key_changed || field_changed) && !changed) {
+          changed = true;
+          if (value.is_map()) {
+            resolved = factory->new_map(value.map_size());
+          } else {
+            Seed seed = factory->new_seed();
+            seed.set_header(value.seed_header());
+            resolved = seed;
+          }
+          for (Map_Iterator j = mappings_begin(value); j != i; j++)
+            set_mapping(resolved, j->key(), j->value());
+        }
+        if (changed)
+          set_mapping(resolved, key, field);
+      }
+      if (changed)
+        resolved.ensure_frozen();
+      AbstractSeedType *type = value.is_seed()
+          ? registry->resolve_type(value.seed_header())
+          : NULL;
+      if (type == NULL) {
+        *result_out = resolved;
+        return changed;
+      }
+      Variant instance = type->get_initial_instance(value.seed_header(), factory);
+      Variant payload = resolved;
+      if (type->receives_fields()) {
+        Map_Iterator fields_end = mappings_end(resolved);
+        for (Map_Iterator i = mappings_begin(resolved); i != fields_end; i++)
+          type->on_field(instance, i->key(), i->value(), factory);
+        payload = Variant::null();
+      }
+      *result_out = type->get_complete_instance(instance, payload, factory);
+      return true;
+    }
+    default:
+      break;
+  }
+  *result_out = value;
+  return false;
+}
+
+Variant InputStream::decode_message(MessageData *message, Factory *factory,
+    TypeRegistry *type_registry) {
+  if (message->kind() == MessageData::VALUE) {
+    BinaryReader reader(factory);
+    reader.set_type_registry(type_registry);
+    reader.set_string_dictionary(string_dictionary());
+    return reader.parse(message->data(), message->size());
+  }
+  // Delta values are kept in the stream's own arena, which the factory adopts,
+  // so the next delta can be applied to them. A base starts a new arena which
+  // bounds how much the stream holds on to.
+  bool is_base = (message->kind() == MessageData::DELTA_BASE);
+  if (is_base) {
+    delete delta_arena_;
+    delta_arena_ = new Arena();
+    delta_value_ = Variant::null();
+  } else if (delta_arena_ == NULL) {
+    return Variant::null();
+  }
+  BinaryReader reader(delta_arena_);
+  reader.set_string_dictionary(string_dictionary());
+  Variant payload = reader.parse(message->data(), message->size());
+  Variant result;
+  if (is_base) {
+    result = payload;
+  } else if (!ValuePatch::apply(delta_value_, payload, delta_arena_, &result)) {
+    // The stream is out of sync so nothing can be decoded until the next base.
+    delete delta_arena_;
+    delta_arena_ = NULL;
+    return Variant::null();
+  }
+  delta_value_ = result;
+  factory->adopt_ownership(delta_arena_);
+  // The stream keeps the plain value for the next delta to apply to; what's
+  // returned has its seeds resolved like the values of any other message.
+  if (type_registry != NULL)
+    resolve_seeds(result, type_registry, factory, &result);
+  return result;
+}
+
+void InputStream::set_string_dictionary_size(uint32_t value) {
+  delete string_dictionary_;
+  string_dictionary_ = (value == 0) ? NULL : new StringDictionary(value);
+}
+
 InputStream *PushInputStream::new_instance(InputStreamConfig *config) {
   return new PushInputStream(config);
 }
 
 void PushInputStream::receive_block(MessageData *message) {
   Arena arena;
-  BinaryReader reader(&arena);
-  reader.set_type_registry(type_registry_);
-  Variant value = reader.parse(message->data(), message->size());
+  Variant value = decode_message(message, &arena, type_registry_);
   delete message;
   ParsedMessage parsed(&arena, value);
   for (std::vector<MessageAction>::iterator i = actions_.begin();
@@ -1471,14 +2383,20 @@ fat_bool_t InputSocket::init() {
     if (header[i] != kHeader[i])
       return F_FALSE;
   }
-  StreamId id = root_id();
-  InputStreamConfig config(id, default_type_registry_);
-  InputStream *root_stream = stream_factory_(&config);
-  streams_[id] = root_stream;
+  add_stream(root_id());
   has_been_inited_ = true;
   return F_TRUE;
 }
 
+InputStream *InputSocket::add_stream(StreamId id) {
+  InputStreamConfig config(id, default_type_registry_);
+  InputStream *stream = stream_factory_(&config);
+  if (string_dictionary_size_ > 0)
+    stream->set_string_dictionary_size(string_dictionary_size_);
+  streams_[id] = stream;
+  return stream;
+}
+
 fat_bool_t InputSocket::process_next_instruction(ProcessInstrStatus *status_out) {
   bool at_eof = false;
   byte_t opcode = read_byte(&at_eof);
@@ -1488,18 +2406,59 @@ fat_bool_t InputSocket::process_next_instruction(ProcessInstrStatus *status_out)
       read_padding(&at_eof);
       return F_BOOL(!at_eof);
     }
-    case kSendValue: {
+    case kSetStringDictionarySize: {
+      // Read in full so values that are too wide are rejected below rather
+      // than failing a check.
+      uint64_t size = read_uint64(&at_eof);
+      read_padding(&at_eof);
+      if (size > StringDictionary::kMaxCapacity) {
+        if (status_out != NULL)
+          *status_out = ProcessInstrStatus(true);
+        return F_FALSE;
+      }
+      // Streams created from now on get a dictionary too.
+      string_dictionary_size_ = static_cast<uint32_t>(size);
+      for (StreamMap::iterator i = streams_.begin(); i != streams_.end(); ++i)
+        i->second->set_string_dictionary_size(string_dictionary_size_);
+      return F_BOOL(!at_eof);
+    }
+    case kSetCompression: {
+      uint64_t compression = read_uint64(&at_eof);
+      read_padding(&at_eof);
+      if (compression != kNoCompression && compression != kLzCompression) {
+        if (status_out != NULL)
+          *status_out = ProcessInstrStatus(true);
+        return F_FALSE;
+      }
+      compression_ = static_cast<uint32_t>(compression);
+      return F_BOOL(!at_eof);
+    }
+    case kSendValue:
+    case kSendDeltaBase:
+    case kSendDelta: {
       size_t stream_id_size = 0;
       byte_t *stream_id_data = read_value(&stream_id_size, &at_eof);
       StreamId id(stream_id_data, stream_id_size, true);
       size_t value_size = 0;
-      byte_t *value_data = read_value(&value_size, &at_eof);
+      byte_t *value_data = read_value_frame(&value_size, &at_eof);
+      if (value_data == NULL) {
+        id.dispose();
+        if (status_out != NULL)
+          *status_out = ProcessInstrStatus(true);
+        return F_FALSE;
+      }
       read_padding(&at_eof);
       InputStream *dest = get_stream(id);
       if (dest == NULL) {
         delete value_data;
       } else {
-        dest->receive_block(new MessageData(value_data, value_size));
+        MessageData::Kind kind = MessageData::VALUE;
+        if (opcode == kSendDeltaBase) {
+          kind = MessageData::DELTA_BASE;
+        } else if (opcode == kSendDelta) {
+          kind = MessageData::DELTA;
+        }
+        dest->receive_block(new MessageData(value_data, value_size, kind));
       }
       id.dispose();
       return F_BOOL(!at_eof);
@@ -1534,6 +2493,35 @@ byte_t *InputSocket::read_value(size_t *size_out, bool *at_eof_out) {
   return data;
 }
 
+byte_t *InputSocket::read_value_frame(size_t *size_out, bool *at_eof_out) {
+  if (compression_ == kNoCompression)
+    return read_value(size_out, at_eof_out);
+  uint64_t header = read_uint64(at_eof_out);
+  size_t frame_size = static_cast<size_t>(header >> 1);
+  if ((header & 1) == 0) {
+    byte_t *data = new byte_t[frame_size];
+    read_blob(data, frame_size, at_eof_out);
+    *size_out = frame_size;
+    return data;
+  }
+  uint64_t size = read_uint64(at_eof_out);
+  // The size comes from the peer so it's checked before anything is allocated.
+  if (size > BlockCodec::max_decompressed_size(frame_size))
+    return NULL;
+  byte_t *compressed = new byte_t[frame_size];
+  read_blob(compressed, frame_size, at_eof_out);
+  byte_t *data = new byte_t[static_cast<size_t>(size)];
+  bool is_valid = BlockCodec::decompress(compressed, frame_size, data,
+      static_cast<size_t>(size));
+  delete[] compressed;
+  if (!is_valid) {
+    delete[] data;
+    return NULL;
+  }
+  *size_out = static_cast<size_t>(size);
+  return data;
+}
+
 StreamId InputSocket::root_id() {
   return StreamId(const_cast<byte_t*>(kRawRootId), 1, false);
 }
@@ -205,6 +205,23 @@ char *pton_string_mutable_chars(pton_variant_t variant);
 // PTON_CHARSET_NONE.
 pton_charset_t pton_string_encoding(pton_variant_t variant);
 
+// Returns true if the given value is a string that is known to consist only of
+// ascii characters. A false result means that it either isn't or isn't known
+// to be.
+bool pton_string_is_ascii(pton_variant_t variant);
+
+// Records that the given string consists only of ascii characters. Only
+// mutable strings can be marked; returns true iff marking succeeded.
+bool pton_string_mark_ascii(pton_variant_t variant);
+
+// Checks that the given data is valid UTF-8, copying it to the given
+// destination at the same time unless it is NULL. Returns true iff the data is
+// valid, in which case is_ascii_out, if not NULL, is set to whether all the
+// characters are ascii. If the data is invalid the destination may have been
+// partially written.
+bool pton_validate_utf8(const void *data, size_t size, void *dest,
+    bool *is_ascii_out);
+
 // If this variant is a blob, returns the number of bytes. If not, returns 0.
 uint32_t pton_blob_size(pton_variant_t variant);
 
@@ -380,6 +397,76 @@ bool pton_assembler_begin_map(pton_assembler_t *assm, uint32_t size);
 // Writes a seed header.
 bool pton_assembler_begin_seed(pton_assembler_t *assm, uint32_t headerc, uint32_t fieldc);
 
+// Writes the header of an array with the given number of elements that also
+// records the size in bytes of the elements, which allows readers to skip over
+// the array without decoding it. The elements must be followed by a call to
+// pton_assembler_end_sized. Readers that don't understand sized containers
+// will reject the output so this should only be used when the reader is
+// known to support them.
+bool pton_assembler_begin_sized_array(pton_assembler_t *assm, uint32_t length);
+
+// Writes the header of a map that records its size in bytes, like
+// pton_assembler_begin_sized_array.
+bool pton_assembler_begin_sized_map(pton_assembler_t *assm, uint32_t size);
+
+// Writes the header of a seed that records its size in bytes, like
+// pton_assembler_begin_sized_array.
+bool pton_assembler_begin_sized_seed(pton_assembler_t *assm, uint32_t headerc,
+    uint32_t fieldc);
+
+// Ends the innermost sized container, filling in its size. Returns false if
+// there is no sized container to end.
+bool pton_assembler_end_sized(pton_assembler_t *assm);
+
+// Writes the header of an array whose length isn't known in advance. The
+// elements can be written as they become available and must be followed by a
+// call to pton_assembler_end_open. Like sized containers these should only be
+// used when the reader is known to support them.
+bool pton_assembler_begin_open_array(pton_assembler_t *assm);
+
+// Writes the header of a map whose size isn't known in advance, like
+// pton_assembler_begin_open_array. The mappings are written keys and values
+// alternating.
+bool pton_assembler_begin_open_map(pton_assembler_t *assm);
+
+// Ends the innermost open array or map.
+bool pton_assembler_end_open(pton_assembler_t *assm);
+
+// Writes the header of an array of the given number of maps, or seeds if
+// headerc is nonzero, which all have the same keys. The header must be
+// followed by the headers shared by the seeds, then the keys, then for each
+// key a column: an array of the given number of values, one for each row, or
+// an integer array written with pton_assembler_emit_delta_array.
+bool pton_assembler_begin_columns(pton_assembler_t *assm, uint32_t rowc,
+    uint32_t headerc, uint32_t keyc);
+
+// Writes an array of the given integers, each encoded as the difference from
+// the one before it.
+bool pton_assembler_emit_delta_array(pton_assembler_t *assm,
+    const int64_t *values, uint32_t count);
+
+// Writes the header of a sized array whose contents are known in advance to
+// take up the given number of bytes. Unlike pton_assembler_begin_sized_array
+// the size is written immediately so the elements must not be followed by a
+// call to pton_assembler_end_sized.
+bool pton_assembler_begin_measured_array(pton_assembler_t *assm,
+    uint32_t length, uint64_t contents_size);
+
+// Writes the header of a sized map whose contents are known in advance to take
+// up the given number of bytes, like pton_assembler_begin_measured_array.
+bool pton_assembler_begin_measured_map(pton_assembler_t *assm, uint32_t size,
+    uint64_t contents_size);
+
+// Writes the header of a sized seed whose contents are known in advance to
+// take up the given number of bytes, like pton_assembler_begin_measured_array.
+bool pton_assembler_begin_measured_seed(pton_assembler_t *assm,
+    uint32_t headerc, uint32_t fieldc, uint64_t contents_size);
+
+// Ensures that the assembler has room for the given number of bytes beyond
+// what has already been written such that writing them won't cause the
+// code to be reallocated.
+void pton_assembler_reserve(pton_assembler_t *assm, size_t size);
+
 // Writes the given boolean value.
 bool pton_assembler_emit_bool(pton_assembler_t *assm, bool value);
 
@@ -407,6 +494,22 @@ bool pton_assembler_emit_id64(pton_assembler_t *assm, uint32_t size,
 // Writes a reference to the previously seen value at the given offset.
 bool pton_assembler_emit_reference(pton_assembler_t *assm, uint64_t offset);
 
+// Writes the prefix that marks the value that follows as one where all
+// strings, blobs, arrays, maps, and seeds can be referenced rather than just
+// seeds.
+bool pton_assembler_emit_indexed_values(pton_assembler_t *assm);
+
+// Writes a reference to the string at the given index in the string dictionary
+// the reader shares with the writer. Only readers that have been given the
+// matching dictionary can read the result.
+bool pton_assembler_emit_dictionary_string(pton_assembler_t *assm,
+    uint32_t index);
+
+// Writes data that has already been encoded, for instance by another
+// assembler, verbatim. The data must be a sequence of complete values.
+bool pton_assembler_emit_encoded(pton_assembler_t *assm, const void *data,
+    size_t size);
+
 // Returns the code written by the assembler. The result is still owned by the
 // assembler and any further modification invalidates a previously peeked
 // result. Typically you'll want to immediately copy the data away.
@@ -419,6 +522,10 @@ blob_t pton_assembler_release_code(pton_assembler_t *assm);
 // Disposes a block of memory returned from this assembler.
 void pton_assembler_dispose_code(blob_t memory);
 
+// Discards the code written so far, keeping the memory that holds it such that
+// the assembler can be reused without reallocating.
+void pton_assembler_reset(pton_assembler_t *assm);
+
 typedef enum pton_instr_opcode_t {
   PTON_OPCODE_INT64,
   PTON_OPCODE_ID64,
@@ -430,13 +537,27 @@ typedef enum pton_instr_opcode_t {
   PTON_OPCODE_BOOL,
   PTON_OPCODE_BEGIN_SEED,
   PTON_OPCODE_REFERENCE,
-  PTON_OPCODE_BLOB
+  PTON_OPCODE_BLOB,
+  PTON_OPCODE_END,
+  PTON_OPCODE_BEGIN_COLUMNS,
+  PTON_OPCODE_DELTA_ARRAY,
+  PTON_OPCODE_DICTIONARY_STRING,
+  PTON_OPCODE_INDEXED_VALUES
 } pton_instr_opcode_t;
 
 // Describes an individual binary plankton code instruction.
 typedef struct {
   pton_instr_opcode_t opcode;
   size_t size;
+  // True if this is the header of a container that was encoded with its size,
+  // in which case contents_size holds the size in bytes of the container's
+  // contents which start immediately after this instruction.
+  bool is_sized;
+  uint64_t contents_size;
+  // True if this is the header of an array or map whose length wasn't known
+  // when it was written, in which case its contents are terminated by an end
+  // instruction and the length or size in the payload is 0.
+  bool is_open;
   union pton_instr_payload_t {
     bool bool_value;
     int64_t int64_value;
@@ -464,6 +585,19 @@ typedef struct {
       uint64_t value;
     } id64;
     uint64_t reference_offset;
+    struct {
+      uint32_t rowc;
+      uint32_t headerc;
+      uint32_t keyc;
+    } columns_data;
+    struct {
+      // The number of integers and the encoded deltas between them, which can
+      // be read back with pton_decode_delta_array.
+      uint32_t count;
+      const uint8_t *contents;
+      size_t size;
+    } delta_array_data;
+    uint32_t dictionary_index;
   } payload;
 } pton_instr_t;
 
@@ -473,6 +607,18 @@ typedef struct {
 bool pton_decode_next_instruction(const uint8_t *code, size_t size,
     pton_instr_t *instr_out);
 
+// Decodes a run of consecutive integer instructions starting at the given code
+// pointer, at most max_count of them, storing the values in the given array.
+// The number of bytes read is stored in size_out. Returns the number of
+// integers decoded which is 0 if the code doesn't start with an integer.
+size_t pton_decode_int64_run(const uint8_t *code, size_t size,
+    int64_t *values_out, size_t max_count, size_t *size_out);
+
+// Decodes the integers of a delta array instruction into the given array,
+// which must have room for all of them. Returns false if the instruction's
+// contents are invalid.
+bool pton_decode_delta_array(pton_instr_t *instr, int64_t *values_out);
+
 // Returns true if the given input is valid plankton.
 bool pton_validate(const void *code, size_t size);
 
@@ -519,4 +665,7 @@ char pton_syntax_error_offender(pton_syntax_error_t *that);
 // Serialize the given value onto the given assembler.
 void pton_binary_writer_write(pton_assembler_t *assm, pton_variant_t value);
 
+// Returns the number of bytes it takes to serialize the given value.
+size_t pton_binary_writer_measure(pton_variant_t value);
+
 #endif // _PLANKTON_H
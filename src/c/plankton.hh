@@ -14,15 +14,27 @@ struct pton_command_line_t { };
 struct pton_command_line_reader_t { };
 struct pton_syntax_error_t { };
 
+namespace tclib {
+class OutStream;
+} // namespace tclib
+
 namespace plankton {
 
+class VariantWriter;
+
 // Utility for encoding plankton data. For most uses you can use a BinaryWriter
 // to encode a whole variant at a time, but in cases where data is represented
 // in some other way you can use this to build custom encoding.
 class Assembler {
 public:
-  Assembler(pton_assembler_t *assm) : own_assm_(NULL), assm_(assm) { }
-  Assembler() : own_assm_(pton_new_assembler()), assm_(own_assm_) { }
+  Assembler(pton_assembler_t *assm)
+    : own_assm_(NULL)
+    , assm_(assm)
+    , outer_writer_(NULL) { }
+  Assembler()
+    : own_assm_(pton_new_assembler())
+    , assm_(own_assm_)
+    , outer_writer_(NULL) { }
   ~Assembler() { pton_dispose_assembler(own_assm_); }
 
   // Writes an array header for an array with the given number of elements. This
@@ -37,6 +49,69 @@ public:
   // fields. This must be followed immediately by the headers and body of the seed.
   bool begin_seed(uint32_t headerc, uint32_t fieldc) { return pton_assembler_begin_seed(assm_, headerc, fieldc); }
 
+  // Writes the header of an array that records the size of its elements. The
+  // elements must be followed by a call to end_sized.
+  bool begin_sized_array(uint32_t length) { return pton_assembler_begin_sized_array(assm_, length); }
+
+  // Writes the header of a map that records the size of its mappings. The
+  // mappings must be followed by a call to end_sized.
+  bool begin_sized_map(uint32_t size) { return pton_assembler_begin_sized_map(assm_, size); }
+
+  // Writes the header of a seed that records the size of its headers and
+  // fields. The fields must be followed by a call to end_sized.
+  bool begin_sized_seed(uint32_t headerc, uint32_t fieldc) {
+    return pton_assembler_begin_sized_seed(assm_, headerc, fieldc);
+  }
+
+  // Ends the innermost sized container.
+  bool end_sized() { return pton_assembler_end_sized(assm_); }
+
+  // Writes the header of an array whose length isn't known yet. The elements
+  // must be followed by a call to end_open.
+  bool begin_open_array() { return pton_assembler_begin_open_array(assm_); }
+
+  // Writes the header of a map whose size isn't known yet. The mappings must
+  // be followed by a call to end_open.
+  bool begin_open_map() { return pton_assembler_begin_open_map(assm_); }
+
+  // Ends the innermost open array or map.
+  bool end_open() { return pton_assembler_end_open(assm_); }
+
+  // Writes the header of an array of maps or seeds with the same keys whose
+  // values are written column by column.
+  bool begin_columns(uint32_t rowc, uint32_t headerc, uint32_t keyc) {
+    return pton_assembler_begin_columns(assm_, rowc, headerc, keyc);
+  }
+
+  // Writes an array of integers encoded as the deltas between them.
+  bool emit_delta_array(const int64_t *values, uint32_t count) {
+    return pton_assembler_emit_delta_array(assm_, values, count);
+  }
+
+  // Writes the header of a sized array whose contents are known to take up
+  // the given number of bytes. No call to end_sized must follow.
+  bool begin_measured_array(uint32_t length, uint64_t contents_size) {
+    return pton_assembler_begin_measured_array(assm_, length, contents_size);
+  }
+
+  // Writes the header of a sized map whose contents are known to take up the
+  // given number of bytes. No call to end_sized must follow.
+  bool begin_measured_map(uint32_t size, uint64_t contents_size) {
+    return pton_assembler_begin_measured_map(assm_, size, contents_size);
+  }
+
+  // Writes the header of a sized seed whose contents are known to take up the
+  // given number of bytes. No call to end_sized must follow.
+  bool begin_measured_seed(uint32_t headerc, uint32_t fieldc,
+      uint64_t contents_size) {
+    return pton_assembler_begin_measured_seed(assm_, headerc, fieldc,
+        contents_size);
+  }
+
+  // Ensures that there's room for the given number of bytes to be written
+  // without reallocating.
+  void reserve(size_t size) { pton_assembler_reserve(assm_, size); }
+
   // Writes the given boolean value.
   bool emit_bool(bool value) { return pton_assembler_emit_bool(assm_, value); }
 
@@ -64,27 +139,275 @@ public:
     return pton_assembler_emit_id64(assm_, size, value);
   }
 
+  // Writes a reference to the value the given number of values back.
+  bool emit_reference(uint64_t offset) {
+    return pton_assembler_emit_reference(assm_, offset);
+  }
+
+  // Marks the value that follows as one where all values can be referenced.
+  bool emit_indexed_values() {
+    return pton_assembler_emit_indexed_values(assm_);
+  }
+
+  // Writes a reference to the string at the given index in the shared string
+  // dictionary.
+  bool emit_dictionary_string(uint32_t index) {
+    return pton_assembler_emit_dictionary_string(assm_, index);
+  }
+
+  // Writes data that has already been encoded verbatim.
+  bool emit_encoded(const void *data, size_t size) {
+    return pton_assembler_emit_encoded(assm_, data, size);
+  }
+
   // Flushes the given assembler, writing the output into the given parameters.
   // The caller assumes ownership of the returned array and is responsible for
   // freeing it. This doesn't free the assembler, it must still be disposed with
   // pton_dispose_assembler.
   blob_t peek_code() { return pton_assembler_peek_code(assm_); }
 
+  // Returns the code written by this assembler and gives up ownership of it.
+  // The result must be disposed with pton_assembler_dispose_code.
+  blob_t release_code() { return pton_assembler_release_code(assm_); }
+
+  // Discards the code written so far but keeps the memory for reuse.
+  void reset() { pton_assembler_reset(assm_); }
+
 private:
+  friend class BinaryWriter;
+  friend class VariantWriter;
   pton_assembler_t *own_assm_;
   pton_assembler_t *assm_;
+  // The writer a native is writing itself to this assembler for, if any.
+  // Values the native writes with BinaryWriter::write_to use its settings.
+  VariantWriter *outer_writer_;
+};
+
+// A fast non-cryptographic 64-bit hash of a sequence of bytes. The bytes can be
+// given in any number of pieces; the hash only depends on their concatenation.
+class ContentHasher {
+public:
+  ContentHasher();
+
+  // Adds the given bytes to the data being hashed.
+  void update(const void *data, size_t size);
+
+  // Returns the hash of the bytes given so far.
+  uint64_t digest() const;
+
+  // Returns the hash of the given bytes.
+  static uint64_t hash(const void *data, size_t size);
+
+private:
+  // Mixes a full word into the state.
+  void mix(uint64_t word);
+
+  uint64_t state_;
+  // Bytes that don't yet make up a whole word.
+  uint64_t pending_;
+  size_t pending_size_;
+  uint64_t length_;
+};
+
+// A bounded set of strings shared by a writer and a reader across the values
+// they exchange, such that a string that has been sent before can be written
+// as its index rather than in full. The writer and the reader each keep their
+// own dictionary and update them the same way: after each value the strings
+// that were written in full are added and, once the dictionary is full, each
+// new string replaces the one that was used least recently. For the two to
+// stay in sync every value written using one dictionary must be read, in
+// order, using the other.
+class StringDictionary {
+public:
+  // Creates an empty dictionary that holds at most the given number of
+  // strings.
+  StringDictionary(uint32_t capacity);
+  ~StringDictionary();
+
+  // Strings shorter than this gain nothing from being referenced and strings
+  // longer than this are unlikely to repeat so neither are added.
+  static const uint32_t kMinLength = 3;
+  static const uint32_t kMaxLength = 256;
+
+  // The largest capacity a dictionary can have. This bounds the memory a peer
+  // can make a socket allocate for each stream.
+  static const uint32_t kMaxCapacity = 1 << 16;
+
+  // Returned by find when the string isn't in the dictionary.
+  static const uint32_t kNotFound = ~static_cast<uint32_t>(0);
+
+  // Returns true iff a string of the given length can be added.
+  static bool is_eligible(uint32_t length) {
+    return kMinLength <= length && length <= kMaxLength;
+  }
+
+  // Returns the max number of strings this dictionary holds.
+  uint32_t capacity() { return capacity_; }
+
+  // Returns the number of strings this dictionary holds.
+  uint32_t size() { return static_cast<uint32_t>(slots_.size()); }
+
+  // Returns the index of the given string or kNotFound if it isn't here.
+  uint32_t find(const char *chars, uint32_t length);
+
+  // Returns the string at the given index or null if there is none.
+  String get(uint32_t index);
+
+  // Marks the string at the given index as the one used most recently.
+  void touch(uint32_t index);
+
+  // Adds the given string, replacing the least recently used one if the
+  // dictionary is full. If the string is already here it is touched instead.
+  void add(const char *chars, uint32_t length);
+
+  // Returns the arena that holds the strings. It is replaced from time to
+  // time so values that refer to the strings must keep the arena's contents
+  // alive by adopting it.
+  Arena *arena() { return arena_; }
+
+private:
+  // Marks the end of the recency list and of hash chains.
+  static const uint32_t kNone = kNotFound;
+
+  // Returns the index of the given string, whose hash is given, or kNotFound.
+  uint32_t find(const char *chars, uint32_t length, uint64_t hash);
+
+  // Once this many bytes of replaced strings have built up in the arena, and
+  // they make up more than half of it, the live strings are moved to a fresh
+  // one.
+  static const size_t kMaxGarbageSize = 64 * 1024;
+
+  struct Slot {
+    Slot() : value(Variant::null()) { }
+    String value;
+    uint64_t hash;
+    // Neighbours in the recency list and the next slot in the same bucket.
+    uint32_t newer;
+    uint32_t older;
+    uint32_t next_in_bucket;
+  };
+
+  // Returns the bucket strings with the given hash go in.
+  uint32_t &bucket(uint64_t hash) {
+    return buckets_[static_cast<size_t>(hash) & (buckets_.size() - 1)];
+  }
+
+  // Removes the given slot from the recency list.
+  void unlink(uint32_t index);
+
+  // Makes the given slot the most recently used.
+  void link_newest(uint32_t index);
+
+  // Removes the given slot from its hash bucket.
+  void remove_from_bucket(uint32_t index);
+
+  // Copies the live strings to a new arena and disposes the old one.
+  void compact();
+
+  uint32_t capacity_;
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> buckets_;
+  uint32_t newest_;
+  uint32_t oldest_;
+  Arena *arena_;
+  size_t live_size_;
+  size_t garbage_size_;
 };
 
-// Utility for serializing variant values to plankton.
+// Utility for serializing variant values to plankton. A writer can be used to
+// write any number of values one after the other; each write replaces the
+// previous one and reuses the memory it used, so a long-lived writer doesn't
+// have to allocate anything for values that aren't larger than ones it has
+// written before.
 class BinaryWriter {
 public:
   BinaryWriter();
   ~BinaryWriter();
 
-  // Write the given value to this writer's internal buffer.
+  // Write the given value to this writer's internal buffer, replacing any value
+  // written before. If containers are written with their sizes the value is
+  // measured first such that the sizes are known up front and the buffer only
+  // has to grow once if it's too small.
   void write(Variant value);
 
-  // Returns the start of the buffer.
+  // Discards the value written most recently, keeping the memory for reuse.
+  void reset();
+
+  // Returns the number of bytes it would take to write the given value with
+  // this writer's current settings. Framing layers can use this to write a
+  // length prefix ahead of the value.
+  size_t measure(Variant value);
+
+  // Writes the given value to the given assembler. Seed types use this to
+  // write fields that hold arbitrary values from AbstractSeedType::encode_to,
+  // in which case the value is written with the sized containers and columns
+  // settings of the writer the native is being written by; otherwise the
+  // default settings are used. Returns false if writing failed.
+  static bool write_to(Assembler *assm, Variant value);
+
+  // Sets whether arrays, maps, and seeds should be written such that they
+  // record the size of their contents, allowing readers to skip over them
+  // without decoding. Off by default since older readers don't understand
+  // sized containers.
+  void set_sized_containers(bool value) { sized_containers_ = value; }
+
+  // Sets whether repeated strings and blobs, and arrays, maps, and seeds that
+  // occur more than once within a value, should be written as references back
+  // to their first occurrence. Shared containers are then read back as a
+  // single shared value and cycles can be written. Values are prefixed with
+  // boIndexedValues since plain references only refer to seeds. Off by
+  // default since older readers don't understand the prefix.
+  void set_references(bool value) { references_ = value; }
+
+  // Sets whether values should be written canonically. In canonical mode the
+  // entries of maps and seeds are written in the order of their encoded keys
+  // rather than insertion order so values that are equal get written the same
+  // way. Only repeated strings and blobs are written as references, not
+  // shared containers, since sharing doesn't affect equality; values with
+  // cycles can't be written canonically.
+  void set_canonical(bool value) { canonical_ = value; }
+
+  // Arrays with fewer elements than this are never written as columns.
+  static const uint32_t kMinColumnarLength = 4;
+
+  // Sets whether arrays of maps that all have the same keys, or of seeds that
+  // also have the same header, should be written as columns: the keys are
+  // written once followed by the values of each key for all the rows, with
+  // columns of integers written as the deltas between them. The rows are read
+  // back as ordinary maps and seeds. Columns aren't used when writing
+  // references or canonically. Off by default since older readers don't
+  // understand columns.
+  void set_columnar(bool value) { columnar_ = value; }
+
+  // Values with fewer elements or entries than this are always written on the
+  // calling thread.
+  static const size_t kMinParallelLength = 1024;
+
+  // Sets the number of threads to use when writing large arrays and maps. The
+  // elements, or entries, are split between the threads which each write
+  // theirs into their own buffer and the results are then joined behind the
+  // container's header. The result is the same as when writing on a single
+  // thread. The default, 1, writes everything on the calling thread. Values
+  // can't be written in parallel if references are enabled since whether a
+  // value is written as a reference depends on everything written before it.
+  // Note that native values may be converted from several threads at once.
+  void set_thread_count(size_t value) { thread_count_ = value; }
+
+  // Sets the dictionary used to write strings that have been written before,
+  // by this writer or another one using the same dictionary, as their index.
+  // The strings written in full are added to the dictionary after each write.
+  // The values must be read by a reader with a dictionary of the same
+  // capacity that has read all the values written using this one. Values
+  // aren't written in parallel and preencoded values aren't spliced in while
+  // a dictionary is set. Pass NULL to stop using the dictionary.
+  void set_string_dictionary(StringDictionary *value) { string_dictionary_ = value; }
+
+  // Returns a hash of the data written by the most recent write. If the value
+  // was written canonically, equal values get the same hash.
+  uint64_t content_hash() { return ContentHasher::hash(bytes_, size_); }
+
+  // Returns the start of the buffer. The buffer is owned by the writer and is
+  // only valid until the next write or reset.
   uint8_t *operator*() { return bytes_; }
 
   // Returns the size in bytes of the data written to this writer's buffer.
@@ -92,8 +415,109 @@ public:
 
 private:
   friend class VariantWriter;
+
+  // Returns this writer's variant writer, creating it if necessary.
+  VariantWriter *writer();
+
   uint8_t *bytes_;
   size_t size_;
+  bool sized_containers_;
+  bool references_;
+  bool canonical_;
+  bool columnar_;
+  size_t thread_count_;
+  StringDictionary *string_dictionary_;
+  Assembler assm_;
+  VariantWriter *writer_;
+
+  // Not copyable since the variant writer is owned by this writer.
+  BinaryWriter(const BinaryWriter&);
+  BinaryWriter &operator=(const BinaryWriter&);
+};
+
+// Utility for serializing variant values directly to an output stream. The
+// encoded data is collected in a buffer of a fixed size which is written to
+// the stream whenever it fills up, so the whole encoded value never has to be
+// held in memory. The buffer can overflow by at most the size of the largest
+// string, blob, or column of integers in the value. If containers are written
+// with their sizes the value is measured before it is written, which means
+// visiting it twice.
+class StreamingBinaryWriter {
+public:
+  // The default size of the buffer.
+  static const size_t kDefaultBufferSize = 64 * 1024;
+
+  StreamingBinaryWriter(tclib::OutStream *dest,
+      size_t buffer_size = kDefaultBufferSize);
+  ~StreamingBinaryWriter();
+
+  // Sets whether containers should be written with their sizes, like
+  // BinaryWriter::set_sized_containers.
+  void set_sized_containers(bool value) { sized_containers_ = value; }
+
+  // Sets whether values that occur more than once should be written as
+  // references, like BinaryWriter::set_references.
+  void set_references(bool value) { references_ = value; }
+
+  // Sets whether values should be written canonically, like
+  // BinaryWriter::set_canonical.
+  void set_canonical(bool value) { canonical_ = value; }
+
+  // Sets whether arrays of same-shaped maps and seeds should be written as
+  // columns, like BinaryWriter::set_columnar.
+  void set_columnar(bool value) { columnar_ = value; }
+
+  // Begins an array whose elements are given by the following calls to write
+  // and which is ended by a call to end. This way an array can be written
+  // without knowing its length in advance or holding all the elements at
+  // once. Only readers that understand open containers can read the result.
+  bool begin_array();
+
+  // Begins a map whose keys and values are given by the following calls to
+  // write, alternating, and which is ended by a call to end.
+  bool begin_map();
+
+  // Ends the innermost array or map begun by begin_array or begin_map.
+  bool end();
+
+  // Returns a hash of all the data written so far, including data that is
+  // still in the buffer. The hash is updated as the data is written so this
+  // doesn't require another pass over it.
+  uint64_t content_hash();
+
+  // Writes the given value to the stream. Some of the value may remain in the
+  // buffer until flush is called. Returns false if writing to the stream
+  // failed.
+  bool write(Variant value);
+
+  // Writes anything left in the buffer to the stream and flushes the stream.
+  bool flush();
+
+  // Returns the total number of bytes written so far, including any still in
+  // the buffer.
+  uint64_t bytes_written() { return drained_ + assm_.peek_code().size; }
+
+private:
+  friend class VariantWriter;
+
+  // Writes the contents of the buffer to the stream and clears it.
+  bool drain();
+
+  tclib::OutStream *dest_;
+  size_t buffer_size_;
+  bool sized_containers_;
+  bool references_;
+  bool canonical_;
+  bool columnar_;
+  bool has_failed_;
+  // The number of arrays and maps that have been begun but not ended.
+  size_t open_depth_;
+  // Hash of the data that has been written to the stream.
+  ContentHasher hasher_;
+  // The number of bytes written to the stream so far.
+  uint64_t drained_;
+  Assembler assm_;
+  VariantWriter *writer_;
 };
 
 // The syntaxes text can be formatted as.
@@ -128,25 +552,210 @@ private:
 
 class AbstractTypeRegistry;
 
+// Describes why decoding binary plankton failed.
+class DecodeError {
+public:
+  // The reasons decoding can fail.
+  enum Cause {
+    // Decoding didn't fail.
+    NONE,
+    // The input ended in the middle of a value.
+    TRUNCATED,
+    // An instruction had an unknown opcode.
+    UNKNOWN_OPCODE,
+    // An instruction's payload was malformed, for instance a count that
+    // doesn't fit in 32 bits or an identity token of an unsupported size.
+    INVALID_PAYLOAD,
+    // A string wasn't validly encoded. Only checked if the reader has been
+    // asked to validate strings.
+    INVALID_ENCODING,
+    // Containers were nested deeper than the reader allows.
+    TOO_DEEP,
+    // A container's recorded size didn't match the size of its contents.
+    SIZE_MISMATCH,
+    // There was more input after the value.
+    TRAILING_DATA
+  };
+
+  DecodeError()
+    : cause_(NONE)
+    , offset_(0)
+    , opcode_(-1) { }
+
+  DecodeError(Cause cause, size_t offset, int opcode)
+    : cause_(cause)
+    , offset_(offset)
+    , opcode_(opcode) { }
+
+  // Returns the reason decoding failed.
+  Cause cause() const { return cause_; }
+
+  // Returns the byte offset within the input of the instruction where
+  // decoding failed.
+  size_t offset() const { return offset_; }
+
+  // Returns the opcode of the offending instruction, or -1 if decoding failed
+  // at the end of the input.
+  int opcode() const { return opcode_; }
+
+  // Returns a human-readable description of the cause.
+  const char *reason() const;
+
+private:
+  Cause cause_;
+  size_t offset_;
+  int opcode_;
+};
+
 // Utility for reading variant values from serialized data.
 class BinaryReader {
 public:
   // Creates a new reader that allocates values from the given arena.
   BinaryReader(Factory *factory);
 
-  // Deserializes the given input and returns the result as a variant.
+  // Deserializes the given input and returns the result as a variant. The
+  // input is validated while it is being decoded; if it is invalid null is
+  // returned and has_failed() and error() can be used to inspect what went
+  // wrong. Input that holds more than a single value is invalid.
   Variant parse(const void *data, size_t size);
 
+  // Deserializes the value at the beginning of the given input, which may be
+  // followed by more data, and stores the number of bytes it took up in the
+  // given out parameter. This can be used to walk through a stream of values
+  // written back to back. If the input is invalid null is returned, the size
+  // is set to 0, and has_failed() and error() tell what went wrong.
+  Variant parse_next(const void *data, size_t size, size_t *size_out);
+
+  // Deserializes all the values in the given input, which must consist of
+  // zero or more values written back to back, and returns them as an array.
+  // This is cheaper than calling parse_next for each one since the decoding
+  // state is shared between them. If the input is invalid null is returned
+  // and has_failed() and error() tell what went wrong; the error's offset is
+  // relative to the beginning of the whole input.
+  Array parse_all(const void *data, size_t size);
+
+  // Returns true iff the last parse failed. If parse hasn't been called at all
+  // returns false.
+  bool has_failed() { return error_.cause() != DecodeError::NONE; }
+
+  // If has_failed() returns true this describes why parsing failed.
+  const DecodeError &error() { return error_; }
+
   // Sets the type registry to use to resolve types during parsing.
   void set_type_registry(AbstractTypeRegistry *value) { type_registry_ = value; }
 
+  // Sets whether decoded strings and blobs should borrow their contents from
+  // the input rather than copying them into the factory. In borrowed mode the
+  // values point directly into the data passed to parse so the caller must
+  // ensure that the data stays alive and unchanged as long as the values are
+  // used, for instance by parsing directly out of a mapped file or a message
+  // buffer that is retained along with the result. Note that borrowed strings
+  // are not null-terminated. Strings with a non-default encoding are always
+  // copied since external strings can't carry an encoding.
+  void set_borrow_input(bool value) { borrow_input_ = value; }
+
+  // The default maximum nesting depth.
+  static const size_t kDefaultMaxDepth = 1024;
+
+  // Sets the maximum depth to which containers can be nested within each other
+  // in the input; parsing fails on input nested deeper than that. Nesting
+  // doesn't use the native stack so the limit can be set as high as the
+  // memory to hold the decoding state allows.
+  void set_max_depth(size_t value) { max_depth_ = value; }
+
+  // Inputs smaller than this are always decoded on the calling thread.
+  static const size_t kMinParallelInputSize = 64 * 1024;
+
+  // Sets the number of threads to use when decoding large inputs whose value
+  // is an array. The elements are split into slices that are decoded by
+  // separate threads, each into its own arena; the arenas are then adopted by
+  // this reader's factory and the elements stitched together into a single
+  // array. The default, 1, decodes everything on the calling thread. Note that
+  // the type registry, if there is one, will be used from several threads at
+  // once.
+  void set_thread_count(size_t value) { thread_count_ = value; }
+
+  // Sets whether to lay out decoded values compactly. In compact mode the
+  // input is scanned up front to determine how much memory the result needs,
+  // that much is reserved in the factory as one block, and the values are then
+  // laid out within it in the order they appear in the input, with containers
+  // sized exactly. This costs an extra pass over the input but gives better
+  // locality when traversing the result and wastes less memory.
+  void set_compact_layout(bool value) { compact_layout_ = value; }
+
+  // Sets whether to check that strings whose encoding is UTF-8, including
+  // those with the default encoding, or US-ASCII are valid. The check is done
+  // while the characters are being copied out of the input. Strings that turn
+  // out to be all ascii are marked as such, except in borrowed mode where the
+  // strings aren't copied and so can't be marked.
+  void set_validate_strings(bool value) { validate_strings_ = value; }
+
+  // Sets the dictionary used to resolve strings written as their index by a
+  // writer with a dictionary, see BinaryWriter::set_string_dictionary. The
+  // strings read in full are added to the dictionary after each value. The
+  // factory adopts the dictionary's arena so strings read from the dictionary
+  // stay valid after it changes. Input isn't decoded in parallel while a
+  // dictionary is set.
+  void set_string_dictionary(StringDictionary *value) { string_dictionary_ = value; }
+
   // Returns true iff the given input is valid binary plankton.
   static bool validate(const void *data, size_t size);
 
+  // Returns the size in bytes of the value at the beginning of the given data,
+  // or 0 if the data doesn't start with a valid value. Containers that were
+  // written with their sizes are skipped without scanning their contents.
+  static size_t value_size(const void *data, size_t size);
+
 private:
   friend class BinaryReaderImpl;
+  friend class ParallelDecodeSlice;
+
+  // Parses the given input using several threads if it is suitable for that.
+  // Returns false if the input wasn't suitable and must be parsed the usual
+  // way.
+  bool parse_parallel(const uint8_t *data, size_t size, Variant *result_out);
+
+  // If this reader is in compact mode, reserves the memory needed to decode
+  // the given input within the factory. Nothing is reserved unless the input
+  // consists of complete values.
+  void reserve_layout(const uint8_t *data, size_t size);
+
+  // Reserves the memory needed to decode the given input which is known to
+  // consist of complete values.
+  void reserve_checked_layout(const uint8_t *data, size_t size);
+
   Factory *factory_;
   AbstractTypeRegistry *type_registry_;
+  bool borrow_input_;
+  size_t max_depth_;
+  size_t thread_count_;
+  bool compact_layout_;
+  bool validate_strings_;
+  StringDictionary *string_dictionary_;
+  DecodeError error_;
+};
+
+// A value that has already been encoded as binary plankton, for instance a
+// fragment held by a cache. Embedding it as a native in a larger value lets it
+// be written without decoding it and encoding it again. Use
+// Factory::new_preencoded to create one.
+class Preencoded {
+public:
+  Preencoded(Blob encoded) : encoded_(encoded) { }
+
+  // Returns the encoded value.
+  Blob encoded() { return encoded_; }
+
+  // The seed type for preencoded values.
+  static SeedType<Preencoded> *seed_type() { return &kSeedType; }
+
+private:
+  // Writers that can't splice in the encoded value write it decoded.
+  static Variant decode(Preencoded *value, Factory *factory);
+  static Blob get_encoded(Preencoded *value) { return value->encoded_; }
+
+  static SeedType<Preencoded> kSeedType;
+  Blob encoded_;
 };
 
 // Represents a syntax error while parsing text input. If parsing fails an
@@ -197,12 +806,18 @@ public:
   // does.
   SyntaxError *error() { return error_; }
 
+  // Sets whether to check that strings are valid UTF-8, after escapes have
+  // been resolved. An invalid string causes a syntax error just after it.
+  // Strings that turn out to be all ascii are marked as such.
+  void set_validate_strings(bool value) { validate_strings_ = value; }
+
 protected:
   friend class TextReaderImpl;
   Factory *factory_;
   Arena *scratch_arena_;
   TextSyntax syntax_;
   SyntaxError *error_;
+  bool validate_strings_;
 };
 
 
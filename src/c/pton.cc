@@ -31,10 +31,30 @@ void disass_instr(pton_instr_t *instr, string_buffer_t *buf) {
       break;
     }
     case PTON_OPCODE_BEGIN_ARRAY:
-      string_buffer_printf(buf, "begin_array:%i", instr->payload.array_length);
+      if (instr->is_open) {
+        string_buffer_printf(buf, "begin_open_array");
+      } else {
+        string_buffer_printf(buf, "begin_array:%i", instr->payload.array_length);
+      }
       break;
     case PTON_OPCODE_BEGIN_MAP:
-      string_buffer_printf(buf, "begin_map:%i", instr->payload.map_size);
+      if (instr->is_open) {
+        string_buffer_printf(buf, "begin_open_map");
+      } else {
+        string_buffer_printf(buf, "begin_map:%i", instr->payload.map_size);
+      }
+      break;
+    case PTON_OPCODE_END:
+      string_buffer_printf(buf, "end");
+      break;
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      string_buffer_printf(buf, "begin_columns:%i:%i:%i",
+          instr->payload.columns_data.rowc, instr->payload.columns_data.headerc,
+          instr->payload.columns_data.keyc);
+      break;
+    case PTON_OPCODE_DELTA_ARRAY:
+      string_buffer_printf(buf, "delta_array:%i",
+          instr->payload.delta_array_data.count);
       break;
     case PTON_OPCODE_BEGIN_SEED:
       string_buffer_printf(buf, "begin_seed:%i:%i", instr->payload.seed_data.headerc,
@@ -49,6 +69,12 @@ void disass_instr(pton_instr_t *instr, string_buffer_t *buf) {
     case PTON_OPCODE_REFERENCE:
       string_buffer_printf(buf, "get_ref:%i", instr->payload.reference_offset);
       break;
+    case PTON_OPCODE_DICTIONARY_STRING:
+      string_buffer_printf(buf, "dict_string:%i", instr->payload.dictionary_index);
+      break;
+    case PTON_OPCODE_INDEXED_VALUES:
+      string_buffer_printf(buf, "indexed_values");
+      break;
     default:
       string_buffer_printf(buf, "unknown (%i)", instr->opcode);
       break;
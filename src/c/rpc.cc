@@ -29,14 +29,15 @@ public:
   RequestMessage(OutgoingRequest *request, uint64_t serial)
     : request_(*request)
     , serial_(serial) { }
-  static SeedType<RequestMessage> *seed_type() { return &kSeedType; }
+  static StreamingSeedType<RequestMessage> *seed_type() { return &kSeedType; }
   OutgoingRequest &request() { return request_; }
   uint64_t serial() { return serial_; }
 public:
   Variant to_seed(Factory *factory);
+  bool encode_to(Assembler *assm);
   static RequestMessage *new_instance(Variant header, Factory *factory);
-  void init(Seed payload, Factory *factory);
-  static SeedType<RequestMessage> kSeedType;
+  void on_field(Variant key, Variant value, Factory *factory);
+  static StreamingSeedType<RequestMessage> kSeedType;
   OutgoingRequest request_;
   uint64_t serial_;
 };
@@ -45,20 +46,40 @@ public:
 }
 }
 
-SeedType<RequestMessage> RequestMessage::kSeedType("rpc.Request",
-    RequestMessage::new_instance,
-    new_callback(&RequestMessage::init),
-    new_callback(&RequestMessage::to_seed));
+StreamingSeedType<RequestMessage> RequestMessage::kSeedType("rpc.Request");
 
 RequestMessage *RequestMessage::new_instance(Variant header, Factory *factory) {
   return factory->register_destructor(new (factory) RequestMessage());
 }
 
-void RequestMessage::init(Seed payload, Factory *factory) {
-  serial_ = payload.get_field("serial").integer_value();
-  request().set_subject(payload.get_field("subject"));
-  request().set_selector(payload.get_field("selector"));
-  request().set_arguments(payload.get_field("arguments"));
+void RequestMessage::on_field(Variant key, Variant value, Factory *factory) {
+  if (key == Variant("serial")) {
+    serial_ = value.integer_value();
+  } else if (key == Variant("subject")) {
+    request().set_subject(value);
+  } else if (key == Variant("selector")) {
+    request().set_selector(value);
+  } else if (key == Variant("arguments")) {
+    request().set_arguments(value);
+  }
+}
+
+// Writes a field key given as a string literal.
+static bool emit_key(Assembler *assm, const char *key) {
+  return assm->emit_default_string(key, static_cast<uint32_t>(strlen(key)));
+}
+
+bool RequestMessage::encode_to(Assembler *assm) {
+  return assm->begin_seed(1, 4)
+      && BinaryWriter::write_to(assm, seed_type()->header())
+      && emit_key(assm, "serial")
+      && assm->emit_int64(serial_)
+      && emit_key(assm, "subject")
+      && BinaryWriter::write_to(assm, request().subject())
+      && emit_key(assm, "selector")
+      && BinaryWriter::write_to(assm, request().selector())
+      && emit_key(assm, "arguments")
+      && BinaryWriter::write_to(assm, request().arguments());
 }
 
 Variant RequestMessage::to_seed(Factory *factory) {
@@ -173,12 +194,14 @@ public:
     , serial_(serial) { }
   uint64_t serial() { return serial_; }
   OutgoingResponse &response() { return response_; }
-  static SeedType<ResponseMessage> *seed_type() { return &kSeedType; }
+  static StreamingSeedType<ResponseMessage> *seed_type() { return &kSeedType; }
 private:
+  friend class plankton::StreamingSeedType<ResponseMessage>;
   Variant to_seed(Factory *factory);
+  bool encode_to(Assembler *assm);
   static ResponseMessage *new_instance(Variant header, Factory *factory);
-  void init(Seed payload, Factory *factory);
-  static SeedType<ResponseMessage> kSeedType;
+  void on_field(Variant key, Variant value, Factory *factory);
+  static StreamingSeedType<ResponseMessage> kSeedType;
   OutgoingResponse response_;
   uint64_t serial_;
 };
@@ -187,21 +210,39 @@ private:
 }
 }
 
-SeedType<ResponseMessage> ResponseMessage::kSeedType("rpc.Response",
-    ResponseMessage::new_instance,
-    new_callback(&ResponseMessage::init),
-    new_callback(&ResponseMessage::to_seed));
+StreamingSeedType<ResponseMessage> ResponseMessage::kSeedType("rpc.Response");
 
 ResponseMessage *ResponseMessage::new_instance(Variant header, Factory *factory) {
   return factory->register_destructor(new (factory) ResponseMessage());
 }
 
-void ResponseMessage::init(Seed payload, Factory *factory) {
-  serial_ = payload.get_field("serial").integer_value();
-  OutgoingResponse::Status status = payload.get_field("is_success").bool_value()
-      ? OutgoingResponse::SUCCESS
-      : OutgoingResponse::FAILURE;
-  response_ = OutgoingResponse(status, payload.get_field("payload"));
+void ResponseMessage::on_field(Variant key, Variant value, Factory *factory) {
+  // The status and payload can arrive in any order so the response is
+  // rebuilt from the current one for each.
+  if (key == Variant("serial")) {
+    serial_ = value.integer_value();
+  } else if (key == Variant("is_success")) {
+    OutgoingResponse::Status status = value.bool_value()
+        ? OutgoingResponse::SUCCESS
+        : OutgoingResponse::FAILURE;
+    response_ = OutgoingResponse(status, response_.payload());
+  } else if (key == Variant("payload")) {
+    OutgoingResponse::Status status = response_.is_success()
+        ? OutgoingResponse::SUCCESS
+        : OutgoingResponse::FAILURE;
+    response_ = OutgoingResponse(status, value);
+  }
+}
+
+bool ResponseMessage::encode_to(Assembler *assm) {
+  return assm->begin_seed(1, 3)
+      && BinaryWriter::write_to(assm, seed_type()->header())
+      && emit_key(assm, "serial")
+      && assm->emit_int64(serial_)
+      && emit_key(assm, "is_success")
+      && assm->emit_bool(response().is_success())
+      && emit_key(assm, "payload")
+      && BinaryWriter::write_to(assm, response().payload());
 }
 
 Variant ResponseMessage::to_seed(Factory *factory) {
@@ -18,12 +18,135 @@ namespace plankton {
 
 static const byte_t kSetDefaultStringEncoding = 1;
 static const byte_t kSendValue = 2;
+static const byte_t kSetStringDictionarySize = 3;
+static const byte_t kSendDeltaBase = 4;
+static const byte_t kSendDelta = 5;
+static const byte_t kSetCompression = 6;
+
+// The codecs value frames can be compressed with.
+static const uint32_t kNoCompression = 0;
+static const uint32_t kLzCompression = 1;
+
+// Utility class that wraps a binary stream id and adds the functionality you
+// need in order to use one as the key in a hash map.
+class StreamId {
+public:
+  // Creates a new stream id for the stream with the given binary key.
+  StreamId(byte_t *raw_key, size_t key_size, bool owns_key);
+
+  // Returns true iff this and the given stream id wrap identical binary keys.
+  bool operator==(const StreamId &that) const;
+
+  // Returns true iff the binary key is lexically less than the given one.
+  bool operator<(const StreamId &that) const;
+
+  // Returns a hash of the underlying key.
+  size_t hash_code() const { return hash_code_; }
+
+  // Helper class that tells the hash map how to hash ids.
+  class Hasher {
+  public:
+    size_t operator()(const StreamId &id) const { return id.hash_code(); }
+
+    // See http://msdn.microsoft.com/en-us/library/1s1byw77.aspx.
+    static const size_t bucket_size = 4;
+
+    // The MSVC hash map needs the keys to be ordered using this operator. Wut?
+    bool operator()(const StreamId &a, const StreamId &b) { return a < b; }
+  };
+
+  // Stream ids are passed around by value so they don't need a destructor.
+  // Sometimes though we need to be sure the underlying data is disposed and
+  // that's what this method does.
+  void dispose();
+
+private:
+  byte_t *raw_key_;
+  size_t key_size_;
+  size_t hash_code_;
+  bool owns_key_;
+};
+
+// Utilities for describing how one value differs from another as a patch that
+// can be applied to the first value to get the second. A patch is a plain
+// value itself so it can be encoded like any other. A patch node is an array
+// whose first element is the kind of change:
+//
+//   [kReplace, value]: the value is replaced wholesale.
+//   [kEditMap, removed_keys, changes]: the given keys are removed from a map
+//     and the value of each key in the changes map is patched by the node it
+//     maps to.
+//   [kEditSeed, removed_keys, changes]: same as for maps but for the fields of
+//     a seed whose header is unchanged.
+//   [kEditArray, changes]: each index in the changes map is patched by the
+//     node it maps to. The array's length is unchanged.
+//   [kSpliceArray, start, delete_count, inserted]: delete_count elements from
+//     start are replaced by the elements of the inserted array.
+//   [kUnchanged]: the value is unchanged.
+class ValuePatch {
+public:
+  enum Kind {
+    kUnchanged = 0,
+    kReplace = 1,
+    kEditMap = 2,
+    kEditSeed = 3,
+    kEditArray = 4,
+    kSpliceArray = 5
+  };
+
+  // Returns a deep copy of the given value allocated in the given factory.
+  // Native values are replaced by their encoded seeds so the result is always
+  // plain data.
+  static Variant copy(Variant value, Factory *factory);
+
+  // Returns a patch that turns the old value into the new one. The old value
+  // must be plain data, for instance the result of copying; natives in the new
+  // value are diffed as their encoded seeds. The patch may share structure
+  // with the new value.
+  static Variant diff(Variant old_value, Variant new_value, Factory *factory);
+
+  // Applies the given patch to the given value, storing the result in the out
+  // parameter. The value itself is not changed; containers that are changed by
+  // the patch are copied and the rest is shared with the original, so the cost
+  // is proportional to the size of the changed containers and the patch, not
+  // the whole value. Returns false if the patch doesn't match the value.
+  static bool apply(Variant value, Variant patch, Factory *factory,
+      Variant *result_out);
+
+  // Returns true iff the two values are structurally equal.
+  static bool equals(Variant a, Variant b);
+
+private:
+  // Returns the patch node for the given pair of values, or null if they're
+  // equal.
+  static Variant diff_node(Variant old_value, Variant new_value, Factory *factory);
+
+  // Diffs the mappings of two maps or the fields of two seeds, adding the
+  // removed keys and the changes to the given collections. Returns true iff
+  // anything changed.
+  static bool diff_mappings(Variant old_value, Variant new_value,
+      Array removed, Map changes, Factory *factory);
+
+  // Returns the patch node for two arrays, or null if they're equal.
+  static Variant diff_arrays(Array old_value, Array new_value, Factory *factory);
+
+  // Looks up the given key in a map or seed, storing the value in the out
+  // parameter. The cursor is where the search starts and is left just past
+  // the mapping that was found. Returns true iff the key was found.
+  static bool find_mapping(Variant container, Map_Iterator *cursor, Variant key,
+      Variant *value_out);
+
+  // Adds the mappings of the given map or seed, with the changes of a patch
+  // applied, to the target.
+  static bool apply_mappings(Variant value, Array removed, Map changes,
+      Factory *factory, Variant target);
+};
 
 class OutputSocket : public tclib::DefaultDestructable {
 public:
   // Create a new output socket that writes to the given stream.
   OutputSocket(tclib::OutStream *dest);
-  virtual ~OutputSocket() { }
+  virtual ~OutputSocket();
   virtual void default_destroy() { tclib::default_delete_concrete(this); }
 
   // Write the stream header.
@@ -33,6 +156,32 @@ public:
   // be done before init is called. The default encoding is utf-8.
   bool set_default_string_encoding(pton_charset_t value);
 
+  // Sets the number of strings to keep in each stream's string dictionary. If
+  // it is nonzero, strings that have been sent on a stream before, and are
+  // still in the stream's dictionary, are sent as their index. This must be
+  // done before init is called and the receiving socket must understand
+  // string dictionaries. The default, 0, sends all strings in full. Sizes
+  // above StringDictionary::kMaxCapacity are rejected.
+  bool set_string_dictionary_size(uint32_t value);
+
+  // Sets the size in bytes above which encoded values are compressed. If it is
+  // nonzero, values at least that large are compressed with the in-tree LZ
+  // codec whenever that makes them smaller. This must be done before init is
+  // called and the receiving socket must understand compression. The default,
+  // 0, never compresses.
+  bool set_compression_threshold(uint32_t value);
+
+  // Sets how values are sent when the same stream is sent many similar values.
+  // If the interval is nonzero each value is sent as a patch against the
+  // previous value sent on the same stream, whenever the patch is smaller than
+  // the last full value, and every interval'th value is sent in full. The
+  // receiving stream rebuilds the values from the patches and only keeps the
+  // values since the last full one so the interval bounds the memory used on
+  // both ends. Natives are sent as their seeds, which the receiving stream
+  // resolves through its type registry. The default, 0, sends every value in
+  // full.
+  void set_delta_resync_interval(uint32_t value) { delta_resync_interval_ = value; }
+
   // Sends the given value to the default stream.
   void send_value(Variant value, Variant stream_id = Variant::null());
 
@@ -40,8 +189,6 @@ private:
   // Writes the given raw data to the destination.
   void write_blob(byte_t *data, size_t size);
 
-  // Serializes and writes the given value.
-  void write_value(Variant value);
 
   // Writes a single byte to the destination.
   void write_byte(byte_t value);
@@ -54,18 +201,82 @@ private:
 
   void flush();
 
+  // Writes the data currently held by the given writer.
+  void write_encoded(BinaryWriter *writer);
+
+  // Writes the value currently held by the given writer, compressed if
+  // compression is enabled and the value is large enough.
+  void write_value_frame(BinaryWriter *writer);
+
+  // What we keep track of for each stream values are sent to.
+  struct StreamState {
+    StreamState()
+      : dictionary(NULL)
+      , delta_arena(NULL)
+      , delta_count(0)
+      , base_size(0) { }
+
+    // The stream's string dictionary, if there is one.
+    StringDictionary *dictionary;
+
+    // The arena holding the copy of the last value sent, if values are sent
+    // as patches.
+    Arena *delta_arena;
+
+    // The last value sent.
+    Variant last_value;
+
+    // The number of values sent since the last full one.
+    uint32_t delta_count;
+
+    // The encoded size of the last full value sent.
+    size_t base_size;
+  };
+
+  // Returns the state of the stream whose encoded id is held by the id
+  // writer, creating it if necessary.
+  StreamState *get_stream_state();
+
+  // Encodes the given value for the given stream, either in full or as a
+  // patch against the previous value sent, and returns the opcode to send it
+  // with.
+  byte_t encode_delta_value(Variant value, StreamState *stream);
+
+  typedef platform_hash_map<StreamId, StreamState*, StreamId::Hasher> StreamStateMap;
+
   tclib::OutStream *dest_;
+  // Reused for all the values written to this socket.
+  BinaryWriter writer_;
+  // Reused for the ids of the streams values are sent to.
+  BinaryWriter id_writer_;
   size_t cursor_;
   pton_charset_t default_encoding_;
+  uint32_t string_dictionary_size_;
+  uint32_t delta_resync_interval_;
+  uint32_t compression_threshold_;
+  // Reused for compressing values.
+  std::vector<byte_t> compressed_;
+  StreamStateMap streams_;
   bool has_been_inited_;
 };
 
 // The raw binary data associated with a message sent on a stream.
 class MessageData {
 public:
-  MessageData(byte_t *data, size_t size)
+  // The different ways a message's data can relate to the value it carries.
+  enum Kind {
+    // The data encodes the value.
+    VALUE,
+    // The data encodes the value which later deltas will be relative to.
+    DELTA_BASE,
+    // The data encodes a patch against the previous value on the stream.
+    DELTA
+  };
+
+  MessageData(byte_t *data, size_t size, Kind kind = VALUE)
     : data_(data)
-    , size_(size) { }
+    , size_(size)
+    , kind_(kind) { }
 
   ~MessageData() { delete[] data_; }
 
@@ -75,49 +286,13 @@ public:
   // Returns the size in bytes of the message data.
   size_t size() { return size_; }
 
+  // Returns how the data relates to the message's value.
+  Kind kind() { return kind_; }
+
 private:
   byte_t *data_;
   size_t size_;
-};
-
-// Utility class that wraps a binary stream id and adds the functionality you
-// need in order to use one as the key in a hash map.
-class StreamId {
-public:
-  // Creates a new stream id for the stream with the given binary key.
-  StreamId(byte_t *raw_key, size_t key_size, bool owns_key);
-
-  // Returns true iff this and the given stream id wrap identical binary keys.
-  bool operator==(const StreamId &that) const;
-
-  // Returns true iff the binary key is lexically less than the given one.
-  bool operator<(const StreamId &that) const;
-
-  // Returns a hash of the underlying key.
-  size_t hash_code() const { return hash_code_; }
-
-  // Helper class that tells the hash map how to hash ids.
-  class Hasher {
-  public:
-    size_t operator()(const StreamId &id) const { return id.hash_code(); }
-
-    // See http://msdn.microsoft.com/en-us/library/1s1byw77.aspx.
-    static const size_t bucket_size = 4;
-
-    // The MSVC hash map needs the keys to be ordered using this operator. Wut?
-    bool operator()(const StreamId &a, const StreamId &b) { return a < b; }
-  };
-
-  // Stream ids are passed around by value so they don't need a destructor.
-  // Sometimes though we need to be sure the underlying data is disposed and
-  // that's what this method does.
-  void dispose();
-
-private:
-  byte_t *raw_key_;
-  size_t key_size_;
-  size_t hash_code_;
-  bool owns_key_;
+  Kind kind_;
 };
 
 // Data used when initializing new streams.
@@ -137,16 +312,41 @@ private:
 // socket.
 class InputStream {
 public:
-  InputStream(InputStreamConfig *config) : id_(config->id()) { }
-  virtual ~InputStream() { }
+  InputStream(InputStreamConfig *config)
+    : id_(config->id())
+    , string_dictionary_(NULL)
+    , delta_arena_(NULL) { }
+  virtual ~InputStream();
 
   // Called by the socket when a new value with this stream as its destination
   // has been received. Ownership of the message is passed to this stream so
   // it is the stream's responsibility to destroy it once it's no longer needed.
   virtual void receive_block(MessageData *message) = 0;
 
+  // Called by the socket when the sender announces that strings sent on this
+  // stream may refer to a string dictionary of the given size.
+  void set_string_dictionary_size(uint32_t value);
+
+protected:
+  // Returns the dictionary to decode the messages on this stream with, or
+  // NULL if there is none. Messages must be decoded in the order they were
+  // received for the dictionary to stay in sync with the sender's.
+  StringDictionary *string_dictionary() { return string_dictionary_; }
+
+  // Decodes the given message, acquiring storage from the given factory and
+  // resolving seeds through the given type registry. Deltas are applied to the
+  // previous value on this stream so messages must be decoded in the order
+  // they were received. Returns null if the message couldn't be decoded.
+  Variant decode_message(MessageData *message, Factory *factory,
+      TypeRegistry *type_registry);
+
 private:
   StreamId id_;
+  StringDictionary *string_dictionary_;
+  // Holds the values received since the last delta base.
+  Arena *delta_arena_;
+  // The most recent value the next delta will be applied to.
+  Variant delta_value_;
 };
 
 // An input stream that buffers blocks as they come in and lets clients pull
@@ -298,6 +498,10 @@ private:
   // Reads the next block of data.
   byte_t *read_value(size_t *size_out, bool *at_eof_out);
 
+  // Reads the next value frame, decompressing it if necessary. Returns NULL if
+  // the frame is invalid.
+  byte_t *read_value_frame(size_t *size_out, bool *at_eof_out);
+
   // The default stream factory function.
   static InputStream *new_default_stream(InputStreamConfig *config);
 
@@ -308,6 +512,10 @@ private:
   // found.
   InputStream *get_stream(StreamId id);
 
+  // Creates and records a stream with the given id, set up according to the
+  // instructions processed so far.
+  InputStream *add_stream(StreamId id);
+
   typedef platform_hash_map<StreamId, InputStream*, StreamId::Hasher> StreamMap;
 
   tclib::InStream *src_;
@@ -316,6 +524,9 @@ private:
   InputStreamFactory stream_factory_;
   StreamMap streams_;
   TypeRegistry *default_type_registry_;
+  uint32_t compression_;
+  // The size of the string dictionary of each stream, as set by the peer.
+  uint32_t string_dictionary_size_;
 };
 
 } // namespace plankton
@@ -0,0 +1,360 @@
+//- Copyright 2015 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Direct encoding and decoding of C++ structs.
+///
+/// A struct that lists its fields using PLANKTON_FIELDS can be written
+/// straight to an assembler and read straight back from binary plankton
+/// without going through an intermediate variant tree:
+///
+///   struct Point {
+///     int64_t x;
+///     int64_t y;
+///     PLANKTON_FIELDS(Point, "geo.Point", x, y)
+///   };
+///
+///   StructCodec<Point>::encode(&assm, point);
+///   StructCodec<Point>::decode(&in, &point);
+///
+/// A struct is encoded as a seed with the given header and a field for each
+/// member, named like the member, so it can also be read as a plain seed and a
+/// seed written some other way can be read as a struct. Each field is encoded
+/// according to its C++ type which is resolved at compile time: integers,
+/// bools, std::string, std::vector of any supported type, and other structs
+/// with PLANKTON_FIELDS are supported.
+
+#ifndef _STRUCT_CODEC_HH
+#define _STRUCT_CODEC_HH
+
+#include "plankton.hh"
+
+#include <string>
+#include <vector>
+
+namespace plankton {
+
+// Reads binary plankton one instruction at a time.
+class InstrReader {
+public:
+  InstrReader(const void *data, size_t size)
+    : data_(static_cast<const uint8_t*>(data))
+    , size_(size)
+    , cursor_(0) { }
+
+  // Decodes the next instruction into the out parameter and moves past it.
+  // Returns false if the input is invalid or there is no more input.
+  bool next(pton_instr_t *instr_out) {
+    if (!pton_decode_next_instruction(data_ + cursor_, size_ - cursor_, instr_out))
+      return false;
+    cursor_ += instr_out->size;
+    return true;
+  }
+
+  // Moves past the next value without decoding it. Returns false if the input
+  // doesn't start with a valid value.
+  bool skip_value() {
+    size_t size = BinaryReader::value_size(data_ + cursor_, size_ - cursor_);
+    cursor_ += size;
+    return size > 0;
+  }
+
+  // Returns true iff all of the input has been read.
+  bool at_end() { return cursor_ == size_; }
+
+  // Returns the number of bytes of input that haven't been read yet.
+  size_t remaining() { return size_ - cursor_; }
+
+private:
+  const uint8_t *data_;
+  size_t size_;
+  size_t cursor_;
+};
+
+// Encodes and decodes values of type T. This general version handles structs
+// with PLANKTON_FIELDS; the specializations below handle the other supported
+// field types.
+template <typename T>
+class StructCodec {
+public:
+  // Writes the given value to the given assembler. Returns true iff writing
+  // succeeded.
+  static bool encode(Assembler *assm, const T &value);
+
+  // Reads a value from the given input into the out parameter. Fields that
+  // aren't present in the input are left unchanged and fields the struct
+  // doesn't have are skipped. Returns false if the input doesn't hold a seed
+  // with the struct's header or a field has the wrong type. The input must be
+  // in the form written by encode or a binary writer without references,
+  // dictionaries, or columns.
+  static bool decode(InstrReader *in, T *value_out);
+
+private:
+  // Counts the fields of a struct.
+  class FieldCounter {
+  public:
+    FieldCounter() : count(0) { }
+    template <typename F>
+    void visit(const char *name, F *field) { count++; }
+    uint32_t count;
+  };
+
+  // Writes each field of a struct as a key and value.
+  class FieldEncoder {
+  public:
+    FieldEncoder(Assembler *assm) : assm_(assm), succeeded(true) { }
+    template <typename F>
+    void visit(const char *name, const F *field) {
+      succeeded = succeeded
+          && assm_->emit_default_string(name, static_cast<uint32_t>(strlen(name)))
+          && StructCodec<F>::encode(assm_, *field);
+    }
+  private:
+    Assembler *assm_;
+  public:
+    bool succeeded;
+  };
+
+  // Decodes the value of the field with a given key. The fields of two
+  // versions of the same struct are usually in the same order so the field
+  // after the last one that was decoded is tried before the others.
+  class FieldDecoder {
+  public:
+    FieldDecoder(InstrReader *in, const uint8_t *key, uint32_t key_length,
+        uint32_t expected)
+      : in_(in)
+      , key_(key)
+      , key_length_(key_length)
+      , expected_(expected)
+      , index_(0)
+      , found(false)
+      , succeeded(true)
+      , found_index(0) { }
+    template <typename F>
+    void visit(const char *name, F *field) {
+      uint32_t index = index_++;
+      if (found || (expected_ != kAnyIndex && index != expected_))
+        return;
+      if (strlen(name) != key_length_ || memcmp(name, key_, key_length_) != 0)
+        return;
+      found = true;
+      found_index = index;
+      succeeded = StructCodec<F>::decode(in_, field);
+    }
+    static const uint32_t kAnyIndex = ~0u;
+  private:
+    InstrReader *in_;
+    const uint8_t *key_;
+    uint32_t key_length_;
+    uint32_t expected_;
+    uint32_t index_;
+  public:
+    bool found;
+    bool succeeded;
+    uint32_t found_index;
+  };
+};
+
+template <typename T>
+bool StructCodec<T>::encode(Assembler *assm, const T &value) {
+  FieldCounter counter;
+  T::pton_visit_fields(&value, &counter);
+  const char *header = T::pton_header();
+  if (!assm->begin_seed(1, counter.count)
+      || !assm->emit_default_string(header, static_cast<uint32_t>(strlen(header))))
+    return false;
+  FieldEncoder encoder(assm);
+  T::pton_visit_fields(&value, &encoder);
+  return encoder.succeeded;
+}
+
+template <typename T>
+bool StructCodec<T>::decode(InstrReader *in, T *value_out) {
+  pton_instr_t instr;
+  if (!in->next(&instr)
+      || instr.opcode != PTON_OPCODE_BEGIN_SEED
+      || instr.payload.seed_data.headerc != 1)
+    return false;
+  uint32_t fieldc = instr.payload.seed_data.fieldc;
+  const char *header = T::pton_header();
+  if (!in->next(&instr)
+      || instr.opcode != PTON_OPCODE_DEFAULT_STRING
+      || instr.payload.default_string_data.length != strlen(header)
+      || memcmp(instr.payload.default_string_data.contents, header,
+          instr.payload.default_string_data.length) != 0)
+    return false;
+  uint32_t expected = 0;
+  for (uint32_t i = 0; i < fieldc; i++) {
+    if (!in->next(&instr) || instr.opcode != PTON_OPCODE_DEFAULT_STRING)
+      return false;
+    const uint8_t *key = instr.payload.default_string_data.contents;
+    uint32_t key_length = instr.payload.default_string_data.length;
+    FieldDecoder decoder(in, key, key_length, expected);
+    T::pton_visit_fields(value_out, &decoder);
+    if (!decoder.found) {
+      FieldDecoder fallback(in, key, key_length, FieldDecoder::kAnyIndex);
+      T::pton_visit_fields(value_out, &fallback);
+      decoder = fallback;
+    }
+    if (!decoder.found) {
+      if (!in->skip_value())
+        return false;
+      continue;
+    }
+    if (!decoder.succeeded)
+      return false;
+    expected = decoder.found_index + 1;
+  }
+  return true;
+}
+
+// Integers are encoded as int64s. Decoding fails if the value doesn't fit.
+template <typename I>
+class IntegerStructCodec {
+public:
+  static bool encode(Assembler *assm, const I &value) {
+    return assm->emit_int64(static_cast<int64_t>(value));
+  }
+
+  static bool decode(InstrReader *in, I *value_out) {
+    pton_instr_t instr;
+    if (!in->next(&instr) || instr.opcode != PTON_OPCODE_INT64)
+      return false;
+    int64_t value = instr.payload.int64_value;
+    I result = static_cast<I>(value);
+    if (static_cast<int64_t>(result) != value)
+      return false;
+    *value_out = result;
+    return true;
+  }
+};
+
+template <> class StructCodec<int64_t> : public IntegerStructCodec<int64_t> { };
+template <> class StructCodec<int32_t> : public IntegerStructCodec<int32_t> { };
+template <> class StructCodec<uint32_t> : public IntegerStructCodec<uint32_t> { };
+template <> class StructCodec<int16_t> : public IntegerStructCodec<int16_t> { };
+template <> class StructCodec<uint16_t> : public IntegerStructCodec<uint16_t> { };
+template <> class StructCodec<int8_t> : public IntegerStructCodec<int8_t> { };
+template <> class StructCodec<uint8_t> : public IntegerStructCodec<uint8_t> { };
+
+template <>
+class StructCodec<bool> {
+public:
+  static bool encode(Assembler *assm, const bool &value) {
+    return assm->emit_bool(value);
+  }
+
+  static bool decode(InstrReader *in, bool *value_out) {
+    pton_instr_t instr;
+    if (!in->next(&instr) || instr.opcode != PTON_OPCODE_BOOL)
+      return false;
+    *value_out = instr.payload.bool_value;
+    return true;
+  }
+};
+
+// Strings are encoded in the default encoding and their contents are taken
+// as they are when decoding, whatever their encoding.
+template <>
+class StructCodec<std::string> {
+public:
+  static bool encode(Assembler *assm, const std::string &value) {
+    return assm->emit_default_string(value.data(),
+        static_cast<uint32_t>(value.size()));
+  }
+
+  static bool decode(InstrReader *in, std::string *value_out) {
+    pton_instr_t instr;
+    if (!in->next(&instr))
+      return false;
+    if (instr.opcode == PTON_OPCODE_DEFAULT_STRING) {
+      value_out->assign(
+          reinterpret_cast<const char*>(instr.payload.default_string_data.contents),
+          instr.payload.default_string_data.length);
+      return true;
+    } else if (instr.opcode == PTON_OPCODE_STRING_WITH_ENCODING) {
+      value_out->assign(
+          reinterpret_cast<const char*>(instr.payload.string_with_encoding_data.contents),
+          instr.payload.string_with_encoding_data.length);
+      return true;
+    }
+    return false;
+  }
+};
+
+template <typename E>
+class StructCodec< std::vector<E> > {
+public:
+  static bool encode(Assembler *assm, const std::vector<E> &value) {
+    if (!assm->begin_array(static_cast<uint32_t>(value.size())))
+      return false;
+    for (size_t i = 0; i < value.size(); i++) {
+      if (!StructCodec<E>::encode(assm, value[i]))
+        return false;
+    }
+    return true;
+  }
+
+  static bool decode(InstrReader *in, std::vector<E> *value_out) {
+    pton_instr_t instr;
+    if (!in->next(&instr)
+        || instr.opcode != PTON_OPCODE_BEGIN_ARRAY
+        || instr.is_open)
+      return false;
+    uint32_t length = instr.payload.array_length;
+    // Each element takes at least a byte so a length beyond what's left of the
+    // input can't be right, and would otherwise be allocated up front.
+    if (length > in->remaining())
+      return false;
+    value_out->clear();
+    value_out->reserve(length);
+    for (uint32_t i = 0; i < length; i++) {
+      value_out->push_back(E());
+      if (!StructCodec<E>::decode(in, &value_out->back()))
+        return false;
+    }
+    return true;
+  }
+};
+
+} // namespace plankton
+
+// Expands a macro for each of up to 16 arguments. The extra level of expansion
+// makes MSVC split __VA_ARGS__ into separate arguments.
+#define PTON_FIELDS_EXPAND(X) X
+#define PTON_FIELDS_EACH_1(M, A) M(A)
+#define PTON_FIELDS_EACH_2(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_1(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_3(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_2(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_4(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_3(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_5(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_4(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_6(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_5(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_7(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_6(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_8(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_7(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_9(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_8(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_10(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_9(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_11(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_10(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_12(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_11(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_13(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_12(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_14(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_13(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_15(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_14(M, __VA_ARGS__))
+#define PTON_FIELDS_EACH_16(M, A, ...) M(A) PTON_FIELDS_EXPAND(PTON_FIELDS_EACH_15(M, __VA_ARGS__))
+#define PTON_FIELDS_PICK_EACH(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12,   \
+    _13, _14, _15, _16, NAME, ...) NAME
+#define PTON_FIELDS_FOR_EACH(M, ...) PTON_FIELDS_EXPAND(PTON_FIELDS_PICK_EACH(__VA_ARGS__, \
+    PTON_FIELDS_EACH_16, PTON_FIELDS_EACH_15, PTON_FIELDS_EACH_14, PTON_FIELDS_EACH_13,    \
+    PTON_FIELDS_EACH_12, PTON_FIELDS_EACH_11, PTON_FIELDS_EACH_10, PTON_FIELDS_EACH_9,     \
+    PTON_FIELDS_EACH_8, PTON_FIELDS_EACH_7, PTON_FIELDS_EACH_6, PTON_FIELDS_EACH_5,        \
+    PTON_FIELDS_EACH_4, PTON_FIELDS_EACH_3, PTON_FIELDS_EACH_2, PTON_FIELDS_EACH_1)(M, __VA_ARGS__))
+
+#define PTON_FIELDS_VISIT_FIELD(F) visitor->visit(#F, &self->F);
+
+// Describes the fields of a struct to the struct codec. This must be placed
+// within the definition of the struct T, it uses the given header for the
+// seeds instances are encoded as, and lists up to 16 of the struct's fields.
+#define PLANKTON_FIELDS(T, HEADER, ...)                                        \
+  static const char *pton_header() { return HEADER; }                          \
+  template <typename S, typename V>                                            \
+  static void pton_visit_fields(S *self, V *visitor) {                         \
+    PTON_FIELDS_FOR_EACH(PTON_FIELDS_VISIT_FIELD, __VA_ARGS__)                       \
+  }
+
+#endif // _STRUCT_CODEC_HH
@@ -28,6 +28,18 @@ public:
   // necessary.
   void fill(const T &value, size_t count);
 
+
+  // Ensures that this buffer can hold 'size' additional elements without being
+  // reallocated, allocating exactly as much as is needed if it can't already.
+  void reserve(size_t size);
+
+  // Removes all the elements from this buffer but keeps the memory that held
+  // them.
+  void clear() { cursor_ = 0; }
+
+  // Removes the elements beyond the given length, keeping the memory.
+  void truncate(size_t length) { cursor_ = length; }
+
   // Returns the start of this buffer. The buffer is only valid until the next
   // modification to the buffer.
   T *operator*() { return data_; }
@@ -45,6 +57,10 @@ private:
   // Ensures that this buffer will hold at least 'size' additional elements.
   void ensure_capacity(size_t size);
 
+  // Moves the contents of this buffer into a new backing array of the given
+  // capacity.
+  void resize(size_t new_capacity);
+
   size_t capacity_;
   size_t cursor_;
   T *data_;
@@ -85,9 +101,21 @@ void Buffer<T>::write(const T *data, size_t count) {
 template <typename T>
 void Buffer<T>::ensure_capacity(size_t size) {
   size_t required = cursor_ + size;
-  if (required < capacity_)
+  if (required <= capacity_)
     return;
-  size_t new_capacity = (required < 128) ? 256 : (2 * required);
+  resize((required < 128) ? 256 : (2 * required));
+}
+
+template <typename T>
+void Buffer<T>::reserve(size_t size) {
+  size_t required = cursor_ + size;
+  if (required <= capacity_)
+    return;
+  resize(required);
+}
+
+template <typename T>
+void Buffer<T>::resize(size_t new_capacity) {
   T *new_data = new T[new_capacity];
   if (cursor_ > 0)
     memcpy(new_data, data_, sizeof(T) * cursor_);
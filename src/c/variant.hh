@@ -168,6 +168,14 @@ public:
   // Returns this string's encoding if this is a string, otherwise null.
   pton_charset_t string_encoding() const;
 
+  // Returns true if this is a string known to consist only of ascii
+  // characters.
+  bool string_is_ascii() const;
+
+  // Records that this mutable string consists only of ascii characters.
+  // Returns true iff marking succeeded.
+  bool string_mark_ascii();
+
   // If this variant is a blob, returns the number of bytes. If not, returns 0.
   uint32_t blob_size() const;
 
@@ -551,6 +559,12 @@ public:
   // Returns this string's characters.
   const char *chars() const { return string_chars(); }
 
+  // Returns true if this string is known to consist only of ascii characters.
+  bool is_ascii() const { return string_is_ascii(); }
+
+  // Records that this mutable string consists only of ascii characters.
+  bool mark_ascii() { return string_mark_ascii(); }
+
   // If this string is mutable, returns the mutable backing array. Otherwise
   // return NULL.
   char *mutable_chars() { return string_mutable_chars(); }
@@ -621,6 +635,10 @@ public:
   // Creates and returns a new map value.
   virtual Map new_map() = 0;
 
+  // Creates and returns a new map value with room for the given number of
+  // entries. The capacity is only a hint; by default it's ignored.
+  virtual Map new_map(uint32_t init_capacity) { return new_map(); }
+
   // Creates and returns a new mutable array value.
   virtual Array new_array() = 0;
 
@@ -646,6 +664,12 @@ public:
   // Creates and returns a new mutable blob value of the given size.
   virtual Blob new_blob(uint32_t size) = 0;
 
+  // Creates and returns a native that holds a copy of the given binary
+  // plankton, which must be a single valid value. Binary writers splice the
+  // bytes directly into their output instead of encoding a value again. If
+  // the data is invalid null is returned.
+  Native new_preencoded(const void *data, uint32_t size);
+
   // Creates and returns a new variant blob. The contents it copied into this
   // arena so the data array can be disposed after this call returns.
   virtual Blob new_blob(const void *data, uint32_t size) = 0;
@@ -677,6 +701,15 @@ public:
   // directly but through the 'new' operator, which calls it.
   virtual void *alloc_raw(size_t size) = 0;
 
+  // Returns the number of bytes this factory allocates when creating a value
+  // of the given type with room for the given number of elements, entries,
+  // fields, or bytes, or 0 if it doesn't know.
+  virtual size_t value_footprint(pton_type_t type, uint32_t length) { return 0; }
+
+  // Hints that the given number of bytes are about to be allocated such that
+  // the factory can set them aside in one block.
+  virtual void reserve(size_t bytes) { }
+
   // Assume shared ownership of the values produced in the given arena. After
   // this call, values returned from the given arena will be valid as long as
   // either the given arena _or_ this arena exist. Or, indeed, any other arenas
@@ -771,10 +804,15 @@ private:
 // shared.
 class ArenaData : public tclib::refcount_shared_t, VariantOwner {
 public:
+  ArenaData();
   ~ArenaData();
   void adopt_ownership(VariantOwner *other);
   void register_cleanup(tclib::callback_t<void(void)> callback);
 
+  // Disposes everything allocated so far, keeping memory for what's allocated
+  // next.
+  void reset();
+
 protected:
   void mark_adopted();
   void unmark_adopted();
@@ -788,9 +826,17 @@ private:
   // number of bytes.
   void *alloc_raw(size_t bytes);
 
+  // Allocates a single block of the given size from which subsequent
+  // allocations will be made until it runs out.
+  void reserve(size_t bytes);
+
   // The raw pages of memory allocated for this arena.
   std::vector<blob_t> blocks_;
 
+  // The unused part of the reserved block, if there is one.
+  uint8_t *reserved_next_;
+  uint8_t *reserved_limit_;
+
   // Other arenas this one has adopted.
   std::vector<VariantOwner*> adopted_;
 
@@ -829,6 +875,10 @@ public:
   // Creates and returns a new mutable map value.
   Map new_map();
 
+  // Creates and returns a new mutable map value with room for the given number
+  // of entries.
+  Map new_map(uint32_t init_capacity);
+
   // Creates and returns a new mutable seed value.
   Seed new_seed(AbstractSeedType *type = NULL);
 
@@ -890,6 +940,21 @@ public:
   // Allocates a raw block of memory.
   void *alloc_raw(size_t size);
 
+  // Disposes all the values allocated in this arena, running the cleanups and
+  // releasing adopted owners, but keeps the memory so values allocated
+  // afterwards reuse it. Values from this arena must no longer be used, so it
+  // must not have been adopted by another owner.
+  void reset();
+
+  // Returns the number of bytes allocated within this arena for a value of
+  // the given type and length.
+  virtual size_t value_footprint(pton_type_t type, uint32_t length);
+
+  // Allocates a single block of the given size which values created after
+  // this call are laid out in, in the order they're created, until it runs
+  // out. If the size is exact the values end up contiguous in memory.
+  virtual void reserve(size_t bytes);
+
   // Register a callback to be invoked when this factory is disposed.
   virtual void register_cleanup(tclib::callback_t<void(void)> callback);
 
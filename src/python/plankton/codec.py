@@ -8,6 +8,7 @@ import base64
 import collections
 import codecs
 import operator
+import types
 
 
 _INT32_TAG = 0
@@ -21,6 +22,13 @@ _SEED_TAG = 7
 _REFERENCE_TAG = 8
 _BLOB_TAG = 12
 _STRING_TAG = 13
+_SIZED_ARRAY_TAG = 14
+_SIZED_MAP_TAG = 15
+_SIZED_SEED_TAG = 16
+_OPEN_ARRAY_TAG = 17
+_OPEN_MAP_TAG = 18
+_END_TAG = 19
+_INDEXED_VALUES_TAG = 23
 
 
 def is_string(data):
@@ -37,6 +45,8 @@ def visit_data(data, visitor):
     return visitor.visit_string(data)
   elif (t == list) or (t == tuple):
     return visitor.visit_array(data)
+  elif (t == types.GeneratorType):
+    return visitor.visit_open_array(data)
   elif (t == dict) or (t == collections.OrderedDict):
     return visitor.visit_map(data)
   elif (t == bytearray):
@@ -127,6 +137,14 @@ class DataOutputStream(object):
     for elm in value:
       self.write_object(elm)
 
+  # Emit an array whose length isn't known up front, terminated by an end tag.
+  # The elements are written as they're produced.
+  def visit_open_array(self, value):
+    self.assm.tag(_OPEN_ARRAY_TAG)
+    for elm in value:
+      self.write_object(elm)
+    self.assm.tag(_END_TAG)
+
   # Emit a tagged map.
   def visit_map(self, value):
     self.assm.tag(_MAP_TAG)
@@ -193,6 +211,9 @@ class DataInputStream(object):
     self.cursor = 0
     self.object_index = {}
     self.object_offset = 0
+    # Only objects get an index unless the value is prefixed with the indexed
+    # values tag.
+    self.index_values = False
     self.default_object = default_object
     self.string_codec = string_codec
 
@@ -221,6 +242,19 @@ class DataInputStream(object):
       return self._decode_reference()
     elif tag == _BLOB_TAG:
       return self._decode_blob()
+    elif tag == _SIZED_ARRAY_TAG:
+      return self._decode_sized_array()
+    elif tag == _SIZED_MAP_TAG:
+      return self._decode_sized_map()
+    elif tag == _SIZED_SEED_TAG:
+      return self._decode_sized_seed()
+    elif tag == _OPEN_ARRAY_TAG:
+      return self._decode_open_array()
+    elif tag == _OPEN_MAP_TAG:
+      return self._decode_open_map()
+    elif tag == _INDEXED_VALUES_TAG:
+      self.index_values = True
+      return self.read_object()
     else:
       raise Exception(tag)
 
@@ -244,6 +278,9 @@ class DataInputStream(object):
       return self._disassemble_seed(indent)
     elif tag == _REFERENCE_TAG:
       return self._disassemble_reference(indent)
+    elif tag == _INDEXED_VALUES_TAG:
+      self.index_values = True
+      return "%sindexed values\n%s" % (indent, self.disassemble_object(indent))
     else:
       return str(tag)
 
@@ -274,7 +311,7 @@ class DataInputStream(object):
     bytes = bytearray()
     for i in xrange(0, length):
       bytes.append(self._get_byte())
-    return str(bytes)
+    return self._index_value(str(bytes))
 
   def _decode_string(self):
     encoding = self._decode_uint32()
@@ -282,7 +319,7 @@ class DataInputStream(object):
     bytes = bytearray()
     for i in xrange(0, length):
       bytes.append(self._get_byte())
-    return self.string_codec.decode(bytes, encoding)
+    return self._index_value(self.string_codec.decode(bytes, encoding))
 
   # Reads a blob from the stream.
   def _decode_blob(self):
@@ -290,17 +327,35 @@ class DataInputStream(object):
     bytes = bytearray()
     for i in xrange(0, length):
       bytes.append(self._get_byte())
-    return bytes
+    return self._index_value(bytes)
 
   # Reads a naked array from the stream.
   def _decode_array(self):
     length = self._decode_uint32()
-    result = []
+    return self._decode_array_contents(length)
+
+  def _decode_array_contents(self, length):
+    result = self._index_value([])
     for i in xrange(0, length):
       result.append(self.read_object())
     return result
 
+  # Reads an array whose header records the size of its contents. We always
+  # read the whole thing so the size isn't needed.
+  def _decode_sized_array(self):
+    length = self._decode_uint32()
+    self._decode_uint32()
+    return self._decode_array_contents(length)
+
+  # Reads an array whose elements are terminated by an end tag.
+  def _decode_open_array(self):
+    result = self._index_value([])
+    while not self._at_end_tag():
+      result.append(self.read_object())
+    return result
+
   def _disassemble_array(self, indent):
+    self._index_value(None)
     length = self._decode_uint32()
     children = []
     for i in xrange(0, length):
@@ -308,8 +363,8 @@ class DataInputStream(object):
       children.append(self.disassemble_object(new_indent))
     return "%sarray %i\n%s" % (indent, length, "\n".join(children))
 
-  def _decode_map_contents(self, length):
-    result = {}
+  # Reads the given number of mappings into the given dict.
+  def _decode_map_contents(self, length, result):
     for i in xrange(0, length):
       k = self.read_object()
       v = self.read_object()
@@ -319,9 +374,33 @@ class DataInputStream(object):
   # Reads a naked map from the stream.
   def _decode_map(self):
     length = self._decode_uint32()
-    return self._decode_map_contents(length)
+    return self._decode_map_contents(length, self._index_value({}))
+
+  # Reads a map whose header records the size of its contents.
+  def _decode_sized_map(self):
+    length = self._decode_uint32()
+    self._decode_uint32()
+    return self._decode_map_contents(length, self._index_value({}))
+
+  # Reads a map whose mappings are terminated by an end tag.
+  def _decode_open_map(self):
+    result = self._index_value({})
+    while not self._at_end_tag():
+      k = self.read_object()
+      v = self.read_object()
+      result[k] = v
+    return result
+
+  # If the next byte is an end tag, skips it and returns True. Otherwise
+  # returns False.
+  def _at_end_tag(self):
+    if self.bytes[self.cursor] != _END_TAG:
+      return False
+    self.cursor += 1
+    return True
 
   def _disassemble_map(self, indent):
+    self._index_value(None)
     length = self._decode_uint32()
     children = []
     for i in xrange(0, length):
@@ -334,6 +413,16 @@ class DataInputStream(object):
   def _decode_seed(self):
     headerc = self._decode_uint32()
     fieldc = self._decode_uint32()
+    return self._decode_seed_contents(headerc, fieldc)
+
+  # Reads an object whose header records the size of its contents.
+  def _decode_sized_seed(self):
+    headerc = self._decode_uint32()
+    fieldc = self._decode_uint32()
+    self._decode_uint32()
+    return self._decode_seed_contents(headerc, fieldc)
+
+  def _decode_seed_contents(self, headerc, fieldc):
     index = self.grab_index()
     self.object_index[index] = None
     headers = []
@@ -346,7 +435,7 @@ class DataInputStream(object):
     else:
       instance = (self.default_object)(header)
     self.object_index[index] = instance
-    payload = self._decode_map_contents(fieldc)
+    payload = self._decode_map_contents(fieldc, {})
     if not meta_info is None:
       meta_info.set_instance_contents(instance, payload)
     else:
@@ -365,6 +454,13 @@ class DataInputStream(object):
     self.object_offset += 1
     return result
 
+  # If all values are being indexed, gives the given non-object value the next
+  # index. Returns the value.
+  def _index_value(self, value):
+    if self.index_values:
+      self.object_index[self.grab_index()] = value
+    return value
+
   # Reads a raw object reference from the stream.
   def _decode_reference(self):
     offset = self._decode_uint32()
@@ -814,6 +910,9 @@ class Stringifier(object):
   def visit_array(self, value):
     return "[%s]" % ", ".join([self.s(e) for e in value ])
 
+  def visit_open_array(self, value):
+    return self.visit_array(value)
+
 
   def visit_map(self, value):
     return "{%s}" % ", ".join([
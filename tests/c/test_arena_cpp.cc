@@ -117,3 +117,31 @@ TEST(arena_cpp, adopt_inner) {
   ASSERT_EQ(5, arr[1].integer_value());
   ASSERT_EQ(4, arr[2].integer_value());
 }
+
+static void count_cleanup(int *count) {
+  (*count)++;
+}
+
+TEST(arena_cpp, reset) {
+  Arena arena;
+  int count = 0;
+  arena.register_cleanup(tclib::new_callback(count_cleanup, &count));
+  for (uint32_t i = 1; i < 100; i++)
+    arena.alloc_values<int64_t>(i);
+  arena.reset();
+  ASSERT_EQ(1, count);
+  // Allocating the same again after a reset is laid out in the memory that
+  // was kept rather than allocated block by block.
+  int64_t *first = arena.alloc_values<int64_t>(1);
+  int64_t *last = first;
+  for (uint32_t i = 2; i < 100; i++) {
+    int64_t *next = arena.alloc_values<int64_t>(i);
+    ASSERT_PTREQ(last + (i - 1), next);
+    last = next;
+  }
+  Array array = arena.new_array();
+  array.add(8);
+  ASSERT_EQ(8, array[0].integer_value());
+  arena.reset();
+  ASSERT_EQ(1, count);
+}
@@ -1,6 +1,7 @@
 //- Copyright 2014 the Neutrino authors (see AUTHORS).
 //- Licensed under the Apache License, Version 2.0 (see LICENSE).
 
+#include "io/stream.hh"
 #include "plankton-binary.hh"
 #include "test/asserts.hh"
 #include "test/unittest.hh"
@@ -76,3 +77,1127 @@ TEST(binary, string_encodings) {
   Variant decoded = reader.parse(*writer, writer.size());
   ASSERT_EQ(PTON_CHARSET_SHIFT_JIS, decoded.string_encoding());
 }
+
+TEST(binary, borrow_input) {
+  Arena arena;
+  Array array = arena.new_array();
+  array.add("foo");
+  array.add(Variant::blob("\1\2\3", 3));
+  array.add(arena.new_string("bar", 3, PTON_CHARSET_SHIFT_JIS));
+  BinaryWriter writer;
+  writer.write(array);
+  const uint8_t *start = *writer;
+  const uint8_t *end = start + writer.size();
+  BinaryReader reader(&arena);
+  reader.set_borrow_input(true);
+  Array decoded = reader.parse(*writer, writer.size());
+  ASSERT_TRUE(decoded.is_frozen());
+  ASSERT_EQ(3, decoded.length());
+  Variant str = decoded[0];
+  ASSERT_EQ(3, str.string_length());
+  ASSERT_EQ(0, strncmp("foo", str.string_chars(), 3));
+  const uint8_t *chars = reinterpret_cast<const uint8_t*>(str.string_chars());
+  ASSERT_TRUE(start <= chars && chars < end);
+  Blob blob = decoded[1];
+  ASSERT_EQ(3, blob.size());
+  const uint8_t *data = static_cast<const uint8_t*>(blob.data());
+  ASSERT_TRUE(start <= data && data < end);
+  ASSERT_EQ(2, data[1]);
+  // Strings with a non-default encoding are copied.
+  Variant encoded = decoded[2];
+  ASSERT_EQ(PTON_CHARSET_SHIFT_JIS, encoded.string_encoding());
+  chars = reinterpret_cast<const uint8_t*>(encoded.string_chars());
+  ASSERT_FALSE(start <= chars && chars < end);
+}
+
+TEST(binary, sized_containers) {
+  Arena arena;
+  Map map = arena.new_map();
+  map.set("a", 1);
+  Array inner = arena.new_array();
+  for (int i = 0; i < 100; i++)
+    inner.add(i * 1000);
+  map.set("b", inner);
+  Seed seed = arena.new_seed();
+  seed.set_header("x");
+  seed.set_field("y", "z");
+  map.set("c", seed);
+  BinaryWriter plain;
+  plain.write(map);
+  BinaryWriter sized;
+  sized.set_sized_containers(true);
+  sized.write(map);
+  ASSERT_TRUE(BinaryReader::validate(*sized, sized.size()));
+  ASSERT_EQ(sized.size(), BinaryReader::value_size(*sized, sized.size()));
+  ASSERT_EQ(plain.size(), BinaryReader::value_size(*plain, plain.size()));
+  BinaryReader reader(&arena);
+  Variant decoded = reader.parse(*sized, sized.size());
+  TextWriter expected;
+  expected.write(map);
+  TextWriter found;
+  found.write(decoded);
+  ASSERT_EQ(0, strcmp(*expected, *found));
+  // Skipping only looks at the header of a sized container so trailing data
+  // and garbage contents don't matter.
+  uint8_t data[5] = {BinaryImplUtils::boSizedArray, 1, 1, 0xFF, 0xFF};
+  ASSERT_EQ(4, BinaryReader::value_size(data, 5));
+  ASSERT_FALSE(BinaryReader::validate(data, 4));
+  // A sized container whose size is wrong is invalid.
+  uint8_t wrong[6] = {BinaryImplUtils::boSizedArray, 1, 3, BinaryImplUtils::boNull,
+      BinaryImplUtils::boNull, BinaryImplUtils::boNull};
+  ASSERT_FALSE(BinaryReader::validate(wrong, 6));
+  wrong[2] = 1;
+  ASSERT_TRUE(BinaryReader::validate(wrong, 4));
+}
+
+TEST(binary, end_sized) {
+  // Sized containers closed with end_sized, nested and with a size that takes
+  // more than one byte, come out the same as ones that were measured.
+  char chars[200];
+  memset(chars, 'x', 200);
+  Arena arena;
+  Array inner = arena.new_array();
+  inner.add(arena.new_string(chars, 200));
+  inner.add(5);
+  Map map = arena.new_map();
+  map.set("k", inner);
+  Array outer = arena.new_array();
+  outer.add(map);
+  outer.add(arena.new_array());
+  BinaryWriter writer;
+  writer.set_sized_containers(true);
+  writer.write(outer);
+  Assembler assm;
+  ASSERT_TRUE(assm.begin_sized_array(2));
+  ASSERT_TRUE(assm.begin_sized_map(1));
+  ASSERT_TRUE(assm.emit_default_string("k", 1));
+  ASSERT_TRUE(assm.begin_sized_array(2));
+  ASSERT_TRUE(assm.emit_default_string(chars, 200));
+  ASSERT_TRUE(assm.emit_int64(5));
+  ASSERT_TRUE(assm.end_sized());
+  ASSERT_TRUE(assm.end_sized());
+  ASSERT_TRUE(assm.begin_sized_array(0));
+  ASSERT_TRUE(assm.end_sized());
+  ASSERT_TRUE(assm.end_sized());
+  ASSERT_FALSE(assm.end_sized());
+  blob_t code = assm.peek_code();
+  ASSERT_EQ(writer.size(), code.size);
+  ASSERT_EQ(0, memcmp(*writer, code.start, code.size));
+}
+
+TEST(binary, varints) {
+  // Values around each varint length boundary, where the bias matters.
+  Arena arena;
+  Array array = arena.new_array();
+  uint64_t boundary = 0;
+  for (int length = 1; length <= 9; length++) {
+    boundary = (boundary + 1) << 7;
+    for (int64_t delta = -3; delta <= 3; delta++) {
+      uint64_t value = boundary + delta;
+      array.add(Variant::integer(static_cast<int64_t>(value >> 1)));
+      array.add(Variant::integer(-static_cast<int64_t>(value >> 1)));
+    }
+  }
+  array.add(Variant::integer(INT64_MAX));
+  array.add(Variant::integer(INT64_MIN));
+  CHECK_BINARY(array);
+  // Check that runs of integers interrupted by other values come out right.
+  Array mixed = arena.new_array();
+  for (int i = 0; i < 200; i++) {
+    if ((i % 67) == 0) {
+      mixed.add("foo");
+    } else {
+      mixed.add(Variant::integer(i * 1234567));
+    }
+  }
+  CHECK_BINARY(mixed);
+}
+
+TEST(binary, long_varints) {
+  // Values whose encodings take 9 and 10 bytes. Most are followed by enough
+  // data to be decoded a block at a time, the last few by the byte loop.
+  Arena arena;
+  Array array = arena.new_array();
+  for (int shift = 55; shift < 64; shift++) {
+    uint64_t bit = static_cast<uint64_t>(1) << shift;
+    array.add(Variant::integer(static_cast<int64_t>(bit - 1)));
+    array.add(Variant::integer(-static_cast<int64_t>(bit - 1)));
+    array.add(Variant::integer(static_cast<int64_t>(bit >> 1)));
+  }
+  array.add(Variant::integer(INT64_MAX));
+  array.add(Variant::integer(INT64_MIN));
+  CHECK_BINARY(array);
+  // No value needs 11 bytes, whether or not there's data after it.
+  uint8_t data[32];
+  data[0] = BinaryImplUtils::boInteger;
+  for (size_t i = 1; i <= 10; i++)
+    data[i] = 0xFF;
+  for (size_t i = 11; i < 32; i++)
+    data[i] = 0;
+  int64_t value = 0;
+  size_t size = 0;
+  ASSERT_EQ(0, pton_decode_int64_run(data, 32, &value, 1, &size));
+  ASSERT_EQ(0, pton_decode_int64_run(data, 12, &value, 1, &size));
+  // Replacing the eleventh byte makes it a valid 10-byte varint.
+  data[10] = 0x01;
+  ASSERT_EQ(1, pton_decode_int64_run(data, 32, &value, 1, &size));
+  ASSERT_EQ(11, size);
+  ASSERT_EQ(1, pton_decode_int64_run(data, 11, &value, 1, &size));
+  ASSERT_EQ(11, size);
+}
+
+TEST(binary, int64_run) {
+  Arena arena;
+  Array array = arena.new_array();
+  array.add(1);
+  array.add(-100000);
+  array.add(Variant::integer(1LL << 40));
+  array.add("foo");
+  BinaryWriter writer;
+  writer.write(array);
+  // Skip the array header.
+  const uint8_t *code = *writer + 2;
+  int64_t values[8];
+  size_t size = 0;
+  ASSERT_EQ(3, pton_decode_int64_run(code, writer.size() - 2, values, 8, &size));
+  ASSERT_EQ(1, values[0]);
+  ASSERT_EQ(-100000, values[1]);
+  ASSERT_EQ(1LL << 40, values[2]);
+  ASSERT_EQ(BinaryImplUtils::boDefaultString, code[size]);
+  ASSERT_EQ(2, pton_decode_int64_run(code, writer.size() - 2, values, 2, &size));
+  ASSERT_EQ(0, pton_decode_int64_run(code + size, 1, values, 8, &size));
+}
+
+// Returns the encoding of 'depth' arrays nested within each other with a null
+// at the bottom.
+static std::vector<uint8_t> nested_arrays(size_t depth) {
+  std::vector<uint8_t> result;
+  for (size_t i = 0; i < depth; i++) {
+    result.push_back(BinaryImplUtils::boArray);
+    result.push_back(1);
+  }
+  result.push_back(BinaryImplUtils::boNull);
+  return result;
+}
+
+TEST(binary, max_depth) {
+  Arena arena;
+  BinaryReader reader(&arena);
+  std::vector<uint8_t> shallow = nested_arrays(BinaryReader::kDefaultMaxDepth);
+  ASSERT_TRUE(reader.parse(&shallow[0], shallow.size()).is_array());
+  std::vector<uint8_t> deep = nested_arrays(BinaryReader::kDefaultMaxDepth + 1);
+  ASSERT_TRUE(reader.parse(&deep[0], deep.size()).is_null());
+  // Much deeper input works when the limit is raised since decoding doesn't
+  // recurse.
+  std::vector<uint8_t> deeper = nested_arrays(1000000);
+  reader.set_max_depth(2000000);
+  Variant current = reader.parse(&deeper[0], deeper.size());
+  for (size_t i = 0; i < 1000000; i++) {
+    ASSERT_EQ(1, current.array_length());
+    current = current.array_get(0);
+  }
+  ASSERT_TRUE(current.is_null());
+}
+
+#define CHECK_DECODE_ERROR(CAUSE, OFFSET, OPCODE, N, ...) do {                 \
+  Arena arena;                                                                 \
+  BinaryReader reader(&arena);                                                 \
+  uint8_t data[N] = {__VA_ARGS__};                                             \
+  ASSERT_TRUE(reader.parse(data, (N)).is_null());                              \
+  ASSERT_TRUE(reader.has_failed());                                            \
+  ASSERT_EQ(DecodeError::CAUSE, reader.error().cause());                       \
+  ASSERT_EQ((OFFSET), reader.error().offset());                                \
+  ASSERT_EQ((OPCODE), reader.error().opcode());                                \
+  ASSERT_FALSE(BinaryReader::validate(data, (N)));                             \
+} while (false)
+
+TEST(binary, decode_errors) {
+  Arena arena;
+  BinaryReader reader(&arena);
+  uint8_t valid[3] = {BinaryImplUtils::boArray, 1, BinaryImplUtils::boNull};
+  ASSERT_TRUE(reader.parse(valid, 3).is_array());
+  ASSERT_FALSE(reader.has_failed());
+  // Input ending in the middle of an array.
+  CHECK_DECODE_ERROR(TRUNCATED, 2, -1, 2, BinaryImplUtils::boArray, 1);
+  // A string that is longer than the input.
+  CHECK_DECODE_ERROR(TRUNCATED, 2, BinaryImplUtils::boDefaultString, 4,
+      BinaryImplUtils::boArray, 1, BinaryImplUtils::boDefaultString, 5);
+  CHECK_DECODE_ERROR(UNKNOWN_OPCODE, 2, 0xFF, 3, BinaryImplUtils::boArray, 1,
+      0xFF);
+  // An array length that doesn't fit in 32 bits.
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 0, BinaryImplUtils::boArray, 6,
+      BinaryImplUtils::boArray, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F);
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 0, BinaryImplUtils::boId, 3,
+      BinaryImplUtils::boId, 3, 0);
+  // A reference to a value before the first one.
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 2, BinaryImplUtils::boReference, 4,
+      BinaryImplUtils::boArray, 1, BinaryImplUtils::boReference, 1);
+  // Ends that don't close an open container, or come between a key and its
+  // value.
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 2, BinaryImplUtils::boEnd, 3,
+      BinaryImplUtils::boArray, 1, BinaryImplUtils::boEnd);
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 2, BinaryImplUtils::boEnd, 3,
+      BinaryImplUtils::boOpenMap, BinaryImplUtils::boNull,
+      BinaryImplUtils::boEnd);
+  CHECK_DECODE_ERROR(TRUNCATED, 2, -1, 2, BinaryImplUtils::boOpenArray,
+      BinaryImplUtils::boNull);
+  // Columns that don't have a value for each row, or aren't arrays.
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 7, BinaryImplUtils::boArray, 10,
+      BinaryImplUtils::boColumns, 2, 0, 1, BinaryImplUtils::boDefaultString, 1,
+      'a', BinaryImplUtils::boArray, 1, BinaryImplUtils::boNull);
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 7, BinaryImplUtils::boReference, 9,
+      BinaryImplUtils::boColumns, 1, 0, 1, BinaryImplUtils::boDefaultString, 1,
+      'a', BinaryImplUtils::boReference, 0);
+  CHECK_DECODE_ERROR(SIZE_MISMATCH, 0, BinaryImplUtils::boSizedArray, 4,
+      BinaryImplUtils::boSizedArray, 1, 0, BinaryImplUtils::boNull);
+  CHECK_DECODE_ERROR(TRAILING_DATA, 3, BinaryImplUtils::boTrue, 4,
+      BinaryImplUtils::boArray, 1, BinaryImplUtils::boNull,
+      BinaryImplUtils::boTrue);
+  reader.set_max_depth(1);
+  uint8_t deep[5] = {BinaryImplUtils::boArray, 1, BinaryImplUtils::boArray, 1,
+      BinaryImplUtils::boNull};
+  ASSERT_TRUE(reader.parse(deep, 5).is_null());
+  ASSERT_EQ(DecodeError::TOO_DEEP, reader.error().cause());
+  ASSERT_EQ(2, reader.error().offset());
+  // A successful parse clears the error.
+  ASSERT_TRUE(reader.parse(valid, 3).is_array());
+  ASSERT_FALSE(reader.has_failed());
+}
+
+TEST(binary, parallel) {
+  Arena arena;
+  Array input = arena.new_array();
+  for (int i = 0; i < 10000; i++) {
+    Map elm = arena.new_map();
+    elm.set("i", i);
+    elm.set("s", "a string");
+    Array inner = arena.new_array();
+    inner.add(i);
+    inner.add(-i);
+    elm.set("a", inner);
+    input.add(elm);
+  }
+  TextWriter expected;
+  expected.write(input);
+  for (int sized = 0; sized < 2; sized++) {
+    BinaryWriter writer;
+    writer.set_sized_containers(sized == 1);
+    writer.write(input);
+    ASSERT_TRUE(writer.size() >= BinaryReader::kMinParallelInputSize);
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+      BinaryReader reader(&arena);
+      reader.set_thread_count(threads);
+      Variant decoded = reader.parse(*writer, writer.size());
+      ASSERT_FALSE(reader.has_failed());
+      ASSERT_TRUE(decoded.is_frozen());
+      TextWriter found;
+      found.write(decoded);
+      ASSERT_EQ(0, strcmp(*expected, *found));
+    }
+    // An error within one of the slices is reported the same way as if the
+    // input had been decoded on a single thread.
+    BinaryReader serial(&arena);
+    serial.set_max_depth(2);
+    ASSERT_TRUE(serial.parse(*writer, writer.size()).is_null());
+    ASSERT_EQ(DecodeError::TOO_DEEP, serial.error().cause());
+    BinaryReader parallel(&arena);
+    parallel.set_max_depth(2);
+    parallel.set_thread_count(4);
+    ASSERT_TRUE(parallel.parse(*writer, writer.size()).is_null());
+    ASSERT_EQ(DecodeError::TOO_DEEP, parallel.error().cause());
+    ASSERT_EQ(serial.error().offset(), parallel.error().offset());
+  }
+}
+
+TEST(binary, oversized_arrays) {
+  // Arrays that claim more elements than the rest of the input could hold
+  // fail, where the input ends, before anything is allocated for them.
+  CHECK_DECODE_ERROR(TRUNCATED, 6, -1, 6,
+      BinaryImplUtils::boArray, 0xFF, 0xFE, 0xFE, 0xFE, 0x0E);
+  CHECK_DECODE_ERROR(TRUNCATED, 5, -1, 5,
+      BinaryImplUtils::boArray, 1, BinaryImplUtils::boArray, 3,
+      BinaryImplUtils::boNull);
+  // Likewise columns with too many rows or keys, including a key count that
+  // overflows 32 bits when the columns are added to it.
+  CHECK_DECODE_ERROR(TRUNCATED, 10, -1, 10,
+      BinaryImplUtils::boColumns, 0xFF, 0xFE, 0xFE, 0xFE, 0x0E, 0, 1,
+      BinaryImplUtils::boNull, BinaryImplUtils::boNull);
+  CHECK_DECODE_ERROR(TRUNCATED, 8, -1, 8,
+      BinaryImplUtils::boColumns, 1, 0, 0x80, 0xFF, 0xFE, 0xFE, 0x06);
+  // Rows without any keys.
+  CHECK_DECODE_ERROR(INVALID_PAYLOAD, 0, BinaryImplUtils::boColumns, 4,
+      BinaryImplUtils::boColumns, 5, 0, 0);
+}
+
+TEST(binary, oversized_maps) {
+  // A map that claims more entries than the rest of the input could hold
+  // fails, where the input ends, before anything is allocated for them.
+  CHECK_DECODE_ERROR(TRUNCATED, 6, -1, 6,
+      BinaryImplUtils::boMap, 0xFF, 0xFE, 0xFE, 0xFE, 0x0E);
+  // A sized map's contents aren't checked before memory is reserved for the
+  // value so the claim is limited there too.
+  uint8_t sized[7] = {BinaryImplUtils::boSizedMap, 0xFF, 0xFE, 0xFE, 0xFE,
+      0x0E, 0};
+  Arena arena;
+  BinaryReader reader(&arena);
+  reader.set_compact_layout(true);
+  ASSERT_TRUE(reader.parse(sized, 7).is_null());
+  ASSERT_EQ(DecodeError::TRUNCATED, reader.error().cause());
+}
+
+TEST(binary, compact_layout) {
+  Arena arena;
+  Map map = arena.new_map();
+  Array strs = arena.new_array();
+  for (int i = 0; i < 100; i++)
+    strs.add(arena.new_string("abc"));
+  map.set("strs", strs);
+  Seed seed = arena.new_seed();
+  seed.set_header("x");
+  for (int i = 0; i < 10; i++)
+    seed.set_field(i, arena.new_blob("blob", 4));
+  map.set("seed", seed);
+  map.set("empty", arena.new_array());
+  TextWriter expected;
+  expected.write(map);
+  for (int sized = 0; sized < 2; sized++) {
+    BinaryWriter writer;
+    writer.set_sized_containers(sized == 1);
+    writer.write(map);
+    Arena decoded_arena;
+    BinaryReader reader(&decoded_arena);
+    reader.set_compact_layout(true);
+    Variant decoded = reader.parse(*writer, writer.size());
+    TextWriter found;
+    found.write(decoded);
+    ASSERT_EQ(0, strcmp(*expected, *found));
+    // The strings are laid out one after the other in the order they were
+    // read.
+    Array decoded_strs = decoded.map_get("strs");
+    size_t step = decoded_arena.value_footprint(PTON_STRING, 3);
+    for (uint32_t i = 1; i < decoded_strs.length(); i++) {
+      const char *prev = decoded_strs[i - 1].string_chars();
+      const char *next = decoded_strs[i].string_chars();
+      ASSERT_EQ(step, static_cast<size_t>(next - prev));
+    }
+  }
+}
+
+TEST(binary, parse_next) {
+  Arena arena;
+  std::vector<uint8_t> stream;
+  Variant values[4] = {Variant::integer(8), Variant::string("foo"),
+      Variant::null(), arena.new_array()};
+  size_t last_offset = 0;
+  for (size_t i = 0; i < 4; i++) {
+    BinaryWriter writer;
+    writer.write(values[i]);
+    last_offset = stream.size();
+    stream.insert(stream.end(), *writer, *writer + writer.size());
+  }
+  BinaryReader reader(&arena);
+  size_t offset = 0;
+  for (size_t i = 0; i < 4; i++) {
+    size_t size = 0;
+    Variant value = reader.parse_next(&stream[offset], stream.size() - offset,
+        &size);
+    ASSERT_FALSE(reader.has_failed());
+    ASSERT_TRUE(size > 0);
+    ASSERT_EQ(values[i].type(), value.type());
+    offset += size;
+  }
+  ASSERT_EQ(stream.size(), offset);
+  Array all = reader.parse_all(&stream[0], stream.size());
+  ASSERT_EQ(4, all.length());
+  ASSERT_EQ(8, all[0].integer_value());
+  ASSERT_TRUE(all[1] == Variant::string("foo"));
+  ASSERT_TRUE(all[2].is_null());
+  ASSERT_TRUE(all[3].is_array());
+  ASSERT_EQ(0, reader.parse_all(&stream[0], 0).length());
+  // An error in one of the later values is reported relative to the whole
+  // input.
+  ASSERT_TRUE(reader.parse_all(&stream[0], stream.size() - 1).is_null());
+  ASSERT_EQ(DecodeError::TRUNCATED, reader.error().cause());
+  ASSERT_EQ(last_offset, reader.error().offset());
+  size_t size = 1;
+  ASSERT_TRUE(reader.parse_next(&stream[0], 0, &size).is_null());
+  ASSERT_EQ(0, size);
+  ASSERT_TRUE(reader.has_failed());
+}
+
+TEST(binary, validate_strings) {
+  Arena arena;
+  BinaryReader reader(&arena);
+  reader.set_validate_strings(true);
+  uint8_t ascii[5] = {BinaryImplUtils::boDefaultString, 3, 'f', 'o', 'o'};
+  String str = reader.parse(ascii, 5);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_TRUE(str.is_ascii());
+  uint8_t utf8[4] = {BinaryImplUtils::boDefaultString, 2, 0xC3, 0xA5};
+  str = reader.parse(utf8, 4);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_FALSE(str.is_ascii());
+  ASSERT_EQ(2, str.length());
+  uint8_t invalid[6] = {BinaryImplUtils::boArray, 1,
+      BinaryImplUtils::boDefaultString, 2, 0xC3, 'a'};
+  ASSERT_TRUE(reader.parse(invalid, 6).is_null());
+  ASSERT_EQ(DecodeError::INVALID_ENCODING, reader.error().cause());
+  ASSERT_EQ(2, reader.error().offset());
+  // Strings declared to be ascii must be.
+  uint8_t us_ascii[5] = {BinaryImplUtils::boStringWithEncoding,
+      PTON_CHARSET_US_ASCII, 2, 0xC3, 0xA5};
+  ASSERT_TRUE(reader.parse(us_ascii, 5).is_null());
+  ASSERT_EQ(DecodeError::INVALID_ENCODING, reader.error().cause());
+  // Other encodings aren't checked.
+  us_ascii[1] = PTON_CHARSET_SHIFT_JIS;
+  ASSERT_EQ(2, String(reader.parse(us_ascii, 5)).length());
+  // Borrowed strings are validated but can't be marked.
+  reader.set_borrow_input(true);
+  ASSERT_TRUE(reader.parse(invalid, 6).is_null());
+  str = reader.parse(ascii, 5);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_FALSE(str.is_ascii());
+  // Without validation nothing is checked.
+  BinaryReader lenient(&arena);
+  ASSERT_TRUE(lenient.parse(invalid, 6).is_array());
+  ASSERT_FALSE(String(lenient.parse(ascii, 5)).is_ascii());
+}
+
+TEST(binary, zigzag) {
+  ASSERT_EQ(0, BinaryImplUtils::zigzag(0));
+  ASSERT_EQ(1, BinaryImplUtils::zigzag(-1));
+  ASSERT_EQ(2, BinaryImplUtils::zigzag(1));
+  ASSERT_EQ(127, BinaryImplUtils::zigzag(-64));
+  ASSERT_TRUE(BinaryImplUtils::zigzag(INT64_MAX) == ~static_cast<uint64_t>(1));
+  ASSERT_TRUE(BinaryImplUtils::zigzag(INT64_MIN) == ~static_cast<uint64_t>(0));
+}
+
+TEST(binary, measure) {
+  Arena arena;
+  Map map = arena.new_map();
+  int64_t ints[8] = {0, -1, 63, -64, 64, 8256, -8257, INT64_MIN};
+  Array array = arena.new_array();
+  for (size_t i = 0; i < 8; i++)
+    array.add(ints[i]);
+  map.set("ints", array);
+  Array strs = arena.new_array();
+  for (uint32_t i = 0; i < 300; i += 17)
+    strs.add(arena.new_string(i));
+  strs.add(arena.new_string("blob", 4, PTON_CHARSET_SHIFT_JIS));
+  strs.add(arena.new_blob(200));
+  map.set("strs", strs);
+  Seed seed = arena.new_seed();
+  seed.set_header("x");
+  seed.set_field("y", Variant::id(32, 0xFABACAEA));
+  seed.set_field("z", Variant::yes());
+  map.set("seed", seed);
+  for (int sized = 0; sized < 2; sized++) {
+    BinaryWriter writer;
+    writer.set_sized_containers(sized == 1);
+    writer.write(map);
+    ASSERT_EQ(writer.size(), writer.measure(map));
+    if (sized == 1) {
+      ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+    } else {
+      ASSERT_EQ(writer.size(), pton_binary_writer_measure(map.to_c()));
+    }
+    BinaryReader reader(&arena);
+    Variant decoded = reader.parse(*writer, writer.size());
+    TextWriter expected;
+    expected.write(map);
+    TextWriter found;
+    found.write(decoded);
+    ASSERT_EQ(0, strcmp(*expected, *found));
+  }
+}
+
+// An output stream that collects everything written to it.
+class CollectingOutStream : public tclib::OutStream {
+public:
+  CollectingOutStream() : largest_write_(0), flush_count_(0) { }
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  virtual bool write_sync(tclib::write_iop_state_t *op);
+  virtual bool flush() { flush_count_++; return true; }
+  virtual bool close() { return true; }
+  std::vector<uint8_t> &data() { return data_; }
+  size_t largest_write() { return largest_write_; }
+  size_t flush_count() { return flush_count_; }
+private:
+  std::vector<uint8_t> data_;
+  size_t largest_write_;
+  size_t flush_count_;
+};
+
+bool CollectingOutStream::write_sync(tclib::write_iop_state_t *op) {
+  const uint8_t *src = static_cast<const uint8_t*>(op->src);
+  data_.insert(data_.end(), src, src + op->src_size);
+  if (op->src_size > largest_write_)
+    largest_write_ = op->src_size;
+  tclib::write_iop_state_deliver(op, op->src_size);
+  return true;
+}
+
+TEST(binary, streaming) {
+  Arena arena;
+  Array array = arena.new_array();
+  for (int i = 0; i < 5000; i++) {
+    Map elm = arena.new_map();
+    elm.set("i", i);
+    elm.set("s", "a string");
+    array.add(elm);
+  }
+  for (int sized = 0; sized < 2; sized++) {
+    BinaryWriter writer;
+    writer.set_sized_containers(sized == 1);
+    writer.write(array);
+    CollectingOutStream out;
+    StreamingBinaryWriter streaming(&out, 1024);
+    streaming.set_sized_containers(sized == 1);
+    ASSERT_TRUE(streaming.write(array));
+    ASSERT_TRUE(streaming.write(Variant::integer(7)));
+    ASSERT_TRUE(streaming.flush());
+    ASSERT_EQ(1, out.flush_count());
+    // The output was written in chunks no larger than the buffer plus the
+    // largest value.
+    ASSERT_TRUE(out.largest_write() < 1024 + 32);
+    ASSERT_EQ(writer.size() + 2, out.data().size());
+    ASSERT_EQ(out.data().size(), streaming.bytes_written());
+    ASSERT_EQ(0, memcmp(*writer, &out.data()[0], writer.size()));
+    BinaryReader reader(&arena);
+    Array all = reader.parse_all(&out.data()[0], out.data().size());
+    ASSERT_EQ(2, all.length());
+    ASSERT_EQ(7, all[1].integer_value());
+  }
+}
+
+TEST(binary, reuse_writer) {
+  Arena arena;
+  Array array = arena.new_array();
+  for (int i = 0; i < 100; i++)
+    array.add(i);
+  BinaryWriter writer;
+  writer.write(array);
+  uint8_t *first = *writer;
+  size_t first_size = writer.size();
+  // Writing something smaller reuses the same memory.
+  writer.write("foo");
+  ASSERT_TRUE(first == *writer);
+  ASSERT_EQ(5, writer.size());
+  BinaryReader reader(&arena);
+  ASSERT_TRUE(reader.parse(*writer, writer.size()) == Variant::string("foo"));
+  writer.reset();
+  ASSERT_EQ(0, writer.size());
+  writer.write(array);
+  ASSERT_TRUE(first == *writer);
+  ASSERT_EQ(first_size, writer.size());
+  writer.set_sized_containers(true);
+  writer.write(array);
+  ASSERT_EQ(first_size + 2, writer.size());
+  ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+  // The same goes for the C api, through an assembler.
+  pton_assembler_t *assm = pton_new_assembler();
+  pton_binary_writer_write(assm, array.to_c());
+  blob_t code = pton_assembler_peek_code(assm);
+  pton_assembler_reset(assm);
+  ASSERT_EQ(0, pton_assembler_peek_code(assm).size);
+  pton_binary_writer_write(assm, Variant::integer(1).to_c());
+  ASSERT_TRUE(code.start == pton_assembler_peek_code(assm).start);
+  pton_dispose_assembler(assm);
+}
+
+TEST(binary, references) {
+  Arena arena;
+  // References are given as the number of values back the value is. The
+  // prefix makes strings count as values that can be referenced.
+  Array pair = arena.new_array();
+  pair.add("foo");
+  pair.add("foo");
+  BinaryWriter writer;
+  writer.set_references(true);
+  writer.write(pair);
+  uint8_t expected[10] = {BinaryImplUtils::boIndexedValues,
+      BinaryImplUtils::boArray, 2, BinaryImplUtils::boDefaultString, 3, 'f',
+      'o', 'o', BinaryImplUtils::boReference, 0};
+  ASSERT_EQ(10, writer.size());
+  ASSERT_EQ(0, memcmp(expected, *writer, 10));
+  // Repeated strings and shared containers.
+  Map shared = arena.new_map();
+  shared.set("name", "a fairly long repeated string");
+  shared.set("x", 1);
+  Array array = arena.new_array();
+  for (int i = 0; i < 10; i++) {
+    Seed seed = arena.new_seed();
+    seed.set_header("Point");
+    seed.set_field("name", "a fairly long repeated string");
+    seed.set_field("shared", shared);
+    array.add(seed);
+  }
+  array.add(array);
+  BinaryWriter plain;
+  plain.set_sized_containers(true);
+  for (int sized = 0; sized < 2; sized++) {
+    writer.set_sized_containers(sized == 1);
+    writer.write(array);
+    ASSERT_EQ(writer.size(), writer.measure(array));
+    ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+    BinaryReader reader(&arena);
+    Array decoded = reader.parse(*writer, writer.size());
+    ASSERT_FALSE(reader.has_failed());
+    ASSERT_EQ(11, decoded.length());
+    // The cycle is preserved.
+    ASSERT_TRUE(decoded[10] == decoded);
+    Seed first = decoded[0];
+    Seed last = decoded[9];
+    ASSERT_TRUE(first.get_field("shared") == last.get_field("shared"));
+    ASSERT_FALSE(first.get_field("shared") == shared);
+    ASSERT_EQ(1, Map(first.get_field("shared"))["x"].integer_value());
+    ASSERT_TRUE(last.header() == Variant("Point"));
+    ASSERT_TRUE(last.get_field("name") == Variant("a fairly long repeated string"));
+    // The streaming writer makes the same decisions.
+    CollectingOutStream out;
+    StreamingBinaryWriter streaming(&out, 64);
+    streaming.set_sized_containers(sized == 1);
+    streaming.set_references(true);
+    ASSERT_TRUE(streaming.write(array));
+    ASSERT_TRUE(streaming.flush());
+    ASSERT_EQ(writer.size(), out.data().size());
+    ASSERT_EQ(0, memcmp(*writer, &out.data()[0], writer.size()));
+  }
+  // Without the cycle the value can also be written in full, which takes
+  // more space.
+  array = arena.new_array();
+  for (int i = 0; i < 10; i++)
+    array.add(shared);
+  writer.write(array);
+  plain.write(array);
+  ASSERT_TRUE(writer.size() < plain.size() / 5);
+}
+
+TEST(binary, object_references) {
+  // Without the prefix only seeds can be referenced, which is how the python
+  // codec writes references.
+  Arena arena;
+  uint8_t objects[15] = {BinaryImplUtils::boArray, 3,
+      BinaryImplUtils::boDefaultString, 1, 'a', BinaryImplUtils::boSeed, 1, 0,
+      BinaryImplUtils::boDefaultString, 1, 'P', BinaryImplUtils::boArray, 1,
+      BinaryImplUtils::boReference, 0};
+  ASSERT_TRUE(BinaryReader::validate(objects, 15));
+  BinaryReader reader(&arena);
+  Array decoded = reader.parse(objects, 15);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_EQ(3, decoded.length());
+  ASSERT_TRUE(decoded[0] == Variant("a"));
+  ASSERT_TRUE(Seed(decoded[1]).header() == Variant("P"));
+  ASSERT_TRUE(Array(decoded[2])[0].to_c().payload_.as_arena_seed_
+      == decoded[1].to_c().payload_.as_arena_seed_);
+  // A plain reference to a string refers to nothing.
+  uint8_t strings[7] = {BinaryImplUtils::boArray, 2,
+      BinaryImplUtils::boDefaultString, 1, 'a', BinaryImplUtils::boReference, 0};
+  ASSERT_FALSE(BinaryReader::validate(strings, 7));
+  reader.parse(strings, 7);
+  ASSERT_TRUE(reader.has_failed());
+  ASSERT_EQ(DecodeError::INVALID_PAYLOAD, reader.error().cause());
+}
+
+TEST(binary, parallel_references) {
+  // Values written with references are prefixed with boIndexedValues which
+  // the parallel decoder leaves to the serial one.
+  Arena arena;
+  Array array = arena.new_array();
+  for (int i = 0; i < 20000; i++) {
+    array.add("a string that is repeated throughout");
+    array.add(i);
+  }
+  BinaryWriter writer;
+  writer.set_references(true);
+  writer.write(array);
+  ASSERT_TRUE(writer.size() >= BinaryReader::kMinParallelInputSize);
+  BinaryReader reader(&arena);
+  reader.set_thread_count(4);
+  Array decoded = reader.parse(*writer, writer.size());
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_EQ(40000, decoded.length());
+  ASSERT_TRUE(decoded[39998] == Variant("a string that is repeated throughout"));
+  ASSERT_EQ(19999, decoded[39999].integer_value());
+}
+
+// Returns a map with the given entries, added in the order given.
+static Map new_map(Arena *arena, const char *k0, Variant v0, const char *k1,
+    Variant v1, const char *k2, Variant v2) {
+  Map result = arena->new_map();
+  result.set(k0, v0);
+  result.set(k1, v1);
+  result.set(k2, v2);
+  return result;
+}
+
+TEST(binary, canonical) {
+  Arena arena;
+  BinaryWriter writer;
+  writer.set_canonical(true);
+  Map small = new_map(&arena, "b", 1, "c", 3, "a", 2);
+  writer.write(small);
+  uint8_t expected[17] = {BinaryImplUtils::boMap, 3,
+      BinaryImplUtils::boDefaultString, 1, 'a', BinaryImplUtils::boInteger, 4,
+      BinaryImplUtils::boDefaultString, 1, 'b', BinaryImplUtils::boInteger, 2,
+      BinaryImplUtils::boDefaultString, 1, 'c', BinaryImplUtils::boInteger, 6};
+  ASSERT_EQ(17, writer.size());
+  ASSERT_EQ(0, memcmp(expected, *writer, 17));
+  // Two equal values built in different orders and with different sharing.
+  Seed seed_a = arena.new_seed();
+  seed_a.set_header("Point");
+  seed_a.set_field("x", 1);
+  seed_a.set_field("y", 2);
+  Seed seed_b = arena.new_seed();
+  seed_b.set_header("Point");
+  seed_b.set_field("y", 2);
+  seed_b.set_field("x", 1);
+  Map inner_a = new_map(&arena, "p", seed_a, "q", "a repeated string", "r", 5);
+  Map inner_b = new_map(&arena, "r", 5, "q", "a repeated string", "p", seed_b);
+  Map inner_c = new_map(&arena, "q", "a repeated string", "r", 5, "p", seed_a);
+  Map a = new_map(&arena, "one", inner_a, "two", inner_a, "three", small);
+  Map b = new_map(&arena, "three", new_map(&arena, "a", 2, "c", 3, "b", 1),
+      "two", inner_b, "one", inner_c);
+  for (int flags = 0; flags < 4; flags++) {
+    writer.set_sized_containers((flags & 1) != 0);
+    writer.set_references((flags & 2) != 0);
+    writer.write(a);
+    ASSERT_EQ(writer.size(), writer.measure(a));
+    std::vector<uint8_t> a_bytes(*writer, *writer + writer.size());
+    uint64_t a_hash = writer.content_hash();
+    writer.write(b);
+    ASSERT_EQ(a_bytes.size(), writer.size());
+    ASSERT_EQ(0, memcmp(&a_bytes[0], *writer, writer.size()));
+    ASSERT_TRUE(a_hash == writer.content_hash());
+    BinaryReader reader(&arena);
+    Map decoded = reader.parse(*writer, writer.size());
+    ASSERT_EQ(3, decoded.size());
+    ASSERT_EQ(5, Map(decoded["two"])["r"].integer_value());
+    // The streaming writer produces and hashes the same data.
+    CollectingOutStream out;
+    StreamingBinaryWriter streaming(&out, 7);
+    streaming.set_canonical(true);
+    streaming.set_sized_containers((flags & 1) != 0);
+    streaming.set_references((flags & 2) != 0);
+    ASSERT_TRUE(streaming.write(b));
+    ASSERT_TRUE(a_hash == streaming.content_hash());
+    ASSERT_TRUE(streaming.flush());
+    ASSERT_EQ(0, memcmp(&a_bytes[0], &out.data()[0], a_bytes.size()));
+  }
+  // Without canonical mode the encodings differ.
+  BinaryWriter plain;
+  plain.write(a);
+  std::vector<uint8_t> a_bytes(*plain, *plain + plain.size());
+  plain.write(b);
+  ASSERT_FALSE(memcmp(&a_bytes[0], *plain, plain.size()) == 0);
+}
+
+TEST(binary, preencoded) {
+  Arena arena;
+  Array inner = arena.new_array();
+  inner.add(1);
+  inner.add("foo");
+  BinaryWriter inner_writer;
+  inner_writer.write(inner);
+  Native fragment = arena.new_preencoded(*inner_writer,
+      static_cast<uint32_t>(inner_writer.size()));
+  ASSERT_TRUE(fragment.is_native());
+  Array outer = arena.new_array();
+  outer.add("foo");
+  outer.add(fragment);
+  outer.add(fragment);
+  Array expected = arena.new_array();
+  expected.add("foo");
+  expected.add(inner);
+  expected.add(inner);
+  // The fragment is spliced in as is in plain and sized mode; with references
+  // or in canonical mode it's decoded and written like any other value.
+  for (int flags = 0; flags < 8; flags++) {
+    BinaryWriter writer;
+    writer.set_sized_containers((flags & 1) != 0);
+    writer.set_references((flags & 2) != 0);
+    writer.set_canonical((flags & 4) != 0);
+    writer.write(outer);
+    ASSERT_EQ(writer.size(), writer.measure(outer));
+    BinaryReader reader(&arena);
+    Variant decoded = reader.parse(*writer, writer.size());
+    BinaryWriter plain;
+    plain.write(expected);
+    std::vector<uint8_t> expected_bytes(*plain, *plain + plain.size());
+    plain.write(decoded);
+    ASSERT_EQ(expected_bytes.size(), plain.size());
+    ASSERT_EQ(0, memcmp(&expected_bytes[0], *plain, plain.size()));
+    if (flags == 0) {
+      ASSERT_EQ(expected_bytes.size(), writer.size());
+      ASSERT_EQ(0, memcmp(&expected_bytes[0], *writer, writer.size()));
+    }
+  }
+  // Invalid data is rejected up front.
+  uint8_t truncated[2] = {BinaryImplUtils::boArray, 1};
+  ASSERT_TRUE(arena.new_preencoded(truncated, 2).is_null());
+  // Cached encodings that don't hold exactly one value aren't spliced in, so
+  // the output stays valid.
+  uint8_t pair[2] = {BinaryImplUtils::boNull, BinaryImplUtils::boNull};
+  const void *broken[2] = {truncated, pair};
+  for (size_t i = 0; i < 2; i++) {
+    Preencoded *value = new (&arena) Preencoded(arena.new_blob(broken[i], 2));
+    Array holder = arena.new_array();
+    holder.add("foo");
+    holder.add(arena.new_native(value));
+    for (int flags = 0; flags < 2; flags++) {
+      BinaryWriter writer;
+      writer.set_sized_containers(flags == 1);
+      writer.write(holder);
+      ASSERT_EQ(writer.size(), writer.measure(holder));
+      ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+    }
+  }
+}
+
+// Returns the plain encoding of the given value.
+static std::vector<uint8_t> plain_encoding(Variant value) {
+  BinaryWriter writer;
+  writer.write(value);
+  return std::vector<uint8_t>(*writer, *writer + writer.size());
+}
+
+TEST(binary, columns) {
+  Arena arena;
+  const char *names[3] = {"foo", "bar", "baz"};
+  Array maps = arena.new_array();
+  Array seeds = arena.new_array();
+  for (int64_t i = 0; i < 100; i++) {
+    Map map = arena.new_map();
+    map.set("id", 1000 + i * 3);
+    map.set("name", names[i % 3]);
+    map.set("ok", (i % 2) == 0);
+    maps.add(map);
+    Seed seed = arena.new_seed();
+    seed.set_header("Point");
+    seed.set_field("x", -i);
+    seed.set_field("y", Variant::null());
+    seeds.add(seed);
+  }
+  Array values[2] = {maps, seeds};
+  for (int v = 0; v < 2; v++) {
+    Array value = values[v];
+    std::vector<uint8_t> plain = plain_encoding(value);
+    for (int sized = 0; sized < 2; sized++) {
+      BinaryWriter writer;
+      writer.set_columnar(true);
+      writer.set_sized_containers(sized != 0);
+      writer.write(value);
+      ASSERT_EQ(BinaryImplUtils::boColumns, (*writer)[0]);
+      ASSERT_TRUE(writer.size() < plain.size() / 3);
+      ASSERT_EQ(writer.size(), writer.measure(value));
+      ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+      ASSERT_EQ(writer.size(), BinaryReader::value_size(*writer, writer.size()));
+      BinaryReader reader(&arena);
+      Array decoded = reader.parse(*writer, writer.size());
+      ASSERT_EQ(100, decoded.length());
+      std::vector<uint8_t> replain = plain_encoding(decoded);
+      ASSERT_EQ(plain.size(), replain.size());
+      ASSERT_EQ(0, memcmp(&plain[0], &replain[0], plain.size()));
+      // The streaming writer produces the same data.
+      CollectingOutStream out;
+      StreamingBinaryWriter streaming(&out, 16);
+      streaming.set_columnar(true);
+      streaming.set_sized_containers(sized != 0);
+      ASSERT_TRUE(streaming.write(value));
+      ASSERT_TRUE(streaming.flush());
+      ASSERT_EQ(writer.size(), out.data().size());
+      ASSERT_EQ(0, memcmp(*writer, &out.data()[0], writer.size()));
+    }
+  }
+  // Rows with different keys are written as a plain array.
+  Map(maps[50]).set("extra", 4);
+  BinaryWriter writer;
+  writer.set_columnar(true);
+  writer.write(maps);
+  ASSERT_EQ(BinaryImplUtils::boArray, (*writer)[0]);
+}
+
+TEST(binary, string_dictionary) {
+  // Strings are replaced in least recently used order.
+  StringDictionary dict(2);
+  dict.add("foo", 3);
+  dict.add("bar", 3);
+  dict.add("x", 1);
+  ASSERT_EQ(2, dict.size());
+  uint32_t foo = dict.find("foo", 3);
+  ASSERT_TRUE(foo != StringDictionary::kNotFound);
+  dict.touch(foo);
+  dict.add("baz", 3);
+  ASSERT_EQ(foo, dict.find("foo", 3));
+  ASSERT_EQ(StringDictionary::kNotFound, dict.find("bar", 3));
+  ASSERT_TRUE(dict.find("baz", 3) != StringDictionary::kNotFound);
+  ASSERT_TRUE(dict.get(7).is_null());
+
+  // Strings sent before are written as their index in later values.
+  Arena arena;
+  Seed request = arena.new_seed();
+  request.set_header("rpc.Request");
+  request.set_field("subject", "test_subject");
+  request.set_field("selector", "echo");
+  request.set_field("arguments", arena.new_array());
+  std::vector<uint8_t> plain = plain_encoding(request);
+  StringDictionary out_dict(16);
+  StringDictionary *in_dict = new StringDictionary(16);
+  BinaryWriter writer;
+  writer.set_string_dictionary(&out_dict);
+  BinaryReader reader(&arena);
+  reader.set_string_dictionary(in_dict);
+  Variant last;
+  for (int i = 0; i < 3; i++) {
+    // Measuring doesn't change the dictionary.
+    size_t measured = writer.measure(request);
+    writer.write(request);
+    ASSERT_EQ(measured, writer.size());
+    if (i == 0) {
+      ASSERT_EQ(plain.size(), writer.size());
+    } else {
+      ASSERT_TRUE(writer.size() < plain.size() / 3);
+    }
+    ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+    last = reader.parse(*writer, writer.size());
+    ASSERT_FALSE(reader.has_failed());
+    std::vector<uint8_t> replain = plain_encoding(last);
+    ASSERT_EQ(plain.size(), replain.size());
+    ASSERT_EQ(0, memcmp(&plain[0], &replain[0], plain.size()));
+    ASSERT_EQ(out_dict.size(), in_dict->size());
+  }
+  // Strings read from the dictionary outlive it.
+  delete in_dict;
+  ASSERT_TRUE(Seed(last).header() == Variant("rpc.Request"));
+
+  // A reader without the dictionary can't read the result.
+  BinaryReader plain_reader(&arena);
+  ASSERT_TRUE(plain_reader.parse(*writer, writer.size()).is_null());
+  ASSERT_EQ(DecodeError::INVALID_PAYLOAD, plain_reader.error().cause());
+  ASSERT_EQ(BinaryImplUtils::boDictionaryString, plain_reader.error().opcode());
+}
+
+TEST(binary, content_hash) {
+  uint8_t data[100];
+  for (size_t i = 0; i < 100; i++)
+    data[i] = static_cast<uint8_t>(i * 7);
+  uint64_t whole = ContentHasher::hash(data, 100);
+  // Hashing in pieces gives the same result regardless of how the data is
+  // split.
+  for (size_t step = 1; step < 20; step++) {
+    ContentHasher hasher;
+    for (size_t i = 0; i < 100; i += step)
+      hasher.update(data + i, (i + step <= 100) ? step : (100 - i));
+    ASSERT_TRUE(whole == hasher.digest());
+  }
+  // Different data, including just different lengths, hash differently.
+  ASSERT_FALSE(whole == ContentHasher::hash(data, 99));
+  ASSERT_FALSE(ContentHasher::hash(data, 0) == ContentHasher::hash(data, 1));
+  data[50]++;
+  ASSERT_FALSE(whole == ContentHasher::hash(data, 100));
+}
+
+TEST(binary, parallel_write) {
+  Arena arena;
+  Array array = arena.new_array();
+  Map map = arena.new_map();
+  for (int i = 0; i < 3000; i++) {
+    Seed record = arena.new_seed();
+    record.set_header("Record");
+    record.set_field("id", i);
+    record.set_field("tags", new_map(&arena, "z", i % 7, "y", "tag", "x",
+        Variant::boolean(i % 2 == 0)));
+    Array values = arena.new_array();
+    for (int j = 0; j < i % 5; j++)
+      values.add(j * i);
+    record.set_field("values", values);
+    array.add(record);
+    map.set(Variant::integer(3000 - i), record);
+  }
+  for (int flags = 0; flags < 8; flags++) {
+    BinaryWriter serial;
+    serial.set_sized_containers((flags & 1) != 0);
+    serial.set_canonical((flags & 2) != 0);
+    serial.set_references((flags & 4) != 0);
+    BinaryWriter parallel;
+    parallel.set_sized_containers((flags & 1) != 0);
+    parallel.set_canonical((flags & 2) != 0);
+    parallel.set_references((flags & 4) != 0);
+    for (size_t threads = 2; threads <= 5; threads += 3) {
+      parallel.set_thread_count(threads);
+      serial.write(array);
+      parallel.write(array);
+      ASSERT_EQ(serial.size(), parallel.size());
+      ASSERT_EQ(0, memcmp(*serial, *parallel, serial.size()));
+      serial.write(map);
+      parallel.write(map);
+      ASSERT_EQ(serial.size(), parallel.size());
+      ASSERT_EQ(0, memcmp(*serial, *parallel, serial.size()));
+    }
+  }
+}
+
+TEST(binary, open_containers) {
+  // [1, {"x": [], "y": [true]}, "a"] with both the outer array and the map
+  // open-ended, followed by a second value.
+  Assembler assm;
+  assm.begin_open_array();
+  assm.emit_int64(1);
+  assm.begin_open_map();
+  assm.emit_default_string("x", 1);
+  assm.begin_open_array();
+  assm.end_open();
+  assm.emit_default_string("y", 1);
+  assm.begin_sized_array(1);
+  assm.emit_bool(true);
+  assm.end_sized();
+  assm.end_open();
+  assm.emit_default_string("a", 1);
+  assm.end_open();
+  size_t first_size = assm.peek_code().size;
+  assm.emit_null();
+  blob_t code = assm.peek_code();
+  const uint8_t *data = static_cast<const uint8_t*>(code.start);
+  ASSERT_TRUE(BinaryReader::validate(data, first_size));
+  ASSERT_EQ(first_size, BinaryReader::value_size(data, code.size));
+  Arena arena;
+  BinaryReader reader(&arena);
+  Array all = reader.parse_all(data, code.size);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_EQ(2, all.length());
+  Array array = all[0];
+  ASSERT_EQ(3, array.length());
+  ASSERT_EQ(1, array[0].integer_value());
+  Map map = array[1];
+  ASSERT_EQ(2, map.size());
+  ASSERT_EQ(0, Array(map["x"]).length());
+  ASSERT_TRUE(Array(map["y"])[0].bool_value());
+  ASSERT_TRUE(array[2] == Variant("a"));
+  ASSERT_TRUE(all[1].is_null());
+  // Incomplete values aren't valid.
+  ASSERT_FALSE(BinaryReader::validate(data, first_size - 1));
+  ASSERT_EQ(0, BinaryReader::value_size(data, first_size - 1));
+}
+
+TEST(binary, streaming_open_containers) {
+  CollectingOutStream out;
+  StreamingBinaryWriter streaming(&out, 64);
+  ASSERT_FALSE(streaming.end());
+  ASSERT_TRUE(streaming.begin_array());
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_TRUE(streaming.begin_map());
+    ASSERT_TRUE(streaming.write("i"));
+    ASSERT_TRUE(streaming.write(i));
+    ASSERT_TRUE(streaming.end());
+  }
+  ASSERT_TRUE(streaming.end());
+  ASSERT_TRUE(streaming.flush());
+  // The output was written as it went along.
+  ASSERT_TRUE(out.largest_write() < 128);
+  Arena arena;
+  BinaryReader reader(&arena);
+  Array array = reader.parse(&out.data()[0], out.data().size());
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_EQ(1000, array.length());
+  ASSERT_EQ(999, Map(array[999])["i"].integer_value());
+}
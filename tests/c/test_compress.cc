@@ -0,0 +1,82 @@
+//- Copyright 2015 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "compress.hh"
+#include "test/asserts.hh"
+#include "test/unittest.hh"
+
+#include <vector>
+
+using namespace plankton;
+
+// Compresses and decompresses the given data, checking that the result is the
+// same as the input. Returns the compressed size.
+static size_t check_roundtrip(const std::vector<byte_t> &data) {
+  std::vector<byte_t> compressed(BlockCodec::max_compressed_size(data.size()));
+  const byte_t *src = data.empty() ? NULL : &data[0];
+  size_t size = BlockCodec::compress(src, data.size(), &compressed[0]);
+  ASSERT_TRUE(size <= compressed.size());
+  std::vector<byte_t> decompressed(data.size() + 1);
+  ASSERT_TRUE(BlockCodec::decompress(&compressed[0], size, &decompressed[0],
+      data.size()));
+  for (size_t i = 0; i < data.size(); i++)
+    ASSERT_EQ(data[i], decompressed[i]);
+  // Decompressing into a buffer of the wrong size fails.
+  ASSERT_FALSE(BlockCodec::decompress(&compressed[0], size, &decompressed[0],
+      data.size() + 1));
+  return size;
+}
+
+TEST(compress, roundtrip) {
+  std::vector<byte_t> data;
+  check_roundtrip(data);
+  for (size_t i = 0; i < 100; i++)
+    data.push_back(static_cast<byte_t>(i));
+  check_roundtrip(data);
+  // Text-like data compresses well.
+  std::vector<byte_t> text;
+  const char *line = "{\"selector\": \"ping\", \"subject\": \"storage\"}\n";
+  for (size_t i = 0; i < 200; i++) {
+    for (const char *p = line; *p != '\0'; p++)
+      text.push_back(*p);
+    text.push_back(static_cast<byte_t>('0' + (i % 10)));
+  }
+  ASSERT_TRUE(check_roundtrip(text) * 5 < text.size());
+  // Long runs produce overlapping matches and long lengths.
+  std::vector<byte_t> run(70000, 'x');
+  size_t run_size = check_roundtrip(run);
+  ASSERT_TRUE(run_size < 500);
+  ASSERT_TRUE(run.size() <= BlockCodec::max_decompressed_size(run_size));
+  // Noise doesn't grow beyond the bound.
+  std::vector<byte_t> noise;
+  uint32_t state = 1;
+  for (size_t i = 0; i < 100000; i++) {
+    state = state * 1103515245 + 12345;
+    noise.push_back(static_cast<byte_t>(state >> 24));
+  }
+  check_roundtrip(noise);
+}
+
+TEST(compress, invalid) {
+  byte_t dest[16];
+  // A back reference before the start of the output.
+  byte_t bad_offset[5] = {0x10, 'a', 2, 0, 0};
+  ASSERT_FALSE(BlockCodec::decompress(bad_offset, 5, dest, 16));
+  // A literal run longer than the input.
+  byte_t truncated[3] = {0x50, 'a', 'b'};
+  ASSERT_FALSE(BlockCodec::decompress(truncated, 3, dest, 16));
+  // A length that's cut off.
+  byte_t cut_length[1] = {0xF0};
+  ASSERT_FALSE(BlockCodec::decompress(cut_length, 1, dest, 16));
+  // Output that would overflow the destination.
+  byte_t overflow[4] = {0x1F, 'a', 1, 0};
+  ASSERT_FALSE(BlockCodec::decompress(overflow, 4, dest, 16));
+}
+
+TEST(compress, max_decompressed_size) {
+  ASSERT_EQ(16, BlockCodec::max_decompressed_size(0));
+  ASSERT_EQ(255 * 4 + 16, BlockCodec::max_decompressed_size(4));
+  // Sizes that would overflow are clamped.
+  size_t huge = static_cast<size_t>(-1) / 2;
+  ASSERT_EQ(static_cast<size_t>(-1), BlockCodec::max_decompressed_size(huge));
+}
@@ -5,6 +5,8 @@
 #include "test/unittest.hh"
 #include "plankton-binary.hh"
 #include "marshal-inl.hh"
+#include "struct-codec.hh"
+#include "sync/thread.hh"
 
 BEGIN_C_INCLUDES
 #include "utils/strbuf.h"
@@ -267,6 +269,54 @@ TEST(marshal, variant_map) {
   ASSERT_EQ(7, *ints[Variant::null()]);
 }
 
+TEST(marshal, variant_map_keys) {
+  Arena arena;
+  VariantMap<int> map;
+  // Strings are compared by their full contents.
+  map.set(arena.new_string("a\0b", 3), 1);
+  map.set(arena.new_string("a\0c", 3), 2);
+  map.set(arena.new_string("a", 1), 3);
+  ASSERT_EQ(1, *map[Variant::string("a\0b", 3)]);
+  ASSERT_EQ(2, *map[Variant::string("a\0c", 3)]);
+  ASSERT_EQ(3, *map["a"]);
+  ASSERT_TRUE(map[Variant::blob("a", 1)] == NULL);
+  map.set(Variant::blob("a", 1), 4);
+  ASSERT_EQ(4, *map[Variant::blob("a", 1)]);
+  ASSERT_EQ(3, *map["a"]);
+  // Integers, ids, and bools by value.
+  map.set(8, 5);
+  map.set(Variant::id(64, 8), 6);
+  map.set(Variant::id(32, 8), 7);
+  map.set(Variant::no(), 8);
+  ASSERT_EQ(5, *map[8]);
+  ASSERT_EQ(6, *map[Variant::id(64, 8)]);
+  ASSERT_EQ(7, *map[Variant::id(32, 8)]);
+  ASSERT_EQ(8, *map[Variant::no()]);
+  ASSERT_TRUE(map[Variant::yes()] == NULL);
+  ASSERT_TRUE(map[Variant::id(64, 9)] == NULL);
+  // Containers and seeds by identity.
+  Seed s0 = arena.new_seed();
+  Seed s1 = arena.new_seed();
+  Array a0 = arena.new_array();
+  map.set(s0, 9);
+  map.set(a0, 10);
+  ASSERT_EQ(9, *map[s0]);
+  ASSERT_TRUE(map[s1] == NULL);
+  ASSERT_EQ(10, *map[a0]);
+  ASSERT_TRUE(map[arena.new_array()] == NULL);
+  map.set(s0, 11);
+  ASSERT_EQ(11, *map[s0]);
+  ASSERT_EQ(10, map.size());
+  // Many non-string keys still work after the table has grown.
+  VariantMap<int64_t> ids;
+  for (int64_t i = 0; i < 1000; i++)
+    ids.set(Variant::id(64, i * 7), i);
+  ASSERT_EQ(1000, ids.size());
+  for (int64_t i = 0; i < 1000; i++)
+    ASSERT_EQ(i, *ids[Variant::id(64, i * 7)]);
+  ASSERT_TRUE(ids[Variant::id(64, 1)] == NULL);
+}
+
 class A {
 public:
   A(int *count) : count_(count) { inc(); }
@@ -360,3 +410,350 @@ TEST(marshal, native_info) {
   ASSERT_PTREQ(NULL, var.native_object());
   ASSERT_PTREQ(NULL, var.native_type());
 }
+
+struct Coord {
+  int64_t x;
+  int32_t y;
+  PLANKTON_FIELDS(Coord, "struct.Coord", x, y)
+};
+
+struct Track {
+  std::string name;
+  bool visible;
+  uint8_t layer;
+  std::vector<Coord> coords;
+  std::vector<std::string> tags;
+  PLANKTON_FIELDS(Track, "struct.Track", name, visible, layer, coords, tags)
+};
+
+// Returns a track with some contents.
+static Track new_track() {
+  Track track;
+  track.name = "route";
+  track.visible = true;
+  track.layer = 3;
+  for (int64_t i = 0; i < 5; i++) {
+    Coord coord = {i, static_cast<int32_t>(-i)};
+    track.coords.push_back(coord);
+  }
+  track.tags.push_back("a");
+  track.tags.push_back("bc");
+  return track;
+}
+
+TEST(marshal, struct_roundtrip) {
+  Track track = new_track();
+  Assembler assm;
+  ASSERT_TRUE(StructCodec<Track>::encode(&assm, track));
+  blob_t code = assm.peek_code();
+  InstrReader in(code.start, code.size);
+  Track decoded;
+  ASSERT_TRUE(StructCodec<Track>::decode(&in, &decoded));
+  ASSERT_TRUE(in.at_end());
+  ASSERT_TRUE(decoded.name == "route");
+  ASSERT_TRUE(decoded.visible);
+  ASSERT_EQ(3, decoded.layer);
+  ASSERT_EQ(5, decoded.coords.size());
+  ASSERT_EQ(4, decoded.coords[4].x);
+  ASSERT_EQ(-4, decoded.coords[4].y);
+  ASSERT_EQ(2, decoded.tags.size());
+  ASSERT_TRUE(decoded.tags[1] == "bc");
+  // The encoding is an ordinary seed.
+  Arena arena;
+  BinaryReader reader(&arena);
+  Seed seed = reader.parse(code.start, code.size);
+  ASSERT_TRUE(seed.header() == Variant("struct.Track"));
+  ASSERT_TRUE(seed.get_field("name") == Variant("route"));
+  ASSERT_EQ(5, Array(seed.get_field("coords")).length());
+  Seed coord = Array(seed.get_field("coords"))[2];
+  ASSERT_TRUE(coord.header() == Variant("struct.Coord"));
+  ASSERT_EQ(-2, coord.get_field("y").integer_value());
+}
+
+TEST(marshal, struct_from_seed) {
+  // Fields can come in any order, unknown fields are skipped, and missing
+  // fields are left alone.
+  Arena arena;
+  Seed coord = arena.new_seed();
+  coord.set_header("struct.Coord");
+  coord.set_field("y", 8);
+  coord.set_field("z", arena.new_array());
+  coord.set_field("x", 7);
+  Seed seed = arena.new_seed();
+  seed.set_header("struct.Track");
+  seed.set_field("extra", coord);
+  seed.set_field("layer", 9);
+  Array coords = arena.new_array();
+  coords.add(coord);
+  seed.set_field("coords", coords);
+  BinaryWriter writer;
+  writer.write(seed);
+  InstrReader in(*writer, writer.size());
+  Track track;
+  track.name = "unchanged";
+  ASSERT_TRUE(StructCodec<Track>::decode(&in, &track));
+  ASSERT_TRUE(track.name == "unchanged");
+  ASSERT_EQ(9, track.layer);
+  ASSERT_EQ(1, track.coords.size());
+  ASSERT_EQ(7, track.coords[0].x);
+  ASSERT_EQ(8, track.coords[0].y);
+  // Values of the wrong type or out of range are rejected.
+  Seed wrong = arena.new_seed();
+  wrong.set_header("struct.Track");
+  wrong.set_field("layer", 256);
+  writer.write(wrong);
+  InstrReader wrong_in(*writer, writer.size());
+  ASSERT_FALSE(StructCodec<Track>::decode(&wrong_in, &track));
+  writer.write(coord);
+  InstrReader coord_in(*writer, writer.size());
+  ASSERT_FALSE(StructCodec<Track>::decode(&coord_in, &track));
+}
+
+TEST(marshal, struct_oversized_array) {
+  // An array that claims more elements than the input could hold is rejected
+  // rather than allocated.
+  uint8_t oversized[6] = {BinaryImplUtils::boArray, 0xFF, 0xFE, 0xFE, 0xFE, 0x0E};
+  InstrReader oversized_in(oversized, 6);
+  std::vector<Coord> coords;
+  ASSERT_FALSE(StructCodec< std::vector<Coord> >::decode(&oversized_in, &coords));
+  ASSERT_EQ(0, coords.size());
+  // So is one that is cut off after some of its elements.
+  Assembler assm;
+  std::vector<int64_t> ints;
+  for (int64_t i = 0; i < 10; i++)
+    ints.push_back(i);
+  ASSERT_TRUE(StructCodec< std::vector<int64_t> >::encode(&assm, ints));
+  blob_t code = assm.peek_code();
+  std::vector<int64_t> decoded;
+  InstrReader truncated_in(code.start, code.size - 3);
+  ASSERT_FALSE(StructCodec< std::vector<int64_t> >::decode(&truncated_in, &decoded));
+  InstrReader complete_in(code.start, code.size);
+  ASSERT_TRUE(StructCodec< std::vector<int64_t> >::decode(&complete_in, &decoded));
+  ASSERT_EQ(10, decoded.size());
+  ASSERT_EQ(9, decoded[9]);
+}
+
+class Segment {
+public:
+  Segment()
+    : length_(0)
+    , fieldc_(0) { }
+  Segment(int64_t length, Variant label)
+    : length_(length)
+    , label_(label)
+    , fieldc_(0) { }
+  int64_t length() { return length_; }
+  Variant label() { return label_; }
+  int fieldc() { return fieldc_; }
+  static StreamingSeedType<Segment> *seed_type() { return &kType; }
+  static Segment *new_instance(Variant header, Factory *factory);
+  void on_field(Variant key, Variant value, Factory *factory);
+  bool encode_to(Assembler *assm);
+  Variant to_seed(Factory *factory);
+private:
+  static StreamingSeedType<Segment> kType;
+  int64_t length_;
+  Variant label_;
+  int fieldc_;
+};
+
+StreamingSeedType<Segment> Segment::kType("binary.Segment");
+
+Segment *Segment::new_instance(Variant header, Factory *factory) {
+  return new (*factory) Segment();
+}
+
+void Segment::on_field(Variant key, Variant value, Factory *factory) {
+  fieldc_++;
+  if (key == Variant("length")) {
+    length_ = value.integer_value();
+  } else if (key == Variant("label")) {
+    label_ = value;
+  }
+}
+
+bool Segment::encode_to(Assembler *assm) {
+  return assm->begin_seed(1, 2)
+      && BinaryWriter::write_to(assm, seed_type()->header())
+      && assm->emit_default_string("length", 6)
+      && assm->emit_int64(length_)
+      && assm->emit_default_string("label", 5)
+      && BinaryWriter::write_to(assm, label_);
+}
+
+Variant Segment::to_seed(Factory *factory) {
+  Seed obj = factory->new_seed(seed_type());
+  obj.set_field("length", length_);
+  obj.set_field("label", label_);
+  return obj;
+}
+
+static void check_streaming_encode(bool sized) {
+  Arena arena;
+  Array label = arena.new_array();
+  label.add("a");
+  label.add(4);
+  Segment first(3, label);
+  Segment second(5, "b");
+  Array segments = arena.new_array();
+  segments.add(arena.new_native(&first));
+  segments.add(arena.new_native(&second));
+  BinaryWriter out;
+  out.set_sized_containers(sized);
+  out.write(segments);
+  // The seeds themselves are written however encode_to writes them, which
+  // here is unsized, so without sizes the output is the same as writing the
+  // seeds the slow way.
+  Array seeds = arena.new_array();
+  seeds.add(first.to_seed(&arena));
+  seeds.add(second.to_seed(&arena));
+  BinaryWriter expected;
+  expected.set_sized_containers(sized);
+  expected.write(seeds);
+  if (!sized) {
+    ASSERT_EQ(expected.size(), out.size());
+    ASSERT_EQ(0, memcmp(*expected, *out, out.size()));
+  } else {
+    // The fields encode_to writes through write_to are sized like the rest.
+    Assembler assm;
+    assm.begin_sized_array(2);
+    assm.begin_seed(1, 2);
+    assm.emit_default_string("binary.Segment", 14);
+    assm.emit_default_string("length", 6);
+    assm.emit_int64(3);
+    assm.emit_default_string("label", 5);
+    assm.begin_sized_array(2);
+    assm.emit_default_string("a", 1);
+    assm.emit_int64(4);
+    assm.end_sized();
+    assm.begin_seed(1, 2);
+    assm.emit_default_string("binary.Segment", 14);
+    assm.emit_default_string("length", 6);
+    assm.emit_int64(5);
+    assm.emit_default_string("label", 5);
+    assm.emit_default_string("b", 1);
+    assm.end_sized();
+    blob_t code = assm.peek_code();
+    ASSERT_EQ(code.size, out.size());
+    ASSERT_EQ(0, memcmp(code.start, *out, out.size()));
+  }
+  TypeRegistry registry;
+  registry.register_type<Segment>();
+  BinaryReader in(&arena);
+  in.set_type_registry(&registry);
+  Array value = in.parse(*out, out.size());
+  ASSERT_EQ(2, value.length());
+  Segment *s0 = Native(value[0]).as<Segment>();
+  ASSERT_EQ(3, s0->length());
+  ASSERT_EQ(2, s0->fieldc());
+  ASSERT_EQ(2, s0->label().array_length());
+  ASSERT_EQ(4, Array(s0->label())[1].integer_value());
+  Segment *s1 = Native(value[1]).as<Segment>();
+  ASSERT_EQ(5, s1->length());
+  ASSERT_EQ(2, s1->fieldc());
+  ASSERT_TRUE(s1->label() == Variant("b"));
+}
+
+TEST(marshal, streaming_encode) {
+  check_streaming_encode(false);
+  check_streaming_encode(true);
+}
+
+TEST(marshal, registry_fallbacks) {
+  StreamingSeedType<Segment> shadow("binary.Point");
+  TypeRegistry first;
+  TypeRegistry second;
+  TypeRegistry registry;
+  registry.add_fallback(&first);
+  registry.add_fallback(&second);
+  // Fallbacks are allowed to loop.
+  second.add_fallback(&registry);
+  first.register_type<Rect>();
+  second.register_type<Point>();
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == Point::seed_type());
+  ASSERT_TRUE(registry.resolve_type("binary.Rect") == Rect::seed_type());
+  ASSERT_TRUE(second.resolve_type("binary.Rect") == Rect::seed_type());
+  ASSERT_TRUE(registry.resolve_type("binary.Segment") == NULL);
+  // Changes to a fallback are picked up, and earlier registries take
+  // precedence over later ones.
+  first.register_type(&shadow);
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == &shadow);
+  ASSERT_TRUE(second.resolve_type("binary.Point") == Point::seed_type());
+  registry.register_type<Segment>();
+  ASSERT_TRUE(registry.resolve_type("binary.Segment") == Segment::seed_type());
+  ASSERT_TRUE(first.resolve_type("binary.Segment") == NULL);
+  // Within a registry the latest registration wins.
+  registry.register_type<Point>();
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == Point::seed_type());
+}
+
+static const size_t kRegistryTypeCount = 64;
+
+static opaque_t resolve_while_registering(TypeRegistry *registry) {
+  for (size_t i = 0; i < 10000; i++) {
+    ASSERT_TRUE(registry->resolve_type("binary.Point") == Point::seed_type());
+    ASSERT_TRUE(registry->resolve_type("binary.Rect") == NULL);
+  }
+  return o0();
+}
+
+TEST(marshal, registry_concurrent) {
+  Arena arena;
+  std::vector<StreamingSeedType<Segment>*> types;
+  for (size_t i = 0; i < kRegistryTypeCount; i++) {
+    char header[16];
+    sprintf(header, "concurrent.%i", static_cast<int>(i));
+    types.push_back(new StreamingSeedType<Segment>(
+        arena.new_string(header, static_cast<uint32_t>(strlen(header)))));
+  }
+  TypeRegistry fallback;
+  fallback.register_type<Point>();
+  TypeRegistry registry;
+  registry.add_fallback(&fallback);
+  tclib::NativeThread readers[4];
+  for (size_t i = 0; i < 4; i++) {
+    readers[i] = tclib::new_callback(resolve_while_registering, &registry);
+    ASSERT_TRUE(readers[i].start());
+  }
+  for (size_t i = 0; i < kRegistryTypeCount; i++)
+    ((i % 2) == 0 ? registry : fallback).register_type(types[i]);
+  for (size_t i = 0; i < 4; i++)
+    ASSERT_TRUE(readers[i].join(NULL));
+  for (size_t i = 0; i < kRegistryTypeCount; i++) {
+    ASSERT_TRUE(registry.resolve_type(types[i]->header()) == types[i]);
+    delete types[i];
+  }
+}
+
+TEST(marshal, registry_retired) {
+  Arena arena;
+  std::vector<StreamingSeedType<Segment>*> types;
+  for (size_t i = 0; i < kRegistryTypeCount; i++) {
+    char header[16];
+    sprintf(header, "retired.%i", static_cast<int>(i));
+    types.push_back(new StreamingSeedType<Segment>(
+        arena.new_string(header, static_cast<uint32_t>(strlen(header)))));
+  }
+  TypeRegistry registry;
+  registry.register_type<Point>();
+  tclib::NativeThread readers[4];
+  for (size_t i = 0; i < 4; i++) {
+    readers[i] = tclib::new_callback(resolve_while_registering, &registry);
+    ASSERT_TRUE(readers[i].start());
+  }
+  // While the readers keep resolving, the snapshots replaced by each
+  // registration are freed except the ones a reader may be holding right
+  // then, at most one per thread.
+  for (size_t i = 0; i < kRegistryTypeCount; i++) {
+    registry.register_type(types[i]);
+    ASSERT_TRUE(registry.resolve_type(types[i]->header()) == types[i]);
+    ASSERT_TRUE(registry.retired_snapshot_count() <= 5);
+  }
+  for (size_t i = 0; i < 4; i++)
+    ASSERT_TRUE(readers[i].join(NULL));
+  // Once they're done the next change frees the rest.
+  registry.register_type<Point>();
+  ASSERT_EQ(0, registry.retired_snapshot_count());
+  for (size_t i = 0; i < kRegistryTypeCount; i++)
+    delete types[i];
+}
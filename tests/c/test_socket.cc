@@ -3,6 +3,8 @@
 
 #include "test/asserts.hh"
 #include "test/unittest.hh"
+#include "plankton-binary.hh"
+#include "marshal-inl.hh"
 #include "plankton-inl.hh"
 #include "socket.hh"
 
@@ -80,3 +82,334 @@ TEST(socket, push_stream) {
     ;
   ASSERT_EQ(3, call_count);
 }
+
+TEST(socket, string_dictionary) {
+  Arena arena;
+  Seed request = arena.new_seed();
+  request.set_header("rpc.Request");
+  request.set_field("selector", "ping");
+  size_t sizes[2];
+  for (int dict = 0; dict < 2; dict++) {
+    ByteOutStream out;
+    OutputSocket outsock(&out);
+    ASSERT_TRUE(outsock.set_string_dictionary_size(dict == 0 ? 0 : 64));
+    outsock.init();
+    ASSERT_FALSE(outsock.set_string_dictionary_size(32));
+    for (int i = 0; i < 10; i++)
+      outsock.send_value(request);
+    sizes[dict] = out.data().size();
+    ByteInStream in(out.data().data(), out.data().size());
+    InputSocket insock(&in);
+    ASSERT_TRUE(insock.init());
+    while (insock.process_next_instruction(NULL))
+      ;
+    BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+    for (int i = 0; i < 10; i++) {
+      Seed received = root_stream->pull_message(&arena);
+      ASSERT_TRUE(received.header() == Variant("rpc.Request"));
+      ASSERT_TRUE(received.get_field("selector") == Variant("ping"));
+    }
+    ASSERT_TRUE(root_stream->is_empty());
+  }
+  ASSERT_TRUE(sizes[1] < sizes[0]);
+}
+
+// Appends the socket encoding of the given integer to the given data.
+static void append_uint64(std::vector<byte_t> *data, uint64_t value) {
+  uint8_t varint[BinaryImplUtils::kMaxVarintSize];
+  size_t size = BinaryImplUtils::encode_uint64(value, varint);
+  data->insert(data->end(), varint, varint + size);
+}
+
+// Appends 0s to the given data until its size is a multiple of 8.
+static void append_padding(std::vector<byte_t> *data) {
+  while ((data->size() % 8) != 0)
+    data->push_back(0);
+}
+
+// Appends a socket instruction with a single integer argument, and the
+// padding after it, to the given data.
+static void append_instruction(std::vector<byte_t> *data, byte_t opcode,
+    uint64_t arg) {
+  data->push_back(opcode);
+  append_uint64(data, arg);
+  append_padding(data);
+}
+
+TEST(socket, string_dictionary_limit) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  ASSERT_FALSE(outsock.set_string_dictionary_size(StringDictionary::kMaxCapacity + 1));
+  ASSERT_TRUE(outsock.set_string_dictionary_size(StringDictionary::kMaxCapacity));
+  outsock.init();
+  // A peer asking for a larger dictionary is an error.
+  std::vector<byte_t> data(out.data().begin(), out.data().begin() + 8);
+  append_instruction(&data, kSetStringDictionarySize,
+      StringDictionary::kMaxCapacity + 1);
+  ByteInStream in(&data[0], data.size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  InputSocket::ProcessInstrStatus status;
+  ASSERT_FALSE(insock.process_next_instruction(&status));
+  ASSERT_TRUE(status.is_error());
+  // So is one that doesn't even fit in 32 bits.
+  std::vector<byte_t> wide(out.data().begin(), out.data().begin() + 8);
+  append_instruction(&wide, kSetStringDictionarySize,
+      static_cast<uint64_t>(1) << 40);
+  ByteInStream wide_in(&wide[0], wide.size());
+  InputSocket wide_insock(&wide_in);
+  ASSERT_TRUE(wide_insock.init());
+  ASSERT_FALSE(wide_insock.process_next_instruction(&status));
+  ASSERT_TRUE(status.is_error());
+}
+
+// Returns the value sent at the given tick in the delta tests: a large map of
+// which a few entries change from tick to tick.
+static Map delta_tick(Factory *factory, int64_t tick) {
+  Map result = factory->new_map();
+  char key[16];
+  for (int64_t i = 0; i < 100; i++) {
+    sprintf(key, "key_%i", static_cast<int>(i));
+    result.set(factory->new_string(key, static_cast<uint32_t>(strlen(key))), (i == tick % 100) ? tick * 1000 : i);
+  }
+  Array log = factory->new_array();
+  for (int64_t i = 0; i <= tick; i++)
+    log.add(i);
+  result.set("log", log);
+  if ((tick % 2) == 0)
+    result.set("even", tick);
+  Seed seed = factory->new_seed();
+  seed.set_header("test.Tick");
+  seed.set_field("tick", tick);
+  seed.set_field("name", "tick");
+  result.set("seed", seed);
+  return result;
+}
+
+// Checks that the given value is what delta_tick returns for the given tick.
+static void check_delta_tick(Map value, int64_t tick) {
+  ASSERT_EQ((tick % 2) == 0 ? 103 : 102, value.size());
+  char key[16];
+  sprintf(key, "key_%i", static_cast<int>(tick % 100));
+  ASSERT_EQ(tick * 1000, value[Variant(key)].integer_value());
+  Array log = value["log"];
+  ASSERT_EQ(tick + 1, log.length());
+  ASSERT_EQ(tick, log[log.length() - 1].integer_value());
+  ASSERT_EQ((tick % 2) == 0, !value["even"].is_null());
+  Seed seed = value["seed"];
+  ASSERT_TRUE(seed.header() == Variant("test.Tick"));
+  ASSERT_EQ(tick, seed.get_field("tick").integer_value());
+  ASSERT_TRUE(seed.get_field("name") == Variant("tick"));
+}
+
+TEST(socket, value_patch) {
+  Arena arena;
+  for (int64_t tick = 0; tick < 10; tick++) {
+    Variant old_value = delta_tick(&arena, tick);
+    Variant new_value = delta_tick(&arena, tick + 1);
+    Variant patch = ValuePatch::diff(old_value, new_value, &arena);
+    Variant result;
+    ASSERT_TRUE(ValuePatch::apply(old_value, patch, &arena, &result));
+    check_delta_tick(result, tick + 1);
+    Variant same = ValuePatch::diff(new_value, result, &arena);
+    ASSERT_EQ(ValuePatch::kUnchanged, Array(same)[0].integer_value());
+  }
+  // Splicing into the middle of an array.
+  Array before = arena.new_array();
+  Array after = arena.new_array();
+  for (int64_t i = 0; i < 10; i++) {
+    before.add(i);
+    after.add(i);
+    if (i == 4)
+      after.add("x");
+  }
+  Array splice = ValuePatch::diff(before, after, &arena);
+  ASSERT_EQ(ValuePatch::kSpliceArray, splice[0].integer_value());
+  ASSERT_EQ(5, splice[1].integer_value());
+  ASSERT_EQ(0, splice[2].integer_value());
+  Variant result;
+  ASSERT_TRUE(ValuePatch::apply(before, splice, &arena, &result));
+  Array spliced = result;
+  ASSERT_EQ(11, spliced.length());
+  ASSERT_TRUE(spliced[5] == Variant("x"));
+  ASSERT_EQ(9, spliced[10].integer_value());
+  // A patch that doesn't match the value is rejected.
+  ASSERT_FALSE(ValuePatch::apply(Variant::integer(3), splice, &arena, &result));
+}
+
+TEST(socket, deltas) {
+  Arena arena;
+  static const int64_t kTickCount = 24;
+  size_t sizes[2];
+  for (int delta = 0; delta < 2; delta++) {
+    ByteOutStream out;
+    OutputSocket outsock(&out);
+    outsock.set_delta_resync_interval(delta == 0 ? 0 : 8);
+    outsock.init();
+    for (int64_t tick = 0; tick < kTickCount; tick++)
+      outsock.send_value(delta_tick(&arena, tick));
+    sizes[delta] = out.data().size();
+    ByteInStream in(out.data().data(), out.data().size());
+    InputSocket insock(&in);
+    ASSERT_TRUE(insock.init());
+    while (insock.process_next_instruction(NULL))
+      ;
+    BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+    std::vector<Variant> received;
+    for (int64_t tick = 0; tick < kTickCount; tick++)
+      received.push_back(root_stream->pull_message(&arena));
+    ASSERT_TRUE(root_stream->is_empty());
+    // Values stay valid and unchanged when later deltas are applied.
+    for (int64_t tick = 0; tick < kTickCount; tick++)
+      check_delta_tick(received[tick], tick);
+  }
+  ASSERT_TRUE(sizes[1] * 3 < sizes[0]);
+}
+
+class Tick {
+public:
+  explicit Tick(int64_t value) : value_(value) { }
+  int64_t value() { return value_; }
+  static SeedType<Tick> *seed_type() { return &kType; }
+private:
+  static Tick *new_instance(Variant header, Factory *factory);
+  void init(Seed payload, Factory *factory);
+  Variant to_seed(Factory *factory);
+  static SeedType<Tick> kType;
+  int64_t value_;
+};
+
+Tick *Tick::new_instance(Variant header, Factory *factory) {
+  return new (*factory) Tick(0);
+}
+
+void Tick::init(Seed payload, Factory *factory) {
+  value_ = payload.get_field("value").integer_value();
+}
+
+Variant Tick::to_seed(Factory *factory) {
+  Seed obj = factory->new_seed(seed_type());
+  obj.set_field("value", value_);
+  return obj;
+}
+
+SeedType<Tick> Tick::kType("test.Tick",
+    tclib::new_callback(Tick::new_instance),
+    tclib::new_callback(&Tick::init),
+    tclib::new_callback(&Tick::to_seed));
+
+TEST(socket, delta_natives) {
+  Arena arena;
+  static const int64_t kTickCount = 12;
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  outsock.set_delta_resync_interval(4);
+  outsock.init();
+  for (int64_t tick = 0; tick < kTickCount; tick++) {
+    Tick current(tick);
+    NativeVariant native(&current);
+    Map value = arena.new_map();
+    value.set("tick", native);
+    Array padding = arena.new_array();
+    for (int64_t i = 0; i < 50; i++)
+      padding.add(i);
+    value.set("padding", padding);
+    outsock.send_value(value);
+  }
+  ByteInStream in(out.data().data(), out.data().size());
+  InputSocket insock(&in);
+  TypeRegistry registry;
+  registry.register_type<Tick>();
+  insock.set_default_type_registry(&registry);
+  ASSERT_TRUE(insock.init());
+  while (insock.process_next_instruction(NULL))
+    ;
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  for (int64_t tick = 0; tick < kTickCount; tick++) {
+    Map value = root_stream->pull_message(&arena);
+    // Deltas are resolved through the registry like full values.
+    Tick *received = value["tick"].native_as<Tick>();
+    ASSERT_TRUE(received != NULL);
+    ASSERT_EQ(tick, received->value());
+    ASSERT_EQ(50, Array(value["padding"]).length());
+  }
+}
+
+TEST(socket, compression) {
+  Arena arena;
+  Array rows = arena.new_array();
+  for (int64_t i = 0; i < 200; i++) {
+    Map row = arena.new_map();
+    row.set("name", "a reasonably long and repetitive piece of text");
+    row.set("index", i);
+    rows.add(row);
+  }
+  size_t sizes[2];
+  for (int compress = 0; compress < 2; compress++) {
+    ByteOutStream out;
+    OutputSocket outsock(&out);
+    ASSERT_TRUE(outsock.set_compression_threshold(compress == 0 ? 0 : 256));
+    outsock.init();
+    ASSERT_FALSE(outsock.set_compression_threshold(128));
+    // A value below the threshold and one above.
+    outsock.send_value("small");
+    outsock.send_value(rows);
+    sizes[compress] = out.data().size();
+    ByteInStream in(out.data().data(), out.data().size());
+    InputSocket insock(&in);
+    ASSERT_TRUE(insock.init());
+    ASSERT_TRUE(insock.process_all_instructions());
+    BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+    ASSERT_TRUE(root_stream->pull_message(&arena) == Variant("small"));
+    Array received = root_stream->pull_message(&arena);
+    ASSERT_EQ(200, received.length());
+    for (int64_t i = 0; i < 200; i++) {
+      Map row = received[static_cast<uint32_t>(i)];
+      ASSERT_TRUE(row["name"] == Variant("a reasonably long and repetitive piece of text"));
+      ASSERT_EQ(i, row["index"].integer_value());
+    }
+    ASSERT_TRUE(root_stream->is_empty());
+  }
+  ASSERT_TRUE(sizes[1] * 3 < sizes[0]);
+}
+
+TEST(socket, compression_limit) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  ASSERT_TRUE(outsock.set_compression_threshold(64));
+  outsock.init();
+  // A compressed frame that claims to decompress to far more than it could is
+  // rejected.
+  std::vector<byte_t> data(out.data().begin(), out.data().end());
+  data.push_back(kSendValue);
+  append_uint64(&data, 1);
+  data.push_back(BinaryImplUtils::boNull);
+  append_uint64(&data, (4 << 1) | 1);
+  append_uint64(&data, static_cast<uint64_t>(1) << 40);
+  for (int i = 0; i < 4; i++)
+    data.push_back(0);
+  append_padding(&data);
+  ByteInStream in(&data[0], data.size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  InputSocket::ProcessInstrStatus status;
+  while (insock.process_next_instruction(&status))
+    ;
+  ASSERT_TRUE(status.is_error());
+}
+
+TEST(socket, compression_operand) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  // An unknown compression scheme is an error, including one that doesn't fit
+  // in 32 bits.
+  std::vector<byte_t> data(out.data().begin(), out.data().begin() + 8);
+  append_instruction(&data, kSetCompression, static_cast<uint64_t>(1) << 40);
+  ByteInStream in(&data[0], data.size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  InputSocket::ProcessInstrStatus status;
+  ASSERT_FALSE(insock.process_next_instruction(&status));
+  ASSERT_TRUE(status.is_error());
+}
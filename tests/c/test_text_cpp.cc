@@ -280,6 +280,25 @@ TEST(text_cpp, strings) {
   check_command_fails('\0', 6, "{--b c");
 }
 
+TEST(text_cpp, validate_strings) {
+  TextReader reader;
+  reader.set_validate_strings(true);
+  String ascii = reader.parse("\"foo\"", 5);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_TRUE(ascii.is_ascii());
+  ASSERT_TRUE(ascii.is_frozen());
+  String utf8 = reader.parse("\"\\xc3\\xa5\"", 10);
+  ASSERT_FALSE(reader.has_failed());
+  ASSERT_FALSE(utf8.is_ascii());
+  ASSERT_EQ(2, utf8.length());
+  reader.parse("\"\\xc3\"", 6);
+  ASSERT_TRUE(reader.has_failed());
+  // Without validation the same string is accepted.
+  TextReader lenient;
+  ASSERT_EQ(1, String(lenient.parse("\"\\xc3\"", 6)).length());
+  ASSERT_FALSE(lenient.has_failed());
+}
+
 TEST(text_cpp, comments) {
   check_both_rewrite("# here comes false\n %f", "%f");
   check_both_rewrite("# here comes false then true %f\n %t", "%t");
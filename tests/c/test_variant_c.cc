@@ -75,3 +75,45 @@ TEST(variant_c, string_encoding) {
   pton_variant_t variant = pton_c_str("foo");
   ASSERT_EQ(PTON_CHARSET_UTF_8, pton_string_encoding(variant));
 }
+
+#define CHECK_UTF8(VALID, ASCII, STR) do {                                     \
+  const char *str = (STR);                                                     \
+  size_t size = strlen(str);                                                   \
+  char copy[64];                                                               \
+  memset(copy, 0, 64);                                                         \
+  bool is_ascii = false;                                                       \
+  ASSERT_EQ((VALID), pton_validate_utf8(str, size, copy, &is_ascii));          \
+  if (VALID) {                                                                 \
+    ASSERT_EQ((ASCII), is_ascii);                                              \
+    ASSERT_EQ(0, strcmp(str, copy));                                           \
+  }                                                                            \
+} while (false)
+
+TEST(variant_c, validate_utf8) {
+  CHECK_UTF8(true, true, "");
+  CHECK_UTF8(true, true, "foo");
+  CHECK_UTF8(true, true, "a string that is longer than a word");
+  CHECK_UTF8(true, false, "bl\xc3\xa5" "b\xc3\xa6" "rgr\xc3\xb8" "d");
+  CHECK_UTF8(true, false, "eight ch\xe2\x82\xac and more");
+  CHECK_UTF8(true, false, "\xf0\x9f\x90\x99 octopus");
+  CHECK_UTF8(true, false, "\xf4\x8f\xbf\xbf");
+  // Non-ascii after and inside blocks of 16 ascii bytes.
+  CHECK_UTF8(true, false, "sixteen bytes...\xc3\xa5 and then some more ascii");
+  CHECK_UTF8(true, false, "fifteen bytes..\xc3\xa5 and then some more ascii");
+  // Stray continuation bytes and truncated sequences.
+  CHECK_UTF8(false, false, "\x80");
+  CHECK_UTF8(false, false, "abcdefgh\xbf");
+  CHECK_UTF8(false, false, "abcdefghijklmnopqrstuvwxyz\xbf");
+  CHECK_UTF8(false, false, "\xc3");
+  CHECK_UTF8(false, false, "\xe2\x82");
+  CHECK_UTF8(false, false, "\xc3" "a");
+  // Overlong encodings.
+  CHECK_UTF8(false, false, "\xc0\xaf");
+  CHECK_UTF8(false, false, "\xe0\x80\xaf");
+  CHECK_UTF8(false, false, "\xf0\x80\x80\xaf");
+  // Surrogates and code points beyond U+10FFFF.
+  CHECK_UTF8(false, false, "\xed\xa0\x80");
+  CHECK_UTF8(false, false, "\xf4\x90\x80\x80");
+  CHECK_UTF8(false, false, "\xff");
+  ASSERT_TRUE(pton_validate_utf8("foo", 3, NULL, NULL));
+}
@@ -28,6 +28,36 @@ class ContainerTest(unittest.TestCase):
     self.assertEquals([1, 2, 3], values.next())
     self.assertEquals({"a": 3}, values.next())
 
+  def test_sized_containers(self):
+    decoder = plankton.Decoder()
+    self.assertEquals([1, 2], decoder.decode(bytearray([14, 2, 4, 0, 2, 0, 4])))
+    self.assertEquals({"a": 3}, decoder.decode(bytearray([15, 1, 5, 1, 1, 97, 0, 6])))
+
+  def test_references(self):
+    decoder = plankton.Decoder()
+    # With the indexed values prefix all values can be referenced.
+    self.assertEquals(["foo", "foo"], decoder.decode(bytearray([23, 2, 2, 1, 3, 102, 111, 111, 8, 0])))
+    [a, b] = decoder.decode(bytearray([23, 2, 2, 3, 0, 8, 0]))
+    self.assertTrue(a is b)
+    # Without it only objects can, so the reference refers to nothing.
+    self.assertRaises(KeyError, decoder.decode, bytearray([2, 2, 3, 0, 8, 0]))
+    # Objects written more than once are written as references and only
+    # objects count towards the offset.
+    obj = plankton.DefaultObject("Point", {"x": 1})
+    data = plankton.Encoder().encode(["a", obj, [obj]])
+    [s, c, [d]] = decoder.decode(data)
+    self.assertEquals("a", s)
+    self.assertTrue(c is d)
+    self.assertEquals("Point", c.get_header())
+
+  def test_open_containers(self):
+    decoder = plankton.Decoder()
+    self.assertEquals([1, {"a": []}], decoder.decode(bytearray([17, 0, 2, 18, 1, 1, 97, 17, 19, 19, 19])))
+    # Generators are written as open arrays.
+    data = plankton.Encoder().encode((i * i for i in xrange(4)))
+    self.assertEquals(17, data[0])
+    self.assertEquals([0, 1, 4, 9], decoder.decode(data))
+
 
 if __name__ == '__main__':
   runner = unittest.TextTestRunner(verbosity=0)